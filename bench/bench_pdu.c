@@ -0,0 +1,384 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Benchmarks of the iSCSI layer: PDU allocation, building and queueing
+ * SCSI command PDUs, matching responses to them, digests and moving
+ * data between iovectors and a socket. None of them needs a target, the
+ * context is made to look logged in and the socket is one end of a
+ * socketpair.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+#include "iscsi-bench.h"
+
+#define BENCH_MAX_BATCH 1024
+
+static volatile uint32_t bench_sink;
+
+void
+bench_fake_login(struct iscsi_context *iscsi)
+{
+	iscsi->session_type = ISCSI_SESSION_NORMAL;
+	iscsi->is_loggedin = 1;
+}
+
+static void
+bench_task_cb(struct iscsi_context *iscsi, int status,
+	      void *command_data, void *private_data)
+{
+	scsi_free_scsi_task(command_data);
+}
+
+uint64_t
+bench_pdu_alloc_free(struct iscsi_context *iscsi, int batch, uint64_t n)
+{
+	struct iscsi_pdu *pdus[BENCH_MAX_BATCH];
+	uint64_t done = 0, start;
+	int i, count;
+
+	start = bench_now();
+	while (done < n) {
+		count = n - done < (uint64_t)batch ? (int)(n - done) : batch;
+		for (i = 0; i < count; i++) {
+			pdus[i] = iscsi_allocate_pdu(iscsi,
+						     ISCSI_PDU_SCSI_REQUEST,
+						     ISCSI_PDU_SCSI_RESPONSE,
+						     iscsi_itt_post_increment(iscsi),
+						     0);
+			if (pdus[i] == NULL) {
+				fprintf(stderr, "Failed to allocate pdu\n");
+				exit(10);
+			}
+		}
+		for (i = 0; i < count; i++) {
+			iscsi->drv->free_pdu(iscsi, pdus[i]);
+		}
+		done += count;
+	}
+
+	return bench_now() - start;
+}
+
+uint64_t
+bench_command_submit(struct iscsi_context *iscsi, int batch, uint64_t n)
+{
+	struct scsi_task *tasks[BENCH_MAX_BATCH];
+	uint64_t done = 0, ns = 0, start;
+	int i, count;
+
+	bench_fake_login(iscsi);
+	while (done < n) {
+		count = n - done < (uint64_t)batch ? (int)(n - done) : batch;
+		for (i = 0; i < count; i++) {
+			tasks[i] = scsi_cdb_read16(done + i, 4096, 512,
+						   0, 0, 0, 0, 0);
+			if (tasks[i] == NULL) {
+				fprintf(stderr, "Failed to create task\n");
+				exit(10);
+			}
+		}
+
+		start = bench_now();
+		for (i = 0; i < count; i++) {
+			if (iscsi_scsi_command_async(iscsi, 0, tasks[i],
+						     bench_task_cb, NULL,
+						     NULL) != 0) {
+				fprintf(stderr, "Failed to queue command: "
+					"%s\n", iscsi_get_error(iscsi));
+				exit(10);
+			}
+		}
+		ns += bench_now() - start;
+
+		/* nothing was written, this completes them all */
+		iscsi_cancel_pdus(iscsi);
+		done += count;
+	}
+
+	return ns;
+}
+
+/*
+ * Queue depth commands, pretend they were all sent and then feed
+ * iscsi_process_pdu() one SCSI Response for each of them in a random
+ * order, like a target that completes them as its disks do.
+ */
+uint64_t
+bench_process_pdu(struct iscsi_context *iscsi, int depth, uint64_t n)
+{
+	unsigned char *hdrs;
+	uint32_t *itts;
+	struct iscsi_pdu *pdu;
+	struct iscsi_in_pdu in;
+	uint64_t done = 0, ns = 0, start;
+	uint32_t statsn, seed = 0x2545f491;
+	int i, count;
+
+	hdrs = calloc(depth, ISCSI_RAW_HEADER_SIZE);
+	itts = calloc(depth, sizeof(uint32_t));
+	if (hdrs == NULL || itts == NULL) {
+		fprintf(stderr, "Out-of-memory\n");
+		exit(10);
+	}
+
+	bench_fake_login(iscsi);
+	while (done < n) {
+		count = n - done < (uint64_t)depth ? (int)(n - done) : depth;
+		for (i = 0; i < count; i++) {
+			struct scsi_task *task = scsi_cdb_testunitready();
+
+			if (task == NULL ||
+			    iscsi_scsi_command_async(iscsi, 0, task,
+						     bench_task_cb, NULL,
+						     NULL) != 0) {
+				fprintf(stderr, "Failed to queue command\n");
+				exit(10);
+			}
+		}
+
+		/* what iscsi_write_to_socket() does once they are sent */
+		count = 0;
+		while ((pdu = iscsi->outqueue) != NULL) {
+			ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
+			ISCSI_LIST_ADD_END(&iscsi->waitpdu, pdu);
+			itts[count++] = pdu->itt;
+		}
+		for (i = count - 1; i > 0; i--) {
+			uint32_t j, tmp;
+
+			seed ^= seed << 13;
+			seed ^= seed >> 17;
+			seed ^= seed << 5;
+			j = seed % (i + 1);
+			tmp = itts[i];
+			itts[i] = itts[j];
+			itts[j] = tmp;
+		}
+
+		statsn = iscsi->statsn;
+		memset(hdrs, 0, count * ISCSI_RAW_HEADER_SIZE);
+		for (i = 0; i < count; i++) {
+			unsigned char *hdr = &hdrs[i * ISCSI_RAW_HEADER_SIZE];
+
+			hdr[0] = ISCSI_PDU_SCSI_RESPONSE;
+			hdr[1] = ISCSI_PDU_DATA_FINAL;
+			scsi_set_uint32(&hdr[16], itts[i]);
+			scsi_set_uint32(&hdr[24], ++statsn);
+			scsi_set_uint32(&hdr[28], iscsi->cmdsn);
+			scsi_set_uint32(&hdr[32], iscsi->cmdsn + 128);
+		}
+
+		start = bench_now();
+		for (i = 0; i < count; i++) {
+			memset(&in, 0, sizeof(in));
+			in.hdr = &hdrs[i * ISCSI_RAW_HEADER_SIZE];
+			if (iscsi_process_pdu(iscsi, &in) != 0) {
+				fprintf(stderr, "Failed to process pdu: %s\n",
+					iscsi_get_error(iscsi));
+				exit(10);
+			}
+		}
+		ns += bench_now() - start;
+		done += count;
+	}
+
+	free(itts);
+	free(hdrs);
+	return ns;
+}
+
+uint64_t
+bench_crc32c(struct iscsi_context *iscsi, int len, uint64_t n)
+{
+	uint8_t *buf;
+	uint64_t i, start, ns;
+	uint32_t crc = 0xffffffff;
+	int j;
+
+	buf = malloc(len);
+	if (buf == NULL) {
+		fprintf(stderr, "Out-of-memory\n");
+		exit(10);
+	}
+	for (j = 0; j < len; j++) {
+		buf[j] = j * 7;
+	}
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		crc = crc32c_chain(crc, buf, len);
+	}
+	ns = bench_now() - start;
+
+	bench_sink = crc;
+	free(buf);
+	return ns;
+}
+
+struct bench_socket {
+	int sv[2];
+	int old_fd;
+	struct scsi_iovector iovector;
+	unsigned char *buf;
+	unsigned char *peer_buf;
+};
+
+static void
+bench_socket_setup(struct iscsi_context *iscsi, struct bench_socket *s,
+		   int niov)
+{
+	int i, size = 4 * BENCH_IOVEC_BYTES;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, s->sv) != 0) {
+		fprintf(stderr, "socketpair failed: %s\n", strerror(errno));
+		exit(10);
+	}
+	for (i = 0; i < 2; i++) {
+		fcntl(s->sv[i], F_SETFL, fcntl(s->sv[i], F_GETFL) | O_NONBLOCK);
+		setsockopt(s->sv[i], SOL_SOCKET, SO_SNDBUF, &size,
+			   sizeof(size));
+		setsockopt(s->sv[i], SOL_SOCKET, SO_RCVBUF, &size,
+			   sizeof(size));
+	}
+
+	s->buf = calloc(1, BENCH_IOVEC_BYTES);
+	s->peer_buf = calloc(1, BENCH_IOVEC_BYTES);
+	memset(&s->iovector, 0, sizeof(s->iovector));
+	s->iovector.iov = calloc(niov, sizeof(struct scsi_iovec));
+	if (s->buf == NULL || s->peer_buf == NULL ||
+	    s->iovector.iov == NULL) {
+		fprintf(stderr, "Out-of-memory\n");
+		exit(10);
+	}
+	for (i = 0; i < niov; i++) {
+		s->iovector.iov[i].iov_base = &s->buf[i * (BENCH_IOVEC_BYTES / niov)];
+		s->iovector.iov[i].iov_len = BENCH_IOVEC_BYTES / niov;
+	}
+	s->iovector.niov = niov;
+	s->iovector.nalloc = niov;
+
+	s->old_fd = iscsi->fd;
+	iscsi->fd = s->sv[0];
+}
+
+static void
+bench_socket_teardown(struct iscsi_context *iscsi, struct bench_socket *s)
+{
+	iscsi->fd = s->old_fd;
+	close(s->sv[0]);
+	close(s->sv[1]);
+	free(s->iovector.iov);
+	free(s->peer_buf);
+	free(s->buf);
+}
+
+static void
+bench_transfer_failed(struct iscsi_context *iscsi)
+{
+	fprintf(stderr, "iovector transfer failed: %s (%s)\n",
+		strerror(errno), iscsi_get_error(iscsi));
+	exit(10);
+}
+
+uint64_t
+bench_iovec_write(struct iscsi_context *iscsi, int niov, uint64_t n)
+{
+	struct bench_socket s;
+	uint64_t i, ns = 0, start;
+	ssize_t count, pos, drained;
+
+	bench_socket_setup(iscsi, &s, niov);
+	for (i = 0; i < n; i++) {
+		s.iovector.offset = 0;
+		s.iovector.consumed = 0;
+		pos = drained = 0;
+		while (drained < BENCH_IOVEC_BYTES) {
+			if (pos < BENCH_IOVEC_BYTES) {
+				start = bench_now();
+				count = iscsi_iovector_readv_writev(iscsi,
+						&s.iovector, pos,
+						BENCH_IOVEC_BYTES - pos,
+						NULL, 1);
+				ns += bench_now() - start;
+				if (count > 0) {
+					pos += count;
+				} else if (errno != EAGAIN) {
+					bench_transfer_failed(iscsi);
+				}
+			}
+			count = read(s.sv[1], s.peer_buf, BENCH_IOVEC_BYTES);
+			if (count > 0) {
+				drained += count;
+			}
+		}
+	}
+	bench_socket_teardown(iscsi, &s);
+
+	return ns;
+}
+
+uint64_t
+bench_iovec_read(struct iscsi_context *iscsi, int niov, uint64_t n)
+{
+	struct bench_socket s;
+	uint64_t i, ns = 0, start;
+	ssize_t count, pos, written;
+
+	bench_socket_setup(iscsi, &s, niov);
+	for (i = 0; i < n; i++) {
+		s.iovector.offset = 0;
+		s.iovector.consumed = 0;
+		pos = written = 0;
+		while (pos < BENCH_IOVEC_BYTES) {
+			if (written < BENCH_IOVEC_BYTES) {
+				count = write(s.sv[1], s.peer_buf,
+					      BENCH_IOVEC_BYTES - written);
+				if (count > 0) {
+					written += count;
+				}
+			}
+			if (pos == written) {
+				continue;
+			}
+			start = bench_now();
+			count = iscsi_iovector_readv_writev(iscsi, &s.iovector,
+							    pos, written - pos,
+							    NULL, 0);
+			ns += bench_now() - start;
+			if (count > 0) {
+				pos += count;
+			} else if (errno != EAGAIN) {
+				bench_transfer_failed(iscsi);
+			}
+		}
+	}
+	bench_socket_teardown(iscsi, &s);
+
+	return ns;
+}
@@ -0,0 +1,232 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Benchmarks of the SCSI layer: building CDBs, unmarshalling the data-in
+ * of the commands every initiator sends when it attaches to a LUN, and
+ * parsing sense data.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "iscsi-bench.h"
+
+#define BENCH_REPORTLUNS_COUNT 64
+
+static struct scsi_task *
+bench_build_cdb(int cdb, uint64_t i)
+{
+	switch (cdb) {
+	case BENCH_CDB_READ16:
+		return scsi_cdb_read16(i, 4096, 512, 0, 0, 0, 0, 0);
+	case BENCH_CDB_WRITE16:
+		return scsi_cdb_write16(i, 4096, 512, 0, 0, 1, 0, 0);
+	case BENCH_CDB_INQUIRY:
+		return scsi_cdb_inquiry(1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS,
+					64);
+	default:
+		return scsi_cdb_testunitready();
+	}
+}
+
+uint64_t
+bench_cdb_build(struct iscsi_context *iscsi, int cdb, uint64_t n)
+{
+	struct scsi_task *task;
+	uint64_t i, start;
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		task = bench_build_cdb(cdb, i);
+		if (task == NULL) {
+			fprintf(stderr, "Failed to build cdb\n");
+			exit(10);
+		}
+		scsi_free_scsi_task(task);
+	}
+
+	return bench_now() - start;
+}
+
+/*
+ * Fill in data-in for the page as a typical disk would return it and
+ * return a task with a CDB that asks for it.
+ */
+static struct scsi_task *
+bench_page(int page, unsigned char *buf, int *len)
+{
+	int i;
+
+	memset(buf, 0, 4096);
+	switch (page) {
+	case BENCH_PAGE_STANDARD_INQUIRY:
+		buf[2] = 0x06;
+		buf[3] = 0x12;
+		buf[4] = 91;
+		buf[5] = 0x10;
+		buf[7] = 0x02;
+		memcpy(&buf[8], "LIBISCSI", 8);
+		memcpy(&buf[16], "BENCH DISK      ", 16);
+		memcpy(&buf[32], "0001", 4);
+		for (i = 0; i < 4; i++) {
+			scsi_set_uint16(&buf[58 + 2 * i], 0x0460 + i);
+		}
+		*len = 96;
+		return scsi_cdb_inquiry(0, 0, 255);
+	case BENCH_PAGE_DEVICE_IDENTIFICATION:
+		buf[1] = SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION;
+		/* NAA IEEE Registered Extended */
+		buf[4] = 0x01;
+		buf[5] = 0x03;
+		buf[7] = 16;
+		buf[8] = 0x60;
+		for (i = 9; i < 24; i++) {
+			buf[i] = i;
+		}
+		/* T10 vendor id */
+		buf[24] = 0x02;
+		buf[25] = 0x01;
+		buf[27] = 24;
+		memcpy(&buf[28], "LIBISCSIbench-disk-00001", 24);
+		/* relative target port */
+		buf[52] = 0x61;
+		buf[53] = 0x94;
+		buf[55] = 4;
+		buf[59] = 1;
+		scsi_set_uint16(&buf[2], 56);
+		*len = 60;
+		return scsi_cdb_inquiry(1,
+			SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION, 255);
+	case BENCH_PAGE_BLOCK_LIMITS:
+		buf[1] = SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS;
+		scsi_set_uint16(&buf[2], 0x3c);
+		buf[5] = 0xff;
+		scsi_set_uint16(&buf[6], 8);
+		scsi_set_uint32(&buf[8], 0x4000);
+		scsi_set_uint32(&buf[12], 0x400);
+		scsi_set_uint32(&buf[20], 0x400000);
+		scsi_set_uint32(&buf[24], 256);
+		scsi_set_uint32(&buf[28], 8);
+		scsi_set_uint32(&buf[40], 0x400000);
+		*len = 64;
+		return scsi_cdb_inquiry(1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS,
+					64);
+	case BENCH_PAGE_READCAPACITY16:
+		scsi_set_uint32(&buf[4], 0x1fffffff);
+		scsi_set_uint32(&buf[8], 512);
+		buf[13] = 0x03;
+		buf[14] = 0x80;
+		*len = 32;
+		return scsi_cdb_readcapacity16();
+	default:
+		scsi_set_uint32(&buf[0], 8 * BENCH_REPORTLUNS_COUNT);
+		for (i = 0; i < BENCH_REPORTLUNS_COUNT; i++) {
+			scsi_set_uint16(&buf[8 + 8 * i], i);
+		}
+		*len = 8 + 8 * BENCH_REPORTLUNS_COUNT;
+		return scsi_reportluns_cdb(0, 4096);
+	}
+}
+
+/*
+ * Every operation unmarshalls into a fresh task with its own copy of the
+ * data-in, like the library hands one to the callback of each command.
+ */
+uint64_t
+bench_datain_unmarshall(struct iscsi_context *iscsi, int page, uint64_t n)
+{
+	unsigned char buf[4096];
+	struct scsi_task *template, *task;
+	uint64_t i, start;
+	int len;
+
+	template = bench_page(page, buf, &len);
+	if (template == NULL) {
+		fprintf(stderr, "Failed to build cdb\n");
+		exit(10);
+	}
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		task = malloc(sizeof(*task));
+		if (task == NULL) {
+			fprintf(stderr, "Out-of-memory\n");
+			exit(10);
+		}
+		memcpy(task, template, sizeof(*task));
+		task->datain.data = malloc(len);
+		if (task->datain.data == NULL) {
+			fprintf(stderr, "Out-of-memory\n");
+			exit(10);
+		}
+		memcpy(task->datain.data, buf, len);
+		task->datain.size = len;
+		if (scsi_datain_unmarshall(task) == NULL) {
+			fprintf(stderr, "Failed to unmarshall data-in\n");
+			exit(10);
+		}
+		scsi_free_scsi_task(task);
+	}
+
+	start = bench_now() - start;
+	scsi_free_scsi_task(template);
+	return start;
+}
+
+uint64_t
+bench_parse_sense(struct iscsi_context *iscsi, int format, uint64_t n)
+{
+	struct scsi_sense sense;
+	unsigned char sb[32];
+	uint64_t i, start;
+
+	memset(sb, 0, sizeof(sb));
+	if (format == BENCH_SENSE_FIXED) {
+		/* ILLEGAL REQUEST, LBA OUT OF RANGE, with a field pointer */
+		sb[0] = 0xf0;
+		sb[2] = SCSI_SENSE_ILLEGAL_REQUEST;
+		scsi_set_uint32(&sb[3], 0x12345678);
+		sb[7] = 10;
+		sb[12] = 0x21;
+		sb[15] = 0xc0;
+		sb[17] = 2;
+	} else {
+		/* MEDIUM ERROR, UNRECOVERED READ ERROR, with the LBA */
+		sb[0] = 0x72;
+		sb[1] = SCSI_SENSE_MEDIUM_ERROR;
+		sb[2] = 0x11;
+		sb[7] = 20;
+		sb[8] = 0x00;
+		sb[9] = 0x0a;
+		sb[10] = 0x80;
+		scsi_set_uint32(&sb[16], 0x12345678);
+		sb[20] = 0x02;
+		sb[21] = 0x06;
+		sb[24] = 0x80;
+	}
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		scsi_parse_sense_data(&sense, sb);
+	}
+
+	return bench_now() - start;
+}
@@ -0,0 +1,382 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Microbenchmarks of the hot paths in lib/ that run without a target.
+ *
+ * Each benchmark is first run with a growing number of operations until
+ * one run takes the minimum time, and then that many operations are run
+ * a few more times and the fastest run is reported. With --json every
+ * result is one JSON object per line, and --compare reads such output
+ * back from an earlier build and fails if anything got slower than the
+ * threshold allows.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+#include "iscsi-bench.h"
+
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+static const char *initiator =
+	"iqn.2007-10.com.github:sahlberg:libiscsi:iscsi-bench";
+
+struct bench {
+	const char *name;
+	bench_fn fn;
+	int arg;
+	int bytes;		/* per operation, for MB/s */
+};
+
+static const struct bench benches[] = {
+	{ "pdu_alloc_free",		bench_pdu_alloc_free, 1, 0 },
+	{ "pdu_alloc_free_batch32",	bench_pdu_alloc_free, 32, 0 },
+	{ "command_submit",		bench_command_submit, 1, 0 },
+	{ "command_submit_batch32",	bench_command_submit, 32, 0 },
+	{ "process_pdu_qd1",		bench_process_pdu, 1, 0 },
+	{ "process_pdu_qd16",		bench_process_pdu, 16, 0 },
+	{ "process_pdu_qd64",		bench_process_pdu, 64, 0 },
+	{ "process_pdu_qd256",		bench_process_pdu, 256, 0 },
+	{ "crc32c_512",			bench_crc32c, 512, 512 },
+	{ "crc32c_4096",		bench_crc32c, 4096, 4096 },
+	{ "crc32c_65536",		bench_crc32c, 65536, 65536 },
+	{ "iovec_write_16",		bench_iovec_write, 16, BENCH_IOVEC_BYTES },
+	{ "iovec_write_64",		bench_iovec_write, 64, BENCH_IOVEC_BYTES },
+	{ "iovec_write_256",		bench_iovec_write, 256, BENCH_IOVEC_BYTES },
+	{ "iovec_read_16",		bench_iovec_read, 16, BENCH_IOVEC_BYTES },
+	{ "iovec_read_64",		bench_iovec_read, 64, BENCH_IOVEC_BYTES },
+	{ "iovec_read_256",		bench_iovec_read, 256, BENCH_IOVEC_BYTES },
+	{ "cdb_read16",			bench_cdb_build, BENCH_CDB_READ16, 0 },
+	{ "cdb_write16",		bench_cdb_build, BENCH_CDB_WRITE16, 0 },
+	{ "cdb_inquiry",		bench_cdb_build, BENCH_CDB_INQUIRY, 0 },
+	{ "cdb_testunitready",		bench_cdb_build, BENCH_CDB_TESTUNITREADY, 0 },
+	{ "unmarshall_inquiry_standard", bench_datain_unmarshall,
+	  BENCH_PAGE_STANDARD_INQUIRY, 0 },
+	{ "unmarshall_inquiry_device_id", bench_datain_unmarshall,
+	  BENCH_PAGE_DEVICE_IDENTIFICATION, 0 },
+	{ "unmarshall_inquiry_block_limits", bench_datain_unmarshall,
+	  BENCH_PAGE_BLOCK_LIMITS, 0 },
+	{ "unmarshall_readcapacity16",	bench_datain_unmarshall,
+	  BENCH_PAGE_READCAPACITY16, 0 },
+	{ "unmarshall_reportluns",	bench_datain_unmarshall,
+	  BENCH_PAGE_REPORTLUNS, 0 },
+	{ "sense_fixed",		bench_parse_sense, BENCH_SENSE_FIXED, 0 },
+	{ "sense_descriptor",		bench_parse_sense,
+	  BENCH_SENSE_DESCRIPTOR, 0 },
+	{ NULL, NULL, 0, 0 }
+};
+
+struct baseline {
+	char name[64];
+	double ns_per_op;
+};
+
+static struct baseline *baselines;
+static int num_baselines;
+
+uint64_t
+bench_now(void)
+{
+	int res;
+	uint64_t ns;
+
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	res = clock_gettime(CLOCK_MONOTONIC, &ts);
+	ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	struct timeval tv;
+	res = gettimeofday(&tv, NULL);
+	ns = tv.tv_sec * 1000000000ULL + tv.tv_usec * 1000;
+#endif
+	if (res == -1) {
+		fprintf(stderr, "could not get requested clock\n");
+		exit(10);
+	}
+	return ns;
+}
+
+static int
+load_baseline(const char *path)
+{
+	char line[1024], *p, *q;
+	struct baseline *b;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		p = strstr(line, "\"benchmark\":\"");
+		if (p == NULL) {
+			continue;
+		}
+		p += strlen("\"benchmark\":\"");
+		q = strchr(p, '"');
+		if (q == NULL || q - p >= (int)sizeof(b->name)) {
+			continue;
+		}
+		b = realloc(baselines, (num_baselines + 1) * sizeof(*b));
+		if (b == NULL) {
+			fprintf(stderr, "Out-of-memory\n");
+			fclose(fp);
+			return -1;
+		}
+		baselines = b;
+		b = &baselines[num_baselines];
+		memcpy(b->name, p, q - p);
+		b->name[q - p] = 0;
+
+		p = strstr(q, "\"ns_per_op\":");
+		if (p == NULL) {
+			continue;
+		}
+		b->ns_per_op = strtod(p + strlen("\"ns_per_op\":"), NULL);
+		if (b->ns_per_op > 0) {
+			num_baselines++;
+		}
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static double
+find_baseline(const char *name)
+{
+	int i;
+
+	for (i = 0; i < num_baselines; i++) {
+		if (!strcmp(baselines[i].name, name)) {
+			return baselines[i].ns_per_op;
+		}
+	}
+	return 0;
+}
+
+static int
+selected(const char *name, int argc, char *argv[])
+{
+	int i;
+
+	if (argc == 0) {
+		return 1;
+	}
+	for (i = 0; i < argc; i++) {
+		if (strstr(name, argv[i]) != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the fastest time per operation in ns and the number of
+ * operations each of the rounds ran.
+ */
+static double
+run_bench(const struct bench *b, uint64_t min_ns, int rounds,
+	  uint64_t *iterations)
+{
+	struct iscsi_context *iscsi;
+	uint64_t n = 1, ns;
+	double best = 0;
+	int i;
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	/* this doubles as the warm up */
+	while ((ns = b->fn(iscsi, b->arg, n)) < min_ns) {
+		uint64_t grow = ns ? min_ns * 12 / 10 / ns : 100;
+
+		if (grow < 2) {
+			grow = 2;
+		}
+		if (grow > 100) {
+			grow = 100;
+		}
+		n *= grow;
+	}
+
+	for (i = 0; i < rounds; i++) {
+		double per_op = (double)b->fn(iscsi, b->arg, n) / n;
+
+		if (i == 0 || per_op < best) {
+			best = per_op;
+		}
+	}
+
+	iscsi_destroy_context(iscsi);
+	*iterations = n;
+	return best;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-bench [-j|--json] [-t|--time <ms>] "
+		"[-r|--rounds <rounds>] [-c|--compare <file>] "
+		"[-T|--threshold <percent>] [-l|--list] [<benchmark>...]\n");
+	fprintf(stderr, "\n"
+		"Runs the benchmarks whose names contain any of the "
+		"<benchmark>\narguments, or all of them. --compare takes "
+		"the --json output of an\nearlier run and exits with "
+		"status 1 if a benchmark got slower by\nmore than "
+		"--threshold percent, 10 by default.\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct bench *b;
+	const char *compare = NULL;
+	uint64_t min_ns = 200 * 1000000ULL;
+	int json = 0, list = 0, rounds = 3, regressions = 0;
+	double threshold = 10;
+	int c;
+
+	static struct option long_options[] = {
+		{"json",           no_argument,          NULL,        'j'},
+		{"time",           required_argument,    NULL,        't'},
+		{"rounds",         required_argument,    NULL,        'r'},
+		{"compare",        required_argument,    NULL,        'c'},
+		{"threshold",      required_argument,    NULL,        'T'},
+		{"list",           no_argument,          NULL,        'l'},
+		{"help",           no_argument,          NULL,        'h'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "jt:r:c:T:lh", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'j':
+			json = 1;
+			break;
+		case 't':
+			min_ns = strtoull(optarg, NULL, 0) * 1000000ULL;
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'c':
+			compare = optarg;
+			break;
+		case 'T':
+			threshold = strtod(optarg, NULL);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (min_ns == 0 || rounds < 1 || threshold < 0) {
+		usage();
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (compare != NULL && load_baseline(compare) != 0) {
+		exit(10);
+	}
+
+	if (!json && !list) {
+		printf("%-32s %12s %12s %10s%s\n", "benchmark", "iterations",
+		       "ns/op", "MB/s", compare ? "     change" : "");
+	}
+	for (b = benches; b->name != NULL; b++) {
+		uint64_t iterations;
+		double ns_per_op, mb_per_s = 0, base, change = 0;
+
+		if (!selected(b->name, argc, argv)) {
+			continue;
+		}
+		if (list) {
+			printf("%s\n", b->name);
+			continue;
+		}
+
+		ns_per_op = run_bench(b, min_ns, rounds, &iterations);
+		if (b->bytes) {
+			mb_per_s = b->bytes * 1000.0 / ns_per_op;
+		}
+		base = compare ? find_baseline(b->name) : 0;
+		if (base > 0) {
+			change = (ns_per_op - base) * 100 / base;
+			if (change > threshold) {
+				regressions++;
+			}
+		}
+
+		if (json) {
+			printf("{\"benchmark\":\"%s\",\"iterations\":%" PRIu64
+			       ",\"ns_per_op\":%.2f", b->name, iterations,
+			       ns_per_op);
+			if (b->bytes) {
+				printf(",\"mb_per_s\":%.1f", mb_per_s);
+			}
+			if (base > 0) {
+				printf(",\"baseline_ns_per_op\":%.2f"
+				       ",\"change_percent\":%.1f"
+				       ",\"regression\":%s", base, change,
+				       change > threshold ? "true" : "false");
+			}
+			printf("}\n");
+		} else {
+			printf("%-32s %12" PRIu64 " %12.2f ", b->name,
+			       iterations, ns_per_op);
+			if (b->bytes) {
+				printf("%10.1f", mb_per_s);
+			} else {
+				printf("%10s", "-");
+			}
+			if (base > 0) {
+				printf(" %+9.1f%%%s", change,
+				       change > threshold ? "  REGRESSION" : "");
+			}
+			printf("\n");
+		}
+		fflush(stdout);
+	}
+
+	free(baselines);
+	if (regressions) {
+		fprintf(stderr, "%d benchmark%s slower than the baseline by "
+			"more than %.0f%%\n", regressions,
+			regressions == 1 ? "" : "s", threshold);
+		return 1;
+	}
+	return 0;
+}
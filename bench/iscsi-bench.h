@@ -0,0 +1,78 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef _ISCSI_BENCH_H_
+#define _ISCSI_BENCH_H_
+
+#include <stdint.h>
+
+struct iscsi_context;
+
+/*
+ * A benchmark runs n operations of its kind and returns how many
+ * nanoseconds the operations themselves took, so that any setup and
+ * cleanup it needs between batches is left out of the result. arg is
+ * the per-benchmark parameter from the table in iscsi-bench.c, such as
+ * a buffer size or a queue depth.
+ */
+typedef uint64_t (*bench_fn)(struct iscsi_context *iscsi, int arg,
+			     uint64_t n);
+
+uint64_t bench_now(void);
+
+/* Make the context look logged in to a target without any connection. */
+void bench_fake_login(struct iscsi_context *iscsi);
+
+uint64_t bench_pdu_alloc_free(struct iscsi_context *iscsi, int batch,
+			      uint64_t n);
+uint64_t bench_command_submit(struct iscsi_context *iscsi, int batch,
+			      uint64_t n);
+uint64_t bench_process_pdu(struct iscsi_context *iscsi, int depth,
+			   uint64_t n);
+uint64_t bench_crc32c(struct iscsi_context *iscsi, int len, uint64_t n);
+uint64_t bench_iovec_write(struct iscsi_context *iscsi, int niov,
+			   uint64_t n);
+uint64_t bench_iovec_read(struct iscsi_context *iscsi, int niov,
+			  uint64_t n);
+
+/* the total size of the transfers of the iovec benchmarks */
+#define BENCH_IOVEC_BYTES	(64 * 1024)
+
+enum bench_cdb {
+	BENCH_CDB_READ16,
+	BENCH_CDB_WRITE16,
+	BENCH_CDB_INQUIRY,
+	BENCH_CDB_TESTUNITREADY,
+};
+
+enum bench_page {
+	BENCH_PAGE_STANDARD_INQUIRY,
+	BENCH_PAGE_DEVICE_IDENTIFICATION,
+	BENCH_PAGE_BLOCK_LIMITS,
+	BENCH_PAGE_READCAPACITY16,
+	BENCH_PAGE_REPORTLUNS,
+};
+
+enum bench_sense {
+	BENCH_SENSE_FIXED,
+	BENCH_SENSE_DESCRIPTOR,
+};
+
+uint64_t bench_cdb_build(struct iscsi_context *iscsi, int cdb, uint64_t n);
+uint64_t bench_datain_unmarshall(struct iscsi_context *iscsi, int page,
+				 uint64_t n);
+uint64_t bench_parse_sense(struct iscsi_context *iscsi, int format,
+			   uint64_t n);
+
+#endif /* _ISCSI_BENCH_H_ */
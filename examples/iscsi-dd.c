@@ -42,7 +42,12 @@ struct iscsi_endpoint {
 	int lun;
 	int blocksize;
 	uint64_t num_blocks;
-	struct scsi_inquiry_device_designator tgt_desig;
+};
+
+struct mapped_range {
+	struct mapped_range *next;
+	uint64_t lba;
+	uint64_t num_blocks;
 };
 
 struct client {
@@ -54,15 +59,20 @@ struct client {
 
 	uint64_t pos;
 
+	/* --sparse: mapped source ranges still to be copied */
+	int sparse;
+	struct mapped_range *ranges;
+	struct mapped_range **ranges_tail;
+
 	int use_16_for_rw;
 	int use_xcopy;
+	struct iscsi_xcopy *xcopy;
 	int progress;
 	int ignore_errors;
 };
 
 
 void fill_read_queue(struct client *client);
-void fill_xcopy_queue(struct client *client);
 
 struct write_task {
        struct scsi_task *rt;
@@ -174,22 +184,46 @@ void fill_read_queue(struct client *client)
 
 	while(client->in_flight < max_in_flight && client->pos < client->src.num_blocks) {
 		struct scsi_task *task;
-		client->in_flight++;
+		uint64_t lba = client->pos;
+
+		if (client->sparse) {
+			struct mapped_range *r = client->ranges;
 
-		num_blocks = client->src.num_blocks - client->pos;
-		if (num_blocks > blocks_per_io) {
-			num_blocks = blocks_per_io;
+			if (r == NULL) {
+				/* wait for more of the extent map */
+				break;
+			}
+			lba = r->lba;
+			num_blocks = r->num_blocks;
+			if (num_blocks > blocks_per_io) {
+				num_blocks = blocks_per_io;
+			}
+			r->lba += num_blocks;
+			r->num_blocks -= num_blocks;
+			if (r->num_blocks == 0) {
+				client->ranges = r->next;
+				if (client->ranges == NULL) {
+					client->ranges_tail = &client->ranges;
+				}
+				free(r);
+			}
+		} else {
+			num_blocks = client->src.num_blocks - client->pos;
+			if (num_blocks > blocks_per_io) {
+				num_blocks = blocks_per_io;
+			}
 		}
+		client->in_flight++;
 
 		if (client->use_16_for_rw) {
 			task = iscsi_read16_task(client->src.iscsi,
-						 client->src.lun, client->pos,
+						 client->src.lun, lba,
 						 num_blocks * client->src.blocksize,
 						 client->src.blocksize, 0, 0, 0, 0, 0,
 						 read_cb, client);
 		} else {
 			task = iscsi_read10_task(client->src.iscsi,
-						 client->src.lun, client->pos,
+						 client->src.lun, lba,
 						 num_blocks * client->src.blocksize,
 						 client->src.blocksize, 0, 0, 0, 0, 0,
 						 read_cb, client);
@@ -202,297 +236,70 @@ void fill_read_queue(struct client *client)
 	}
 }
 
-int populate_tgt_desc(unsigned char *desc,
-		      struct scsi_inquiry_device_designator *tgt_desig,
-		      int rel_init_port_id, uint32_t block_size)
-{
-	desc[0] = IDENT_DESCR_TGT_DESCR;
-	desc[1] = 0;	/* peripheral type */
-	desc[2] = (rel_init_port_id >> 8) & 0xFF;
-	desc[3] = rel_init_port_id & 0xFF;
-	desc[4] = tgt_desig->code_set;
-	desc[5] = (tgt_desig->designator_type & 0xF)
-		| ((tgt_desig->association & 3) << 4);
-	desc[7] = tgt_desig->designator_length;
-	memcpy(desc + 8, tgt_desig->designator, tgt_desig->designator_length);
-
-	desc[28] = 0;
-	desc[29] = (block_size >> 16) & 0xFF;
-	desc[30] = (block_size >> 8) & 0xFF;
-	desc[31] = block_size & 0xFF;
-
-	return 32;
-}
-
-int populate_seg_desc_hdr(unsigned char *hdr, int dc, int cat, int src_index,
-			  int dst_index)
-{
-	int desc_len = 28;
-
-	hdr[0] = BLK_TO_BLK_SEG_DESCR;
-	hdr[1] = ((dc << 1) | cat) & 0xFF;
-	hdr[2] = (desc_len >> 8) & 0xFF;
-	hdr[3] = (desc_len - SEG_DESC_SRC_INDEX_OFFSET) & 0xFF; /* don't account for the first 4 bytes in descriptor header*/
-	hdr[4] = (src_index >> 8) & 0xFF;
-	hdr[5] = src_index & 0xFF;
-	hdr[6] = (dst_index >> 8) & 0xFF;
-	hdr[7] = dst_index & 0xFF;
-
-	return desc_len;
-}
-
-int populate_seg_desc_b2b(unsigned char *desc, int dc, int cat,
-			  int src_index, int dst_index, int num_blks,
-			  uint64_t src_lba, uint64_t dst_lba)
-{
-	int desc_len = populate_seg_desc_hdr(desc, dc, cat,
-					     src_index, dst_index);
-
-	desc[10] = (num_blks >> 8) & 0xFF;
-	desc[11] = num_blks & 0xFF;
-	desc[12] = (src_lba >> 56) & 0xFF;
-	desc[13] = (src_lba >> 48) & 0xFF;
-	desc[14] = (src_lba >> 40) & 0xFF;
-	desc[15] = (src_lba >> 32) & 0xFF;
-	desc[16] = (src_lba >> 24) & 0xFF;
-	desc[17] = (src_lba >> 16) & 0xFF;
-	desc[18] = (src_lba >> 8) & 0xFF;
-	desc[19] = src_lba & 0xFF;
-	desc[20] = (dst_lba >> 56) & 0xFF;
-	desc[21] = (dst_lba >> 48) & 0xFF;
-	desc[22] = (dst_lba >> 40) & 0xFF;
-	desc[23] = (dst_lba >> 32) & 0xFF;
-	desc[24] = (dst_lba >> 24) & 0xFF;
-	desc[25] = (dst_lba >> 16) & 0xFF;
-	desc[26] = (dst_lba >> 8) & 0xFF;
-	desc[27] = dst_lba & 0xFF;
-
-	return desc_len;
-}
-
-void populate_param_header(unsigned char *buf, int list_id, int str, int list_id_usage, int prio, int tgt_desc_len, int seg_desc_len, int inline_data_len)
-{
-	buf[0] = list_id;
-	buf[1] = ((str & 1) << 5) | ((list_id_usage & 3) << 3) | (prio & 7);
-	buf[2] = (tgt_desc_len >> 8) & 0xFF;
-	buf[3] = tgt_desc_len & 0xFF;
-	buf[8] = (seg_desc_len >> 24) & 0xFF;
-	buf[9] = (seg_desc_len >> 16) & 0xFF;
-	buf[10] = (seg_desc_len >> 8) & 0xFF;
-	buf[11] = seg_desc_len & 0xFF;
-	buf[12] = (inline_data_len >> 24) & 0xFF;
-	buf[13] = (inline_data_len >> 16) & 0xFF;
-	buf[14] = (inline_data_len >> 8) & 0xFF;
-	buf[15] = inline_data_len & 0xFF;
-}
-
-void xcopy_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+/*
+ * Extent map of the source for --sparse. Mapped extents are queued for
+ * copying, the rest are skipped and only counted as done.
+ */
+void extent_cb(struct iscsi_context *iscsi, int status,
+	       struct iscsi_lba_extent *extents, int num_extents,
+	       void *private_data)
 {
 	struct client *client = (struct client *)private_data;
-	struct scsi_task *task = command_data;
+	int i;
 
-	if (status == SCSI_STATUS_CHECK_CONDITION) {
-		fprintf(stderr, "XCOPY failed with sense key:%d ascq:%04x\n",
-			task->sense.key, task->sense.ascq);
-		scsi_free_scsi_task(task);
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "GET LBA STATUS failed with %s\n", iscsi_get_error(iscsi));
 		exit(10);
 	}
 
-	if (status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "XCOPY failed with %s\n", iscsi_get_error(iscsi));
-		if (!client->ignore_errors) {
-			scsi_free_scsi_task(task);
+	for (i = 0; i < num_extents; i++) {
+		struct mapped_range *r;
+
+		if (extents[i].provisioning != SCSI_PROVISIONING_TYPE_MAPPED) {
+			client->pos += extents[i].num_blocks;
+			continue;
+		}
+		r = malloc(sizeof(struct mapped_range));
+		if (r == NULL) {
+			fprintf(stderr, "failed to alloc mapped range\n");
 			exit(10);
 		}
+		r->next = NULL;
+		r->lba = extents[i].lba;
+		r->num_blocks = extents[i].num_blocks;
+		*client->ranges_tail = r;
+		client->ranges_tail = &r->next;
 	}
 
-	client->in_flight--;
-	fill_xcopy_queue(client);
-
-	if (client->progress) {
-		printf("\r%"PRIu64" of %"PRIu64" blocks transferred.",
-			client->pos, client->src.num_blocks);
-	}
+	fill_read_queue(client);
 
+	/* pos counts the blocks that have been skipped or read */
 	if ((client->in_flight == 0) && (client->pos == client->src.num_blocks)) {
 		client->finished = 1;
 		if (client->progress) {
 			printf("\n");
 		}
 	}
-	scsi_free_scsi_task(task);
 }
 
-void fill_xcopy_queue(struct client *client)
-{
-	while (client->in_flight < max_in_flight && client->pos < client->src.num_blocks) {
-		struct scsi_task *task;
-		struct iscsi_data data;
-		unsigned char *xcopybuf;
-		int offset;
-		uint32_t num_blocks;
-		int tgt_desc_len;
-		int seg_desc_len;
-
-		client->in_flight++;
-
-		num_blocks = client->src.num_blocks - client->pos;
-		if (num_blocks > blocks_per_io) {
-			num_blocks = blocks_per_io;
-		}
-
-		data.size = XCOPY_DESC_OFFSET +
-			32 * 2 +	/* IDENT_DESCR_TGT_DESCR */
-			28;		/* BLK_TO_BLK_SEG_DESCR */
-		data.data = malloc(data.size);
-		if (data.data == NULL) {
-			fprintf(stderr, "failed to alloc XCOPY buffer\n");
-			exit(10);
-		}
-
-		xcopybuf = data.data;
-		memset(xcopybuf, 0, data.size);
-
-		/* Initialise CSCD list with one src + one dst descriptor */
-		offset = XCOPY_DESC_OFFSET;
-		offset += populate_tgt_desc(xcopybuf + offset,
-					&client->src.tgt_desig,
-					0, client->src.blocksize);
-		offset += populate_tgt_desc(xcopybuf + offset,
-					&client->dst.tgt_desig,
-					0, client->dst.blocksize);
-		tgt_desc_len = offset - XCOPY_DESC_OFFSET;
-
-		/* Initialise one segment descriptor */
-		seg_desc_len = populate_seg_desc_b2b(xcopybuf + offset, 0, 0,
-				0, 1, num_blocks, client->pos, client->pos);
-		offset += seg_desc_len;
-
-		/* Initialise the parameter list header */
-		populate_param_header(xcopybuf, 1, 0, LIST_ID_USAGE_DISCARD, 0,
-				tgt_desc_len, seg_desc_len, 0);
-
-		task = iscsi_extended_copy_task(client->src.iscsi,
-						client->src.lun,
-						&data, xcopy_cb, client);
-		if (task == NULL) {
-			fprintf(stderr, "failed to send XCOPY command\n");
-			exit(10);
-		}
-
-		client->pos += num_blocks;
-	}
-}
-
-void cscd_ident_inq(struct iscsi_context *iscsi,
-		int lun,
-		struct scsi_inquiry_device_designator *_tgt_desig)
-{
-	struct scsi_task *task = NULL;
-	struct scsi_inquiry_device_identification *inq_di = NULL;
-	struct scsi_inquiry_device_designator *desig, *tgt_desig = NULL;
-	enum scsi_designator_type prev_type = 0;
-
-	/* check what type of lun we have */
-	task = iscsi_inquiry_sync(iscsi, lun, 1,
-			SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION, 255);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "failed to send inquiry command: %s\n",
-			iscsi_get_error(iscsi));
-		exit(10);
-	}
-
-	inq_di = scsi_datain_unmarshall(task);
-	if (inq_di == NULL) {
-		fprintf(stderr, "failed to unmarshall inquiry datain blob\n");
-		exit(10);
-	}
-
-	for (desig = inq_di->designators; desig; desig = desig->next) {
-		switch (desig->designator_type) {
-			case SCSI_DESIGNATOR_TYPE_VENDOR_SPECIFIC:
-			case SCSI_DESIGNATOR_TYPE_T10_VENDORT_ID:
-			case SCSI_DESIGNATOR_TYPE_EUI_64:
-			case SCSI_DESIGNATOR_TYPE_NAA:
-				if (prev_type <= desig->designator_type) {
-					tgt_desig = desig;
-					prev_type = desig->designator_type;
-				}
-				/* fall through */
-			default:
-				continue;
-		}
-	}
-
-	if (tgt_desig == NULL) {
-		fprintf(stderr, "No suitable target descriptor format found\n");
-		exit(10);
-	}
-
-	/* copy what's needed for XCOPY */
-	_tgt_desig->code_set = tgt_desig->code_set;
-	_tgt_desig->association = tgt_desig->association;
-	_tgt_desig->designator_type = tgt_desig->designator_type;
-	_tgt_desig->designator_length = tgt_desig->designator_length;
-	_tgt_desig->designator = malloc(tgt_desig->designator_length);
-	if (_tgt_desig->designator == NULL) {
-		fprintf(stderr, "failed to alloc designator\n");
-		exit(10);
-	}
-	
-	memcpy(_tgt_desig->designator, tgt_desig->designator, tgt_desig->designator_length);
-
-	scsi_free_scsi_task(task);
-}
-
-void cscd_param_check(struct iscsi_context *iscsi,
-		      int lun,
-		      uint32_t blocksize)
+void xcopy_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
 {
-	struct scsi_task *task = NULL;
-	struct scsi_copy_results_op_params *opp;
-	uint32_t io_segment_bytes;
-
-	task = iscsi_receive_copy_results_sync(iscsi, lun,
-					SCSI_COPY_RESULTS_OP_PARAMS, 0, 1024);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "XCOPY RECEIVE COPY RESULTS failed: %s\n",
-			iscsi_get_error(iscsi));
-		exit(10);
-	}
-
-	opp = scsi_datain_unmarshall(task);
-	if (opp == NULL) {
-		fprintf(stderr, "failed to unmarshall XCOPY RCR datain blob\n");
-		exit(10);
-	}
+	struct client *client = (struct client *)private_data;
+	uint64_t offloaded;
 
-	if (opp->max_target_desc_count < 2) {
-		fprintf(stderr, "XCOPY max CSCD desc count %d too small\n",
-			opp->max_target_desc_count);
-		exit(10);
-	}
-	if (opp->max_segment_desc_count < 1) {
-		fprintf(stderr, "XCOPY max segment desc count %d too small\n",
-			opp->max_segment_desc_count);
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "XCOPY failed with %s\n", iscsi_get_error(iscsi));
 		exit(10);
 	}
 
-	io_segment_bytes = blocks_per_io * blocksize;
-	if (io_segment_bytes > opp->max_segment_length) {
-		fprintf(stderr,
-			"%u bytes per I/O exceeds XCOPY max segment len %u\n",
-			io_segment_bytes, opp->max_segment_length);
-		exit(10);
-	}
-	if (blocks_per_io > USHRT_MAX) {
-		fprintf(stderr,
-			"%u blocks per I/O exceeds XCOPY field width max %u\n",
-			blocks_per_io, USHRT_MAX);
-		exit(10);
+	iscsi_xcopy_get_progress(client->xcopy, &client->pos, &offloaded);
+	if (client->progress) {
+		printf("\r%"PRIu64" of %"PRIu64" blocks transferred, %"PRIu64
+		       " of them by the target.\n", client->pos,
+		       client->src.num_blocks, offloaded);
 	}
-
-	scsi_free_scsi_task(task);
+	client->xcopy = NULL;
+	client->finished = 1;
 }
 
 void readcap(struct iscsi_context *iscsi, int lun, int use_16,
@@ -540,6 +347,24 @@ void readcap(struct iscsi_context *iscsi, int lun, int use_16,
 	return;
 }
 
+/* Do unmapped blocks of the LUN read back as zeros? */
+int read_zeros_unmapped(struct iscsi_context *iscsi, int lun)
+{
+	struct scsi_task *task;
+	struct scsi_readcapacity16 *rc16;
+	int lbprz = 0;
+
+	task = iscsi_readcapacity16_sync(iscsi, lun);
+	if (task != NULL && task->status == SCSI_STATUS_GOOD) {
+		rc16 = scsi_datain_unmarshall(task);
+		if (rc16 != NULL) {
+			lbprz = rc16->lbpme && rc16->lbprz;
+		}
+	}
+	scsi_free_scsi_task(task);
+	return lbprz;
+}
+
 static void usage_exit(int status)
 {
 	fprintf(stderr, "Usage:\n"
@@ -549,6 +374,9 @@ static void usage_exit(int status)
 "-p, --progress                show progress while copying\n"
 "-6, --16                      use READ16 & WRITE16 SCSI commands\n"
 "-x, --xcopy                   offload I/O to the target via XCOPY\n"
+"-S, --sparse                  only copy the blocks that are mapped on the\n"
+"                              source, the destination must read back zeros\n"
+"                              for the rest, e.g. a freshly created thin LUN\n"
 "-m, --max <NUM>               maximum requests in flight   (default=%u)\n"
 "-b, --blocks <NUM>            blocks per I/O               (default=%u)\n"
 "-n, --ignore-errors           ignore any I/O errors\n"
@@ -582,7 +410,6 @@ static void show_perf(struct timespec *start_time,
 static void iscsi_endpoint_init(const char *url,
 				const char *usage,
 				int use_16_for_rw,
-				int use_xcopy,
 				struct iscsi_endpoint *endpoint)
 {
 	struct iscsi_url *iscsi_url;
@@ -619,13 +446,6 @@ static void iscsi_endpoint_init(const char *url,
 
 	readcap(endpoint->iscsi, endpoint->lun, use_16_for_rw,
 		&endpoint->blocksize, &endpoint->num_blocks);
-
-	if (use_xcopy) {
-		cscd_ident_inq(endpoint->iscsi, endpoint->lun,
-				&endpoint->tgt_desig);
-		cscd_param_check(endpoint->iscsi, endpoint->lun,
-				 endpoint->blocksize);
-	}
 }
 
 int main(int argc, char *argv[])
@@ -647,6 +467,7 @@ int main(int argc, char *argv[])
 		{"progress",       no_argument,          NULL,        'p'},
 		{"16",             no_argument,          NULL,        '6'},
 		{"xcopy",          no_argument,          NULL,        'x'},
+		{"sparse",         no_argument,          NULL,        'S'},
 		{"max",            required_argument,    NULL,        'm'},
 		{"blocks",         required_argument,    NULL,        'b'},
 		{"ignore-errors",  no_argument,          NULL,        'n'},
@@ -657,7 +478,7 @@ int main(int argc, char *argv[])
 
 	memset(&client, 0, sizeof(client));
 
-	while ((c = getopt_long(argc, argv, "d:s:i:m:b:p6nxh", long_options,
+	while ((c = getopt_long(argc, argv, "d:s:i:m:b:p6nxSh", long_options,
 			&option_index)) != -1) {
 		char *endptr;
 
@@ -680,6 +501,9 @@ int main(int argc, char *argv[])
 		case 'x':
 			client.use_xcopy = 1;
 			break;
+		case 'S':
+			client.sparse = 1;
+			break;
 		case 'm':
 			max_in_flight = strtoul(optarg, &endptr, 10);
 			if (*endptr != '\0' || max_in_flight == UINT_MAX) {
@@ -709,9 +533,9 @@ int main(int argc, char *argv[])
 	}
 
 	iscsi_endpoint_init(src_url, "src", client.use_16_for_rw,
-			    client.use_xcopy, &client.src);
+			    &client.src);
 	iscsi_endpoint_init(dst_url, "dst", client.use_16_for_rw,
-			    client.use_xcopy, &client.dst);
+			    &client.dst);
 
 	if (client.src.blocksize != client.dst.blocksize) {
 		fprintf(stderr, "source LUN has different blocksize than destination (%d != %d)\n", client.src.blocksize, client.dst.blocksize);
@@ -723,6 +547,17 @@ int main(int argc, char *argv[])
 		exit(10);
 	}
 
+	if (client.sparse && client.use_xcopy) {
+		fprintf(stderr, "--sparse can not be used with --xcopy\n");
+		exit(10);
+	}
+	if (client.sparse &&
+	    !read_zeros_unmapped(client.src.iscsi, client.src.lun)) {
+		fprintf(stderr, "source LUN does not read unmapped blocks as "
+			"zeros, copying all of it\n");
+		client.sparse = 0;
+	}
+
 #if HAVE_CLOCK_GETTIME
 	gettime_ret = clock_gettime(CLOCK_MONOTONIC, &start_time);
 	if (gettime_ret < 0) {
@@ -731,7 +566,27 @@ int main(int argc, char *argv[])
 #endif
 
 	if (client.use_xcopy) {
-		fill_xcopy_queue(&client);
+		client.xcopy = iscsi_xcopy_async(client.src.iscsi,
+						 client.src.lun, 0,
+						 client.dst.iscsi,
+						 client.dst.lun, 0,
+						 client.src.num_blocks,
+						 client.src.blocksize,
+						 xcopy_cb, &client);
+		if (client.xcopy == NULL) {
+			fprintf(stderr, "failed to start XCOPY: %s\n",
+				iscsi_get_error(client.src.iscsi));
+			exit(10);
+		}
+	} else if (client.sparse) {
+		client.ranges_tail = &client.ranges;
+		if (iscsi_extent_map_async(client.src.iscsi, client.src.lun, 0,
+					   client.src.num_blocks, extent_cb,
+					   &client) == NULL) {
+			fprintf(stderr, "failed to start GET LBA STATUS: %s\n",
+				iscsi_get_error(client.src.iscsi));
+			exit(10);
+		}
 	} else {
 		fill_read_queue(&client);
 	}
@@ -747,7 +602,8 @@ int main(int argc, char *argv[])
 			continue;
 		}
 
-		if (poll(&pfd[0], 2, -1) < 0) {
+		/* wake up to show the progress of the copy manager */
+		if (poll(&pfd[0], 2, client.xcopy ? 500 : -1) < 0) {
 			fprintf(stderr, "Poll failed\n");
 			exit(10);
 		}
@@ -759,6 +615,12 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "iscsi_service failed with : %s\n", iscsi_get_error(client.dst.iscsi));
 			break;
 		}
+		if (client.xcopy && client.progress) {
+			iscsi_xcopy_get_progress(client.xcopy, &client.pos,
+						 NULL);
+			printf("\r%"PRIu64" of %"PRIu64" blocks transferred.",
+			       client.pos, client.src.num_blocks);
+		}
 	}
 
 #if HAVE_CLOCK_GETTIME
@@ -60,6 +60,25 @@ int iscsi_mt_sem_destroy(libiscsi_sem_t *sem);
 int iscsi_mt_sem_post(libiscsi_sem_t *sem);
 int iscsi_mt_sem_wait(libiscsi_sem_t *sem);
 
+/*
+ * Waiters are used by the synchronous API to block the calling thread
+ * until the service thread has completed the command.
+ * Every thread owns exactly one waiter which is created the first time it
+ * is needed and is then reused for all subsequent synchronous calls made
+ * from that thread.
+ *
+ * iscsi_mt_waiter_get() returns the waiter of the calling thread or NULL
+ * if it could not be allocated.
+ * iscsi_mt_waiter_arm() must be called before the command is queued,
+ * iscsi_mt_waiter_wait() blocks until iscsi_mt_waiter_wake() is called.
+ */
+struct iscsi_mt_waiter;
+
+struct iscsi_mt_waiter *iscsi_mt_waiter_get(void);
+void iscsi_mt_waiter_arm(struct iscsi_mt_waiter *waiter);
+void iscsi_mt_waiter_wait(struct iscsi_mt_waiter *waiter);
+void iscsi_mt_waiter_wake(struct iscsi_mt_waiter *waiter);
+
 #endif /* HAVE_MULTITHREADING */
 
 /*
@@ -98,6 +98,78 @@ struct iscsi_in_pdu {
 };
 void iscsi_free_iscsi_in_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
+/* Application memory registered with iscsi_register_buffer(). */
+struct iscsi_rdma_buf {
+	struct iscsi_rdma_buf *next;
+	void *buf;
+	size_t len;
+};
+
+/* A MSG_ZEROCOPY send whose pages the kernel has not released yet. */
+struct iscsi_zc_send {
+	struct iscsi_zc_send *next;
+	struct scsi_task *task;
+	uint32_t id;
+};
+
+/* A task callback held back until all zerocopy sends of the task completed. */
+struct iscsi_zc_deferred {
+	struct iscsi_zc_deferred *next;
+	struct scsi_task *task;
+	int status;
+	iscsi_command_cb callback;
+	void *private_data;
+};
+
+/* A task completed without going to the wire, see iscsi_scsi_task_complete_later(). */
+struct iscsi_completion {
+	struct iscsi_completion *next;
+	struct scsi_task *task;
+	int status;
+	iscsi_command_cb callback;
+	void *private_data;
+};
+
+struct iscsi_read_cache;
+struct iscsi_coalesce;
+struct iscsi_split;
+struct iscsi_xcopy;
+struct iscsi_multipath;
+struct iscsi_portal_cache;
+struct iscsi_trace_ring;
+struct iscsi_recorder;
+
+/*
+ * What a target settled on at the last successful login of an initiator,
+ * offered straight away at the next one. See iscsi_set_login_cache().
+ */
+struct iscsi_login_profile {
+	struct iscsi_login_profile *next;
+	char initiator_name[MAX_ISCSI_NAME_SIZE+1];
+	char target_name[MAX_ISCSI_NAME_SIZE+1];	/* empty if not valid */
+	int auth_none;		/* the target did not ask for authentication */
+	enum iscsi_header_digest header_digest;
+	enum iscsi_data_digest data_digest;
+};
+
+/* What we know about the Block Limits VPD of a LUN. */
+enum iscsi_lun_limits_state {
+	ISCSI_LUN_LIMITS_UNKNOWN = 0,
+	ISCSI_LUN_LIMITS_FETCHING,
+	ISCSI_LUN_LIMITS_VALID,
+	ISCSI_LUN_LIMITS_NONE,		/* the LUN does not report any */
+};
+
+struct iscsi_lun_limits_waiter;
+
+struct iscsi_lun_limits {
+	struct iscsi_lun_limits *next;
+	int lun;
+	enum iscsi_lun_limits_state state;
+	struct scsi_inquiry_block_limits *bl;	/* only if VALID */
+	struct iscsi_lun_limits_waiter *waiters;
+};
+
 /* size of chap response field */
 #define MAX_CHAP_R_SIZE 32 /* md5:16  sha1:20 */
 
@@ -117,6 +189,8 @@ struct iscsi_context {
 	char portal[MAX_STRING_SIZE+1];
 	char alias[MAX_STRING_SIZE+1];
 	char bind_interfaces[MAX_STRING_SIZE+1];
+	char tls_ca_file[MAX_STRING_SIZE+1];
+	char alternate_portals[MAX_STRING_SIZE+1];
 	char unit_serial_number[MAX_STRING_SIZE+1];
 
 	enum iscsi_chap_auth chap_auth;
@@ -134,6 +208,8 @@ struct iscsi_context {
 	enum iscsi_session_type session_type;
 	unsigned char isid[6];
 	uint8_t rdma_ack_timeout;
+	int rdma_mr_cache_max;
+	struct iscsi_rdma_buf *rdma_bufs;
 	uint32_t itt;                  /* Protected by iscsi_lock */
 	uint32_t cmdsn;                /* Protected by iscsi_lock */
 	uint32_t min_cmdsn_waiting;    /* Protected by iscsi_lock */
@@ -155,6 +231,35 @@ struct iscsi_context {
 	int tcp_keepidle;
 	int tcp_syncnt;
 	int tcp_nonblocking;
+	uint32_t tcp_zerocopy_threshold;
+	int tcp_zerocopy;
+
+	uint32_t zc_next_id;
+	struct iscsi_zc_send *zc_sends;
+	struct iscsi_zc_deferred *zc_deferred;
+
+	struct iscsi_completion *completions; /* Protected by iscsi_lock */
+	struct iscsi_read_cache *read_cache;
+	struct iscsi_coalesce *coalesce;
+	struct iscsi_trace_ring *trace;
+	struct iscsi_recorder *recorder; /* Protected by iscsi_mutex */
+	int record_env;		/* LIBISCSI_RECORD, opened at login */
+	struct iscsi_lun_limits *lun_limits; /* Protected by iscsi_lock */
+	int auto_split;
+	struct iscsi_split *splits;	/* Protected by iscsi_lock */
+	int discard_queue_depth;
+	struct iscsi_xcopy *xcopies;	/* Protected by iscsi_lock */
+	int xcopy_list_id;
+	struct iscsi_multipath *multipath;	/* that this is a path of */
+
+	struct iscsi_tls *tls;              /* handshake, then kernel TLS keys */
+	struct iscsi_connecting *connecting; /* only while connecting */
+	struct iscsi_portal_cache *portal_cache; /* kept across reconnects */
+
+	int busy_poll_us;
+	int busy_poll_socket_us;
+	volatile int busy_polling;
+	struct iscsi_busy_poll_stats busy_poll_stats;
 
 	int current_phase;
 	int next_phase;
@@ -163,6 +268,12 @@ struct iscsi_context {
 #define ISCSI_LOGIN_SECNEG_PHASE_SEND_RESPONSE      2
 	int secneg_phase;
 	int login_attempts;
+	char discovery_cache[MAX_STRING_SIZE+1];
+	int discovery_cache_ttl;
+	struct iscsi_login_profile login_profile;
+	struct iscsi_login_cache *login_cache;
+	int login_skipped_auth;	/* went straight to opneg on the profile */
+	int login_auth_none;	/* the target answered AuthMethod=None */
 	int is_loggedin;
 	int bind_interfaces_cnt;
 	int nops_in_flight;
@@ -176,6 +287,9 @@ struct iscsi_context {
 	struct iscsi_pdu *outqueue;         /* Protected by iscsi_lock */
 	struct iscsi_pdu *outqueue_current; /* Protected by iscsi_lock */
 	struct iscsi_pdu *waitpdu;          /* Protected by iscsi_lock */
+	int outqueue_batching;
+	struct iscsi_pdu *outqueue_batch;   /* held until the batch ends */
+	struct iscsi_pdu *outqueue_batch_tail;
 	struct iscsi_in_pdu *incoming;      /* Protected by iscsi_lock */
 
 	uint32_t max_burst_length;
@@ -186,6 +300,13 @@ struct iscsi_context {
 	enum iscsi_initial_r2t use_initial_r2t;
 	enum iscsi_immediate_data want_immediate_data;
 	enum iscsi_immediate_data use_immediate_data;
+	enum iscsi_error_recovery_level want_error_recovery_level;
+	enum iscsi_error_recovery_level error_recovery_level;
+	uint32_t statsn_high;          /* Protected by iscsi_lock */
+	uint32_t statsn_missing;       /* Protected by iscsi_lock */
+#define ISCSI_STATSN_WINDOW 1024
+	/* StatSNs after statsn still missing, by statsn % window */
+	uint32_t statsn_gap[ISCSI_STATSN_WINDOW / 32]; /* Protected by iscsi_lock */
 
 	int lun;
 	int no_auto_reconnect;
@@ -195,16 +316,30 @@ struct iscsi_context {
 
 	int log_level;
 	iscsi_log_fn log_fn;
+	int log_rate_limit;	/* messages per call site and second */
+#define ISCSI_LOG_LIMIT_SETS 8
+#define ISCSI_LOG_LIMIT_WAYS 4
+	struct iscsi_log_limit {
+		const char *format;
+		uint64_t window;	/* iscsi_clock_us() when it started */
+		int count;
+		int suppressed;
+	} log_limits[ISCSI_LOG_LIMIT_SETS * ISCSI_LOG_LIMIT_WAYS];
+				/* Protected by log_lock */
 
 	int mallocs;                               //needs protection?
 	int reallocs;                              //needs protection?
 	int frees;                                 //needs protection?
 	int cache_allocations;                     //needs ptotection?
 
-	time_t next_reconnect;
+	uint64_t next_reconnect;                   /* iscsi_clock_us() */
 	int scsi_timeout;
 	struct iscsi_context *old_iscsi;
 	int retry_cnt;
+	int reconnect_backoff_min_ms;
+	int reconnect_backoff_max_ms;
+	uint64_t reconnect_start_us;       /* when the session was lost */
+	struct iscsi_reconnect_stats reconnect_stats;
 	int no_ua_on_reconnect;
 	void (*fd_dup_cb)(struct iscsi_context *iscsi, void *opaque);
 	void *fd_dup_opaque;
@@ -213,6 +348,7 @@ struct iscsi_context {
         int multithreading_enabled;
         libiscsi_spinlock_t iscsi_lock;
         libiscsi_mutex_t iscsi_mutex;
+        libiscsi_spinlock_t log_lock;
         libiscsi_thread_t service_thread;
         int poll_timeout;
 #ifndef HAVE_STDATOMIC_H
@@ -260,6 +396,7 @@ enum iscsi_opcode {
 	ISCSI_PDU_TEXT_REQUEST                   = 0x04,
 	ISCSI_PDU_DATA_OUT                       = 0x05,
 	ISCSI_PDU_LOGOUT_REQUEST                 = 0x06,
+	ISCSI_PDU_SNACK_REQUEST                  = 0x10,
 	ISCSI_PDU_NOP_IN                         = 0x20,
 	ISCSI_PDU_SCSI_RESPONSE                  = 0x21,
 	ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE  = 0x22,
@@ -273,6 +410,17 @@ enum iscsi_opcode {
 	ISCSI_PDU_NO_PDU                         = 0xff
 };
 
+/* Data-Out and SNACK PDUs do not have a CmdSN of their own */
+#define ISCSI_PDU_HAS_CMDSN(pdu) \
+	(((pdu)->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT && \
+	 ((pdu)->outdata.data[0] & 0x3f) != ISCSI_PDU_SNACK_REQUEST)
+
+enum iscsi_snack_type {
+	ISCSI_SNACK_DATA_R2T = 0,
+	ISCSI_SNACK_STATUS   = 1,
+	ISCSI_SNACK_DATA_ACK = 2
+};
+
 struct iscsi_scsi_cbdata {
 	iscsi_command_cb          callback;
 	void                     *private_data;
@@ -320,6 +468,14 @@ struct iscsi_pdu {
 
 	uint32_t calculated_data_digest;
 	bool outdata_digest_computed;
+
+	/* ErrorRecoveryLevel 1 */
+	uint32_t expdatasn;        /* next Data-In */
+	uint32_t expr2tsn;         /* next R2T */
+	uint32_t datasn_missing;   /* asked for again with a SNACK */
+	uint32_t *datasn_seen;     /* bitmap, once Data-In had a gap */
+	uint32_t datasn_seen_words;
+	unsigned char *status_hdr; /* while Data-In is still missing */
 };
 
 struct iscsi_pdu *iscsi_allocate_pdu(struct iscsi_context *iscsi,
@@ -349,6 +505,13 @@ int iscsi_add_data(struct iscsi_context *iscsi, struct iscsi_data *data,
 		   const unsigned char *dptr, int dsize, int pdualignment);
 
 void iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
+/*
+ * PDUs queued on a TCP context between these two calls are held back and
+ * then added to the outqueue in one go, in the order they were queued.
+ */
+void iscsi_outqueue_batch_begin(struct iscsi_context *iscsi);
+void iscsi_outqueue_batch_end(struct iscsi_context *iscsi);
 struct scsi_task;
 void iscsi_pdu_set_cdb(struct iscsi_pdu *pdu, struct scsi_task *task);
 
@@ -356,6 +519,11 @@ int iscsi_get_pdu_data_size(const unsigned char *hdr);
 int iscsi_get_pdu_padding_size(const unsigned char *hdr);
 int iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in);
 
+/* A copy of discovery results that is freed with one free(). */
+struct iscsi_discovery_address *
+iscsi_discovery_copy(struct iscsi_context *iscsi,
+		     struct iscsi_discovery_address *targets);
+
 int iscsi_process_login_reply(struct iscsi_context *iscsi,
 			      struct iscsi_pdu *pdu,
 			      struct iscsi_in_pdu *in);
@@ -383,6 +551,27 @@ int iscsi_process_reject(struct iscsi_context *iscsi,
 				struct iscsi_in_pdu *in);
 int iscsi_send_target_nop_out(struct iscsi_context *iscsi, uint32_t ttt, uint32_t lun);
 
+/* ErrorRecoveryLevel 1 */
+int iscsi_send_snack(struct iscsi_context *iscsi, enum iscsi_snack_type type,
+		     uint32_t itt, uint32_t ttt, uint32_t lun,
+		     uint32_t begrun, uint32_t runlength);
+int iscsi_snack_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			uint32_t datasn);
+int iscsi_snack_data_lost(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			  uint32_t datasn);
+int iscsi_snack_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    uint32_t r2tsn);
+enum iscsi_statsn_event {
+	ISCSI_STATSN_RECEIVED,
+	ISCSI_STATSN_LOST,		/* discarded for a digest error */
+	ISCSI_STATSN_SENT,		/* sent, from the next StatSN of an R2T
+					 * or unsolicited NOP-In */
+};
+int iscsi_snack_statsn(struct iscsi_context *iscsi, uint32_t statsn,
+		       enum iscsi_statsn_event event,
+		       uint32_t *begrun, uint32_t *runlength);
+void iscsi_snack_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
 void iscsi_set_error(struct iscsi_context *iscsi, const char *error_string,
 		     ...) __attribute__((format(printf, 2, 3)));
 
@@ -421,20 +610,225 @@ uint32_t iscsi_itt_post_increment(struct iscsi_context *iscsi);
 
 void iscsi_timeout_scan(struct iscsi_context *iscsi);
 
+/* Number of milliseconds from now until deadline, 0 if it has passed. */
+int iscsi_ms_until(time_t deadline);
+
+/* Microseconds from an arbitrary, preferably monotonic, starting point. */
+uint64_t iscsi_clock_us(void);
+
+/*
+ * Number of milliseconds until iscsi_timeout_scan() has work to do, a
+ * pending reconnect, the next connection attempt or the held coalesced
+ * writes are due, 0 if there are
+ * completions to run, or -1 if there is nothing to wait for.
+ */
+int iscsi_timeout_next(struct iscsi_context *iscsi);
+
 void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
                         void *command_data, void *private_data);
 
+/*
+ * Number of milliseconds until a pending reconnect is due, or -1 if there
+ * is none.
+ */
+int iscsi_reconnect_next_ms(struct iscsi_context *iscsi);
+
 struct iscsi_pdu *iscsi_tcp_new_pdu(struct iscsi_context *iscsi, size_t size);
 
 void iscsi_init_tcp_transport(struct iscsi_context *iscsi);
+void iscsi_init_tls_transport(struct iscsi_context *iscsi);
 
 void iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
 
+ssize_t iscsi_iovector_readv_writev(struct iscsi_context *iscsi,
+				    struct scsi_iovector *iovector,
+				    uint32_t pos, ssize_t count,
+				    uint32_t *data_digest_ptr, int do_write);
+
 int iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi);
 
+union socket_address;
+
+/* TCP transport entry points, shared with the TLS transport */
+int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa, int ai_family);
+int iscsi_tcp_disconnect(struct iscsi_context *iscsi);
+int iscsi_tcp_service(struct iscsi_context *iscsi, int revents);
+int iscsi_tcp_get_fd(struct iscsi_context *iscsi);
+int iscsi_tcp_which_events(struct iscsi_context *iscsi);
+void iscsi_tcp_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu);
+
+/* Abandon any name resolution and connection attempts in progress. */
+void iscsi_tcp_connect_cancel(struct iscsi_context *iscsi);
+
+/*
+ * Number of milliseconds until the next parallel connection attempt is
+ * due, or the attempts in progress other than iscsi->fd should be polled
+ * again, or -1 if neither is pending.
+ */
+int iscsi_tcp_connect_next_ms(struct iscsi_context *iscsi);
+
+/* Forget the addresses the portals resolved into at the last connect. */
+void iscsi_tcp_portal_cache_free(struct iscsi_context *iscsi);
+
+/*
+ * Called by iscsi_tcp_service() once the TCP connection of a TLS transport
+ * context is established. Starts the TLS handshake, the socket_status_cb
+ * is invoked when the handshake has completed or failed.
+ */
+int iscsi_tls_handshake_start(struct iscsi_context *iscsi);
+
+/* Release TLS handshake and key state, if any. */
+void iscsi_tls_release(struct iscsi_context *iscsi);
+
+/*
+ * Called when a read from a kernel TLS socket failed with EIO, which is
+ * how the kernel reports that the next record is not application data.
+ * Consumes that record: session tickets are dropped and a TLS 1.3
+ * KeyUpdate rekeys the socket. Returns 1 if the read can be retried,
+ * 0 if the socket is not a kernel TLS one and -1 on error.
+ */
+int iscsi_tls_recv_control(struct iscsi_context *iscsi);
+
+/*
+ * Spin on pfd, refreshing pfd->events from iscsi_which_events() every
+ * round, for up to the busy poll budget. Returns like poll(), 0 if the
+ * budget ran out or busy polling is disabled.
+ */
+struct pollfd;
+int iscsi_busy_poll(struct iscsi_context *iscsi, struct pollfd *pfd);
+
+/*
+ * Returns 1 if the task still has zerocopy sends in flight, in which case
+ * the callback is queued and invoked once the kernel has released the pages.
+ */
+int iscsi_tcp_zerocopy_defer(struct iscsi_context *iscsi,
+			     struct scsi_task *task, int status,
+			     iscsi_command_cb callback, void *private_data);
+
+/*
+ * Drop the zerocopy state of owner, e.g. because its socket is going away,
+ * and invoke any deferred callbacks on iscsi.
+ */
+void iscsi_tcp_zerocopy_flush(struct iscsi_context *iscsi,
+			      struct iscsi_context *owner);
+
 void iscsi_dump_pdu_header(struct iscsi_context *iscsi, unsigned char *data);
 
-union socket_address;
+/*
+ * Record a PDU header in the trace ring, if tracing is enabled.
+ */
+void iscsi_trace_pdu(struct iscsi_context *iscsi, int direction,
+		     const unsigned char *hdr);
+#define ISCSI_TRACE_PDU(iscsi, direction, hdr) \
+	do { \
+		if (iscsi->trace) { \
+			iscsi_trace_pdu(iscsi, direction, hdr); \
+		} \
+	} while (0)
+
+/*
+ * Have the completion of task recorded, by putting a callback in front
+ * of *cb that writes the record. Does nothing if the allocation fails.
+ */
+void iscsi_record_command(struct iscsi_context *iscsi, int lun,
+			  struct scsi_task *task, iscsi_command_cb *cb,
+			  void **private_data);
+
+/*
+ * Start the recording asked for with LIBISCSI_RECORD once a normal
+ * session has logged in. The first context of the process records to
+ * the file itself and later ones to the file with .1, .2 ... appended.
+ */
+void iscsi_record_env_start(struct iscsi_context *iscsi);
+
+/*
+ * iscsi_scsi_command_async() without write coalescing in front of it,
+ * also without splitting for iscsi_scsi_command_unsplit(), and without
+ * the read cache either for iscsi_scsi_command_queue().
+ */
+int iscsi_scsi_command_submit(struct iscsi_context *iscsi, int lun,
+			      struct scsi_task *task, iscsi_command_cb cb,
+			      struct iscsi_data *d, void *private_data);
+int iscsi_scsi_command_unsplit(struct iscsi_context *iscsi, int lun,
+			       struct scsi_task *task, iscsi_command_cb cb,
+			       struct iscsi_data *d, void *private_data);
+int iscsi_scsi_command_queue(struct iscsi_context *iscsi, int lun,
+			     struct scsi_task *task, iscsi_command_cb cb,
+			     struct iscsi_data *d, void *private_data);
+
+/*
+ * Invoke the callback of a task that never went to the wire from the next
+ * iscsi_service() rather than from the stack of the caller. The task may
+ * be NULL for requests that are not a single task.
+ */
+int iscsi_scsi_task_complete_later(struct iscsi_context *iscsi,
+				   struct scsi_task *task, int status,
+				   iscsi_command_cb callback,
+				   void *private_data);
+void iscsi_run_completions(struct iscsi_context *iscsi);
+int iscsi_cancel_completion(struct iscsi_context *iscsi,
+			    struct scsi_task *task);
+
+/*
+ * Pass a command through the read cache. Returns 1 if the cache has no
+ * interest in it, in which case the caller queues it itself, else 0 on
+ * success and -1 on failure.
+ */
+int iscsi_cache_command(struct iscsi_context *iscsi, int lun,
+			struct scsi_task *task, iscsi_command_cb cb,
+			struct iscsi_data *d, void *private_data);
+int iscsi_cache_cancel_task(struct iscsi_context *iscsi,
+			    struct scsi_task *task);
+
+/*
+ * Pass a command through the write coalescer, with the same return values
+ * as iscsi_cache_command(). iscsi_coalesce_service() sends the held writes
+ * once they have waited long enough, iscsi_coalesce_next_ms() says when
+ * that is, or -1 if no writes are held.
+ */
+int iscsi_coalesce_command(struct iscsi_context *iscsi, int lun,
+			   struct scsi_task *task, iscsi_command_cb cb,
+			   struct iscsi_data *d, void *private_data);
+int iscsi_coalesce_cancel_task(struct iscsi_context *iscsi,
+			       struct scsi_task *task);
+void iscsi_coalesce_service(struct iscsi_context *iscsi);
+int iscsi_coalesce_next_ms(struct iscsi_context *iscsi);
+
+/*
+ * Copy the Block Limits VPD of a LUN into bl and return 0 if it is known,
+ * all zero if the LUN does not have one. Otherwise start fetching it and
+ * return 1, and if cb is not NULL have it called, with SCSI_STATUS_GOOD
+ * or the status the fetch failed with, once the fetch is done. Returns -1
+ * if the fetch could not be started, in which case cb is not called.
+ */
+int iscsi_lun_limits_get(struct iscsi_context *iscsi, int lun,
+			 struct scsi_inquiry_block_limits *bl,
+			 iscsi_command_cb cb, void *private_data);
+void iscsi_lun_limits_free(struct iscsi_context *iscsi);
+
+/*
+ * Split a read or write that is larger than the maximum transfer length
+ * of the LUN, with the same return values as iscsi_cache_command().
+ */
+int iscsi_split_command(struct iscsi_context *iscsi, int lun,
+			struct scsi_task *task, iscsi_command_cb cb,
+			struct iscsi_data *d, void *private_data);
+int iscsi_split_cancel_task(struct iscsi_context *iscsi,
+			    struct scsi_task *task);
+
+/*
+ * Poll the copy managers for the progress of the EXTENDED COPYs in flight,
+ * and say when that is next due.
+ */
+void iscsi_xcopy_service(struct iscsi_context *iscsi);
+int iscsi_xcopy_next_ms(struct iscsi_context *iscsi);
+
+/*
+ * Retry the commands of a multipath device that are waiting for a usable
+ * path and refresh its ALUA states, and say when that is next due.
+ */
+void iscsi_multipath_service(struct iscsi_context *iscsi);
+int iscsi_multipath_next_ms(struct iscsi_context *iscsi);
 
 typedef struct iscsi_transport {
 	int (*connect)(struct iscsi_context *iscsi, union socket_address *sa, int ai_family);
@@ -0,0 +1,64 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __iscsi_probes_h__
+#define __iscsi_probes_h__
+
+/*
+ * USDT probes, built in with ./configure --enable-usdt.
+ *
+ * A probe is a single nop in the code until a tracer such as bpftrace or
+ * SystemTap attaches to it, and its arguments are only read when it
+ * fires, so they should be values that are at hand anyway. All probes are
+ * in the libiscsi provider and take the context as their first argument:
+ *
+ * command_submit  (iscsi, task, lun, cdb[0], expxferlen)
+ *     iscsi_scsi_command_async() was called.
+ * command_queue   (iscsi, task, itt, cmdsn, lun)
+ *     The SCSI command PDU has its ITT and CmdSN and is queued.
+ * pdu_send        (iscsi, itt, cmdsn, opcode, bytes)
+ *     A PDU was taken off the outqueue to be written to the socket.
+ * pdu_recv        (iscsi, itt, statsn, opcode, data length)
+ *     The header of a PDU was read from the socket.
+ * pdu_match       (iscsi, itt, cmdsn, lun, opcode)
+ *     A received PDU was matched to the request it answers.
+ * command_complete(iscsi, task, itt, cmdsn, status, residual)
+ *     The callback of a SCSI command is about to be invoked.
+ * command_timeout (iscsi, itt, cmdsn, lun, opcode)
+ *     A request timed out, opcode is that of the request.
+ * reconnect_start (iscsi, portal, attempt)
+ *     A new connection is being made to replace a lost one.
+ * reconnect_done  (iscsi, status, attempt, elapsed us, commands replayed)
+ *     A reconnect attempt finished, status is SCSI_STATUS_GOOD on success.
+ */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define ISCSI_PROBE3(name, a, b, c) \
+	DTRACE_PROBE3(libiscsi, name, a, b, c)
+#define ISCSI_PROBE5(name, a, b, c, d, e) \
+	DTRACE_PROBE5(libiscsi, name, a, b, c, d, e)
+#define ISCSI_PROBE6(name, a, b, c, d, e, f) \
+	DTRACE_PROBE6(libiscsi, name, a, b, c, d, e, f)
+
+#else /* HAVE_USDT */
+
+#define ISCSI_PROBE3(name, a, b, c)		do { } while (0)
+#define ISCSI_PROBE5(name, a, b, c, d, e)	do { } while (0)
+#define ISCSI_PROBE6(name, a, b, c, d, e, f)	do { } while (0)
+
+#endif /* HAVE_USDT */
+
+#endif /* __iscsi_probes_h__ */
@@ -58,7 +58,8 @@ struct scsi_iovec;
 
 enum iscsi_transport_type {
 	TCP_TRANSPORT = 0,
-	ISER_TRANSPORT = 1
+	ISER_TRANSPORT = 1,
+	TLS_TRANSPORT = 2
 };
 
 EXTERN void iscsi_set_cache_allocations(struct iscsi_context *iscsi, int ca);
@@ -185,6 +186,25 @@ enum iscsi_initial_r2t {
 EXTERN int
 iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initial_r2t);
 
+/*
+ * This function is used to set the ErrorRecoveryLevel to offer the target.
+ * This can be set on a context before it has been logged in to the target.
+ *
+ * At level 1 a lost or corrupted Data-In or R2T PDU is asked for again
+ * with a Data/R2T SNACK and a missing status with a Status SNACK, instead
+ * of dropping the session and sending every command again. The target may
+ * still choose level 0. Only the TCP transport supports level 1.
+ *
+ * Default is ISCSI_ERROR_RECOVERY_LEVEL_0
+ */
+enum iscsi_error_recovery_level {
+	ISCSI_ERROR_RECOVERY_LEVEL_0 = 0,
+	ISCSI_ERROR_RECOVERY_LEVEL_1 = 1
+};
+EXTERN int
+iscsi_set_error_recovery_level(struct iscsi_context *iscsi,
+			       enum iscsi_error_recovery_level level);
+
 
 enum iscsi_chap_auth {
 	ISCSI_CHAP_MD5 = 5,
@@ -272,6 +292,9 @@ EXTERN int iscsi_destroy_context(struct iscsi_context *iscsi);
  * Sets and initializes the transport type for a context.
  * TCP_TRANSPORT is the default and is available on all platforms.
  * ISER_TRANSPORT is conditionally supported on Linux where available.
+ * TLS_TRANSPORT is TCP encrypted with TLS. The handshake is done with
+ * gnutls and record encryption is then offloaded to kernel TLS, so it is
+ * only available on Linux when built with gnutls.
  *
  * Returns:
  *  0: success
@@ -345,6 +368,38 @@ enum iscsi_session_type {
 EXTERN int iscsi_set_session_type(struct iscsi_context *iscsi,
 			   enum iscsi_session_type session_type);
 
+/*
+ * Login profiles.
+ *
+ * A context remembers what the target settled on at its last successful
+ * login and offers it at the next one, for example when it reconnects.
+ * If the target did not ask for authentication the security negotiation
+ * is skipped and the login goes straight to the operational parameters,
+ * which saves a round trip; if the target does ask for it after all, the
+ * login is retried with CHAP. Digests the context was willing to take
+ * either way are offered as the target chose them.
+ *
+ * A login cache shares the profiles between contexts, so that the first
+ * login to a target speeds up the ones that follow, for example when many
+ * sessions are logged in at once. The cache is thread safe and is kept
+ * alive until it has been destroyed and the last context using it is.
+ */
+struct iscsi_login_cache;
+
+EXTERN struct iscsi_login_cache *iscsi_create_login_cache(void);
+EXTERN void iscsi_destroy_login_cache(struct iscsi_login_cache *cache);
+
+/*
+ * Use the cache for the logins of the context, NULL to stop using one.
+ * Can only be set/changed before the context is logged in.
+ *
+ * Returns:
+ *  0: success
+ * <0: error
+ */
+EXTERN int iscsi_set_login_cache(struct iscsi_context *iscsi,
+				 struct iscsi_login_cache *cache);
+
 
 /*
  * Types of header digest we support. Default is NONE
@@ -684,10 +739,36 @@ EXTERN struct iscsi_discovery_address *iscsi_discovery_sync(
         struct iscsi_context *iscsi);
 
 /* Free the discovery data structures returned by iscsi_discovery_sync
+ * and iscsi_discovery_cache_lookup
  */
 EXTERN void iscsi_free_discovery_data(struct iscsi_context *iscsi,
                                       struct iscsi_discovery_address *da);
 
+/*
+ * Keep the results of discoveries on this context in a file, shared by
+ * all processes that use the same one. Results older than ttl seconds are
+ * not used. Set path to NULL to stop using the cache.
+ *
+ * Returns:
+ *  0 on success
+ * <0 if the path is too long
+ */
+EXTERN int iscsi_set_discovery_cache(struct iscsi_context *iscsi,
+                                     const char *path, int ttl);
+
+/*
+ * Look up the last discovery through portal in the discovery cache, so
+ * that the discovery session can be skipped.
+ *
+ * Returns:
+ *  NULL if there is no recent enough result for the portal.
+ *  struct iscsi_discovery_address* with the targets, in the same order
+ *    as the callback of iscsi_discovery_async() got them. The data must be
+ *    released by calling iscsi_free_discovery_data.
+ */
+EXTERN struct iscsi_discovery_address *
+iscsi_discovery_cache_lookup(struct iscsi_context *iscsi, const char *portal);
+
 /*
  * Asynchronous call to perform an ISCSI NOP-OUT call
  *
@@ -1649,6 +1730,50 @@ EXTERN void iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn);
 /* predefined log function that just writes to stderr */
 EXTERN void iscsi_log_to_stderr(int level, const char *message);
 
+/*
+ * Allow each place that logs to log at most burst messages per second on
+ * this context, and drop the rest. The number of messages that were
+ * dropped is logged with the next message from the same place that gets
+ * through. 0, the default, disables rate limiting.
+ */
+EXTERN void iscsi_set_log_rate_limit(struct iscsi_context *iscsi, int burst);
+
+/*
+ * ASYNCHRONOUS LOGGING
+ *
+ * Instead of calling the log function of a context from wherever the
+ * message is logged, queue the formatted messages of all contexts in a
+ * process wide ring of entries messages. Queueing never blocks: when the
+ * ring is full the message is dropped and the number of dropped messages
+ * is logged once there is room again.
+ *
+ * With background set, a thread calls the log functions, so they have to
+ * be safe to call from another thread. Otherwise the application calls
+ * iscsi_log_async_drain() when it suits it, from one thread at a time.
+ * It can also be started with the LIBISCSI_LOG_ASYNC environment
+ * variable, set to the number of entries, which uses a background thread.
+ *
+ * The ring is created the first time this is called, entries <= 0 means
+ * 1024, and is reused when it is started again after being stopped.
+ *
+ * Returns 0 on success, also if it was already started, -1 on failure.
+ */
+EXTERN int iscsi_log_async_start(int entries, int background);
+
+/*
+ * Call the log functions for the queued messages. Does nothing if the
+ * messages are delivered by a background thread.
+ *
+ * Returns the number of messages delivered.
+ */
+EXTERN int iscsi_log_async_drain(void);
+
+/*
+ * Go back to calling the log functions directly, after delivering the
+ * messages that are still queued.
+ */
+EXTERN void iscsi_log_async_stop(void);
+
 /*
  * This function is to set the TCP_USER_TIMEOUT option. It has to be called after iscsi
  * context creation. The value given in ms is then applied each time a new socket is created.
@@ -1684,6 +1809,16 @@ iscsi_set_tcp_keepintvl(struct iscsi_context *iscsi, int value);
 EXTERN void
 iscsi_set_tcp_syncnt(struct iscsi_context *iscsi, int value);
 
+/*
+ * This function is to send write payloads of at least threshold bytes with
+ * MSG_ZEROCOPY instead of copying them into the socket buffers. The callback
+ * of such a task is delayed until the kernel has released the data buffers.
+ * 0 disables zerocopy (default). Only supported on Linux, it has to be
+ * called after iscsi context creation and applies on next socket creation.
+ */
+EXTERN void
+iscsi_set_tcp_zerocopy(struct iscsi_context *iscsi, int threshold);
+
 /*
  * This function is to set the interface that outbound connections for this socket are bound to.
  * You max specify more than one interface here separated by comma.
@@ -1691,6 +1826,56 @@ iscsi_set_tcp_syncnt(struct iscsi_context *iscsi, int value);
 EXTERN void
 iscsi_set_bind_interfaces(struct iscsi_context *iscsi, char * interfaces);
 
+/*
+ * This function sets the PEM file with the CA certificates used to verify
+ * the target certificate for TLS_TRANSPORT. By default the system trust
+ * store is used. It applies to the next TLS handshake.
+ */
+EXTERN void
+iscsi_set_tls_ca_file(struct iscsi_context *iscsi, const char *ca_file);
+
+/*
+ * Set a whitespace separated list of alternate portals, e.g.
+ * "10.0.0.2:3260 [fe80::2]:3260", for the same target. When connecting,
+ * the portal and its alternates are resolved and every address they
+ * resolve into is tried in parallel with a short stagger, preferring the
+ * order of the list. The first connection to complete is used.
+ * Hostnames are resolved without blocking the caller when libiscsi is
+ * built with pthread support.
+ * It applies to the next connect and is kept across reconnects.
+ */
+EXTERN void
+iscsi_set_alternate_portals(struct iscsi_context *iscsi, const char *portals);
+
+/*
+ * Register application memory for RDMA. For iSER contexts, commands whose
+ * data buffer is a single, virtually contiguous range inside a registered
+ * buffer are transferred by the target directly to and from that memory
+ * instead of through an internal bounce buffer. Registrations are kept
+ * across reconnects. For other transports this is only bookkeeping.
+ *
+ * The memory must stay mapped until it is unregistered, with the same
+ * buf and len, or the context is destroyed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_register_buffer(struct iscsi_context *iscsi, void *buf, size_t len);
+EXTERN int
+iscsi_unregister_buffer(struct iscsi_context *iscsi, void *buf, size_t len);
+
+/*
+ * Number of registrations of application memory that iSER may create on
+ * demand, and keep in an LRU cache, for buffers that were not registered
+ * with iscsi_register_buffer(). 0, the default, disables this.
+ *
+ * Only enable this if buffers used for I/O are never unmapped while the
+ * context exists, as a cached registration would otherwise keep referring
+ * to the pages the buffer had when it was registered.
+ */
+EXTERN void
+iscsi_set_rdma_mr_cache(struct iscsi_context *iscsi, int entries);
+
 /*
  * This function is to disable auto reconnect logic.
  *
@@ -1711,6 +1896,36 @@ iscsi_set_noautoreconnect(struct iscsi_context *iscsi, int state);
 EXTERN void
 iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count);
 
+/*
+ * Set the backoff between reconnect attempts. A lost session is
+ * reconnected right away. After n failed attempts the next one waits a
+ * random time between half and all of min_ms * 2^(n-1), but not more than
+ * max_ms. After a successful reconnect the next one is held off for the
+ * same time as after the first failed attempt.
+ *
+ * The defaults are 100 and 30000 ms.
+ */
+EXTERN void
+iscsi_set_reconnect_backoff(struct iscsi_context *iscsi, int min_ms,
+			    int max_ms);
+
+struct iscsi_reconnect_stats {
+	uint64_t reconnects;  /* sessions that were reconnected */
+	uint64_t failures;    /* reconnect attempts that failed */
+	uint64_t replayed;    /* commands sent again after a reconnect */
+	uint64_t last_us;     /* time from losing the session until it was
+			       * logged in again, for the last reconnect */
+	uint64_t max_us;      /* and the longest */
+	uint64_t total_us;    /* and all of them */
+};
+
+/*
+ * Fetch the reconnect statistics of the context.
+ */
+EXTERN void
+iscsi_get_reconnect_stats(struct iscsi_context *iscsi,
+			  struct iscsi_reconnect_stats *stats);
+
 /* Set to true to have libiscsi use TESTUNITREADY and consume any/all
    UnitAttentions that may have triggered in the target.
  */
@@ -1723,6 +1938,795 @@ iscsi_set_fd_dup_cb(struct iscsi_context *iscsi,
 		    void (*cb)(struct iscsi_context *iscsi, void *opaque),
 		    void *opaque);
 
+/*
+ * BUSY POLLING
+ *
+ * When spin_us is > 0 the service thread, and the event loop of the
+ * synchronous API, poll the socket and the queue of new PDUs without
+ * blocking for up to spin_us microseconds before they go to sleep in
+ * poll(). This trades a CPU core for lower latency.
+ *
+ * When socket_us is > 0 SO_BUSY_POLL is set to socket_us, and
+ * SO_PREFER_BUSY_POLL is enabled, on the next socket creation so that the
+ * kernel polls the NIC queue while we spin. Raising SO_BUSY_POLL above
+ * net.core.busy_read needs CAP_NET_ADMIN.
+ *
+ * 0/0 disables busy polling (default).
+ */
+EXTERN void
+iscsi_set_busy_poll(struct iscsi_context *iscsi, int spin_us, int socket_us);
+
+struct iscsi_busy_poll_stats {
+	uint64_t spins;     /* times we started spinning */
+	uint64_t hits;      /* spins that found work within the budget */
+	uint64_t sleeps;    /* spins that ran out and fell back to poll() */
+	uint64_t spin_us;   /* total time spent spinning */
+};
+
+/*
+ * Fetch the busy polling statistics of the context.
+ */
+EXTERN void
+iscsi_get_busy_poll_stats(struct iscsi_context *iscsi,
+			  struct iscsi_busy_poll_stats *stats);
+
+/*
+ * READ CACHE
+ *
+ * Cache the data of small reads through this context in up to budget
+ * bytes of memory. READ10/12/16 of up to 256 kb, without protection
+ * information or FUA, are served from the cache when all blocks are
+ * cached, and otherwise fetch the 4 kb pages they touch from the target.
+ * Concurrent reads of pages that are already being fetched wait for that
+ * fetch. Once two reads have been back to back, readahead bytes beyond
+ * the end of the stream are fetched in the background.
+ *
+ * Writes, UNMAP and other commands that modify the medium through this
+ * context invalidate the blocks they touch. Changes made by other
+ * initiators, or other contexts, are NOT seen so only use this on a LUN
+ * that nobody else writes to.
+ *
+ * A budget of 0, the default, disables the cache and frees its memory.
+ * It can also be enabled with the LIBISCSI_READ_CACHE environment
+ * variable, set to the budget in bytes. The cache is kept across
+ * reconnects.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_read_cache(struct iscsi_context *iscsi, size_t budget,
+		     size_t readahead);
+
+struct iscsi_read_cache_stats {
+	uint64_t hits;          /* reads served from the cache */
+	uint64_t misses;        /* reads that had to fetch pages */
+	uint64_t coalesced;     /* misses that waited for a fetch in flight */
+	uint64_t bypassed;      /* reads the cache can not hold */
+	uint64_t readaheads;    /* background fetches issued */
+	uint64_t invalidations; /* pages dropped because of writes */
+	uint64_t evictions;     /* pages dropped to stay within the budget */
+	uint64_t cached;        /* bytes currently cached */
+};
+
+/*
+ * Fetch the read cache statistics of the context. All zero if the cache
+ * is disabled.
+ */
+EXTERN void
+iscsi_get_read_cache_stats(struct iscsi_context *iscsi,
+			   struct iscsi_read_cache_stats *stats);
+
+/*
+ * WRITE COALESCING
+ *
+ * Merge small writes to consecutive blocks into larger WRITE16 commands.
+ * When nothing is in flight through the coalescer a WRITE10/12/16 is sent
+ * right away. While writes are in flight, later writes that continue the
+ * LBA range of the one before them are held back and then sent together
+ * once the writes in flight complete, the merged write would exceed window
+ * bytes, a write with FUA is added, or the first held write has waited for
+ * delay_us microseconds. Any other command sent through the context
+ * flushes the held writes first, so the order of commands is kept.
+ *
+ * Merged writes never exceed the maximum transfer length the LUN reports
+ * in its Block Limits VPD. The page is fetched the first time a LUN is
+ * written to and writes go out unmerged until it is known. Each write
+ * completes with the status and sense data of the command it was merged
+ * into, and with its share of any residual.
+ *
+ * Writes with protection information are never merged. A window of 0, the
+ * default, disables coalescing. It can also be enabled with the
+ * LIBISCSI_WRITE_COALESCING environment variable, set to the window in
+ * bytes, with a delay of 200us.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_write_coalescing(struct iscsi_context *iscsi, uint32_t window,
+			   int delay_us);
+
+/*
+ * BLOCK LIMITS
+ *
+ * The Block Limits VPD page of each LUN is fetched once per context and
+ * kept across reconnects.
+ */
+struct scsi_inquiry_block_limits;
+
+/*
+ * Copy the Block Limits VPD page of the LUN into bl, fetching it from the
+ * target if this is the first time it is needed. bl is all zero if the
+ * LUN does not have the page.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_get_block_limits_sync(struct iscsi_context *iscsi, int lun,
+			    struct scsi_inquiry_block_limits *bl);
+
+/*
+ * Automatically split READ10/12/16 and WRITE10/12/16 that are larger than
+ * the MAXIMUM TRANSFER LENGTH of the LUN into READ16/WRITE16 commands
+ * that are all sent at once. Pieces are aligned to, and a multiple of,
+ * the OPTIMAL TRANSFER LENGTH where the maximum allows it. The task that
+ * was submitted completes once all pieces have, with the status and
+ * sense data of the lowest failing piece and a residual that counts the
+ * data of the pieces that failed or were short. Commands with protection
+ * information are never split.
+ *
+ * An enable value larger than 1 is also the largest piece in blocks, for
+ * when pieces should be smaller than the LUN allows.
+ *
+ * Until the Block Limits of a LUN are known, reads and writes to it wait
+ * for them to be fetched. Splitting is disabled by default and can also
+ * be enabled by setting the LIBISCSI_AUTO_SPLIT environment variable to
+ * 1, or to the largest piece in blocks.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_auto_split(struct iscsi_context *iscsi, int enable);
+
+/*
+ * EXTENT MAPS
+ *
+ * Walk a range of a LUN with GET LBA STATUS and report which parts of it
+ * are mapped, deallocated or anchored, e.g. so that a bulk reader can
+ * skip the parts that are not mapped. Several GET LBA STATUS are kept in
+ * flight at once. Extents are reported in LBA order, neighbouring extents
+ * with the same status are merged, and together they cover the range
+ * exactly. A LUN that does not support GET LBA STATUS is reported as
+ * mapped throughout.
+ */
+struct iscsi_lba_extent {
+	uint64_t lba;
+	uint64_t num_blocks;
+	int provisioning;       /* enum scsi_provisioning_type */
+};
+
+/*
+ * Called with SCSI_STATUS_GOOD and the next num_extents extents, which are
+ * only valid during the call, as they become known. Called a final time
+ * with num_extents 0 and SCSI_STATUS_GOOD once the whole range has been
+ * reported, or the status the walk failed with, after which the map is
+ * gone.
+ */
+typedef void (*iscsi_extent_cb)(struct iscsi_context *iscsi, int status,
+				struct iscsi_lba_extent *extents,
+				int num_extents, void *private_data);
+
+struct iscsi_extent_map;
+
+/*
+ * Start walking num_blocks blocks from lba. Returns the map, or NULL if
+ * the walk could not be started in which case cb is never called.
+ */
+EXTERN struct iscsi_extent_map *
+iscsi_extent_map_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint64_t num_blocks, iscsi_extent_cb cb,
+		       void *private_data);
+
+/*
+ * Stop a walk that has not yet made its final callback. The callback is
+ * invoked with SCSI_STATUS_CANCELLED before this returns.
+ */
+EXTERN void
+iscsi_extent_map_cancel(struct iscsi_context *iscsi,
+			struct iscsi_extent_map *map);
+
+/*
+ * The same for synchronous readers: iscsi_extent_iter_next_sync() returns
+ * 1 and the next extent, 0 once the whole range has been reported, or -1
+ * on failure. Close the iterator when done with it, at any point.
+ */
+struct iscsi_extent_iter;
+
+EXTERN struct iscsi_extent_iter *
+iscsi_extent_iter_open(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint64_t num_blocks);
+EXTERN int
+iscsi_extent_iter_next_sync(struct iscsi_extent_iter *iter,
+			    struct iscsi_lba_extent *extent);
+EXTERN void
+iscsi_extent_iter_close(struct iscsi_extent_iter *iter);
+
+/*
+ * DISCARD
+ *
+ * Discard any number of block ranges, in any order, with as few UNMAPs
+ * as the Block Limits of the LUN allow. The ranges are merged where they
+ * touch or overlap, and trimmed to whole unmap granules as the target
+ * would not deallocate parts of a granule anyway. Up to the discard
+ * queue depth UNMAPs are kept in flight. If the LUN does not implement
+ * UNMAP WRITE SAME(16) with the UNMAP bit set is used instead, which
+ * needs block_size.
+ *
+ * With ISCSI_DISCARD_WRITE_ZEROES the ranges are written with zeros
+ * using WRITE SAME(16) instead, without trimming them.
+ *
+ * cb is called with SCSI_STATUS_GOOD and NULL command_data once all of
+ * it is done, or the status of the first failure.
+ *
+ * Returns 0 if the discard was started, in which case cb will be called,
+ * or -1 if it could not be.
+ */
+#define ISCSI_DISCARD_WRITE_ZEROES	0x01
+
+EXTERN int
+iscsi_discard_async(struct iscsi_context *iscsi, int lun,
+		    struct unmap_list *list, int list_len,
+		    uint32_t block_size, int flags,
+		    iscsi_command_cb cb, void *private_data);
+
+/*
+ * Returns 0 on success and -1 on failure.
+ */
+EXTERN int
+iscsi_discard_sync(struct iscsi_context *iscsi, int lun,
+		   struct unmap_list *list, int list_len,
+		   uint32_t block_size, int flags);
+
+/*
+ * How many commands a discard keeps in flight, 8 by default.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_discard_queue_depth(struct iscsi_context *iscsi, int depth);
+
+/*
+ * OFFLOADED COPY
+ *
+ * Copy num_blocks blocks of block_size bytes from src_lba of src_lun to
+ * dst_lba of dst_lun with EXTENDED COPY, sent to the source LUN, so that
+ * the data does not pass through the initiator. Several EXTENDED COPYs
+ * are kept in flight, each as large as the RECEIVE COPY RESULTS
+ * OPERATING PARAMETERS of the copy manager allow. The parts the copy
+ * manager will not copy, or all of it if it can not copy at all, are
+ * copied with READ16 on src and WRITE16 on dst instead.
+ *
+ * src and dst may be the same context. Both have to be serviced, and
+ * neither destroyed, until cb has been called with SCSI_STATUS_GOOD and
+ * NULL command_data once all of it is copied, or the status of the first
+ * failure.
+ *
+ * Returns the copy, or NULL if it could not be started in which case cb
+ * is not called.
+ */
+struct iscsi_xcopy;
+
+EXTERN struct iscsi_xcopy *
+iscsi_xcopy_async(struct iscsi_context *src, int src_lun, uint64_t src_lba,
+		  struct iscsi_context *dst, int dst_lun, uint64_t dst_lba,
+		  uint64_t num_blocks, uint32_t block_size,
+		  iscsi_command_cb cb, void *private_data);
+
+/*
+ * How many blocks of a copy are done so far, and how many of those the
+ * copy manager copied. The EXTENDED COPYs in flight are polled for their
+ * progress twice a second. This can be called until cb returns.
+ */
+EXTERN void
+iscsi_xcopy_get_progress(struct iscsi_xcopy *xcopy, uint64_t *copied,
+			 uint64_t *offloaded);
+
+/*
+ * SESSION POOLS
+ *
+ * A session pool logs in several sessions, each with its own ISID, to the
+ * same target and LUN and spreads SCSI commands across them, so that the
+ * queue depth is not limited by the CmdSN window of a single session.
+ * Each command goes to the session with the fewest commands in flight.
+ * Sessions that are reconnecting, which each of them does on its own
+ * like any other context, only get commands when no other session is
+ * logged in.
+ *
+ * The sessions are ordinary contexts. Use iscsi_session_pool_get_context()
+ * to change their settings before connecting, and iscsi_get_fd(),
+ * iscsi_which_events() and iscsi_service() on each of them to drive the
+ * pool from an event loop. The sync functions below do that themselves.
+ */
+struct iscsi_session_pool;
+
+typedef void (*iscsi_session_pool_cb)(struct iscsi_session_pool *pool,
+				      int status, void *private_data);
+
+/*
+ * Create a pool of session contexts with initiator_name for the target
+ * and LUN of a full iSCSI URL.
+ *
+ * Returns NULL on failure.
+ */
+EXTERN struct iscsi_session_pool *
+iscsi_session_pool_create(const char *initiator_name, const char *url,
+			  int sessions);
+
+/*
+ * Destroy all sessions of the pool. Commands that are still in flight
+ * are completed with SCSI_STATUS_CANCELLED.
+ */
+EXTERN void
+iscsi_session_pool_destroy(struct iscsi_session_pool *pool);
+
+EXTERN int
+iscsi_session_pool_get_count(struct iscsi_session_pool *pool);
+
+EXTERN struct iscsi_context *
+iscsi_session_pool_get_context(struct iscsi_session_pool *pool, int n);
+
+EXTERN const char *
+iscsi_session_pool_get_error(struct iscsi_session_pool *pool);
+
+/*
+ * Bind the sessions to a comma separated list of local interfaces. Session
+ * n is bound to interface n modulo the number of interfaces.
+ * See iscsi_set_bind_interfaces().
+ */
+EXTERN void
+iscsi_session_pool_set_bind_interfaces(struct iscsi_session_pool *pool,
+				       const char *interfaces);
+
+/*
+ * Connect and log in all sessions in parallel. cb is called with
+ * SCSI_STATUS_GOOD once all of them are logged in, or with the status of
+ * a session that failed once the others have finished.
+ *
+ * Returns 0 if cb will be called, -1 if no session could be started.
+ */
+EXTERN int
+iscsi_session_pool_connect_async(struct iscsi_session_pool *pool,
+				 iscsi_session_pool_cb cb, void *private_data);
+EXTERN int
+iscsi_session_pool_connect_sync(struct iscsi_session_pool *pool);
+
+/*
+ * Log out all sessions that are logged in, in parallel.
+ */
+EXTERN int
+iscsi_session_pool_logout_async(struct iscsi_session_pool *pool,
+				iscsi_session_pool_cb cb, void *private_data);
+EXTERN int
+iscsi_session_pool_logout_sync(struct iscsi_session_pool *pool);
+
+/*
+ * Send a task to the LUN of the pool on the least loaded session, like
+ * iscsi_scsi_command_async(). cb is called with the context of that
+ * session.
+ *
+ * Returns 0 on success, -1 on failure in which case cb is not called.
+ */
+EXTERN int
+iscsi_session_pool_command_async(struct iscsi_session_pool *pool,
+				 struct scsi_task *task, iscsi_command_cb cb,
+				 struct iscsi_data *data, void *private_data);
+EXTERN struct scsi_task *
+iscsi_session_pool_command_sync(struct iscsi_session_pool *pool,
+				struct scsi_task *task,
+				struct iscsi_data *data);
+
+/*
+ * How many commands sent through the pool are in flight.
+ */
+EXTERN int
+iscsi_session_pool_queue_length(struct iscsi_session_pool *pool);
+
+/*
+ * BULK LOGIN
+ *
+ * Connects and logs in many sessions, to any number of targets, from one
+ * event loop instead of one iscsi_full_connect_sync() after the other. At
+ * most max_in_flight sessions are connecting at any time, 64 by default,
+ * and the logins to each portal can be limited to a number per second so
+ * that a target is not flooded. The others wait in the order they were
+ * added. The sessions share a login cache, see iscsi_set_login_cache().
+ *
+ * The sessions are ordinary contexts, and stay logged in once they are.
+ * Use iscsi_bulk_login_get_context() to change their settings before the
+ * bulk login is started and to use them afterwards, and
+ * iscsi_bulk_login_take_context() to keep one after the bulk login is
+ * destroyed.
+ */
+struct iscsi_bulk_login;
+
+/*
+ * Called as each session, the n:th one added, has logged in or failed to.
+ * The error of a failed one is in iscsi_get_error() of its context.
+ */
+typedef void (*iscsi_bulk_login_cb)(struct iscsi_bulk_login *bulk, int n,
+				    int status, void *private_data);
+
+/*
+ * Create a bulk login with a session for each of count full iSCSI URLs.
+ * urls can be NULL if count is 0.
+ *
+ * Returns NULL on failure.
+ */
+EXTERN struct iscsi_bulk_login *
+iscsi_bulk_login_create(const char *initiator_name,
+			const char * const *urls, int count);
+
+/*
+ * Destroy the bulk login and all its contexts that have not been taken.
+ */
+EXTERN void
+iscsi_bulk_login_destroy(struct iscsi_bulk_login *bulk);
+
+/*
+ * Add a session for a full iSCSI URL, or a context that has been set up
+ * for a normal session by the application, which the bulk login then
+ * owns. Sessions can only be added before the bulk login is started.
+ *
+ * Returns the number of the session, or -1 on failure.
+ */
+EXTERN int
+iscsi_bulk_login_add_url(struct iscsi_bulk_login *bulk, const char *url);
+EXTERN int
+iscsi_bulk_login_add_context(struct iscsi_bulk_login *bulk,
+			     struct iscsi_context *iscsi,
+			     const char *portal, int lun);
+
+EXTERN int
+iscsi_bulk_login_get_count(struct iscsi_bulk_login *bulk);
+
+/*
+ * The context of session n, or NULL if it has been taken.
+ */
+EXTERN struct iscsi_context *
+iscsi_bulk_login_get_context(struct iscsi_bulk_login *bulk, int n);
+
+/*
+ * Take over the context of session n once it has finished, logged in or
+ * not. The application destroys it when done with it.
+ */
+EXTERN struct iscsi_context *
+iscsi_bulk_login_take_context(struct iscsi_bulk_login *bulk, int n);
+
+EXTERN void
+iscsi_bulk_login_set_max_in_flight(struct iscsi_bulk_login *bulk, int max);
+
+/*
+ * Start no more than logins_per_second sessions to the same portal each
+ * second, 0 for no limit, which is the default.
+ */
+EXTERN void
+iscsi_bulk_login_set_target_rate(struct iscsi_bulk_login *bulk,
+				 int logins_per_second);
+
+/*
+ * Start logging in the sessions. Drive the contexts of the sessions from
+ * an event loop with iscsi_get_fd(), iscsi_which_events() and
+ * iscsi_service() until iscsi_bulk_login_remaining() is 0, and call
+ * iscsi_bulk_login_service() at the latest when the time it returned last
+ * has passed, to start the sessions that were held back.
+ *
+ * Returns 0, cb is called for each session.
+ */
+EXTERN int
+iscsi_bulk_login_async(struct iscsi_bulk_login *bulk,
+		       iscsi_bulk_login_cb cb, void *private_data);
+
+/*
+ * Start the sessions that are due.
+ *
+ * Returns the number of milliseconds until the next one is, or -1 if no
+ * session is held back by the rate limit.
+ */
+EXTERN int
+iscsi_bulk_login_service(struct iscsi_bulk_login *bulk);
+
+/*
+ * Number of sessions that have not yet logged in or failed to.
+ */
+EXTERN int
+iscsi_bulk_login_remaining(struct iscsi_bulk_login *bulk);
+
+/*
+ * Log in all sessions and return once they have, calling cb, which can be
+ * NULL, as each of them does.
+ *
+ * Returns the number of sessions that failed, or -1 on failure.
+ */
+EXTERN int
+iscsi_bulk_login_sync(struct iscsi_bulk_login *bulk,
+		      iscsi_bulk_login_cb cb, void *private_data);
+
+/*
+ * MULTIPATH
+ *
+ * A multipath device logs in to the same LU through several target ports,
+ * one context per path, and sends each command down one of them. The
+ * Device Identification VPD of every path has to name the same LU, paths
+ * that lead elsewhere are not used.
+ *
+ * The ALUA states of the target port groups come from REPORT TARGET PORT
+ * GROUPS and are asked again when a path reports that they changed, or
+ * a path comes back. Commands go to active/optimized paths if there are
+ * any, and to active/non-optimized ones otherwise. Standby, unavailable
+ * and transitioning paths get none. Targets without ALUA have all paths
+ * treated as active/optimized.
+ *
+ * A command that fails because of its path, a transport error, timeout or
+ * an ALUA sense code, is sent again on another path, as are the commands
+ * in flight on a path that starts to reconnect. When there is no usable
+ * path, commands wait for one for up to the no path timeout and then
+ * complete with the status of their last try.
+ *
+ * As with session pools, use iscsi_get_fd(), iscsi_which_events() and
+ * iscsi_service() on each path context to drive the device from an event
+ * loop, all from the same thread.
+ */
+struct iscsi_multipath;
+
+enum iscsi_multipath_policy {
+	/* the next usable path */
+	ISCSI_MULTIPATH_ROUND_ROBIN   = 0,
+	/* the path with the fewest commands in flight */
+	ISCSI_MULTIPATH_QUEUE_LENGTH  = 1,
+	/* the path with the least expected wait from the commands in
+	 * flight and the average time a command takes on it */
+	ISCSI_MULTIPATH_SERVICE_TIME  = 2
+};
+
+typedef void (*iscsi_multipath_cb)(struct iscsi_multipath *mp, int status,
+				   void *private_data);
+
+/*
+ * Create a multipath device without any paths.
+ *
+ * Returns NULL on failure.
+ */
+EXTERN struct iscsi_multipath *
+iscsi_multipath_create(const char *initiator_name);
+
+/*
+ * Add a path from a full iSCSI URL. Paths have to be added before
+ * connecting.
+ *
+ * Returns the index of the path, or -1 on failure.
+ */
+EXTERN int
+iscsi_multipath_add_path(struct iscsi_multipath *mp, const char *url);
+
+/*
+ * Destroy all paths. Commands that are still in flight or waiting for a
+ * path are completed with SCSI_STATUS_CANCELLED.
+ */
+EXTERN void
+iscsi_multipath_destroy(struct iscsi_multipath *mp);
+
+EXTERN int
+iscsi_multipath_get_path_count(struct iscsi_multipath *mp);
+
+EXTERN struct iscsi_context *
+iscsi_multipath_get_context(struct iscsi_multipath *mp, int n);
+
+EXTERN const char *
+iscsi_multipath_get_error(struct iscsi_multipath *mp);
+
+/*
+ * Default is ISCSI_MULTIPATH_ROUND_ROBIN.
+ */
+EXTERN void
+iscsi_multipath_set_policy(struct iscsi_multipath *mp,
+			   enum iscsi_multipath_policy policy);
+
+/*
+ * How long commands wait for a usable path. Default is 30 seconds.
+ */
+EXTERN void
+iscsi_multipath_set_no_path_timeout(struct iscsi_multipath *mp,
+				    int seconds);
+
+/*
+ * The ALUA state, enum scsi_alua_state, of path n or -1 if it is down.
+ */
+EXTERN int
+iscsi_multipath_get_path_state(struct iscsi_multipath *mp, int n);
+
+/*
+ * Connect all paths in parallel and read the ALUA states. cb is called
+ * with SCSI_STATUS_GOOD if at least one path is usable.
+ *
+ * Returns 0 if cb will be called, -1 if no path could be started.
+ */
+EXTERN int
+iscsi_multipath_connect_async(struct iscsi_multipath *mp,
+			      iscsi_multipath_cb cb, void *private_data);
+EXTERN int
+iscsi_multipath_connect_sync(struct iscsi_multipath *mp);
+
+/*
+ * Log out all paths that are logged in, in parallel.
+ */
+EXTERN int
+iscsi_multipath_logout_async(struct iscsi_multipath *mp,
+			     iscsi_multipath_cb cb, void *private_data);
+EXTERN int
+iscsi_multipath_logout_sync(struct iscsi_multipath *mp);
+
+/*
+ * Send a task to the LU, like iscsi_scsi_command_async(). cb is called
+ * with the context of the path the command completed on.
+ *
+ * Returns 0 on success, -1 on failure in which case cb is not called.
+ */
+EXTERN int
+iscsi_multipath_command_async(struct iscsi_multipath *mp,
+			      struct scsi_task *task, iscsi_command_cb cb,
+			      struct iscsi_data *data, void *private_data);
+EXTERN struct scsi_task *
+iscsi_multipath_command_sync(struct iscsi_multipath *mp,
+			     struct scsi_task *task,
+			     struct iscsi_data *data);
+
+/*
+ * PDU TRACING
+ *
+ * Keep a binary record of the most recent PDUs sent and received on the
+ * context in a ring of fixed size records. Tracing takes no locks and
+ * does not allocate, so it is cheap enough to leave on, and the ring can
+ * be read from another thread while the context is in use. The records
+ * hold a copy of the basic header segment, without any AHS or data.
+ *
+ * The ring is kept across reconnects. It can also be enabled with the
+ * LIBISCSI_PDU_TRACE environment variable, set to the number of entries.
+ * iscsi-trace decodes the files written by iscsi_pdu_trace_save() to
+ * text or to pcapng.
+ */
+#define ISCSI_TRACE_TX	0
+#define ISCSI_TRACE_RX	1
+
+struct iscsi_trace_record {
+	uint64_t timestamp;     /* microseconds, monotonic clock */
+	uint32_t latency;       /* RX: microseconds since the request with
+				 * this ITT was sent, 0 if not known */
+	uint32_t itt;
+	uint32_t sn;            /* CmdSN when sent, StatSN when received */
+	uint32_t data_length;   /* DataSegmentLength */
+	uint64_t lun;           /* bytes 8-15 of the header */
+	uint8_t direction;      /* ISCSI_TRACE_TX or ISCSI_TRACE_RX */
+	uint8_t opcode;
+	uint8_t reserved[6];
+	unsigned char bhs[48];
+};
+
+/*
+ * A trace file is this header, in host byte order, followed by count
+ * records.
+ */
+#define ISCSI_TRACE_MAGIC	"ISCSITRC"
+#define ISCSI_TRACE_VERSION	1
+
+struct iscsi_trace_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t count;
+	int64_t realtime_offset; /* add to a timestamp for microseconds
+				  * since the epoch */
+	char target_address[256];
+};
+
+/*
+ * Trace the last entries PDUs, rounded up to a power of two. 0, the
+ * default, disables tracing and frees the ring. Changing the size throws
+ * away what has been traced so far. Do not change it while another
+ * thread is reading the ring.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_pdu_trace(struct iscsi_context *iscsi, int entries);
+
+/*
+ * Copy the newest, up to max, records into records, oldest first,
+ * leaving them in the ring.
+ *
+ * Returns the number of records copied.
+ */
+EXTERN int
+iscsi_pdu_trace_snapshot(struct iscsi_context *iscsi,
+			 struct iscsi_trace_record *records, int max);
+
+/*
+ * Copy up to max records that have not been drained before into records,
+ * oldest first. Records that were overwritten before they could be
+ * drained are lost. Only one thread at a time may drain the ring.
+ *
+ * Returns the number of records copied.
+ */
+EXTERN int
+iscsi_pdu_trace_drain(struct iscsi_context *iscsi,
+		      struct iscsi_trace_record *records, int max);
+
+/*
+ * Write a snapshot of the whole ring to a trace file.
+ *
+ * Returns the number of records written, or -1 on failure.
+ */
+EXTERN int
+iscsi_pdu_trace_save(struct iscsi_context *iscsi, const char *path);
+
+/*
+ * COMMAND RECORDING
+ *
+ * Write one fixed size record for every SCSI command the application
+ * sends through the context to a file, as the command completes. This
+ * captures the I/O pattern of an application, which iscsi-replay can then
+ * run against another target. Commands are recorded as the application
+ * issued them, before any write coalescing, splitting or read caching.
+ *
+ * The file is kept open across reconnects. Recording can also be started
+ * with the LIBISCSI_RECORD environment variable set to the path of the
+ * file. The first context of the process to log in to a normal session
+ * then records to that file and later ones to the file with .1, .2 ...
+ * appended.
+ */
+struct iscsi_command_record {
+	uint64_t submit;        /* microseconds since the recording started */
+	uint64_t lba;           /* of a read or write, else 0 */
+	uint32_t latency;       /* microseconds from submit to completion */
+	uint32_t lun;
+	uint32_t blocks;        /* transfer length of a read or write */
+	uint32_t xferlen;       /* expected transfer length in bytes */
+	uint32_t status;        /* SCSI_STATUS_* the command completed with */
+	uint16_t ascq;          /* sense, for SCSI_STATUS_CHECK_CONDITION */
+	uint8_t sense_key;
+	uint8_t opcode;
+	uint8_t xfer_dir;       /* SCSI_XFER_* */
+	uint8_t cdb_size;
+	uint8_t reserved[6];
+	unsigned char cdb[16];
+};
+
+/*
+ * A record file is this header, in host byte order, followed by records
+ * in the order the commands completed.
+ */
+#define ISCSI_RECORD_MAGIC	"ISCSIREC"
+#define ISCSI_RECORD_VERSION	1
+
+struct iscsi_record_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+	uint64_t start_realtime; /* microseconds since the epoch when the
+				  * recording started */
+	char target_name[256];
+	char target_address[256];
+};
+
+/*
+ * Start recording the commands of the context to path, replacing the file
+ * and any recording already in progress. A NULL path stops recording and
+ * closes the file. Records are buffered, so the file is only complete
+ * once recording has stopped or the context was destroyed.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+EXTERN int
+iscsi_set_command_record(struct iscsi_context *iscsi, const char *path);
+
 /*
  * MULTITHREADING
  */
@@ -62,6 +62,19 @@
 #define	BHSSC_FLAGS_W		0x20
 
 #define ISER_MAX_CQ_LEN 1024
+#define ISER_CQ_POLL_BATCH 64
+
+#define ISER_ITT_HASH_SIZE 1024
+
+/* payloads above DATA_BUFFER_CHUNK_SIZE use power of two sized buffers of
+ * up to DATA_BUFFER_CHUNK_SIZE << ISER_LARGE_POOL_ORDERS bytes, a few of
+ * each size are kept registered for reuse as long as they are all within
+ * ISER_LARGE_POOL_BYTES and get used again within ISER_LARGE_POOL_IDLE_US.
+ * Larger payloads get a buffer of their own size that is not kept. */
+#define ISER_LARGE_POOL_ORDERS  3
+#define ISER_LARGE_POOL_DEPTH   4
+#define ISER_LARGE_POOL_BYTES   (64ULL << 20)
+#define ISER_LARGE_POOL_IDLE_US 2000000
 
 #define ISER_ZBVA_NOT_SUPPORTED         0x80
 #define ISER_SEND_W_INV_NOT_SUPPORTED   0x40
@@ -137,9 +150,14 @@ static_assert(offsetof(struct iser_rx_desc, hdr_mr) % 8 == 0, "iser_rx_desc is n
  * @num_sge:       number sges used on this TX task
  * @mr:            iser/iscsi headers mr
  * @data_mr:       mr for case we need to allocate mr for read
+ * @chunk:         buffer chunk data_buff was allocated from, if any
+ * @user_mr:       cached registration of the application buffer when
+ *                 data_buff points into it instead of a bounce buffer
  * @next:          next descriptor on the list
  */
 
+struct iser_mr_entry;
+
 struct iser_tx_desc {
 	struct iser_hdr              iser_header;
 	unsigned char                iscsi_header[ISCSI_RAW_HEADER_SIZE];
@@ -148,6 +166,8 @@ struct iser_tx_desc {
 	struct ibv_mr                *hdr_mr;
 	char			     *data_buff;
 	struct ibv_mr                *data_mr;
+	struct iser_buf_chunk        *chunk;
+	struct iser_mr_entry         *user_mr;
 	enum desc_type		     type;
 	enum data_dir                data_dir;
 	struct iser_tx_desc          *next;
@@ -161,6 +181,7 @@ struct iser_cm_hdr {
 struct iser_pdu {
 	struct iscsi_pdu              iscsi_pdu;
 	struct iser_tx_desc           *desc;
+	struct iser_pdu               *itt_next;
 };
 
 struct iser_buf_chunk {
@@ -170,6 +191,50 @@ struct iser_buf_chunk {
     int8_t tree[DATA_BUFFER_CHUNK_UNITS << 1];
 };
 
+struct iser_large_buf {
+	unsigned char                *buf;
+	struct ibv_mr                *mr;
+	uint64_t                     idle_since;
+	struct iser_large_buf        *next;
+};
+
+/**
+ * struct iser_mr_entry - registration of application memory
+ *
+ * @start:         first byte of the registered range
+ * @end:           end of the registered range (exclusive)
+ * @mr:            memory region
+ * @pinned:        number of iscsi_register_buffer() ranges it covers,
+ *                 pinned entries are never evicted
+ * @refcnt:        number of tasks with RDMA in flight to or from it
+ * @last_use:      cache tick of the last lookup, for LRU eviction
+ */
+struct iser_mr_entry {
+	uintptr_t                    start;
+	uintptr_t                    end;
+	struct ibv_mr                *mr;
+	int                          pinned;
+	int                          refcnt;
+	uint64_t                     last_use;
+};
+
+/**
+ * struct iser_mr_cache - registrations of application memory
+ *
+ * @entries:       sorted by start address, ranges never overlap
+ * @count:         number of entries
+ * @size:          allocated size of entries
+ * @cached:        number of entries which are not pinned
+ * @tick:          lookup counter
+ */
+struct iser_mr_cache {
+	struct iser_mr_entry         **entries;
+	int                          count;
+	int                          size;
+	int                          cached;
+	uint64_t                     tick;
+};
+
 struct iser_conn {
 	struct rdma_cm_id            *cma_id;
 	struct rdma_event_channel    *cma_channel;
@@ -198,10 +263,28 @@ struct iser_conn {
 
 	struct iser_tx_desc          *tx_desc;
 	struct iser_buf_chunk        *buf_chunk;
+	struct iser_buf_chunk        *chunk_hint;
+	struct iser_large_buf        *large_pool[ISER_LARGE_POOL_ORDERS + 1];
+	int                          large_pool_count[ISER_LARGE_POOL_ORDERS + 1];
+	uint64_t                     large_pool_bytes;
+	uint64_t                     large_pool_trimmed;
+
+	/* sent pdus by itt, protected by iscsi_lock */
+	struct iser_pdu              *itt_hash[ISER_ITT_HASH_SIZE];
+
+	struct iser_mr_cache         mr_cache;
 };
 
 void iscsi_init_iser_transport(struct iscsi_context *iscsi);
 
+/*
+ * Register, or drop a pinned registration of, application memory with the
+ * protection domain of the connection. A no-op until the connection has one,
+ * buffers are registered when it is created.
+ */
+int iser_mr_register(struct iscsi_context *iscsi, void *buf, size_t len);
+void iser_mr_unregister(struct iscsi_context *iscsi, void *buf, size_t len);
+
 #endif /* __linux */
 
 #endif   /* __iser_private_h__ */
@@ -175,6 +175,9 @@ EXTERN const char *scsi_sense_key_str(int key);
 
 /* ascq */
 #define SCSI_SENSE_ASCQ_NO_ADDL_SENSE			   0x0000
+#define SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_TRANSITION 0x040a
+#define SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY_STATE       0x040b
+#define SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE_STATE   0x040c
 #define SCSI_SENSE_ASCQ_SANITIZE_IN_PROGRESS               0x041b
 #define SCSI_SENSE_ASCQ_UNREACHABLE_COPY_TARGET		   0x0804
 #define SCSI_SENSE_ASCQ_COPY_TARGET_DEVICE_NOT_REACHABLE   0x0d02
@@ -203,6 +206,7 @@ EXTERN const char *scsi_sense_key_str(int key);
 #define SCSI_SENSE_ASCQ_TRANSCEIVER_MODE_CHANGED_TO_LVD    0x2906
 #define SCSI_SENSE_ASCQ_NEXUS_LOSS                         0x2907
 #define SCSI_SENSE_ASCQ_MODE_PARAMETERS_CHANGED            0x2a01
+#define SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED    0x2a06
 #define SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED          0x2a09
 #define SCSI_SENSE_ASCQ_THIN_PROVISION_SOFT_THRES_REACHED  0x3807
 #define SCSI_SENSE_ASCQ_MEDIUM_NOT_PRESENT                 0x3a00
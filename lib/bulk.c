@@ -0,0 +1,475 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Bulk login.
+ *
+ * Connects and logs in many independent sessions at once, each an ordinary
+ * context. At most max_in_flight of them are connecting at any time and the
+ * logins to each portal are spread out to no more than target_rate per
+ * second. The rest wait in the order they were added. All sessions share a
+ * login cache, so only the first login to a target pays for finding out
+ * what it will take.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef AROS
+#include "aros/aros_compat.h"
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#define BULK_DEFAULT_IN_FLIGHT	64
+
+/* how long to sleep while a session has nothing to poll for */
+#define BULK_IDLE_MS		100
+
+enum iscsi_bulk_state {
+	BULK_WAITING = 0,
+	BULK_CONNECTING,
+	BULK_DONE,
+	BULK_TAKEN,		/* the application owns the context */
+};
+
+struct iscsi_bulk_portal {
+	char portal[MAX_STRING_SIZE + 1];
+	uint64_t next_start;	/* iscsi_clock_us() */
+};
+
+struct iscsi_bulk_session {
+	struct iscsi_bulk_login *bulk;
+	struct iscsi_context *iscsi;
+	int portal;		/* index into portals */
+	int lun;
+	enum iscsi_bulk_state state;
+};
+
+struct iscsi_bulk_login {
+	char initiator_name[MAX_STRING_SIZE + 1];
+	struct iscsi_login_cache *login_cache;
+
+	struct iscsi_bulk_session *sessions;
+	int count;
+	int size;
+	int first_waiting;	/* no session before it is waiting */
+
+	struct iscsi_bulk_portal *portals;
+	int portal_count;
+	int portal_size;
+
+	int max_in_flight;
+	int in_flight;
+	int target_rate;
+
+	iscsi_bulk_login_cb cb;
+	void *private_data;
+	int remaining;		/* sessions that have not finished */
+	int failed;
+	int starting;
+};
+
+struct iscsi_bulk_login *
+iscsi_bulk_login_create(const char *initiator_name,
+			const char * const *urls, int count)
+{
+	struct iscsi_bulk_login *bulk;
+	int i;
+
+	bulk = calloc(1, sizeof(*bulk));
+	if (bulk == NULL) {
+		return NULL;
+	}
+	strncpy(bulk->initiator_name, initiator_name, MAX_STRING_SIZE);
+	bulk->max_in_flight = BULK_DEFAULT_IN_FLIGHT;
+	bulk->login_cache = iscsi_create_login_cache();
+	if (bulk->login_cache == NULL) {
+		free(bulk);
+		return NULL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (iscsi_bulk_login_add_url(bulk, urls[i]) < 0) {
+			iscsi_bulk_login_destroy(bulk);
+			return NULL;
+		}
+	}
+
+	return bulk;
+}
+
+void
+iscsi_bulk_login_destroy(struct iscsi_bulk_login *bulk)
+{
+	int i;
+
+	if (bulk == NULL) {
+		return;
+	}
+
+	for (i = 0; i < bulk->count; i++) {
+		if (bulk->sessions[i].state != BULK_TAKEN) {
+			iscsi_destroy_context(bulk->sessions[i].iscsi);
+		}
+	}
+	iscsi_destroy_login_cache(bulk->login_cache);
+	free(bulk->sessions);
+	free(bulk->portals);
+	free(bulk);
+}
+
+static int
+bulk_find_portal(struct iscsi_bulk_login *bulk, const char *portal)
+{
+	struct iscsi_bulk_portal *p;
+	int i;
+
+	for (i = 0; i < bulk->portal_count; i++) {
+		if (!strcmp(bulk->portals[i].portal, portal)) {
+			return i;
+		}
+	}
+
+	if (bulk->portal_count == bulk->portal_size) {
+		int size = bulk->portal_size ? bulk->portal_size * 2 : 16;
+
+		p = realloc(bulk->portals, size * sizeof(*p));
+		if (p == NULL) {
+			return -1;
+		}
+		bulk->portals = p;
+		bulk->portal_size = size;
+	}
+	p = &bulk->portals[bulk->portal_count];
+	memset(p, 0, sizeof(*p));
+	strncpy(p->portal, portal, MAX_STRING_SIZE);
+
+	return bulk->portal_count++;
+}
+
+int
+iscsi_bulk_login_add_context(struct iscsi_bulk_login *bulk,
+			     struct iscsi_context *iscsi,
+			     const char *portal, int lun)
+{
+	struct iscsi_bulk_session *s;
+	int p;
+
+	if (bulk->count == bulk->size) {
+		int size = bulk->size ? bulk->size * 2 : 16;
+
+		s = realloc(bulk->sessions, size * sizeof(*s));
+		if (s == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: Failed to "
+					"allocate bulk login session");
+			return -1;
+		}
+		bulk->sessions = s;
+		bulk->size = size;
+	}
+	p = bulk_find_portal(bulk, portal);
+	if (p < 0) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"bulk login portal");
+		return -1;
+	}
+	if (iscsi->login_cache == NULL &&
+	    iscsi_set_login_cache(iscsi, bulk->login_cache) != 0) {
+		return -1;
+	}
+
+	s = &bulk->sessions[bulk->count];
+	memset(s, 0, sizeof(*s));
+	s->bulk = bulk;
+	s->iscsi = iscsi;
+	s->portal = p;
+	s->lun = lun;
+	s->state = BULK_WAITING;
+
+	return bulk->count++;
+}
+
+int
+iscsi_bulk_login_add_url(struct iscsi_bulk_login *bulk, const char *url)
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url;
+	int n;
+
+	iscsi = iscsi_create_context(bulk->initiator_name);
+	if (iscsi == NULL) {
+		return -1;
+	}
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+	if (iscsi_url == NULL) {
+		iscsi_destroy_context(iscsi);
+		return -1;
+	}
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	n = iscsi_bulk_login_add_context(bulk, iscsi, iscsi_url->portal,
+					 iscsi_url->lun);
+	iscsi_destroy_url(iscsi_url);
+	if (n < 0) {
+		iscsi_destroy_context(iscsi);
+	}
+	return n;
+}
+
+int
+iscsi_bulk_login_get_count(struct iscsi_bulk_login *bulk)
+{
+	return bulk->count;
+}
+
+struct iscsi_context *
+iscsi_bulk_login_get_context(struct iscsi_bulk_login *bulk, int n)
+{
+	if (n < 0 || n >= bulk->count || bulk->sessions[n].state == BULK_TAKEN) {
+		return NULL;
+	}
+	return bulk->sessions[n].iscsi;
+}
+
+struct iscsi_context *
+iscsi_bulk_login_take_context(struct iscsi_bulk_login *bulk, int n)
+{
+	if (n < 0 || n >= bulk->count || bulk->sessions[n].state != BULK_DONE) {
+		return NULL;
+	}
+	bulk->sessions[n].state = BULK_TAKEN;
+	return bulk->sessions[n].iscsi;
+}
+
+void
+iscsi_bulk_login_set_max_in_flight(struct iscsi_bulk_login *bulk, int max)
+{
+	bulk->max_in_flight = max > 0 ? max : BULK_DEFAULT_IN_FLIGHT;
+}
+
+void
+iscsi_bulk_login_set_target_rate(struct iscsi_bulk_login *bulk,
+				 int logins_per_second)
+{
+	bulk->target_rate = logins_per_second > 0 ? logins_per_second : 0;
+}
+
+static void
+bulk_session_done(struct iscsi_bulk_session *s, int status)
+{
+	struct iscsi_bulk_login *bulk = s->bulk;
+
+	if (s->state == BULK_CONNECTING) {
+		bulk->in_flight--;
+	}
+	s->state = BULK_DONE;
+	bulk->remaining--;
+	if (status != SCSI_STATUS_GOOD) {
+		bulk->failed++;
+	}
+	if (bulk->cb != NULL) {
+		bulk->cb(bulk, (int)(s - bulk->sessions), status,
+			 bulk->private_data);
+	}
+}
+
+static void
+bulk_connect_cb(struct iscsi_context *iscsi, int status,
+		void *command_data, void *private_data)
+{
+	struct iscsi_bulk_session *s = private_data;
+
+	/* already failed by the event loop */
+	if (s->state != BULK_CONNECTING) {
+		return;
+	}
+	bulk_session_done(s, status);
+	iscsi_bulk_login_service(s->bulk);
+}
+
+int
+iscsi_bulk_login_service(struct iscsi_bulk_login *bulk)
+{
+	uint64_t now = 0, wait = 0;
+	int i;
+
+	/* a session that fails to start calls back into here */
+	if (bulk->starting) {
+		return 0;
+	}
+	bulk->starting = 1;
+
+	for (i = bulk->first_waiting;
+	     i < bulk->count && bulk->in_flight < bulk->max_in_flight; i++) {
+		struct iscsi_bulk_session *s = &bulk->sessions[i];
+		struct iscsi_bulk_portal *p = &bulk->portals[s->portal];
+
+		if (s->state != BULK_WAITING) {
+			if (i == bulk->first_waiting) {
+				bulk->first_waiting++;
+			}
+			continue;
+		}
+
+		if (bulk->target_rate) {
+			if (now == 0) {
+				now = iscsi_clock_us();
+			}
+			if (p->next_start > now) {
+				if (wait == 0 || p->next_start - now < wait) {
+					wait = p->next_start - now;
+				}
+				continue;
+			}
+			p->next_start = now + 1000000 / bulk->target_rate;
+		}
+
+		if (i == bulk->first_waiting) {
+			bulk->first_waiting++;
+		}
+		s->state = BULK_CONNECTING;
+		bulk->in_flight++;
+		if (iscsi_full_connect_async(s->iscsi, p->portal, s->lun,
+					     bulk_connect_cb, s) != 0) {
+			bulk_session_done(s, SCSI_STATUS_ERROR);
+		}
+	}
+
+	bulk->starting = 0;
+	if (wait == 0) {
+		return -1;
+	}
+	return (int)((wait + 999) / 1000);
+}
+
+int
+iscsi_bulk_login_async(struct iscsi_bulk_login *bulk,
+		       iscsi_bulk_login_cb cb, void *private_data)
+{
+	int i;
+
+	bulk->cb = cb;
+	bulk->private_data = private_data;
+	bulk->failed = 0;
+	bulk->remaining = 0;
+	for (i = 0; i < bulk->count; i++) {
+		if (bulk->sessions[i].state == BULK_WAITING) {
+			bulk->remaining++;
+		}
+	}
+	bulk->first_waiting = 0;
+
+	iscsi_bulk_login_service(bulk);
+	return 0;
+}
+
+int
+iscsi_bulk_login_remaining(struct iscsi_bulk_login *bulk)
+{
+	return bulk->remaining;
+}
+
+/*
+ * Synchronous bulk login
+ */
+int
+iscsi_bulk_login_sync(struct iscsi_bulk_login *bulk,
+		      iscsi_bulk_login_cb cb, void *private_data)
+{
+	struct pollfd *pfd;
+	int *idx;
+	int i, n, ret, timeout;
+
+	pfd = malloc(bulk->count * sizeof(*pfd) + 1);
+	idx = malloc(bulk->count * sizeof(*idx) + 1);
+	if (pfd == NULL || idx == NULL) {
+		free(pfd);
+		free(idx);
+		return -1;
+	}
+
+	iscsi_bulk_login_async(bulk, cb, private_data);
+
+	while (bulk->remaining > 0) {
+		timeout = iscsi_bulk_login_service(bulk);
+
+		n = 0;
+		for (i = 0; i < bulk->count; i++) {
+			struct iscsi_context *iscsi = bulk->sessions[i].iscsi;
+			int ms;
+
+			if (bulk->sessions[i].state != BULK_CONNECTING) {
+				continue;
+			}
+			pfd[n].fd = iscsi_get_fd(iscsi);
+			pfd[n].events = iscsi_which_events(iscsi);
+			pfd[n].revents = 0;
+			idx[n++] = i;
+
+			ms = iscsi_timeout_next(iscsi);
+			if (pfd[n - 1].fd < 0 || pfd[n - 1].events == 0) {
+				/* see iscsi_which_events() */
+				pfd[n - 1].fd = -1;
+				if (ms < 0 || ms > BULK_IDLE_MS) {
+					ms = BULK_IDLE_MS;
+				}
+			}
+			if (ms >= 0 && (timeout < 0 || ms < timeout)) {
+				timeout = ms;
+			}
+		}
+
+		ret = poll(pfd, n, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			free(pfd);
+			free(idx);
+			bulk->cb = NULL;
+			return -1;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct iscsi_bulk_session *s = &bulk->sessions[idx[i]];
+
+			if (iscsi_service(s->iscsi, pfd[i].revents) < 0 &&
+			    s->state == BULK_CONNECTING) {
+				bulk_session_done(s, SCSI_STATUS_ERROR);
+			}
+		}
+	}
+
+	free(pfd);
+	free(idx);
+	bulk->cb = NULL;
+	return bulk->failed;
+}
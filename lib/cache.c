@@ -0,0 +1,1112 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Client side read cache.
+ *
+ * Small READ10/12/16 commands are served from 4 kb pages indexed by
+ * (lun, byte offset / page size). The pages live in a number of shards,
+ * each with its own lock, hash table and CLOCK for eviction, and the
+ * total number of pages is fixed by the memory budget.
+ *
+ * A read that misses becomes a waiter on a fetch: a page aligned READ16
+ * issued by the cache whose data is copied into the pages when it
+ * completes, after which the waiters look the pages up again. Reads of
+ * pages that are already being fetched, including by readahead, wait for
+ * that fetch instead of issuing their own.
+ *
+ * Writes through the context drop the pages they overlap when they are
+ * submitted and again when they complete, and mark overlapping fetches
+ * in flight as stale so their data is not cached.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+#define ISCSI_CACHE_PAGE_SIZE	4096
+#define ISCSI_CACHE_SHARDS	16
+#define ISCSI_CACHE_STREAMS	8
+/* reads larger than this bypass the cache */
+#define ISCSI_CACHE_MAX_READ	(256 * 1024)
+/* give up and send the read itself after this many failed lookups */
+#define ISCSI_CACHE_MAX_RETRIES	3
+
+struct iscsi_cache_page {
+	struct iscsi_cache_page *hnext;
+	int valid;
+	int referenced;		/* the CLOCK bit */
+	int lun;
+	uint64_t pgno;
+	unsigned char *data;
+};
+
+struct iscsi_cache_shard {
+	libiscsi_spinlock_t lock;
+	struct iscsi_cache_page **hash;
+	uint32_t hash_mask;
+	struct iscsi_cache_page **slots;
+	int nslots;
+	int used;
+	int count;		/* valid pages */
+	int hand;
+	uint64_t evictions;
+};
+
+struct iscsi_cache_waiter {
+	struct iscsi_cache_waiter *next;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	int lun;
+	uint32_t blocksize;
+	uint64_t offset;
+	uint32_t len;
+	int retries;
+};
+
+struct iscsi_cache_fill {
+	struct iscsi_cache_fill *next;
+	struct iscsi_read_cache *cache;
+	struct scsi_task *task;
+	int lun;
+	uint64_t first, last;	/* pages, inclusive */
+	int stale;
+	struct iscsi_cache_waiter *waiters;
+};
+
+struct iscsi_cache_stream {
+	int lun;
+	int run;		/* number of back to back reads */
+	uint64_t next;		/* where the next sequential read starts */
+	uint64_t ra_end;	/* readahead has been issued up to here */
+	uint64_t last_use;
+};
+
+struct iscsi_cache_write {
+	struct iscsi_read_cache *cache;
+	iscsi_command_cb cb;
+	void *private_data;
+	int lun;
+	int all;
+	uint64_t first, last;
+};
+
+struct iscsi_read_cache {
+	struct iscsi_context *iscsi;
+	libiscsi_spinlock_t lock;
+	int refs;		/* the context, fetches and writes in flight */
+	int detached;
+	size_t readahead;
+	uint32_t max_read;
+	struct iscsi_cache_shard shards[ISCSI_CACHE_SHARDS];
+	struct iscsi_cache_fill *fills;
+	struct iscsi_cache_stream streams[ISCSI_CACHE_STREAMS];
+	uint64_t tick;
+	struct iscsi_read_cache_stats stats;
+};
+
+static inline uint64_t
+iscsi_cache_hash(int lun, uint64_t pgno)
+{
+	uint64_t h = (pgno ^ ((uint64_t)lun << 48)) * 0x9e3779b97f4a7c15ULL;
+
+	return h ^ (h >> 29);
+}
+
+static inline struct iscsi_cache_shard *
+iscsi_cache_shard(struct iscsi_read_cache *cache, uint64_t h)
+{
+	return &cache->shards[h % ISCSI_CACHE_SHARDS];
+}
+
+/* Called with the shard locked. */
+static struct iscsi_cache_page *
+iscsi_cache_page_find(struct iscsi_cache_shard *shard, uint64_t h,
+		      int lun, uint64_t pgno)
+{
+	struct iscsi_cache_page *page;
+
+	for (page = shard->hash[(h >> 4) & shard->hash_mask]; page;
+	     page = page->hnext) {
+		if (page->pgno == pgno && page->lun == lun) {
+			return page;
+		}
+	}
+	return NULL;
+}
+
+/* Called with the shard locked. */
+static void
+iscsi_cache_page_drop(struct iscsi_cache_shard *shard,
+		      struct iscsi_cache_page *page)
+{
+	struct iscsi_cache_page **pp;
+	uint64_t h = iscsi_cache_hash(page->lun, page->pgno);
+
+	for (pp = &shard->hash[(h >> 4) & shard->hash_mask]; *pp;
+	     pp = &(*pp)->hnext) {
+		if (*pp == page) {
+			*pp = page->hnext;
+			break;
+		}
+	}
+	page->hnext = NULL;
+	page->valid = 0;
+	shard->count--;
+}
+
+static int
+iscsi_cache_page_present(struct iscsi_read_cache *cache, int lun,
+			 uint64_t pgno)
+{
+	uint64_t h = iscsi_cache_hash(lun, pgno);
+	struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, h);
+	int present;
+
+	iscsi_mt_spin_lock(&shard->lock);
+	present = iscsi_cache_page_find(shard, h, lun, pgno) != NULL;
+	iscsi_mt_spin_unlock(&shard->lock);
+	return present;
+}
+
+/* Store a page, evicting the first unreferenced one the CLOCK finds. */
+static void
+iscsi_cache_page_insert(struct iscsi_read_cache *cache, int lun,
+			uint64_t pgno, const unsigned char *data)
+{
+	uint64_t h = iscsi_cache_hash(lun, pgno);
+	struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, h);
+	struct iscsi_cache_page *page;
+	int i;
+
+	iscsi_mt_spin_lock(&shard->lock);
+	page = iscsi_cache_page_find(shard, h, lun, pgno);
+	if (page != NULL) {
+		memcpy(page->data, data, ISCSI_CACHE_PAGE_SIZE);
+		iscsi_mt_spin_unlock(&shard->lock);
+		return;
+	}
+
+	if (shard->used < shard->nslots) {
+		page = malloc(sizeof(*page) + ISCSI_CACHE_PAGE_SIZE);
+		if (page != NULL) {
+			memset(page, 0, sizeof(*page));
+			page->data = (unsigned char *)(page + 1);
+			shard->slots[shard->used++] = page;
+		}
+	}
+	for (i = 0; page == NULL && i < 2 * shard->used; i++) {
+		struct iscsi_cache_page *p = shard->slots[shard->hand];
+
+		shard->hand = (shard->hand + 1) % shard->used;
+		if (!p->valid) {
+			page = p;
+		} else if (p->referenced) {
+			p->referenced = 0;
+		} else {
+			iscsi_cache_page_drop(shard, p);
+			shard->evictions++;
+			page = p;
+		}
+	}
+	if (page == NULL) {
+		iscsi_mt_spin_unlock(&shard->lock);
+		return;
+	}
+
+	page->lun = lun;
+	page->pgno = pgno;
+	page->valid = 1;
+	page->referenced = 0;
+	shard->count++;
+	memcpy(page->data, data, ISCSI_CACHE_PAGE_SIZE);
+	page->hnext = shard->hash[(h >> 4) & shard->hash_mask];
+	shard->hash[(h >> 4) & shard->hash_mask] = page;
+	iscsi_mt_spin_unlock(&shard->lock);
+}
+
+/*
+ * Copy len bytes at offset of the lun into the data-in buffer of the task.
+ * Returns -1 if a page is not cached.
+ */
+static int
+iscsi_cache_copy(struct iscsi_read_cache *cache, int lun,
+		 struct scsi_task *task, uint64_t offset, uint32_t len)
+{
+	struct scsi_iovector *iovector = &task->iovector_in;
+	unsigned char *buf = NULL;
+	uint32_t pos = 0;
+	int idx = 0;
+	size_t iov_pos = 0;
+
+	if (iovector->iov == NULL) {
+		buf = malloc(len);
+		if (buf == NULL) {
+			return -1;
+		}
+	}
+
+	while (pos < len) {
+		uint64_t pgno = (offset + pos) / ISCSI_CACHE_PAGE_SIZE;
+		uint32_t poff = (offset + pos) % ISCSI_CACHE_PAGE_SIZE;
+		uint32_t count = MIN(ISCSI_CACHE_PAGE_SIZE - poff, len - pos);
+		uint64_t h = iscsi_cache_hash(lun, pgno);
+		struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, h);
+		struct iscsi_cache_page *page;
+		const unsigned char *src;
+
+		iscsi_mt_spin_lock(&shard->lock);
+		page = iscsi_cache_page_find(shard, h, lun, pgno);
+		if (page == NULL) {
+			iscsi_mt_spin_unlock(&shard->lock);
+			free(buf);
+			return -1;
+		}
+		page->referenced = 1;
+		src = page->data + poff;
+		if (buf != NULL) {
+			memcpy(buf + pos, src, count);
+			pos += count;
+		} else {
+			uint32_t end = pos + count;
+
+			while (pos < end && idx < iovector->niov) {
+				struct scsi_iovec *iov = &iovector->iov[idx];
+				size_t n = MIN(iov->iov_len - iov_pos, end - pos);
+
+				memcpy((unsigned char *)iov->iov_base + iov_pos,
+				       src, n);
+				src += n;
+				pos += n;
+				iov_pos += n;
+				if (iov_pos == iov->iov_len) {
+					idx++;
+					iov_pos = 0;
+				}
+			}
+			if (pos < end) {
+				/* the iovector is shorter than the transfer */
+				iscsi_mt_spin_unlock(&shard->lock);
+				return -1;
+			}
+		}
+		iscsi_mt_spin_unlock(&shard->lock);
+	}
+
+	if (buf != NULL) {
+		free(task->datain.data);
+		task->datain.data = buf;
+		task->datain.size = len;
+	}
+	task->status = SCSI_STATUS_GOOD;
+	task->residual_status = SCSI_RESIDUAL_NO_RESIDUAL;
+	task->residual = 0;
+	/* not a valid ITT, the task is not on the wire */
+	task->itt = 0xffffffff;
+	return 0;
+}
+
+/* Called with the cache locked. */
+static struct iscsi_cache_fill *
+iscsi_cache_fill_find(struct iscsi_read_cache *cache, int lun, uint64_t pgno)
+{
+	struct iscsi_cache_fill *fill;
+
+	for (fill = cache->fills; fill; fill = fill->next) {
+		if (fill->lun == lun && !fill->stale &&
+		    pgno >= fill->first && pgno <= fill->last) {
+			return fill;
+		}
+	}
+	return NULL;
+}
+
+/* Drop the cached pages of the lun in first..last, or all of them. */
+static void
+iscsi_cache_invalidate(struct iscsi_read_cache *cache, int lun, int all,
+		       uint64_t first, uint64_t last)
+{
+	struct iscsi_cache_fill *fill;
+	uint64_t dropped = 0;
+	int i;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	for (fill = cache->fills; fill; fill = fill->next) {
+		if (fill->lun == lun &&
+		    (all || (fill->first <= last && fill->last >= first))) {
+			fill->stale = 1;
+		}
+	}
+
+	if (all || last - first >= (uint64_t)cache->shards[0].nslots) {
+		for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+			struct iscsi_cache_shard *shard = &cache->shards[i];
+			int j;
+
+			iscsi_mt_spin_lock(&shard->lock);
+			for (j = 0; j < shard->used; j++) {
+				struct iscsi_cache_page *page = shard->slots[j];
+
+				if (page->valid && page->lun == lun &&
+				    (all || (page->pgno >= first &&
+					     page->pgno <= last))) {
+					iscsi_cache_page_drop(shard, page);
+					dropped++;
+				}
+			}
+			iscsi_mt_spin_unlock(&shard->lock);
+		}
+	} else {
+		uint64_t pgno;
+
+		for (pgno = first; pgno <= last; pgno++) {
+			uint64_t h = iscsi_cache_hash(lun, pgno);
+			struct iscsi_cache_shard *shard = iscsi_cache_shard(cache, h);
+			struct iscsi_cache_page *page;
+
+			iscsi_mt_spin_lock(&shard->lock);
+			page = iscsi_cache_page_find(shard, h, lun, pgno);
+			if (page != NULL) {
+				iscsi_cache_page_drop(shard, page);
+				dropped++;
+			}
+			iscsi_mt_spin_unlock(&shard->lock);
+		}
+	}
+	cache->stats.invalidations += dropped;
+	iscsi_mt_spin_unlock(&cache->lock);
+}
+
+static void
+iscsi_cache_free(struct iscsi_read_cache *cache)
+{
+	int i, j;
+
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		struct iscsi_cache_shard *shard = &cache->shards[i];
+
+		for (j = 0; j < shard->used; j++) {
+			free(shard->slots[j]);
+		}
+		free(shard->slots);
+		free(shard->hash);
+		iscsi_mt_spin_destroy(&shard->lock);
+	}
+	iscsi_mt_spin_destroy(&cache->lock);
+	free(cache);
+}
+
+static void
+iscsi_cache_put(struct iscsi_read_cache *cache)
+{
+	int refs;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	refs = --cache->refs;
+	iscsi_mt_spin_unlock(&cache->lock);
+	if (refs == 0) {
+		iscsi_cache_free(cache);
+	}
+}
+
+static void
+iscsi_cache_complete(struct iscsi_context *iscsi,
+		     struct iscsi_cache_waiter *w, int status)
+{
+	w->task->status = status;
+	if (w->cb) {
+		w->cb(iscsi, status, w->task, w->private_data);
+	}
+	free(w);
+}
+
+/* Send the read of the waiter to the target after all. */
+static void
+iscsi_cache_bypass(struct iscsi_read_cache *cache,
+		   struct iscsi_cache_waiter *w)
+{
+	if (iscsi_scsi_command_queue(cache->iscsi, w->lun, w->task, w->cb,
+				     NULL, w->private_data) != 0) {
+		iscsi_cache_complete(cache->iscsi, w, SCSI_STATUS_ERROR);
+		return;
+	}
+	free(w);
+}
+
+static void iscsi_cache_fill_cb(struct iscsi_context *iscsi, int status,
+				void *command_data, void *private_data);
+
+/*
+ * Create a fetch of pages first..last using READ16 in units of blocksize.
+ * Called with the cache locked, the caller queues fill->task once it has
+ * dropped the lock.
+ */
+static struct iscsi_cache_fill *
+iscsi_cache_fill_new(struct iscsi_read_cache *cache, int lun,
+		     uint32_t blocksize, uint64_t first, uint64_t last)
+{
+	struct iscsi_cache_fill *fill;
+	uint32_t blocks_per_page = ISCSI_CACHE_PAGE_SIZE / blocksize;
+
+	fill = calloc(1, sizeof(*fill));
+	if (fill == NULL) {
+		return NULL;
+	}
+	fill->task = scsi_cdb_read16(first * blocks_per_page,
+				     (last - first + 1) * ISCSI_CACHE_PAGE_SIZE,
+				     blocksize, 0, 0, 0, 0, 0);
+	if (fill->task == NULL) {
+		free(fill);
+		return NULL;
+	}
+	fill->cache = cache;
+	fill->lun = lun;
+	fill->first = first;
+	fill->last = last;
+	ISCSI_LIST_ADD(&cache->fills, fill);
+	cache->refs++;
+	return fill;
+}
+
+/* The fetch could not be queued, let its waiters read for themselves. */
+static void
+iscsi_cache_fill_abort(struct iscsi_read_cache *cache,
+		       struct iscsi_cache_fill *fill)
+{
+	struct iscsi_cache_waiter *waiters;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	ISCSI_LIST_REMOVE(&cache->fills, fill);
+	waiters = fill->waiters;
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	while (waiters) {
+		struct iscsi_cache_waiter *w = waiters;
+
+		waiters = w->next;
+		iscsi_cache_bypass(cache, w);
+	}
+	scsi_free_scsi_task(fill->task);
+	free(fill);
+	iscsi_cache_put(cache);
+}
+
+static void
+iscsi_cache_fill_queue(struct iscsi_read_cache *cache,
+		       struct iscsi_cache_fill *fill)
+{
+	if (iscsi_scsi_command_queue(cache->iscsi, fill->lun, fill->task,
+				     iscsi_cache_fill_cb, NULL, fill) != 0) {
+		ISCSI_LOG(cache->iscsi, 1, "read cache: failed to queue "
+			  "fetch of pages %" PRIu64 "-%" PRIu64 ": %s",
+			  fill->first, fill->last,
+			  iscsi_get_error(cache->iscsi));
+		iscsi_cache_fill_abort(cache, fill);
+	}
+}
+
+/*
+ * Track sequential streams and return in ra_first..ra_last the pages to
+ * read ahead, if any. Called with the cache locked.
+ */
+static int
+iscsi_cache_stream_update(struct iscsi_read_cache *cache, int lun,
+			  uint64_t offset, uint32_t len,
+			  uint64_t *ra_first, uint64_t *ra_last)
+{
+	struct iscsi_cache_stream *s = NULL;
+	uint64_t start, end;
+	int i;
+
+	for (i = 0; i < ISCSI_CACHE_STREAMS; i++) {
+		if (cache->streams[i].run && cache->streams[i].lun == lun &&
+		    cache->streams[i].next == offset) {
+			s = &cache->streams[i];
+			s->run++;
+			break;
+		}
+	}
+	if (s == NULL) {
+		s = &cache->streams[0];
+		for (i = 1; i < ISCSI_CACHE_STREAMS; i++) {
+			if (cache->streams[i].last_use < s->last_use) {
+				s = &cache->streams[i];
+			}
+		}
+		s->lun = lun;
+		s->run = 1;
+		s->ra_end = 0;
+	}
+	s->next = offset + len;
+	s->last_use = ++cache->tick;
+
+	if (cache->readahead == 0 || s->run < 2 ||
+	    s->ra_end >= s->next + cache->readahead / 2) {
+		return 0;
+	}
+	start = MAX(s->ra_end, s->next);
+	end = s->next + cache->readahead;
+	s->ra_end = end;
+	*ra_first = (start + ISCSI_CACHE_PAGE_SIZE - 1) / ISCSI_CACHE_PAGE_SIZE;
+	*ra_last = (end - 1) / ISCSI_CACHE_PAGE_SIZE;
+	return *ra_first <= *ra_last;
+}
+
+/*
+ * Fetch the pages in first..last that are neither cached nor being
+ * fetched, in reads of at most max_read bytes.
+ */
+static void
+iscsi_cache_readahead(struct iscsi_read_cache *cache, int lun,
+		      uint32_t blocksize, uint64_t first, uint64_t last)
+{
+	uint32_t max_pages = cache->max_read / ISCSI_CACHE_PAGE_SIZE;
+
+	while (first <= last) {
+		struct iscsi_cache_fill *fill;
+		uint64_t end;
+
+		iscsi_mt_spin_lock(&cache->lock);
+		while (first <= last &&
+		       (iscsi_cache_fill_find(cache, lun, first) ||
+			iscsi_cache_page_present(cache, lun, first))) {
+			first++;
+		}
+		end = first;
+		while (end < last && end - first + 1 < max_pages &&
+		       !iscsi_cache_fill_find(cache, lun, end + 1) &&
+		       !iscsi_cache_page_present(cache, lun, end + 1)) {
+			end++;
+		}
+		if (first > last) {
+			iscsi_mt_spin_unlock(&cache->lock);
+			return;
+		}
+		fill = iscsi_cache_fill_new(cache, lun, blocksize, first, end);
+		if (fill != NULL) {
+			cache->stats.readaheads++;
+		}
+		iscsi_mt_spin_unlock(&cache->lock);
+		if (fill == NULL) {
+			return;
+		}
+		iscsi_cache_fill_queue(cache, fill);
+		first = end + 1;
+	}
+}
+
+/*
+ * Serve the read of the waiter from the cache, or make it wait for a
+ * fetch. Returns 1 if the data was copied into the task, in which case
+ * the caller completes it, else 0.
+ */
+static int
+iscsi_cache_lookup(struct iscsi_read_cache *cache,
+		   struct iscsi_cache_waiter *w)
+{
+	struct iscsi_cache_fill *fill, *wait_on = NULL;
+	uint64_t first = w->offset / ISCSI_CACHE_PAGE_SIZE;
+	uint64_t last = (w->offset + w->len - 1) / ISCSI_CACHE_PAGE_SIZE;
+	uint64_t miss_first = 0, miss_last = 0, pgno;
+	int missing = 0;
+
+	for (;;) {
+		if (w->retries++ >= ISCSI_CACHE_MAX_RETRIES) {
+			iscsi_cache_bypass(cache, w);
+			return 0;
+		}
+
+		iscsi_mt_spin_lock(&cache->lock);
+		for (pgno = first; pgno <= last; pgno++) {
+			if (iscsi_cache_page_present(cache, w->lun, pgno)) {
+				continue;
+			}
+			fill = iscsi_cache_fill_find(cache, w->lun, pgno);
+			if (fill != NULL) {
+				wait_on = fill;
+				continue;
+			}
+			if (!missing) {
+				miss_first = pgno;
+			}
+			miss_last = pgno;
+			missing = 1;
+		}
+
+		if (missing) {
+			fill = iscsi_cache_fill_new(cache, w->lun, w->blocksize,
+						    miss_first, miss_last);
+			if (fill == NULL) {
+				iscsi_mt_spin_unlock(&cache->lock);
+				iscsi_cache_bypass(cache, w);
+				return 0;
+			}
+			ISCSI_LIST_ADD_END(&fill->waiters, w);
+			iscsi_mt_spin_unlock(&cache->lock);
+			iscsi_cache_fill_queue(cache, fill);
+			return 0;
+		}
+		if (wait_on != NULL) {
+			if (w->retries == 1) {
+				cache->stats.coalesced++;
+			}
+			ISCSI_LIST_ADD_END(&wait_on->waiters, w);
+			iscsi_mt_spin_unlock(&cache->lock);
+			return 0;
+		}
+		iscsi_mt_spin_unlock(&cache->lock);
+
+		if (iscsi_cache_copy(cache, w->lun, w->task, w->offset,
+				     w->len) == 0) {
+			return 1;
+		}
+		/* evicted under our feet, look again */
+	}
+}
+
+static void
+iscsi_cache_fill_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_cache_fill *fill = private_data;
+	struct iscsi_read_cache *cache = fill->cache;
+	struct scsi_task *task = fill->task;
+	struct iscsi_cache_waiter *waiters;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	ISCSI_LIST_REMOVE(&cache->fills, fill);
+	if (status == SCSI_STATUS_GOOD && !fill->stale && !cache->detached) {
+		uint64_t i, npages = task->datain.size / ISCSI_CACHE_PAGE_SIZE;
+
+		for (i = 0; i < npages && fill->first + i <= fill->last; i++) {
+			iscsi_cache_page_insert(cache, fill->lun, fill->first + i,
+					&task->datain.data[i * ISCSI_CACHE_PAGE_SIZE]);
+		}
+	}
+	waiters = fill->waiters;
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	while (waiters) {
+		struct iscsi_cache_waiter *w = waiters;
+
+		waiters = w->next;
+		w->next = NULL;
+		switch (status) {
+		case SCSI_STATUS_GOOD:
+			if (cache->detached) {
+				iscsi_cache_bypass(cache, w);
+			} else if (iscsi_cache_lookup(cache, w)) {
+				iscsi_cache_complete(cache->iscsi, w,
+						     SCSI_STATUS_GOOD);
+			}
+			break;
+		case SCSI_STATUS_ERROR:
+		case SCSI_STATUS_CANCELLED:
+		case SCSI_STATUS_TIMEOUT:
+			iscsi_cache_complete(cache->iscsi, w, status);
+			break;
+		default:
+			/*
+			 * e.g. the page aligned read went past the end of
+			 * the LUN, the read itself gets the right sense.
+			 */
+			iscsi_cache_bypass(cache, w);
+		}
+	}
+
+	scsi_free_scsi_task(task);
+	free(fill);
+	iscsi_cache_put(cache);
+}
+
+static void
+iscsi_cache_write_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct iscsi_cache_write *cw = private_data;
+	iscsi_command_cb cb = cw->cb;
+	void *cb_data = cw->private_data;
+
+	/* a read that raced with the write may have cached old data */
+	iscsi_cache_invalidate(cw->cache, cw->lun, cw->all, cw->first, cw->last);
+	iscsi_cache_put(cw->cache);
+	free(cw);
+
+	if (cb) {
+		cb(iscsi, status, command_data, cb_data);
+	}
+}
+
+/*
+ * The LBA and number of blocks of READ and WRITE type CDBs. Returns -1
+ * for other opcodes.
+ */
+static int
+iscsi_cache_cdb_range(struct scsi_task *task, uint64_t *lba, uint32_t *num)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_WRITE_SAME10:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint16(&task->cdb[7]);
+		return 0;
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[6]);
+		return 0;
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_ORWRITE:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[10]);
+		return 0;
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = task->cdb[13];
+		return 0;
+	}
+	return -1;
+}
+
+static int
+iscsi_cache_write(struct iscsi_context *iscsi, int lun,
+		  struct scsi_task *task, iscsi_command_cb cb,
+		  struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_read_cache *cache = iscsi->read_cache;
+	struct iscsi_cache_write *cw;
+	uint64_t lba = 0, first = 0, last = 0;
+	uint32_t num = 0, blocksize = 0;
+	int all = 1, ret;
+
+	if (iscsi_cache_cdb_range(task, &lba, &num) == 0 && num > 0) {
+		switch (task->cdb[0]) {
+		case SCSI_OPCODE_WRITE_SAME10:
+		case SCSI_OPCODE_WRITE_SAME16:
+			blocksize = task->expxferlen;
+			break;
+		case SCSI_OPCODE_COMPARE_AND_WRITE:
+			blocksize = task->expxferlen / (2 * num);
+			break;
+		default:
+			blocksize = task->expxferlen / num;
+		}
+	}
+	if (blocksize != 0) {
+		all = 0;
+		first = lba * blocksize / ISCSI_CACHE_PAGE_SIZE;
+		last = ((lba + num) * blocksize - 1) / ISCSI_CACHE_PAGE_SIZE;
+	}
+	iscsi_cache_invalidate(cache, lun, all, first, last);
+
+	cw = malloc(sizeof(*cw));
+	if (cw == NULL) {
+		return 1;
+	}
+	cw->cache = cache;
+	cw->cb = cb;
+	cw->private_data = private_data;
+	cw->lun = lun;
+	cw->all = all;
+	cw->first = first;
+	cw->last = last;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	cache->refs++;
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	ret = iscsi_scsi_command_queue(iscsi, lun, task, iscsi_cache_write_cb,
+				       d, cw);
+	if (ret != 0) {
+		iscsi_cache_put(cache);
+		free(cw);
+	}
+	return ret;
+}
+
+static int
+iscsi_cache_read(struct iscsi_context *iscsi, int lun,
+		 struct scsi_task *task, iscsi_command_cb cb,
+		 void *private_data)
+{
+	struct iscsi_read_cache *cache = iscsi->read_cache;
+	struct iscsi_cache_waiter *w;
+	uint64_t lba, offset, ra_first = 0, ra_last = 0;
+	uint32_t num, blocksize;
+	int ra;
+
+	if (iscsi_cache_cdb_range(task, &lba, &num) != 0 || num == 0 ||
+	    task->xfer_dir != SCSI_XFER_READ ||
+	    (task->cdb[1] & 0xe8) ||		/* RDPROTECT or FUA */
+	    task->expxferlen <= 0 ||
+	    (uint32_t)task->expxferlen > cache->max_read ||
+	    task->expxferlen % num) {
+		goto bypass;
+	}
+	blocksize = task->expxferlen / num;
+	if (blocksize > ISCSI_CACHE_PAGE_SIZE ||
+	    ISCSI_CACHE_PAGE_SIZE % blocksize) {
+		goto bypass;
+	}
+	offset = lba * blocksize;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	ra = iscsi_cache_stream_update(cache, lun, offset, task->expxferlen,
+				       &ra_first, &ra_last);
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	task->lun = lun;
+	if (iscsi_cache_copy(cache, lun, task, offset, task->expxferlen) == 0) {
+		if (iscsi_scsi_task_complete_later(iscsi, task,
+						   SCSI_STATUS_GOOD, cb,
+						   private_data) != 0) {
+			goto bypass;
+		}
+		iscsi_mt_spin_lock(&cache->lock);
+		cache->stats.hits++;
+		iscsi_mt_spin_unlock(&cache->lock);
+		if (ra) {
+			iscsi_cache_readahead(cache, lun, blocksize,
+					      ra_first, ra_last);
+		}
+		return 0;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		goto bypass;
+	}
+	w->task = task;
+	w->cb = cb;
+	w->private_data = private_data;
+	w->lun = lun;
+	w->blocksize = blocksize;
+	w->offset = offset;
+	w->len = task->expxferlen;
+	task->itt = 0xffffffff;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	cache->stats.misses++;
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	if (ra) {
+		iscsi_cache_readahead(cache, lun, blocksize, ra_first, ra_last);
+	}
+	if (iscsi_cache_lookup(cache, w)) {
+		/* it arrived while we were looking */
+		if (iscsi_scsi_task_complete_later(iscsi, task,
+						   SCSI_STATUS_GOOD, cb,
+						   private_data) != 0) {
+			free(w);
+			goto bypass;
+		}
+		free(w);
+	}
+	return 0;
+
+ bypass:
+	free(task->datain.data);
+	task->datain.data = NULL;
+	task->datain.size = 0;
+	iscsi_mt_spin_lock(&cache->lock);
+	cache->stats.bypassed++;
+	iscsi_mt_spin_unlock(&cache->lock);
+	return 1;
+}
+
+int
+iscsi_cache_command(struct iscsi_context *iscsi, int lun,
+		    struct scsi_task *task, iscsi_command_cb cb,
+		    struct iscsi_data *d, void *private_data)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_READ16:
+		return iscsi_cache_read(iscsi, lun, task, cb, private_data);
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+	case SCSI_OPCODE_ORWRITE:
+	case SCSI_OPCODE_WRITE_ATOMIC16:
+	case SCSI_OPCODE_UNMAP:
+	case SCSI_OPCODE_SANITIZE:
+	case SCSI_OPCODE_EXTENDED_COPY:
+		return iscsi_cache_write(iscsi, lun, task, cb, d, private_data);
+	}
+	return 1;
+}
+
+int
+iscsi_cache_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_read_cache *cache = iscsi->read_cache;
+	struct iscsi_cache_waiter *w = NULL;
+	struct iscsi_cache_fill *fill;
+
+	iscsi_mt_spin_lock(&cache->lock);
+	for (fill = cache->fills; fill && w == NULL; fill = fill->next) {
+		for (w = fill->waiters; w; w = w->next) {
+			if (w->task == task) {
+				ISCSI_LIST_REMOVE(&fill->waiters, w);
+				break;
+			}
+		}
+	}
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	if (w == NULL) {
+		return -1;
+	}
+	iscsi_cache_complete(iscsi, w, SCSI_STATUS_CANCELLED);
+	return 0;
+}
+
+static void
+iscsi_cache_detach(struct iscsi_context *iscsi)
+{
+	struct iscsi_read_cache *cache = iscsi->read_cache;
+
+	if (cache == NULL) {
+		return;
+	}
+	iscsi->read_cache = NULL;
+
+	/* fetches and writes in flight keep it around until they complete */
+	iscsi_mt_spin_lock(&cache->lock);
+	cache->detached = 1;
+	iscsi_mt_spin_unlock(&cache->lock);
+	iscsi_cache_put(cache);
+}
+
+int
+iscsi_set_read_cache(struct iscsi_context *iscsi, size_t budget,
+		     size_t readahead)
+{
+	struct iscsi_read_cache *cache;
+	size_t pages;
+	int i;
+
+	iscsi_cache_detach(iscsi);
+	if (budget == 0) {
+		ISCSI_LOG(iscsi, 2, "read cache disabled");
+		return 0;
+	}
+
+	pages = budget / ISCSI_CACHE_PAGE_SIZE / ISCSI_CACHE_SHARDS;
+	if (pages < 2) {
+		iscsi_set_error(iscsi, "Read cache budget of %zu bytes is too "
+				"small, at least %d bytes are needed", budget,
+				2 * ISCSI_CACHE_SHARDS * ISCSI_CACHE_PAGE_SIZE);
+		return -1;
+	}
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"read cache");
+		return -1;
+	}
+	cache->iscsi = iscsi;
+	cache->refs = 1;
+	cache->max_read = MIN(ISCSI_CACHE_MAX_READ,
+			      budget / 8 / ISCSI_CACHE_PAGE_SIZE *
+			      ISCSI_CACHE_PAGE_SIZE);
+	if (cache->max_read < ISCSI_CACHE_PAGE_SIZE) {
+		cache->max_read = ISCSI_CACHE_PAGE_SIZE;
+	}
+	/* readahead must not evict what it reads ahead for */
+	cache->readahead = MIN(readahead, budget / 4);
+	iscsi_mt_spin_init(&cache->lock, PTHREAD_PROCESS_PRIVATE);
+
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		struct iscsi_cache_shard *shard = &cache->shards[i];
+		uint32_t buckets = 1;
+
+		while (buckets < pages) {
+			buckets <<= 1;
+		}
+		iscsi_mt_spin_init(&shard->lock, PTHREAD_PROCESS_PRIVATE);
+		shard->nslots = pages;
+		shard->hash_mask = buckets - 1;
+		shard->hash = calloc(buckets, sizeof(*shard->hash));
+		shard->slots = calloc(pages, sizeof(*shard->slots));
+		if (shard->hash == NULL || shard->slots == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate read cache");
+			iscsi_cache_free(cache);
+			return -1;
+		}
+	}
+
+	iscsi->read_cache = cache;
+	ISCSI_LOG(iscsi, 2, "read cache enabled with %zu pages of %d bytes, "
+		  "%zu bytes of readahead", pages * ISCSI_CACHE_SHARDS,
+		  ISCSI_CACHE_PAGE_SIZE, cache->readahead);
+	return 0;
+}
+
+void
+iscsi_get_read_cache_stats(struct iscsi_context *iscsi,
+			   struct iscsi_read_cache_stats *stats)
+{
+	struct iscsi_read_cache *cache = iscsi->read_cache;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	if (cache == NULL) {
+		return;
+	}
+
+	iscsi_mt_spin_lock(&cache->lock);
+	*stats = cache->stats;
+	iscsi_mt_spin_unlock(&cache->lock);
+
+	for (i = 0; i < ISCSI_CACHE_SHARDS; i++) {
+		struct iscsi_cache_shard *shard = &cache->shards[i];
+
+		iscsi_mt_spin_lock(&shard->lock);
+		stats->evictions += shard->evictions;
+		stats->cached += shard->count;
+		iscsi_mt_spin_unlock(&shard->lock);
+	}
+	stats->cached *= ISCSI_CACHE_PAGE_SIZE;
+}
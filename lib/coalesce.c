@@ -0,0 +1,569 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Write coalescing.
+ *
+ * While writes sent through the coalescer are in flight, new WRITE10/12/16
+ * that continue the LBA range of the writes held so far are held back
+ * too. The held writes go out as a single WRITE16 whose data-out iovector
+ * is the concatenation of theirs when
+ *  - the writes in flight have completed,
+ *  - the window, or the maximum transfer length of the LUN, is full,
+ *  - the oldest held write has waited for the configured delay,
+ *  - a write with FUA is added, or
+ *  - any command that does not continue the range is submitted, which
+ *    is then sent after them so the order on the wire is kept.
+ * The completion of the WRITE16 is handed to each of the writes in the
+ * order they were submitted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+struct iscsi_coalesce_write {
+	struct iscsi_coalesce_write *next;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	void *private_data;
+	struct iscsi_data d;	/* if the data-out was not an iovector */
+	uint64_t lba;
+	uint32_t num;
+};
+
+struct iscsi_coalesce_batch {
+	struct iscsi_coalesce *co;
+	struct iscsi_coalesce_write *writes;
+	int count;
+	int lun;
+	uint64_t lba;
+	uint32_t blocksize;
+	uint32_t bytes;
+	int dpo;
+	int fua;
+	struct scsi_task *task;	/* the WRITE16, if more than one write */
+};
+
+struct iscsi_coalesce {
+	struct iscsi_context *iscsi;
+	libiscsi_spinlock_t lock;
+	int refs;		/* the context and batches in flight */
+	uint32_t window;
+	int delay_us;
+	int in_flight;
+
+	/* the writes held back */
+	struct iscsi_coalesce_batch *held;
+	uint64_t next_lba;
+	uint64_t deadline;
+};
+
+static void
+iscsi_coalesce_put(struct iscsi_coalesce *co)
+{
+	int refs;
+
+	iscsi_mt_spin_lock(&co->lock);
+	refs = --co->refs;
+	iscsi_mt_spin_unlock(&co->lock);
+	if (refs == 0) {
+		iscsi_mt_spin_destroy(&co->lock);
+		free(co);
+	}
+}
+
+/* Called with the coalescer locked. */
+static struct iscsi_coalesce_batch *
+iscsi_coalesce_take(struct iscsi_coalesce *co)
+{
+	struct iscsi_coalesce_batch *batch = co->held;
+
+	co->held = NULL;
+	if (batch != NULL) {
+		co->in_flight++;
+		co->refs++;
+	}
+	return batch;
+}
+
+static void
+iscsi_coalesce_free_batch(struct iscsi_coalesce_batch *batch)
+{
+	while (batch->writes) {
+		struct iscsi_coalesce_write *w = batch->writes;
+
+		batch->writes = w->next;
+		free(w);
+	}
+	scsi_free_scsi_task(batch->task);
+	free(batch);
+}
+
+static void
+iscsi_coalesce_batch_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data);
+
+/* Build the command for the batch. Returns the task to send. */
+static struct scsi_task *
+iscsi_coalesce_build(struct iscsi_coalesce_batch *batch)
+{
+	struct iscsi_coalesce_write *w;
+	struct scsi_iovec *iov;
+	struct scsi_task *task;
+	int niov = 0;
+
+	if (batch->count == 1) {
+		return batch->writes->task;
+	}
+
+	task = scsi_cdb_write16(batch->lba, batch->bytes, batch->blocksize, 0,
+				batch->dpo, batch->fua, 0, 0);
+	if (task == NULL) {
+		return NULL;
+	}
+	for (w = batch->writes; w; w = w->next) {
+		niov += w->d.data ? 1 : w->task->iovector_out.niov;
+	}
+	iov = scsi_malloc(task, niov * sizeof(*iov));
+	if (iov == NULL) {
+		scsi_free_scsi_task(task);
+		return NULL;
+	}
+
+	niov = 0;
+	for (w = batch->writes; w; w = w->next) {
+		struct scsi_iovector *v = &w->task->iovector_out;
+		uint32_t left = w->task->expxferlen;
+		int i;
+
+		if (w->d.data != NULL) {
+			iov[niov].iov_base = w->d.data;
+			iov[niov].iov_len = left;
+			niov++;
+			continue;
+		}
+		for (i = 0; i < v->niov && left > 0; i++) {
+			iov[niov] = v->iov[i];
+			if (iov[niov].iov_len > left) {
+				iov[niov].iov_len = left;
+			}
+			left -= iov[niov].iov_len;
+			niov++;
+		}
+	}
+	scsi_task_set_iov_out(task, iov, niov);
+	batch->task = task;
+	return task;
+}
+
+/* Hand each write of the batch its share of the result. */
+static void
+iscsi_coalesce_complete(struct iscsi_context *iscsi,
+			struct iscsi_coalesce_batch *batch, int status,
+			struct scsi_task *task)
+{
+	struct iscsi_coalesce_write *w;
+	uint32_t offset = 0, transferred = batch->bytes;
+
+	if (task != NULL && task->residual_status == SCSI_RESIDUAL_UNDERFLOW &&
+	    task->residual < batch->bytes) {
+		transferred = batch->bytes - task->residual;
+	}
+
+	for (w = batch->writes; w; w = w->next) {
+		struct scsi_task *wt = w->task;
+		uint32_t len = wt->expxferlen;
+
+		wt->status = status;
+		if (task != NULL && task != wt) {
+			wt->sense = task->sense;
+			wt->residual_status = SCSI_RESIDUAL_NO_RESIDUAL;
+			wt->residual = 0;
+			if (offset + len > transferred) {
+				wt->residual_status = SCSI_RESIDUAL_UNDERFLOW;
+				wt->residual = MIN(len, offset + len - transferred);
+			}
+			if (task->datain.size > 0 && wt->datain.data == NULL) {
+				/* the sense data of a CHECK CONDITION */
+				wt->datain.data = malloc(task->datain.size);
+				if (wt->datain.data != NULL) {
+					memcpy(wt->datain.data,
+					       task->datain.data,
+					       task->datain.size);
+					wt->datain.size = task->datain.size;
+				}
+			}
+		}
+		offset += len;
+		if (w->cb) {
+			w->cb(iscsi, status, wt, w->private_data);
+		}
+	}
+}
+
+static void
+iscsi_coalesce_send(struct iscsi_coalesce *co,
+		    struct iscsi_coalesce_batch *batch)
+{
+	struct iscsi_data *d = NULL;
+	struct scsi_task *task;
+
+	task = iscsi_coalesce_build(batch);
+	if (batch->count == 1 && batch->writes->d.data != NULL) {
+		d = &batch->writes->d;
+	}
+	if (task != NULL &&
+	    iscsi_scsi_command_submit(co->iscsi, batch->lun, task,
+				      iscsi_coalesce_batch_cb, d,
+				      batch) == 0) {
+		return;
+	}
+
+	ISCSI_LOG(co->iscsi, 1, "failed to send %d coalesced writes: %s",
+		  batch->count, iscsi_get_error(co->iscsi));
+	iscsi_coalesce_batch_cb(co->iscsi, SCSI_STATUS_ERROR, task, batch);
+}
+
+static void
+iscsi_coalesce_batch_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data)
+{
+	struct iscsi_coalesce_batch *batch = private_data;
+	struct iscsi_coalesce *co = batch->co;
+	struct iscsi_coalesce_batch *next = NULL;
+
+	iscsi_mt_spin_lock(&co->lock);
+	if (--co->in_flight == 0) {
+		next = iscsi_coalesce_take(co);
+	}
+	iscsi_mt_spin_unlock(&co->lock);
+
+	/* keep the pipe busy before running the callbacks */
+	if (next != NULL) {
+		iscsi_coalesce_send(co, next);
+	}
+
+	iscsi_coalesce_complete(co->iscsi, batch, status, command_data);
+	iscsi_coalesce_free_batch(batch);
+	iscsi_coalesce_put(co);
+}
+
+/*
+ * The LBA and number of blocks of a write we can merge, -1 if the write is
+ * not one of those.
+ */
+static int
+iscsi_coalesce_range(struct scsi_task *task, struct iscsi_data *d,
+		     uint64_t *lba, uint32_t *num)
+{
+	if (task->xfer_dir != SCSI_XFER_WRITE || (task->cdb[1] & 0xe0)) {
+		return -1;
+	}
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_WRITE10:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint16(&task->cdb[7]);
+		break;
+	case SCSI_OPCODE_WRITE12:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[6]);
+		break;
+	case SCSI_OPCODE_WRITE16:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[10]);
+		break;
+	default:
+		return -1;
+	}
+	if (*num == 0 || task->expxferlen <= 0 || task->expxferlen % *num) {
+		return -1;
+	}
+	if (d != NULL && d->data != NULL) {
+		return d->size >= (size_t)task->expxferlen ? 0 : -1;
+	}
+	return task->iovector_out.iov != NULL ? 0 : -1;
+}
+
+int
+iscsi_coalesce_command(struct iscsi_context *iscsi, int lun,
+		       struct scsi_task *task, iscsi_command_cb cb,
+		       struct iscsi_data *d, void *private_data)
+{
+	struct iscsi_coalesce *co = iscsi->coalesce;
+	struct iscsi_coalesce_batch *flush = NULL, *now = NULL;
+	struct iscsi_coalesce_batch *batch;
+	struct iscsi_coalesce_write *w;
+	struct scsi_inquiry_block_limits bl;
+	uint32_t blocksize, limit;
+	uint64_t lba;
+	uint32_t num;
+
+	if (iscsi_coalesce_range(task, d, &lba, &num) != 0 ||
+	    iscsi_lun_limits_get(iscsi, lun, &bl, NULL, NULL) != 0) {
+		goto pass;
+	}
+	blocksize = task->expxferlen / num;
+	limit = co->window;
+	if (bl.max_xfer_len != 0 &&
+	    (uint64_t)bl.max_xfer_len * blocksize < limit) {
+		limit = bl.max_xfer_len * blocksize;
+	}
+	if ((uint32_t)task->expxferlen > limit) {
+		goto pass;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		goto pass;
+	}
+	w->task = task;
+	w->cb = cb;
+	w->private_data = private_data;
+	if (d != NULL && d->data != NULL) {
+		w->d = *d;
+	}
+	w->lba = lba;
+	w->num = num;
+	task->lun = lun;
+	task->itt = 0xffffffff;
+
+	iscsi_mt_spin_lock(&co->lock);
+	batch = co->held;
+	if (batch != NULL &&
+	    (batch->lun != lun || batch->blocksize != blocksize ||
+	     co->next_lba != lba ||
+	     batch->bytes + (uint32_t)task->expxferlen > limit)) {
+		flush = iscsi_coalesce_take(co);
+		batch = NULL;
+	}
+	if (batch == NULL) {
+		batch = calloc(1, sizeof(*batch));
+		if (batch == NULL) {
+			iscsi_mt_spin_unlock(&co->lock);
+			free(w);
+			if (flush != NULL) {
+				iscsi_coalesce_send(co, flush);
+			}
+			return iscsi_scsi_command_submit(iscsi, lun, task, cb,
+							 d, private_data);
+		}
+		batch->co = co;
+		batch->lun = lun;
+		batch->lba = lba;
+		batch->blocksize = blocksize;
+		batch->dpo = 1;
+		co->held = batch;
+		co->deadline = iscsi_clock_us() + co->delay_us;
+	}
+	ISCSI_LIST_ADD_END(&batch->writes, w);
+	batch->count++;
+	batch->bytes += task->expxferlen;
+	/* DPO only holds if all writes asked for it, FUA if any did */
+	batch->dpo &= !!(task->cdb[1] & 0x10);
+	batch->fua |= !!(task->cdb[1] & 0x08);
+	co->next_lba = lba + num;
+
+	if (co->in_flight == 0 || batch->fua || batch->bytes >= limit) {
+		now = iscsi_coalesce_take(co);
+	}
+	iscsi_mt_spin_unlock(&co->lock);
+
+	if (flush != NULL) {
+		iscsi_coalesce_send(co, flush);
+	}
+	if (now != NULL) {
+		iscsi_coalesce_send(co, now);
+	}
+	return 0;
+
+ pass:
+	/* anything else goes out after the writes held so far */
+	iscsi_mt_spin_lock(&co->lock);
+	flush = iscsi_coalesce_take(co);
+	iscsi_mt_spin_unlock(&co->lock);
+	if (flush != NULL) {
+		iscsi_coalesce_send(co, flush);
+	}
+	return 1;
+}
+
+void
+iscsi_coalesce_service(struct iscsi_context *iscsi)
+{
+	struct iscsi_coalesce *co = iscsi->coalesce;
+	struct iscsi_coalesce_batch *batch = NULL;
+
+	iscsi_mt_spin_lock(&co->lock);
+	if (co->held != NULL && iscsi_clock_us() >= co->deadline) {
+		batch = iscsi_coalesce_take(co);
+	}
+	iscsi_mt_spin_unlock(&co->lock);
+	if (batch != NULL) {
+		iscsi_coalesce_send(co, batch);
+	}
+}
+
+int
+iscsi_coalesce_next_ms(struct iscsi_context *iscsi)
+{
+	struct iscsi_coalesce *co = iscsi->coalesce;
+	uint64_t now;
+	int ms = -1;
+
+	if (co == NULL) {
+		return -1;
+	}
+	iscsi_mt_spin_lock(&co->lock);
+	if (co->held != NULL) {
+		now = iscsi_clock_us();
+		ms = now >= co->deadline ? 0 :
+			(int)((co->deadline - now + 999) / 1000);
+	}
+	iscsi_mt_spin_unlock(&co->lock);
+	return ms;
+}
+
+/* Recompute the summary of a batch after writes were taken out of it. */
+static void
+iscsi_coalesce_account(struct iscsi_coalesce_batch *batch)
+{
+	struct iscsi_coalesce_write *w;
+
+	batch->lba = batch->writes->lba;
+	batch->count = 0;
+	batch->bytes = 0;
+	batch->dpo = 1;
+	batch->fua = 0;
+	for (w = batch->writes; w; w = w->next) {
+		batch->count++;
+		batch->bytes += w->task->expxferlen;
+		batch->dpo &= !!(w->task->cdb[1] & 0x10);
+		batch->fua |= !!(w->task->cdb[1] & 0x08);
+	}
+}
+
+int
+iscsi_coalesce_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_coalesce *co = iscsi->coalesce;
+	struct iscsi_coalesce_batch *batch, *before = NULL;
+	struct iscsi_coalesce_write *w = NULL, *prev = NULL;
+
+	iscsi_mt_spin_lock(&co->lock);
+	batch = co->held;
+	if (batch != NULL) {
+		for (w = batch->writes; w; prev = w, w = w->next) {
+			if (w->task == task) {
+				break;
+			}
+		}
+	}
+	if (w != NULL && prev != NULL) {
+		/*
+		 * The writes in front of the cancelled one no longer
+		 * continue into the ones after it, send them on their own.
+		 */
+		before = calloc(1, sizeof(*before));
+		if (before == NULL) {
+			iscsi_mt_spin_unlock(&co->lock);
+			return -1;
+		}
+		*before = *batch;
+		prev->next = NULL;
+		iscsi_coalesce_account(before);
+		co->in_flight++;
+		co->refs++;
+		batch->writes = w;
+	}
+	if (w != NULL) {
+		batch->writes = w->next;
+		if (batch->writes == NULL) {
+			co->held = NULL;
+			free(batch);
+		} else {
+			iscsi_coalesce_account(batch);
+		}
+	}
+	iscsi_mt_spin_unlock(&co->lock);
+
+	if (w == NULL) {
+		return -1;
+	}
+	if (before != NULL) {
+		iscsi_coalesce_send(co, before);
+	}
+	task->status = SCSI_STATUS_CANCELLED;
+	if (w->cb) {
+		w->cb(iscsi, SCSI_STATUS_CANCELLED, task, w->private_data);
+	}
+	free(w);
+	return 0;
+}
+
+int
+iscsi_set_write_coalescing(struct iscsi_context *iscsi, uint32_t window,
+			   int delay_us)
+{
+	struct iscsi_coalesce *co = iscsi->coalesce;
+
+	if (co != NULL) {
+		struct iscsi_coalesce_batch *batch;
+
+		iscsi->coalesce = NULL;
+		iscsi_mt_spin_lock(&co->lock);
+		batch = iscsi_coalesce_take(co);
+		iscsi_mt_spin_unlock(&co->lock);
+		if (batch != NULL) {
+			iscsi_coalesce_send(co, batch);
+		}
+		/* batches in flight keep it around until they complete */
+		iscsi_coalesce_put(co);
+	}
+
+	if (window == 0) {
+		ISCSI_LOG(iscsi, 2, "write coalescing disabled");
+		return 0;
+	}
+
+	co = calloc(1, sizeof(*co));
+	if (co == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"write coalescing state");
+		return -1;
+	}
+	co->iscsi = iscsi;
+	co->refs = 1;
+	co->window = window;
+	co->delay_us = delay_us > 0 ? delay_us : 0;
+	iscsi_mt_spin_init(&co->lock, PTHREAD_PROCESS_PRIVATE);
+	iscsi->coalesce = co;
+
+	ISCSI_LOG(iscsi, 2, "write coalescing enabled, window %u bytes, "
+		  "delay %dus", window, co->delay_us);
+	return 0;
+}
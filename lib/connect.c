@@ -36,6 +36,7 @@
 #include "slist.h"
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-probes.h"
 #include "scsi-lowlevel.h"
 
 struct connect_task {
@@ -43,6 +44,11 @@ struct connect_task {
 	void *private_data;
 	int lun;
 	int num_uas;
+	int pending;        /* probes still in flight after the login */
+	int status;
+	int is_disk;
+	int usn_status;
+	char usn[MAX_STRING_SIZE+1];
 };
 
 static void
@@ -92,6 +98,48 @@ iscsi_inquiry_task_connect(struct iscsi_context *iscsi, int lun, int evpd, int p
 	return task;
 }
 
+/*
+ * TEST UNIT READY, the standard INQUIRY and the Unit Serial Number VPD page
+ * are all sent right after the login and the connect completes once the
+ * last of them has. INQUIRY does not report unit attentions so it does not
+ * have to wait for the TEST UNIT READYs that consume them.
+ */
+static void
+iscsi_connect_probe_fail(struct iscsi_context *iscsi, struct connect_task *ct,
+			 const char *msg)
+{
+	if (!ct->status) {
+		iscsi_set_error(iscsi, "%s", msg);
+		ct->status = 1;
+	}
+}
+
+static void
+iscsi_connect_probe_done(struct iscsi_context *iscsi, struct connect_task *ct)
+{
+	if (--ct->pending > 0) {
+		return;
+	}
+
+	if (!ct->status && ct->is_disk) {
+		if (ct->usn_status) {
+			iscsi_connect_probe_fail(iscsi, ct, "iscsi_inquiry_task failed. could not read vpd page 0x80.");
+		} else if (!iscsi->unit_serial_number[0]) {
+			ISCSI_LOG(iscsi, 2, "unit serial number is [%s]", ct->usn);
+			strncpy(iscsi->unit_serial_number, ct->usn, MAX_STRING_SIZE);
+		} else if (strncmp(iscsi->unit_serial_number, ct->usn, MAX_STRING_SIZE)) {
+			iscsi_set_error(iscsi, "unit serial number mismatch. got [%s] expected [%s]",
+					ct->usn, iscsi->unit_serial_number);
+			ct->status = 1;
+		} else {
+			ISCSI_LOG(iscsi, 2, "successfully validated unit serial number [%s]", ct->usn);
+		}
+	}
+
+	ct->cb(iscsi, ct->status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL, ct->private_data);
+	iscsi_free(iscsi, ct);
+}
+
 static void
 iscsi_inquiry_page_0x80_cb(struct iscsi_context *iscsi, int status,
 		       void *command_data, void *private_data)
@@ -100,30 +148,18 @@ iscsi_inquiry_page_0x80_cb(struct iscsi_context *iscsi, int status,
 	struct scsi_task *task = command_data;
 	struct scsi_inquiry_unit_serial_number *inq;
 
+	/* only an error if it turns out to be a disk */
+	ct->usn_status = 1;
 	if (!status) {
 		inq = scsi_datain_unmarshall(task);
 		if (inq != NULL) {
-			if (!iscsi->unit_serial_number[0]) {
-				ISCSI_LOG(iscsi, 2, "unit serial number is [%s]", inq->usn);
-				strncpy(iscsi->unit_serial_number, inq->usn, MAX_STRING_SIZE);
-			} else if (strncmp(iscsi->unit_serial_number, inq->usn, MAX_STRING_SIZE)) {
-				iscsi_set_error(iscsi, "unit serial number mismatch. got [%s] expected [%s]",
-												inq->usn, iscsi->unit_serial_number);
-				status = 1;
-			} else {
-				ISCSI_LOG(iscsi, 2, "successfully validated unit serial number [%s]", inq->usn);
-			}
-		} else {
-			iscsi_set_error(iscsi, "iscsi_inquiry_task datain_unmarshall failed. could not read vpd page 0x80.");
-			status = 1;
+			strncpy(ct->usn, inq->usn, MAX_STRING_SIZE);
+			ct->usn_status = 0;
 		}
-	} else {
-		iscsi_set_error(iscsi, "iscsi_inquiry_task failed. could not read vpd page 0x80.");
 	}
 
-	ct->cb(iscsi, status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL, ct->private_data);
 	scsi_free_scsi_task(task);
-	iscsi_free(iscsi, ct);
+	iscsi_connect_probe_done(iscsi, ct);
 }
 
 static void
@@ -141,24 +177,17 @@ iscsi_inquiry_page_0x0_cb(struct iscsi_context *iscsi, int status,
 			          scsi_devtype_to_str(inq->device_type), inq->vendor_identification,
 			          inq->product_identification, inq->product_revision_level);
 			if (!inq->rmb && inq->device_type == SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
-				if (iscsi_inquiry_task_connect(iscsi, ct->lun, 1, 0x80, MAX_STRING_SIZE + 4,
-				                               iscsi_inquiry_page_0x80_cb, ct) != NULL) {
-					return;
-				}
-				iscsi_set_error(iscsi, "iscsi_inquiry_task for evpd 0x80 failed.");
-				status = 1;
+				ct->is_disk = 1;
 			}
 		} else {
-			iscsi_set_error(iscsi, "iscsi_inquiry_task datain_unmarshall failed. could not read vpd page 0x0.");
-			status = 1;
+			iscsi_connect_probe_fail(iscsi, ct, "iscsi_inquiry_task datain_unmarshall failed. could not read vpd page 0x0.");
 		}
 	} else {
-		iscsi_set_error(iscsi, "iscsi_inquiry_task failed. could not read vpd page 0x0.");
+		iscsi_connect_probe_fail(iscsi, ct, "iscsi_inquiry_task failed. could not read vpd page 0x0.");
 	}
 
-	ct->cb(iscsi, status?SCSI_STATUS_ERROR:SCSI_STATUS_GOOD, NULL, ct->private_data);
 	scsi_free_scsi_task(task);
-	iscsi_free(iscsi, ct);
+	iscsi_connect_probe_done(iscsi, ct);
 }
 
 static void
@@ -178,23 +207,21 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 			 */
 			ct->num_uas++;
 			if (ct->num_uas > 10) {
-				iscsi_set_error(iscsi, "iscsi_testunitready "
+				iscsi_connect_probe_fail(iscsi, ct,
+						"iscsi_testunitready "
 						"Too many UnitAttentions "
 						"during login.");
-				ct->cb(iscsi, SCSI_STATUS_ERROR, NULL,
-				       ct->private_data);
-				iscsi_free(iscsi, ct);
 				scsi_free_scsi_task(task);
+				iscsi_connect_probe_done(iscsi, ct);
 				return;
 			}
 			if (iscsi_testunitready_connect(iscsi, ct->lun,
 							iscsi_testunitready_cb,
 							ct) == NULL) {
-				iscsi_set_error(iscsi, "iscsi_testunitready "
+				iscsi_connect_probe_fail(iscsi, ct,
+						"iscsi_testunitready "
 						"failed.");
-				ct->cb(iscsi, SCSI_STATUS_ERROR, NULL,
-				       ct->private_data);
-				iscsi_free(iscsi, ct);
+				iscsi_connect_probe_done(iscsi, ct);
 			}
 			scsi_free_scsi_task(task);
 			return;
@@ -223,19 +250,11 @@ iscsi_testunitready_cb(struct iscsi_context *iscsi, int status,
 	}
 
 	if (status != 0) {
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL,
-		       ct->private_data);
-		scsi_free_scsi_task(task);
-		iscsi_free(iscsi, ct);
-		return;
-	}
-
-	if (iscsi_inquiry_task_connect(iscsi, ct->lun, 0, 0, 96,
-	                               iscsi_inquiry_page_0x0_cb, ct) == NULL) {
-		iscsi_set_error(iscsi, "iscsi_inquiry_task for vpd 0x0 failed.");
-		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
+		/* keep the error of the TEST UNIT READY itself */
+		ct->status = 1;
 	}
+	scsi_free_scsi_task(task);
+	iscsi_connect_probe_done(iscsi, ct);
 }
 
 static void
@@ -254,37 +273,75 @@ iscsi_login_cb(struct iscsi_context *iscsi, int status, void *command_data,
 		return;
 	}
 
+	if (status != 0 && iscsi->login_skipped_auth) {
+		char portal[MAX_STRING_SIZE+1];
+
+		/* The profile said the target would not ask for
+		 * authentication but it did, log in again with CHAP.
+		 */
+		ISCSI_LOG(iscsi, 2, "login without authentication failed, "
+			  "retrying with CHAP");
+		strncpy(portal, iscsi->connected_portal, MAX_STRING_SIZE);
+		portal[MAX_STRING_SIZE] = '\0';
+		iscsi_disconnect(iscsi);
+		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_SECNEG;
+		iscsi->secneg_phase = ISCSI_LOGIN_SECNEG_PHASE_OFFER_CHAP;
+		iscsi->login_skipped_auth = 0;
+		if (iscsi_connect_async(iscsi, portal, iscsi_connect_cb,
+					ct) != 0) {
+			ct->cb(iscsi, SCSI_STATUS_ERROR, NULL,
+			       ct->private_data);
+			iscsi_free(iscsi, ct);
+		}
+		return;
+	}
+
 	if (status != 0) {
 		ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
 		iscsi_free(iscsi, ct);
 		return;
 	}
 
+	if (ct->lun == -1) {
+		ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
+		iscsi_free(iscsi, ct);
+		return;
+	}
+
+	/* held until all the probes have been sent */
+	ct->pending = 1;
+
 	/* If the application has requested no UA on reconnect OR if this is
 	   the initial connection attempt then we need to consume any/all
 	   UAs that might be present.
 	*/
-	if (iscsi->no_ua_on_reconnect || (ct->lun != -1 && !iscsi->old_iscsi)) {
+	if (iscsi->no_ua_on_reconnect || !iscsi->old_iscsi) {
+		ct->pending++;
 		if (iscsi_testunitready_connect(iscsi, ct->lun,
 						iscsi_testunitready_cb,
 						ct) == NULL) {
-			iscsi_set_error(iscsi, "iscsi_testunitready_async failed.");
-			ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-			iscsi_free(iscsi, ct);
+			iscsi_connect_probe_fail(iscsi, ct, "iscsi_testunitready_async failed.");
+			ct->pending--;
 		}
-	} else if (ct->lun != -1) {
-		if (iscsi_inquiry_task_connect(iscsi, ct->lun, 0, 0, 96,
-						iscsi_inquiry_page_0x0_cb,
-						ct) == NULL) {
-			iscsi_set_error(iscsi, "iscsi_inquiry_task for vpd 0x0 failed.");
-			ct->cb(iscsi, SCSI_STATUS_ERROR, NULL, ct->private_data);
-			iscsi_free(iscsi, ct);
-		}
-	} else {
-		ct->cb(iscsi, SCSI_STATUS_GOOD, NULL, ct->private_data);
-		iscsi_free(iscsi, ct);
-		return;
 	}
+
+	ct->pending++;
+	if (iscsi_inquiry_task_connect(iscsi, ct->lun, 0, 0, 96,
+				       iscsi_inquiry_page_0x0_cb,
+				       ct) == NULL) {
+		iscsi_connect_probe_fail(iscsi, ct, "iscsi_inquiry_task for vpd 0x0 failed.");
+		ct->pending--;
+	}
+
+	ct->pending++;
+	if (iscsi_inquiry_task_connect(iscsi, ct->lun, 1, 0x80, MAX_STRING_SIZE + 4,
+				       iscsi_inquiry_page_0x80_cb,
+				       ct) == NULL) {
+		ct->usn_status = 1;
+		ct->pending--;
+	}
+
+	iscsi_connect_probe_done(iscsi, ct);
 }
 
 static void
@@ -327,9 +384,9 @@ iscsi_full_connect_async(struct iscsi_context *iscsi, const char *portal,
 				"connect_task structure.");
 		return -ENOMEM;
 	}
+	memset(ct, 0, sizeof(*ct));
 	ct->cb           = cb;
 	ct->lun          = lun;
-	ct->num_uas      = 0;
 	ct->private_data = private_data;
 	if (iscsi_connect_async(iscsi, portal, iscsi_connect_cb, ct) != 0) {
 		iscsi_free(iscsi, ct);
@@ -371,37 +428,121 @@ void iscsi_set_reconnect_max_retries(struct iscsi_context *iscsi, int count)
 	iscsi->reconnect_max_retries = count;
 }
 
+void iscsi_set_reconnect_backoff(struct iscsi_context *iscsi, int min_ms,
+				 int max_ms)
+{
+	iscsi->reconnect_backoff_min_ms = min_ms > 0 ? min_ms : 0;
+	iscsi->reconnect_backoff_max_ms = max_ms > min_ms ? max_ms : min_ms;
+}
+
+void iscsi_get_reconnect_stats(struct iscsi_context *iscsi,
+			       struct iscsi_reconnect_stats *stats)
+{
+	*stats = iscsi->reconnect_stats;
+}
+
+/*
+ * Random time between half and all of min_ms * 2^(attempt-1), capped at
+ * max_ms, so that initiators that lost their sessions together do not all
+ * come back at the same moment.
+ */
+static uint64_t
+iscsi_reconnect_backoff_us(struct iscsi_context *iscsi, int attempt)
+{
+	uint64_t ms = iscsi->reconnect_backoff_min_ms;
+
+	while (--attempt > 0 && ms < (uint64_t)iscsi->reconnect_backoff_max_ms) {
+		ms *= 2;
+	}
+	if (ms > (uint64_t)iscsi->reconnect_backoff_max_ms) {
+		ms = iscsi->reconnect_backoff_max_ms;
+	}
+	ms = ms / 2 + (ms ? (uint64_t)rand() % (ms / 2 + 1) : 0);
+
+	return ms * 1000;
+}
+
+int iscsi_reconnect_next_ms(struct iscsi_context *iscsi)
+{
+	uint64_t now;
+
+	if (!iscsi->pending_reconnect) {
+		return -1;
+	}
+	now = iscsi_clock_us();
+	if (now >= iscsi->next_reconnect) {
+		return 0;
+	}
+	return (int)((iscsi->next_reconnect - now + 999) / 1000);
+}
+
 void iscsi_defer_reconnect(struct iscsi_context *iscsi)
 {
 	iscsi->reconnect_deferred = 1;
 
 	ISCSI_LOG(iscsi, 2, "reconnect deferred, cancelling all tasks");
 
+	/* the session is given up, so do not wait for the kernel to report
+	 * zerocopy sends before failing the tasks */
+	iscsi_tcp_zerocopy_flush(iscsi, iscsi);
 	iscsi_cancel_pdus(iscsi);
 }
 
+static int
+iscsi_replay_cmp(const void *a, const void *b)
+{
+	const struct iscsi_pdu *pa = *(struct iscsi_pdu * const *)a;
+	const struct iscsi_pdu *pb = *(struct iscsi_pdu * const *)b;
+
+	return iscsi_serial32_compare(pa->cmdsn, pb->cmdsn);
+}
+
+static void
+iscsi_replay_pdu(struct iscsi_context *iscsi, struct iscsi_context *old_iscsi,
+		 struct iscsi_pdu *pdu)
+{
+	scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_in);
+	scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_out);
+
+	/* We pass NULL as 'd' since any databuffer has already
+	 * been converted to a task-> iovector first time this
+	 * PDU was sent.
+	 */
+	if (iscsi_scsi_command_queue(iscsi, pdu->lun,
+				     pdu->scsi_cbdata.task,
+				     pdu->scsi_cbdata.callback,
+				     NULL,
+				     pdu->scsi_cbdata.private_data)) {
+		/* not much we can really do at this point */
+	}
+	iscsi->reconnect_stats.replayed++;
+	iscsi->drv->free_pdu(old_iscsi, pdu);
+}
+
 void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
                         void *command_data, void *private_data)
 {
 	struct iscsi_context *old_iscsi;
-        struct iscsi_pdu *tmp = NULL;
+        struct iscsi_pdu *tmp = NULL, *next;
+	struct iscsi_pdu **replay;
+	uint64_t now = iscsi_clock_us(), backoff;
+	int i, count, nreplay = 0;
 
 	if (status != SCSI_STATUS_GOOD) {
-		int backoff = ++iscsi->old_iscsi->retry_cnt;
-		if (backoff > 10) {
-			backoff += rand() % 10;
-			backoff -= 5;
-		}
-		if (backoff > 30) {
-			backoff = 30;
-		}
+		iscsi->reconnect_stats.failures++;
+		backoff = iscsi_reconnect_backoff_us(iscsi,
+						++iscsi->old_iscsi->retry_cnt);
 		if (iscsi->reconnect_max_retries != -1 &&
 		    iscsi->old_iscsi->retry_cnt > iscsi->reconnect_max_retries) {
 			/* we will exit iscsi_service with -1 the next time we enter it. */
 			backoff = 0;
 		}
-		ISCSI_LOG(iscsi, 1, "reconnect try %d failed, waiting %d seconds", iscsi->old_iscsi->retry_cnt, backoff);
-		iscsi->next_reconnect = time(NULL) + backoff;
+		ISCSI_LOG(iscsi, 1, "reconnect try %d failed, waiting %d ms",
+			  iscsi->old_iscsi->retry_cnt, (int)(backoff / 1000));
+		ISCSI_PROBE5(reconnect_done, iscsi, status,
+			     iscsi->old_iscsi->retry_cnt,
+			     now - iscsi->reconnect_start_us, 0);
+		iscsi->next_reconnect = now + backoff;
 		iscsi->pending_reconnect = 1;
 		return;
 	}
@@ -409,16 +550,23 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	old_iscsi = iscsi->old_iscsi;
 	iscsi->old_iscsi = NULL;
 
+	/* the PDUs that were sent and those that were still queued, the
+	 * replay below puts them back in their original CmdSN order */
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+        tmp = old_iscsi->waitpdu;
+        old_iscsi->waitpdu = NULL;
 	while (old_iscsi->outqueue) {
 		struct iscsi_pdu *pdu = old_iscsi->outqueue;
 		ISCSI_LIST_REMOVE(&old_iscsi->outqueue, pdu);
-		ISCSI_LIST_ADD_END(&old_iscsi->waitpdu, pdu);
+		ISCSI_LIST_ADD(&tmp, pdu);
 	}
-        tmp = old_iscsi->waitpdu;
-        old_iscsi->waitpdu = NULL;
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
+	for (count = 0, next = tmp; next; next = next->next) {
+		count++;
+	}
+	replay = count ? iscsi_malloc(iscsi, count * sizeof(*replay)) : NULL;
+
 	while (tmp) {
 		struct iscsi_pdu *pdu = tmp;
 
@@ -442,21 +590,24 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 			continue;
 		}
 
-		scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_in);
-		scsi_task_reset_iov(&pdu->scsi_cbdata.task->iovector_out);
+		if (replay == NULL) {
+			/* out of memory, replay them in whatever order */
+			iscsi_replay_pdu(iscsi, old_iscsi, pdu);
+			continue;
+		}
+		replay[nreplay++] = pdu;
+	}
 
-		/* We pass NULL as 'd' since any databuffer has already
-		 * been converted to a task-> iovector first time this
-		 * PDU was sent.
-		 */
-		if (iscsi_scsi_command_async(iscsi, pdu->lun,
-					     pdu->scsi_cbdata.task,
-					     pdu->scsi_cbdata.callback,
-					     NULL,
-					     pdu->scsi_cbdata.private_data)) {
-			/* not much we can really do at this point */
+	if (replay != NULL) {
+		qsort(replay, nreplay, sizeof(*replay), iscsi_replay_cmp);
+
+		/* and hand them to the socket all at once */
+		iscsi_outqueue_batch_begin(iscsi);
+		for (i = 0; i < nreplay; i++) {
+			iscsi_replay_pdu(iscsi, old_iscsi, replay[i]);
 		}
-		iscsi->drv->free_pdu(old_iscsi, pdu);
+		iscsi_outqueue_batch_end(iscsi);
+		iscsi_free(iscsi, replay);
 	}
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
@@ -474,12 +625,29 @@ void iscsi_reconnect_cb(struct iscsi_context *iscsi, int status,
 	iscsi->mallocs += old_iscsi->mallocs;
 	iscsi->frees += old_iscsi->frees;
 
+	ISCSI_PROBE5(reconnect_done, iscsi, status, old_iscsi->retry_cnt + 1,
+		     now - iscsi->reconnect_start_us, nreplay);
 	free(old_iscsi);
 
-	/* avoid a reconnect faster than 3 seconds */
-	iscsi->next_reconnect = time(NULL) + 3;
+	/* do not reconnect again right away if the target keeps dropping
+	 * us as soon as we log in */
+	iscsi->next_reconnect = now + iscsi_reconnect_backoff_us(iscsi, 1);
+
+	if (iscsi->reconnect_start_us) {
+		uint64_t us = now - iscsi->reconnect_start_us;
+
+		iscsi->reconnect_stats.last_us = us;
+		iscsi->reconnect_stats.total_us += us;
+		if (us > iscsi->reconnect_stats.max_us) {
+			iscsi->reconnect_stats.max_us = us;
+		}
+		iscsi->reconnect_start_us = 0;
+	}
+	iscsi->reconnect_stats.reconnects++;
 
-	ISCSI_LOG(iscsi, 2, "reconnect was successful");
+	ISCSI_LOG(iscsi, 2, "reconnect was successful after %d ms, %d "
+		  "commands replayed", (int)(iscsi->reconnect_stats.last_us / 1000),
+		  nreplay);
 
 	iscsi->pending_reconnect = 0;
 }
@@ -507,7 +675,11 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		return 0;
 	}
 
-	if (time(NULL) < iscsi->next_reconnect) {
+	if (!iscsi->old_iscsi && !iscsi->reconnect_start_us) {
+		iscsi->reconnect_start_us = iscsi_clock_us();
+	}
+
+	if (iscsi_clock_us() < iscsi->next_reconnect) {
 		iscsi->pending_reconnect = 1;
 		return 0;
 	}
@@ -532,7 +704,16 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 		return -1;
 	}
 
+	/* the environment may have given the new context a read cache, a
+	 * write coalescer and a trace ring of its own, drop them as the
+	 * ones of the old context are handed over */
+	iscsi_set_read_cache(tmp_iscsi, 0, 0);
+	iscsi_set_write_coalescing(tmp_iscsi, 0, 0);
+	iscsi_set_pdu_trace(tmp_iscsi, 0);
+
 	ISCSI_LOG(iscsi, 2, "reconnect initiated");
+	ISCSI_PROBE3(reconnect_start, iscsi, iscsi->portal,
+		     iscsi->old_iscsi ? iscsi->old_iscsi->retry_cnt + 1 : 1);
 
 	iscsi_set_targetname(tmp_iscsi, iscsi->target_name);
 
@@ -544,31 +725,90 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 
 	iscsi_set_session_type(tmp_iscsi, ISCSI_SESSION_NORMAL);
 
+	/* log in with the same ISID, and a TSIH of 0, so that the target
+	 * reinstates the session: it drops the old one, and the tasks it
+	 * still holds, right away rather than when it times out */
+	memcpy(tmp_iscsi->isid, iscsi->isid, sizeof(tmp_iscsi->isid));
+
 	tmp_iscsi->lun = iscsi->lun;
 
 	strncpy(tmp_iscsi->portal, iscsi->portal, MAX_STRING_SIZE);
 
 	strncpy(tmp_iscsi->bind_interfaces, iscsi->bind_interfaces, MAX_STRING_SIZE);
+	strncpy(tmp_iscsi->tls_ca_file, iscsi->tls_ca_file, MAX_STRING_SIZE);
+	strncpy(tmp_iscsi->discovery_cache, iscsi->discovery_cache, MAX_STRING_SIZE);
+	tmp_iscsi->discovery_cache_ttl = iscsi->discovery_cache_ttl;
+	strncpy(tmp_iscsi->alternate_portals, iscsi->alternate_portals, MAX_STRING_SIZE);
 	tmp_iscsi->bind_interfaces_cnt = iscsi->bind_interfaces_cnt;
 
 	strncpy(tmp_iscsi->unit_serial_number, iscsi->unit_serial_number, MAX_STRING_SIZE);
 
 	tmp_iscsi->log_level = iscsi->log_level;
 	tmp_iscsi->log_fn = iscsi->log_fn;
+	tmp_iscsi->log_rate_limit = iscsi->log_rate_limit;
 	tmp_iscsi->tcp_user_timeout = iscsi->tcp_user_timeout;
 	tmp_iscsi->tcp_keepidle = iscsi->tcp_keepidle;
 	tmp_iscsi->tcp_keepcnt = iscsi->tcp_keepcnt;
 	tmp_iscsi->tcp_keepintvl = iscsi->tcp_keepintvl;
 	tmp_iscsi->tcp_syncnt = iscsi->tcp_syncnt;
+	tmp_iscsi->tcp_zerocopy_threshold = iscsi->tcp_zerocopy_threshold;
+	tmp_iscsi->busy_poll_us = iscsi->busy_poll_us;
+	tmp_iscsi->busy_poll_socket_us = iscsi->busy_poll_socket_us;
+	tmp_iscsi->busy_poll_stats = iscsi->busy_poll_stats;
 	tmp_iscsi->cache_allocations = iscsi->cache_allocations;
 	tmp_iscsi->scsi_timeout = iscsi->scsi_timeout;
+	tmp_iscsi->want_error_recovery_level = iscsi->want_error_recovery_level;
 	tmp_iscsi->no_ua_on_reconnect = iscsi->no_ua_on_reconnect;
 	tmp_iscsi->fd_dup_cb = iscsi->fd_dup_cb;
 	tmp_iscsi->fd_dup_opaque = iscsi->fd_dup_opaque;
 
 	tmp_iscsi->reconnect_max_retries = iscsi->reconnect_max_retries;
+	tmp_iscsi->reconnect_backoff_min_ms = iscsi->reconnect_backoff_min_ms;
+	tmp_iscsi->reconnect_backoff_max_ms = iscsi->reconnect_backoff_max_ms;
+	tmp_iscsi->reconnect_start_us = iscsi->reconnect_start_us;
+	tmp_iscsi->reconnect_stats = iscsi->reconnect_stats;
+
+	tmp_iscsi->rdma_mr_cache_max = iscsi->rdma_mr_cache_max;
+	tmp_iscsi->auto_split = iscsi->auto_split;
+	tmp_iscsi->discard_queue_depth = iscsi->discard_queue_depth;
+	tmp_iscsi->xcopy_list_id = iscsi->xcopy_list_id;
+	tmp_iscsi->multipath = iscsi->multipath;
+	/* the registrations move to the new context */
+	tmp_iscsi->rdma_bufs = iscsi->rdma_bufs;
+	iscsi->rdma_bufs = NULL;
+	/* and so do the read cache and the tasks it has completed */
+	tmp_iscsi->read_cache = iscsi->read_cache;
+	iscsi->read_cache = NULL;
+	tmp_iscsi->coalesce = iscsi->coalesce;
+	iscsi->coalesce = NULL;
+	tmp_iscsi->portal_cache = iscsi->portal_cache;
+	iscsi->portal_cache = NULL;
+	tmp_iscsi->login_profile = iscsi->login_profile;
+	tmp_iscsi->login_cache = iscsi->login_cache;
+	iscsi->login_cache = NULL;
+	tmp_iscsi->trace = iscsi->trace;
+	iscsi->trace = NULL;
+	iscsi_set_command_record(tmp_iscsi, NULL);
+	tmp_iscsi->record_env = iscsi->record_env;
+	tmp_iscsi->recorder = iscsi->recorder;
+	iscsi->recorder = NULL;
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	tmp_iscsi->completions = iscsi->completions;
+	iscsi->completions = NULL;
+	tmp_iscsi->lun_limits = iscsi->lun_limits;
+	iscsi->lun_limits = NULL;
+	tmp_iscsi->splits = iscsi->splits;
+	iscsi->splits = NULL;
+	tmp_iscsi->xcopies = iscsi->xcopies;
+	iscsi->xcopies = NULL;
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	if (iscsi->old_iscsi) {
+		iscsi_tcp_connect_cancel(iscsi);
+		iscsi_tcp_zerocopy_flush(iscsi, iscsi);
+#ifdef HAVE_KTLS
+		iscsi_tls_release(iscsi);
+#endif
 		iscsi_free(iscsi, iscsi->opaque);
 
 		iscsi->old_iscsi->mallocs += iscsi->mallocs;
@@ -577,6 +817,17 @@ static int reconnect(struct iscsi_context *iscsi, int force)
 	} else {
 		tmp_iscsi->old_iscsi = malloc(sizeof(struct iscsi_context));
 		if (!tmp_iscsi->old_iscsi) {
+			iscsi->rdma_bufs = tmp_iscsi->rdma_bufs;
+			iscsi->read_cache = tmp_iscsi->read_cache;
+			iscsi->coalesce = tmp_iscsi->coalesce;
+			iscsi->portal_cache = tmp_iscsi->portal_cache;
+			iscsi->login_cache = tmp_iscsi->login_cache;
+			iscsi->trace = tmp_iscsi->trace;
+			iscsi->recorder = tmp_iscsi->recorder;
+			iscsi->completions = tmp_iscsi->completions;
+			iscsi->lun_limits = tmp_iscsi->lun_limits;
+			iscsi->splits = tmp_iscsi->splits;
+			iscsi->xcopies = tmp_iscsi->xcopies;
 			free(tmp_iscsi);
 			return -1;
 		}
@@ -602,5 +853,5 @@ int iscsi_force_reconnect(struct iscsi_context *iscsi)
 void iscsi_reset_next_reconnect(struct iscsi_context *iscsi)
 {
 	ISCSI_LOG(iscsi, 1, "reset iscsi next_reconnect");
-	iscsi->next_reconnect = time(NULL);
+	iscsi->next_reconnect = iscsi_clock_us();
 }
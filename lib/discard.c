@@ -0,0 +1,487 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Discarding lists of block ranges.
+ *
+ * The ranges are sorted, merged and trimmed to whole unmap granules and
+ * then packed into as few UNMAPs as the Block Limits of the LUN allow,
+ * several of which are kept in flight. LUNs that do not implement UNMAP
+ * get WRITE SAME(16) with the UNMAP bit set instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/* the parameter list length of UNMAP is 16 bits */
+#define DISCARD_MAX_DESCRIPTORS	((0xffff - 8) / 16)
+
+struct iscsi_discard_range {
+	uint64_t lba;
+	uint64_t num;
+};
+
+struct iscsi_discard {
+	int lun;
+	int flags;
+	uint32_t block_size;
+	iscsi_command_cb cb;
+	void *private_data;
+
+	/* sorted, merged and, unless writing zeros, granule aligned */
+	struct iscsi_discard_range *ranges;
+	int nranges;
+	int next;		/* first range that is not sent in full */
+	uint64_t pos;		/* first block of it that is not sent */
+
+	/* sent as UNMAP but have to go again as WRITE SAME */
+	struct iscsi_discard_range *retry;
+	int nretry;
+	int retryalloc;
+
+	int write_same;
+	uint32_t max_blocks;	/* per command */
+	uint32_t max_descs;
+	uint32_t granularity;
+	uint64_t max_ws_len;
+	unsigned char *zero;	/* one block of data for WRITE SAME */
+
+	int in_flight;
+	int status;
+	int starting;		/* inside iscsi_discard_async() */
+	int busy;		/* inside iscsi_discard_send() */
+};
+
+struct iscsi_discard_cmd {
+	struct iscsi_discard *d;
+	int count;
+	struct unmap_list descs[];
+};
+
+static void
+iscsi_discard_free(struct iscsi_discard *d)
+{
+	free(d->ranges);
+	free(d->retry);
+	free(d->zero);
+	free(d);
+}
+
+static int
+iscsi_discard_range_cmp(const void *a, const void *b)
+{
+	const struct iscsi_discard_range *ra = a, *rb = b;
+
+	if (ra->lba != rb->lba) {
+		return ra->lba < rb->lba ? -1 : 1;
+	}
+	return 0;
+}
+
+/* Round max down to whole granules, as long as that leaves any. */
+static uint32_t
+iscsi_discard_round(uint32_t max, uint32_t granularity)
+{
+	if (max >= granularity) {
+		max -= max % granularity;
+	}
+	return max;
+}
+
+static void
+iscsi_discard_use_write_same(struct iscsi_context *iscsi,
+			     struct iscsi_discard *d)
+{
+	uint64_t max = d->max_ws_len;
+
+	if (max == 0 || max > 0xffffffff) {
+		max = 0xffffffff;
+	}
+	d->write_same = 1;
+	d->max_blocks = iscsi_discard_round(max, d->granularity);
+	d->max_descs = 1;
+	ISCSI_LOG(iscsi, 2, "lun %d: %s with WRITE SAME(16) of up to %u "
+		  "blocks", d->lun,
+		  (d->flags & ISCSI_DISCARD_WRITE_ZEROES) ? "writing zeros" :
+		  "discarding", d->max_blocks);
+}
+
+static void
+iscsi_discard_start(struct iscsi_context *iscsi, struct iscsi_discard *d,
+		    struct scsi_inquiry_block_limits *bl)
+{
+	uint64_t alignment = 0;
+	int i, n;
+
+	d->granularity = 1;
+	d->max_ws_len = bl->max_ws_len;
+
+	if (!(d->flags & ISCSI_DISCARD_WRITE_ZEROES)) {
+		/*
+		 * Parts of granules are not deallocated anyway, and would
+		 * only be written with zeros by WRITE SAME.
+		 */
+		if (bl->opt_unmap_gran > 1) {
+			d->granularity = bl->opt_unmap_gran;
+		}
+		if (bl->ugavalid) {
+			alignment = bl->unmap_gran_align;
+		}
+		for (i = 0, n = 0; i < d->nranges; i++) {
+			uint64_t g = d->granularity;
+			uint64_t start = d->ranges[i].lba;
+			uint64_t end = start + d->ranges[i].num;
+
+			if (g > 1) {
+				start = start < alignment ? alignment :
+					alignment + (start - alignment + g - 1) / g * g;
+				end = end < alignment ? 0 :
+					alignment + (end - alignment) / g * g;
+			}
+			if (end > start) {
+				d->ranges[n].lba = start;
+				d->ranges[n].num = end - start;
+				n++;
+			}
+		}
+		d->nranges = n;
+	}
+
+	if (!(d->flags & ISCSI_DISCARD_WRITE_ZEROES) && bl->max_unmap != 0) {
+		d->max_blocks = iscsi_discard_round(bl->max_unmap,
+						    d->granularity);
+		d->max_descs = bl->max_unmap_bdc;
+		if (d->max_descs == 0 ||
+		    d->max_descs > DISCARD_MAX_DESCRIPTORS) {
+			d->max_descs = DISCARD_MAX_DESCRIPTORS;
+		}
+		ISCSI_LOG(iscsi, 2, "lun %d: discarding with UNMAP of up to %u "
+			  "blocks in %u descriptors, granularity %u",
+			  d->lun, d->max_blocks, d->max_descs,
+			  d->granularity);
+	} else {
+		iscsi_discard_use_write_same(iscsi, d);
+	}
+}
+
+/* Take up to max descriptors worth up to max_blocks blocks in total. */
+static int
+iscsi_discard_fill(struct iscsi_discard *d, struct unmap_list *descs,
+		   int max)
+{
+	uint32_t budget = d->max_blocks;
+	int n = 0;
+
+	while (n < max && budget > 0) {
+		struct iscsi_discard_range *r;
+		uint64_t num;
+
+		if (d->nretry > 0) {
+			r = &d->retry[d->nretry - 1];
+			num = r->num < budget ? r->num : budget;
+			descs[n].lba = r->lba;
+			r->lba += num;
+			r->num -= num;
+			if (r->num == 0) {
+				d->nretry--;
+			}
+		} else if (d->next < d->nranges) {
+			r = &d->ranges[d->next];
+			if (d->pos < r->lba) {
+				d->pos = r->lba;
+			}
+			num = r->lba + r->num - d->pos;
+			if (num > budget) {
+				num = budget;
+			}
+			descs[n].lba = d->pos;
+			d->pos += num;
+			if (d->pos == r->lba + r->num) {
+				d->next++;
+			}
+		} else {
+			break;
+		}
+		descs[n++].num = num;
+		budget -= num;
+	}
+	return n;
+}
+
+static int
+iscsi_discard_requeue(struct iscsi_discard *d, struct unmap_list *descs,
+		      int count)
+{
+	int i;
+
+	if (d->nretry + count > d->retryalloc) {
+		int alloc = d->nretry + count + 16;
+		struct iscsi_discard_range *retry;
+
+		retry = realloc(d->retry, alloc * sizeof(*retry));
+		if (retry == NULL) {
+			return -1;
+		}
+		d->retry = retry;
+		d->retryalloc = alloc;
+	}
+	for (i = 0; i < count; i++) {
+		d->retry[d->nretry].lba = descs[i].lba;
+		d->retry[d->nretry].num = descs[i].num;
+		d->nretry++;
+	}
+	return 0;
+}
+
+static void iscsi_discard_send(struct iscsi_context *iscsi,
+			       struct iscsi_discard *d);
+
+static void
+iscsi_discard_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	struct iscsi_discard_cmd *cmd = private_data;
+	struct iscsi_discard *d = cmd->d;
+	struct scsi_task *task = command_data;
+
+	d->in_flight--;
+
+	if (status == SCSI_STATUS_CHECK_CONDITION && !d->write_same &&
+	    task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST &&
+	    task->sense.ascq == SCSI_SENSE_ASCQ_INVALID_OPERATION_CODE) {
+		ISCSI_LOG(iscsi, 2, "lun %d: UNMAP is not supported", d->lun);
+		iscsi_discard_use_write_same(iscsi, d);
+	}
+	if (status == SCSI_STATUS_CHECK_CONDITION && d->write_same &&
+	    task->cdb[0] == SCSI_OPCODE_UNMAP) {
+		/* sent before we knew better */
+		if (iscsi_discard_requeue(d, cmd->descs, cmd->count) == 0) {
+			status = SCSI_STATUS_GOOD;
+		} else {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"requeue discard ranges");
+			status = SCSI_STATUS_ERROR;
+		}
+	} else if (status == SCSI_STATUS_CHECK_CONDITION) {
+		iscsi_set_error(iscsi, "%s failed with sense key %s(0x%02x) "
+				"ascq %s(0x%04x)",
+				d->write_same ? "WRITE SAME(16)" : "UNMAP",
+				scsi_sense_key_str(task->sense.key),
+				task->sense.key,
+				scsi_sense_ascq_str(task->sense.ascq),
+				task->sense.ascq);
+	}
+	if (status != SCSI_STATUS_GOOD && d->status == SCSI_STATUS_GOOD) {
+		d->status = status;
+	}
+
+	scsi_free_scsi_task(task);
+	free(cmd);
+
+	iscsi_discard_send(iscsi, d);
+}
+
+/*
+ * Keep the queue full and finish once all ranges are done, or once the
+ * commands still in flight are after a failure.
+ */
+static void
+iscsi_discard_send(struct iscsi_context *iscsi, struct iscsi_discard *d)
+{
+	if (d->busy) {
+		return;
+	}
+	d->busy = 1;
+
+	while (d->status == SCSI_STATUS_GOOD &&
+	       d->in_flight < iscsi->discard_queue_depth) {
+		struct iscsi_discard_cmd *cmd;
+		struct scsi_task *task;
+
+		cmd = malloc(sizeof(*cmd) +
+			     d->max_descs * sizeof(struct unmap_list));
+		if (cmd == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate discard command");
+			d->status = SCSI_STATUS_ERROR;
+			break;
+		}
+		cmd->d = d;
+		cmd->count = iscsi_discard_fill(d, cmd->descs, d->max_descs);
+		if (cmd->count == 0) {
+			free(cmd);
+			break;
+		}
+
+		d->in_flight++;
+		if (d->write_same) {
+			task = iscsi_writesame16_task(iscsi, d->lun,
+					cmd->descs[0].lba, d->zero,
+					d->block_size, cmd->descs[0].num, 0,
+					!(d->flags & ISCSI_DISCARD_WRITE_ZEROES),
+					0, 0, iscsi_discard_cb, cmd);
+		} else {
+			task = iscsi_unmap_task(iscsi, d->lun, 0, 0,
+						cmd->descs, cmd->count,
+						iscsi_discard_cb, cmd);
+		}
+		if (task == NULL) {
+			d->in_flight--;
+			d->status = SCSI_STATUS_ERROR;
+			free(cmd);
+			break;
+		}
+	}
+
+	d->busy = 0;
+	if (d->in_flight > 0 || d->starting) {
+		return;
+	}
+	if (d->cb) {
+		d->cb(iscsi, d->status, NULL, d->private_data);
+	}
+	iscsi_discard_free(d);
+}
+
+static void
+iscsi_discard_limits_cb(struct iscsi_context *iscsi, int status,
+			void *command_data, void *private_data)
+{
+	struct iscsi_discard *d = private_data;
+	struct scsi_inquiry_block_limits bl;
+
+	if (status == SCSI_STATUS_GOOD &&
+	    iscsi_lun_limits_get(iscsi, d->lun, &bl, NULL, NULL) == 0) {
+		iscsi_discard_start(iscsi, d, &bl);
+	} else if (status == SCSI_STATUS_GOOD) {
+		status = SCSI_STATUS_ERROR;
+	}
+	d->status = status;
+	iscsi_discard_send(iscsi, d);
+}
+
+int
+iscsi_discard_async(struct iscsi_context *iscsi, int lun,
+		    struct unmap_list *list, int list_len,
+		    uint32_t block_size, int flags,
+		    iscsi_command_cb cb, void *private_data)
+{
+	struct scsi_inquiry_block_limits bl;
+	struct iscsi_discard *d;
+	int i, n, ret;
+
+	if (list_len <= 0) {
+		iscsi_set_error(iscsi, "Empty discard list");
+		return -1;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		goto oom;
+	}
+	d->lun = lun;
+	d->flags = flags;
+	d->block_size = block_size;
+	d->cb = cb;
+	d->private_data = private_data;
+	d->status = SCSI_STATUS_GOOD;
+
+	d->zero = calloc(1, block_size);
+	d->ranges = malloc(list_len * sizeof(*d->ranges));
+	if (d->zero == NULL || d->ranges == NULL) {
+		goto oom;
+	}
+	for (i = 0; i < list_len; i++) {
+		d->ranges[i].lba = list[i].lba;
+		d->ranges[i].num = list[i].num;
+	}
+	qsort(d->ranges, list_len, sizeof(*d->ranges),
+	      iscsi_discard_range_cmp);
+	for (i = 0, n = 0; i < list_len; i++) {
+		struct iscsi_discard_range *r = &d->ranges[i];
+
+		if (r->num == 0) {
+			continue;
+		}
+		if (n > 0 && r->lba <= d->ranges[n - 1].lba +
+		    d->ranges[n - 1].num) {
+			struct iscsi_discard_range *prev = &d->ranges[n - 1];
+
+			if (r->lba + r->num > prev->lba + prev->num) {
+				prev->num = r->lba + r->num - prev->lba;
+			}
+			continue;
+		}
+		d->ranges[n++] = *r;
+	}
+	d->nranges = n;
+
+	ret = iscsi_lun_limits_get(iscsi, lun, &bl, iscsi_discard_limits_cb,
+				   d);
+	if (ret == 1) {
+		return 0;
+	}
+	if (ret < 0) {
+		iscsi_discard_free(d);
+		return -1;
+	}
+
+	d->starting = 1;
+	iscsi_discard_start(iscsi, d, &bl);
+	iscsi_discard_send(iscsi, d);
+	d->starting = 0;
+	if (d->in_flight > 0) {
+		return 0;
+	}
+	/* nothing to do, or we could not send anything */
+	if (d->status == SCSI_STATUS_GOOD &&
+	    iscsi_scsi_task_complete_later(iscsi, NULL, SCSI_STATUS_GOOD,
+					   cb, private_data) == 0) {
+		iscsi_discard_free(d);
+		return 0;
+	}
+	iscsi_discard_free(d);
+	return -1;
+
+ oom:
+	iscsi_set_error(iscsi, "Out-of-memory: failed to allocate discard");
+	if (d != NULL) {
+		iscsi_discard_free(d);
+	}
+	return -1;
+}
+
+int
+iscsi_set_discard_queue_depth(struct iscsi_context *iscsi, int depth)
+{
+	if (depth < 1) {
+		iscsi_set_error(iscsi, "Invalid discard queue depth %d", depth);
+		return -1;
+	}
+	iscsi->discard_queue_depth = depth;
+	return 0;
+}
@@ -26,11 +26,26 @@
 #include <arpa/inet.h>
 #endif
 
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+#include <io.h>
+#include <process.h>
+#endif
+
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/* the most SendTargets text we take from a target */
+#define ISCSI_DISCOVERY_MAX_SIZE	(16 * 1024 * 1024)
 
 int
 iscsi_discovery_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
@@ -78,163 +93,439 @@ iscsi_discovery_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 	return 0;
 }
 
-static void
-iscsi_free_discovery_addresses(struct iscsi_context *iscsi, struct iscsi_discovery_address *addresses)
+/*
+ * Discovery results are built in a single allocation: the targets, their
+ * portals and then the strings, so that the whole list is freed with one
+ * free(). Records for a target name that has been seen already are merged
+ * into the first one, found through a hash of the names.
+ *
+ * The list is linked in reverse order of the text if reverse is set.
+ */
+static uint32_t
+iscsi_discovery_hash(const char *name)
 {
-	while (addresses != NULL) {
-		struct iscsi_discovery_address *next = addresses->next;
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h = (h ^ (unsigned char)*name++) * 16777619U;
+	}
+	return h;
+}
+
+static struct iscsi_discovery_address *
+iscsi_discovery_build(struct iscsi_context *iscsi, const unsigned char *data,
+		      size_t size, int reverse)
+{
+	struct iscsi_discovery_address *targets, *target = NULL;
+	struct iscsi_target_portal *portals, **tails = NULL;
+	const unsigned char *ptr, *end;
+	size_t strings = 0;
+	int ntargets = 0, nportals = 0, nt = 0, np = 0;
+	int *hash = NULL;
+	uint32_t hash_size = 1, h;
+	char *str;
+	void *block;
+
+	/* count what there is and check it makes sense */
+	for (ptr = data; ptr < data + size; ptr = end + 1) {
+		end = memchr(ptr, 0, data + size - ptr);
+		if (end == NULL) {
+			iscsi_set_error(iscsi, "NUL not found after offset %ld "
+					"when parsing discovery data",
+					(long)(ptr - data));
+			return NULL;
+		}
+		if (end == ptr) {
+			break;
+		}
+		if (!strncmp((const char *)ptr, "TargetName=", 11)) {
+			ntargets++;
+			strings += end - ptr - 11 + 1;
+		} else if (!strncmp((const char *)ptr, "TargetAddress=", 14)) {
+			if (ntargets == 0) {
+				iscsi_set_error(iscsi, "Invalid discovery "
+						"reply");
+				return NULL;
+			}
+			nportals++;
+			strings += end - ptr - 14 + 1;
+		} else {
+			iscsi_set_error(iscsi, "Don't know how to handle "
+					"discovery string : %s", ptr);
+			return NULL;
+		}
+	}
+	if (ntargets == 0) {
+		return NULL;
+	}
 
-		iscsi_free(iscsi, addresses->target_name);
-		addresses->target_name = NULL;
+	while (hash_size < 2 * (uint32_t)ntargets) {
+		hash_size <<= 1;
+	}
+	hash = malloc(hash_size * sizeof(*hash));
+	tails = malloc(ntargets * sizeof(*tails));
+	block = calloc(1, ntargets * sizeof(*targets) +
+		       nportals * sizeof(*portals) + strings);
+	if (hash == NULL || tails == NULL || block == NULL) {
+		iscsi_set_error(iscsi, "Failed to allocate data for "
+				"discovered targets");
+		free(hash);
+		free(tails);
+		free(block);
+		return NULL;
+	}
+	memset(hash, 0xff, hash_size * sizeof(*hash));
+	targets = block;
+	portals = (struct iscsi_target_portal *)&targets[ntargets];
+	str = (char *)&portals[nportals];
 
-		while (addresses->portals != NULL) {
-			struct iscsi_target_portal *next_portal = addresses->portals->next;
+	for (ptr = data; ptr < data + size && *ptr; ptr = end + 1) {
+		end = memchr(ptr, 0, data + size - ptr);
 
-			iscsi_free(iscsi, addresses->portals->portal);
-			iscsi_free(iscsi, addresses->portals);
+		if (!strncmp((const char *)ptr, "TargetName=", 11)) {
+			const char *name = (const char *)ptr + 11;
 
-			addresses->portals = next_portal;
+			h = iscsi_discovery_hash(name) & (hash_size - 1);
+			while (hash[h] >= 0 &&
+			       strcmp(targets[hash[h]].target_name, name)) {
+				h = (h + 1) & (hash_size - 1);
+			}
+			if (hash[h] >= 0) {
+				target = &targets[hash[h]];
+				continue;
+			}
+			hash[h] = nt;
+			target = &targets[nt];
+			tails[nt++] = NULL;
+			target->target_name = str;
+			memcpy(str, name, end - ptr - 11 + 1);
+			str += end - ptr - 11 + 1;
+			if (nt > 1 && reverse) {
+				target->next = &targets[nt - 2];
+			} else if (nt > 1) {
+				targets[nt - 2].next = target;
+			}
+		} else {
+			struct iscsi_target_portal *portal = &portals[np++];
+
+			portal->portal = str;
+			memcpy(str, ptr + 14, end - ptr - 14 + 1);
+			str += end - ptr - 14 + 1;
+			if (reverse) {
+				portal->next = target->portals;
+				target->portals = portal;
+			} else {
+				if (tails[target - targets] == NULL) {
+					target->portals = portal;
+				} else {
+					tails[target - targets]->next = portal;
+				}
+				tails[target - targets] = portal;
+			}
 		}
-		addresses->portals = NULL;
+	}
 
-		addresses->next = NULL;
-		iscsi_free(iscsi, addresses);
-		addresses = next;
+	free(hash);
+	free(tails);
+
+	/* The first target is what gets freed. Reversed, the list runs
+	 * from the last one down to it, so swap the two.
+	 */
+	if (reverse && nt > 1) {
+		struct iscsi_discovery_address tmp;
+		int i;
+
+		tmp = targets[0];
+		targets[0] = targets[nt - 1];
+		targets[nt - 1] = tmp;
+		for (i = 0; i < nt; i++) {
+			if (targets[i].next == &targets[0]) {
+				targets[i].next = &targets[nt - 1];
+			}
+		}
 	}
+
+	return targets;
 }
 
-int
-iscsi_process_text_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
-			 struct iscsi_in_pdu *in)
+/*
+ * The list as SendTargets text, in list order.
+ */
+static unsigned char *
+iscsi_discovery_text(struct iscsi_discovery_address *targets, size_t *size)
 {
-	struct iscsi_discovery_address *targets = NULL;
-	unsigned char *ptr = in->data;
-	int size = in->data_pos;
+	struct iscsi_discovery_address *target;
+	struct iscsi_target_portal *portal;
+	unsigned char *data, *ptr;
+	size_t len = 0;
+
+	for (target = targets; target; target = target->next) {
+		len += 11 + strlen(target->target_name) + 1;
+		for (portal = target->portals; portal; portal = portal->next) {
+			len += 14 + strlen(portal->portal) + 1;
+		}
+	}
 
-	/* verify the response looks sane */
-	if (in->hdr[1] != ISCSI_PDU_TEXT_FINAL) {
-		iscsi_set_error(iscsi, "unsupported flags in text "
-				"reply %02x", in->hdr[1]);
-		if (pdu->callback) {
-			pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-			              pdu->private_data);
+	data = malloc(len + 1);
+	if (data == NULL) {
+		return NULL;
+	}
+	ptr = data;
+	for (target = targets; target; target = target->next) {
+		ptr += sprintf((char *)ptr, "TargetName=%s",
+			       target->target_name) + 1;
+		for (portal = target->portals; portal; portal = portal->next) {
+			ptr += sprintf((char *)ptr, "TargetAddress=%s",
+				       portal->portal) + 1;
 		}
+	}
+	*size = len;
+	return data;
+}
+
+struct iscsi_discovery_address *
+iscsi_discovery_copy(struct iscsi_context *iscsi,
+		     struct iscsi_discovery_address *targets)
+{
+	struct iscsi_discovery_address *copy;
+	unsigned char *data;
+	size_t size;
+
+	if (targets == NULL) {
+		return NULL;
+	}
+	data = iscsi_discovery_text(targets, &size);
+	if (data == NULL) {
+		iscsi_set_error(iscsi, "Failed to allocate data for "
+				"discovered targets");
+		return NULL;
+	}
+	copy = iscsi_discovery_build(iscsi, data, size, 1);
+	free(data);
+
+	return copy;
+}
+
+/*
+ * The discovery cache is a text file with a line for each key of the
+ * SendTargets reply of a portal:
+ *
+ *   <portal> <time of the discovery> TargetName=... | TargetAddress=...
+ */
+int
+iscsi_set_discovery_cache(struct iscsi_context *iscsi, const char *path,
+			  int ttl)
+{
+	if (path == NULL) {
+		iscsi->discovery_cache[0] = '\0';
+		return 0;
+	}
+	if (strlen(path) > MAX_STRING_SIZE) {
+		iscsi_set_error(iscsi, "discovery cache path too long");
 		return -1;
 	}
+	strncpy(iscsi->discovery_cache, path, MAX_STRING_SIZE);
+	iscsi->discovery_cache_ttl = ttl;
+	return 0;
+}
 
-	while (size > 0) {
-		unsigned char *end;
-		int len;
+struct iscsi_discovery_address *
+iscsi_discovery_cache_lookup(struct iscsi_context *iscsi, const char *portal)
+{
+	struct iscsi_discovery_address *targets;
+	struct iscsi_data data;
+	char line[MAX_STRING_SIZE * 2 + 64], *key;
+	size_t plen = strlen(portal);
+	time_t now = time(NULL);
+	long long when;
+	FILE *f;
+
+	if (!iscsi->discovery_cache[0]) {
+		return NULL;
+	}
+	f = fopen(iscsi->discovery_cache, "r");
+	if (f == NULL) {
+		return NULL;
+	}
 
-		end = memchr(ptr, 0, size);
-		if (end == NULL) {
-			iscsi_set_error(iscsi, "NUL not found after offset %ld "
-					"when parsing discovery data",
-					(long)(ptr - in->data));
-			if (pdu->callback) {
-				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-				              pdu->private_data);
-			}
-			iscsi_free_discovery_addresses(iscsi, targets);
-			return -1;
+	memset(&data, 0, sizeof(data));
+	while (fgets(line, sizeof(line), f) != NULL) {
+		line[strcspn(line, "\n")] = '\0';
+		if (strncmp(line, portal, plen) || line[plen] != ' ') {
+			continue;
 		}
-
-		len = end - ptr;
-		if (len == 0) {
+		when = strtoll(&line[plen + 1], &key, 10);
+		if (*key++ != ' ' || when + iscsi->discovery_cache_ttl < now) {
+			continue;
+		}
+		if (iscsi_add_data(iscsi, &data, (unsigned char *)key,
+				   strlen(key) + 1, 0) != 0) {
 			break;
 		}
+	}
+	fclose(f);
 
-		/* parse the strings */
-		if (!strncmp((char *)ptr, "TargetName=", 11)) {
-			struct iscsi_discovery_address *target;
+	if (data.size == 0) {
+		return NULL;
+	}
+	targets = iscsi_discovery_build(iscsi, data.data, data.size, 0);
+	iscsi_free(iscsi, data.data);
+	if (targets) {
+		ISCSI_LOG(iscsi, 2, "using the cached discovery of portal %s",
+			  portal);
+	}
+	return targets;
+}
 
-			target = iscsi_zmalloc(iscsi, sizeof(struct iscsi_discovery_address));
-			if (target == NULL) {
-				iscsi_set_error(iscsi, "Failed to allocate "
-						"data for new discovered "
-						"target");
-				if (pdu->callback) {
-					pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-					              pdu->private_data);
-				}
-				iscsi_free_discovery_addresses(iscsi, targets);
-				return -1;
-			}
-			target->target_name = iscsi_strdup(iscsi,(char *)ptr+11);
-			if (target->target_name == NULL) {
-				iscsi_set_error(iscsi, "Failed to allocate "
-						"data for new discovered "
-						"target name");
-				if (pdu->callback) {
-					pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-					              pdu->private_data);
-				}
-				iscsi_free(iscsi, target);
-				target = NULL;
-				iscsi_free_discovery_addresses(iscsi, targets);
-				return -1;
-			}
-			target->next = targets;
-			targets = target;
-		} else if (!strncmp((char *)ptr, "TargetAddress=", 14)) {
-			struct iscsi_target_portal *portal;
+static void
+iscsi_discovery_cache_save(struct iscsi_context *iscsi, const char *portal,
+			   struct iscsi_discovery_address *targets)
+{
+	struct iscsi_discovery_address *target;
+	struct iscsi_target_portal *tp;
+	char line[MAX_STRING_SIZE * 2 + 64];
+	char tmp[MAX_STRING_SIZE + 16];
+	size_t plen = strlen(portal);
+	long long now = (long long)time(NULL);
+	FILE *in, *out;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", iscsi->discovery_cache,
+		 (int)getpid());
+	out = fopen(tmp, "w");
+	if (out == NULL) {
+		ISCSI_LOG(iscsi, 1, "failed to write discovery cache %s: %s",
+			  tmp, strerror(errno));
+		return;
+	}
 
-			if (targets == NULL) {
-				iscsi_set_error(iscsi, "Invalid discovery "
-						"reply");
-				if (pdu->callback) {
-					pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-					              pdu->private_data);
-				}
-				iscsi_free_discovery_addresses(iscsi, targets);
-				return -1;
-			}
-			portal = iscsi_zmalloc(iscsi, sizeof(struct iscsi_target_portal));
-			if (portal == NULL) {
-				iscsi_set_error(iscsi, "Failed to malloc "
-						"portal structure");
-				if (pdu->callback) {
-					pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-					              pdu->private_data);
-				}
-				iscsi_free_discovery_addresses(iscsi, targets);
-				return -1;
+	/* what other portals reported */
+	in = fopen(iscsi->discovery_cache, "r");
+	if (in != NULL) {
+		while (fgets(line, sizeof(line), in) != NULL) {
+			if (!strncmp(line, portal, plen) && line[plen] == ' ') {
+				continue;
 			}
+			fputs(line, out);
+		}
+		fclose(in);
+	}
 
-			portal->next = targets->portals;
-			targets->portals = portal;
-
-			portal->portal = iscsi_strdup(iscsi, (char *)ptr+14);
-			if (portal->portal == NULL) {
-				iscsi_set_error(iscsi, "Failed to allocate "
-						"data for new discovered "
-						"target address");
-				if (pdu->callback) {
-					pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-					              pdu->private_data);
-				}
-				iscsi_free_discovery_addresses(iscsi, targets);
-				return -1;
-			}
-		} else {
-			iscsi_set_error(iscsi, "Don't know how to handle "
-					"discovery string : %s", ptr);
-			if (pdu->callback) {
-				pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
-				              pdu->private_data);
+	for (target = targets; target; target = target->next) {
+		fprintf(out, "%s %lld TargetName=%s\n", portal, now,
+			target->target_name);
+		for (tp = target->portals; tp; tp = tp->next) {
+			fprintf(out, "%s %lld TargetAddress=%s\n", portal, now,
+				tp->portal);
+		}
+	}
+
+	if (fclose(out) != 0 || rename(tmp, iscsi->discovery_cache) != 0) {
+		ISCSI_LOG(iscsi, 1, "failed to write discovery cache %s: %s",
+			  iscsi->discovery_cache, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+/*
+ * Ask for the rest of a SendTargets reply that did not fit in one PDU.
+ * What has arrived so far moves to the new request.
+ */
+static int
+iscsi_discovery_continue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			 uint32_t ttt)
+{
+	struct iscsi_pdu *next;
+
+	next = iscsi_allocate_pdu(iscsi, ISCSI_PDU_TEXT_REQUEST,
+				  ISCSI_PDU_TEXT_RESPONSE, pdu->itt,
+				  ISCSI_PDU_DROP_ON_RECONNECT);
+	if (next == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: Failed to allocate "
+				"text pdu.");
+		return -1;
+	}
+	iscsi_pdu_set_immediate(next);
+	iscsi_pdu_set_cmdsn(next, iscsi->cmdsn);
+	iscsi_pdu_set_pduflags(next, ISCSI_PDU_TEXT_FINAL);
+	iscsi_pdu_set_ttt(next, ttt);
+
+	next->callback     = pdu->callback;
+	next->private_data = pdu->private_data;
+	next->indata       = pdu->indata;
+	pdu->indata.data   = NULL;
+	pdu->indata.size   = 0;
+
+	iscsi_queue_pdu(iscsi, next);
+	return 0;
+}
+
+int
+iscsi_process_text_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+			 struct iscsi_in_pdu *in)
+{
+	struct iscsi_discovery_address *targets = NULL;
+	unsigned char *data = in->data;
+	/* data_pos includes the padding, which would end up inside a key
+	 * that is split between PDUs */
+	size_t size = iscsi_get_pdu_data_size(in->hdr);
+
+	/* verify the response looks sane */
+	if (in->hdr[1] != ISCSI_PDU_TEXT_FINAL
+	&&  in->hdr[1] != ISCSI_PDU_TEXT_CONTINUE
+	&&  in->hdr[1] != 0) {
+		iscsi_set_error(iscsi, "unsupported flags in text "
+				"reply %02x", in->hdr[1]);
+		goto failed;
+	}
+
+	/* a reply in several PDUs is put together in indata, the
+	 * keys can be split anywhere between them
+	 */
+	if (pdu->indata.size || in->hdr[1] != ISCSI_PDU_TEXT_FINAL) {
+		if (pdu->indata.size + size > ISCSI_DISCOVERY_MAX_SIZE) {
+			iscsi_set_error(iscsi, "discovery reply larger than "
+					"%d bytes", ISCSI_DISCOVERY_MAX_SIZE);
+			goto failed;
+		}
+		if (size && iscsi_add_data(iscsi, &pdu->indata, data,
+					   size, 0) != 0) {
+			goto failed;
+		}
+		if (in->hdr[1] != ISCSI_PDU_TEXT_FINAL) {
+			ISCSI_LOG(iscsi, 6, "text reply continues, %zu bytes "
+				  "so far", pdu->indata.size);
+			if (iscsi_discovery_continue(iscsi, pdu,
+					scsi_get_uint32(&in->hdr[20])) != 0) {
+				goto failed;
 			}
-			iscsi_free_discovery_addresses(iscsi, targets);
-			return -1;
+			return 0;
 		}
+		data = pdu->indata.data;
+		size = pdu->indata.size;
+	}
 
-		ptr  += len + 1;
-		size -= len + 1;
+	if (size && *data) {
+		targets = iscsi_discovery_build(iscsi, data, size, 1);
+		if (targets == NULL) {
+			goto failed;
+		}
 	}
 
+	if (targets && iscsi->discovery_cache[0]) {
+		iscsi_discovery_cache_save(iscsi, iscsi->connected_portal,
+					   targets);
+	}
 	if (pdu->callback) {
 		pdu->callback(iscsi, SCSI_STATUS_GOOD, targets, pdu->private_data);
 	}
-	iscsi_free_discovery_addresses(iscsi, targets);
+	free(targets);
 
 	return 0;
+
+ failed:
+	if (pdu->callback) {
+		pdu->callback(iscsi, SCSI_STATUS_ERROR, NULL,
+		              pdu->private_data);
+	}
+	return -1;
 }
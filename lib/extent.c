@@ -0,0 +1,427 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Provisioning status extent maps built with GET LBA STATUS.
+ *
+ * The range is cut into windows that are walked in parallel, each with
+ * one GET LBA STATUS in flight at a time. The extents of the first window
+ * that is not done yet go to the caller as they arrive, those of the
+ * windows after it are kept until it is their turn. Neighbouring extents
+ * with the same provisioning status are merged.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+#define EXTENT_WINDOW_BLOCKS	(1ULL << 21)
+#define EXTENT_WINDOWS		8
+#define EXTENT_ALLOC_LEN	(8 + 16 * 255)
+
+struct iscsi_extent_window {
+	struct iscsi_extent_window *next;
+	struct iscsi_extent_map *map;
+	uint64_t pos;		/* first LBA we do not know about yet */
+	uint64_t end;
+	struct scsi_task *task;	/* the GET LBA STATUS in flight */
+	struct iscsi_lba_extent *extents;
+	int count;
+	int alloc;
+};
+
+struct iscsi_extent_map {
+	struct iscsi_context *iscsi;
+	int lun;
+	iscsi_extent_cb cb;
+	void *private_data;
+
+	uint64_t next;		/* start of the next window */
+	uint64_t end;
+	struct iscsi_extent_window *windows;	/* in LBA order */
+	int nwindows;
+
+	struct iscsi_lba_extent cur;	/* being merged into */
+	struct iscsi_lba_extent *out;
+	int nout;
+	int outalloc;
+
+	int unsupported;	/* the LUN has no GET LBA STATUS */
+	int failed;
+	int busy;		/* inside a callback of ours */
+};
+
+static int
+iscsi_extent_append(struct iscsi_lba_extent **extents, int *count,
+		    int *alloc, struct iscsi_lba_extent *e)
+{
+	if (*count == *alloc) {
+		int n = *alloc ? *alloc * 2 : 64;
+		struct iscsi_lba_extent *p;
+
+		p = realloc(*extents, n * sizeof(*p));
+		if (p == NULL) {
+			return -1;
+		}
+		*extents = p;
+		*alloc = n;
+	}
+	(*extents)[(*count)++] = *e;
+	return 0;
+}
+
+/* Add an extent to what goes to the caller next. */
+static int
+iscsi_extent_emit(struct iscsi_extent_map *map, struct iscsi_lba_extent *e)
+{
+	struct iscsi_lba_extent *cur = &map->cur;
+
+	if (cur->num_blocks > 0 && cur->provisioning == e->provisioning &&
+	    cur->lba + cur->num_blocks == e->lba) {
+		cur->num_blocks += e->num_blocks;
+		return 0;
+	}
+	if (cur->num_blocks > 0 &&
+	    iscsi_extent_append(&map->out, &map->nout, &map->outalloc,
+				cur) != 0) {
+		return -1;
+	}
+	*cur = *e;
+	return 0;
+}
+
+static void
+iscsi_extent_free(struct iscsi_extent_map *map)
+{
+	while (map->windows) {
+		struct iscsi_extent_window *w = map->windows;
+
+		ISCSI_LIST_REMOVE(&map->windows, w);
+		free(w->extents);
+		free(w);
+	}
+	free(map->out);
+	free(map);
+}
+
+static void
+iscsi_extent_gls_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data);
+
+static int
+iscsi_extent_send(struct iscsi_extent_window *w)
+{
+	struct iscsi_extent_map *map = w->map;
+
+	w->task = iscsi_get_lba_status_task(map->iscsi, map->lun, w->pos,
+					    EXTENT_ALLOC_LEN,
+					    iscsi_extent_gls_cb, w);
+	return w->task ? 0 : -1;
+}
+
+/* Keep EXTENT_WINDOWS windows going. */
+static int
+iscsi_extent_open_windows(struct iscsi_extent_map *map)
+{
+	while (map->nwindows < EXTENT_WINDOWS && map->next < map->end) {
+		struct iscsi_extent_window *w;
+
+		w = calloc(1, sizeof(*w));
+		if (w == NULL) {
+			iscsi_set_error(map->iscsi, "Out-of-memory: failed to "
+					"allocate extent window");
+			return -1;
+		}
+		w->map = map;
+		w->pos = map->next;
+		w->end = map->end - map->next > EXTENT_WINDOW_BLOCKS ?
+			map->next + EXTENT_WINDOW_BLOCKS : map->end;
+		map->next = w->end;
+		ISCSI_LIST_ADD_END(&map->windows, w);
+		map->nwindows++;
+		if (map->unsupported) {
+			struct iscsi_lba_extent e;
+
+			e.lba = w->pos;
+			e.num_blocks = w->end - w->pos;
+			e.provisioning = SCSI_PROVISIONING_TYPE_MAPPED;
+			if (iscsi_extent_append(&w->extents, &w->count,
+						&w->alloc, &e) != 0) {
+				return -1;
+			}
+			w->pos = w->end;
+			continue;
+		}
+		if (iscsi_extent_send(w) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Hand whatever is ready to the caller, and the final status if done.
+ * Returns 1 if the map is done with and has been freed.
+ */
+static int
+iscsi_extent_deliver(struct iscsi_extent_map *map, int status)
+{
+	struct iscsi_extent_window *w;
+	int i;
+
+	while (status == SCSI_STATUS_GOOD) {
+		/* the extents of the windows that are next in line */
+		while ((w = map->windows) != NULL) {
+			for (i = 0; i < w->count; i++) {
+				if (iscsi_extent_emit(map, &w->extents[i])) {
+					status = SCSI_STATUS_ERROR;
+				}
+			}
+			w->count = 0;
+			if (w->pos < w->end) {
+				break;
+			}
+			ISCSI_LIST_REMOVE(&map->windows, w);
+			map->nwindows--;
+			free(w->extents);
+			free(w);
+		}
+		if (status == SCSI_STATUS_GOOD &&
+		    iscsi_extent_open_windows(map) != 0) {
+			status = SCSI_STATUS_ERROR;
+		}
+		/* windows of a LUN without GET LBA STATUS are done at once */
+		if (map->windows == NULL ||
+		    map->windows->pos < map->windows->end) {
+			break;
+		}
+	}
+	if (status == SCSI_STATUS_GOOD && map->windows == NULL &&
+	    map->cur.num_blocks > 0) {
+		/* that was the last one */
+		if (iscsi_extent_append(&map->out, &map->nout,
+					&map->outalloc, &map->cur) != 0) {
+			status = SCSI_STATUS_ERROR;
+		}
+		map->cur.num_blocks = 0;
+	}
+
+	if (status != SCSI_STATUS_GOOD) {
+		map->failed = 1;
+		map->cb(map->iscsi, status, NULL, 0, map->private_data);
+
+		/* the callbacks of the cancelled ones only drop them */
+		map->busy++;
+		for (w = map->windows; w; w = w->next) {
+			if (w->task != NULL) {
+				iscsi_scsi_cancel_task(map->iscsi, w->task);
+			}
+		}
+		map->busy--;
+		return 0;
+	}
+
+	if (map->nout > 0) {
+		map->cb(map->iscsi, SCSI_STATUS_GOOD, map->out, map->nout,
+			map->private_data);
+		map->nout = 0;
+	}
+	if (map->windows == NULL) {
+		map->cb(map->iscsi, SCSI_STATUS_GOOD, NULL, 0,
+			map->private_data);
+		iscsi_extent_free(map);
+		return 1;
+	}
+	return 0;
+}
+
+/* Are there any GET LBA STATUS left in flight? */
+static int
+iscsi_extent_in_flight(struct iscsi_extent_map *map)
+{
+	struct iscsi_extent_window *w;
+
+	for (w = map->windows; w; w = w->next) {
+		if (w->task != NULL) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_extent_gls_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_extent_window *w = private_data;
+	struct iscsi_extent_map *map = w->map;
+	struct scsi_task *task = command_data;
+	struct scsi_get_lba_status *gls = NULL;
+	struct iscsi_lba_extent e;
+	uint64_t pos = w->pos;
+	uint32_t i;
+
+	w->task = NULL;
+	if (map->failed) {
+		scsi_free_scsi_task(task);
+		if (!map->busy && !iscsi_extent_in_flight(map)) {
+			iscsi_extent_free(map);
+		}
+		return;
+	}
+
+	if (status == SCSI_STATUS_GOOD) {
+		gls = scsi_datain_unmarshall(task);
+	}
+	if (status == SCSI_STATUS_CHECK_CONDITION &&
+	    task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST) {
+		/* no GET LBA STATUS, everything is mapped as far as we know */
+		ISCSI_LOG(iscsi, 2, "GET LBA STATUS not supported, treating "
+			  "lba %" PRIu64 "-%" PRIu64 " as mapped", w->pos,
+			  map->end - 1);
+		map->unsupported = 1;
+		e.lba = w->pos;
+		e.num_blocks = w->end - w->pos;
+		e.provisioning = SCSI_PROVISIONING_TYPE_MAPPED;
+		if (iscsi_extent_append(&w->extents, &w->count, &w->alloc,
+					&e) != 0) {
+			status = SCSI_STATUS_ERROR;
+		} else {
+			status = SCSI_STATUS_GOOD;
+		}
+		pos = w->end;
+	} else if (status == SCSI_STATUS_GOOD && gls == NULL) {
+		iscsi_set_error(iscsi, "failed to unmarshall GET LBA STATUS "
+				"data");
+		status = SCSI_STATUS_ERROR;
+	}
+
+	for (i = 0; gls != NULL && i < gls->num_descriptors; i++) {
+		struct scsi_lba_status_descriptor *d = &gls->descriptors[i];
+		uint64_t end = d->lba + d->num_blocks;
+
+		/* the descriptors may start before the LBA we asked for */
+		if (end <= pos || d->lba > pos) {
+			continue;
+		}
+		if (end > w->end) {
+			end = w->end;
+		}
+		e.lba = pos;
+		e.num_blocks = end - pos;
+		e.provisioning = d->provisioning;
+		if (iscsi_extent_append(&w->extents, &w->count, &w->alloc,
+					&e) != 0) {
+			status = SCSI_STATUS_ERROR;
+			break;
+		}
+		pos = end;
+		if (pos == w->end) {
+			break;
+		}
+	}
+	scsi_free_scsi_task(task);
+
+	if (status == SCSI_STATUS_GOOD && pos == w->pos) {
+		iscsi_set_error(iscsi, "GET LBA STATUS did not describe lba "
+				"%" PRIu64, w->pos);
+		status = SCSI_STATUS_ERROR;
+	}
+	w->pos = pos;
+	if (status == SCSI_STATUS_GOOD && w->pos < w->end &&
+	    iscsi_extent_send(w) != 0) {
+		status = SCSI_STATUS_ERROR;
+	}
+
+	if (status != SCSI_STATUS_GOOD || w == map->windows) {
+		if (iscsi_extent_deliver(map, status)) {
+			return;
+		}
+		if (map->failed && !iscsi_extent_in_flight(map)) {
+			iscsi_extent_free(map);
+		}
+	}
+}
+
+struct iscsi_extent_map *
+iscsi_extent_map_async(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint64_t num_blocks, iscsi_extent_cb cb,
+		       void *private_data)
+{
+	struct iscsi_extent_map *map;
+
+	if (num_blocks == 0) {
+		iscsi_set_error(iscsi, "Empty extent map range");
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(*map));
+	if (map == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"extent map");
+		return NULL;
+	}
+	map->iscsi = iscsi;
+	map->lun = lun;
+	map->cb = cb;
+	map->private_data = private_data;
+	map->next = lba;
+	map->end = lba + num_blocks;
+
+	if (iscsi_extent_open_windows(map) != 0) {
+		struct iscsi_extent_window *w;
+
+		/* the GET LBA STATUS sent so far only drop the map */
+		map->failed = 1;
+		map->busy++;
+		for (w = map->windows; w; w = w->next) {
+			if (w->task != NULL) {
+				iscsi_scsi_cancel_task(iscsi, w->task);
+			}
+		}
+		map->busy--;
+		if (!iscsi_extent_in_flight(map)) {
+			iscsi_extent_free(map);
+		}
+		return NULL;
+	}
+	return map;
+}
+
+void
+iscsi_extent_map_cancel(struct iscsi_context *iscsi,
+			struct iscsi_extent_map *map)
+{
+	if (map->failed) {
+		return;
+	}
+	iscsi_extent_deliver(map, SCSI_STATUS_CANCELLED);
+	if (!iscsi_extent_in_flight(map)) {
+		iscsi_extent_free(map);
+	}
+}
@@ -62,6 +62,11 @@ int iscsi_init_transport(struct iscsi_context *iscsi,
 	case ISER_TRANSPORT:
 		iscsi_init_iser_transport(iscsi);
 		break;
+#endif
+#ifdef HAVE_KTLS
+	case TLS_TRANSPORT:
+		iscsi_init_tls_transport(iscsi);
+		break;
 #endif
 	default:
 		iscsi_set_error(iscsi, "Unfamiliar transport type");
@@ -180,6 +185,7 @@ iscsi_create_context(const char *initiator_name)
 
         iscsi_mt_spin_init(&iscsi->iscsi_lock, PTHREAD_PROCESS_PRIVATE);
         iscsi_mt_mutex_init(&iscsi->iscsi_mutex);
+        iscsi_mt_spin_init(&iscsi->log_lock, PTHREAD_PROCESS_PRIVATE);
         iscsi->poll_timeout = 100;
 
 	/* initalize transport of context */
@@ -217,6 +223,9 @@ iscsi_create_context(const char *initiator_name)
 	iscsi->tcp_keepidle=30;
 
 	iscsi->reconnect_max_retries = -1;
+	iscsi->reconnect_backoff_min_ms = 100;
+	iscsi->reconnect_backoff_max_ms = 30000;
+	iscsi->discard_queue_depth = 8;
         iscsi->chap_auth = ISCSI_CHAP_MD5;
 
 	if (getenv("LIBISCSI_DEBUG") != NULL) {
@@ -224,6 +233,14 @@ iscsi_create_context(const char *initiator_name)
 		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
 	}
 
+	if (getenv("LIBISCSI_LOG_ASYNC") != NULL) {
+		iscsi_log_async_start(atoi(getenv("LIBISCSI_LOG_ASYNC")), 1);
+	}
+
+	if (getenv("LIBISCSI_LOG_RATE_LIMIT") != NULL) {
+		iscsi_set_log_rate_limit(iscsi, atoi(getenv("LIBISCSI_LOG_RATE_LIMIT")));
+	}
+
 	if (getenv("LIBISCSI_TCP_USER_TIMEOUT") != NULL) {
 		iscsi_set_tcp_user_timeout(iscsi,atoi(getenv("LIBISCSI_TCP_USER_TIMEOUT")));
 	}
@@ -244,6 +261,18 @@ iscsi_create_context(const char *initiator_name)
 		iscsi_set_tcp_syncnt(iscsi,atoi(getenv("LIBISCSI_TCP_SYNCNT")));
 	}
 
+	if (getenv("LIBISCSI_TCP_ZEROCOPY") != NULL) {
+		iscsi_set_tcp_zerocopy(iscsi,atoi(getenv("LIBISCSI_TCP_ZEROCOPY")));
+	}
+
+	if (getenv("LIBISCSI_BUSY_POLL") != NULL) {
+		iscsi_set_busy_poll(iscsi,atoi(getenv("LIBISCSI_BUSY_POLL")),0);
+	}
+
+	if (getenv("LIBISCSI_TLS_CA_FILE") != NULL) {
+		iscsi_set_tls_ca_file(iscsi,getenv("LIBISCSI_TLS_CA_FILE"));
+	}
+
 	if (getenv("LIBISCSI_BIND_INTERFACES") != NULL) {
 		iscsi_set_bind_interfaces(iscsi,getenv("LIBISCSI_BIND_INTERFACES"));
 	}
@@ -252,6 +281,34 @@ iscsi_create_context(const char *initiator_name)
 		iscsi->rdma_ack_timeout = atoi(getenv("LIBISCSI_RDMA_ACK_TIMEOUT"));
 	}
 
+	if (getenv("LIBISCSI_RDMA_MR_CACHE") != NULL) {
+		iscsi_set_rdma_mr_cache(iscsi,atoi(getenv("LIBISCSI_RDMA_MR_CACHE")));
+	}
+
+	if (getenv("LIBISCSI_READ_CACHE") != NULL) {
+		iscsi_set_read_cache(iscsi,
+				     strtoull(getenv("LIBISCSI_READ_CACHE"), NULL, 0),
+				     128 * 1024);
+	}
+
+	if (getenv("LIBISCSI_AUTO_SPLIT") != NULL) {
+		iscsi_set_auto_split(iscsi, atoi(getenv("LIBISCSI_AUTO_SPLIT")));
+	}
+
+	if (getenv("LIBISCSI_WRITE_COALESCING") != NULL) {
+		iscsi_set_write_coalescing(iscsi,
+					   strtoul(getenv("LIBISCSI_WRITE_COALESCING"), NULL, 0),
+					   200);
+	}
+
+	if (getenv("LIBISCSI_PDU_TRACE") != NULL) {
+		iscsi_set_pdu_trace(iscsi, atoi(getenv("LIBISCSI_PDU_TRACE")));
+	}
+
+	if (getenv("LIBISCSI_RECORD") != NULL) {
+		iscsi->record_env = 1;
+	}
+
 	ca = getenv("LIBISCSI_CACHE_ALLOCATIONS");
 	if (!ca || atoi(ca) != 0) {
 		iscsi->cache_allocations = 1;
@@ -374,8 +431,20 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
 	iscsi_disconnect(iscsi);
 
+	/* the held writes are sent, and cancelled, with everything else */
+	iscsi_set_write_coalescing(iscsi, 0, 0);
+
 	iscsi_cancel_pdus(iscsi);
 
+	iscsi_run_completions(iscsi);
+	iscsi_set_read_cache(iscsi, 0, 0);
+	iscsi_lun_limits_free(iscsi);
+	iscsi_tcp_portal_cache_free(iscsi);
+	iscsi_destroy_login_cache(iscsi->login_cache);
+	iscsi->login_cache = NULL;
+	iscsi_set_pdu_trace(iscsi, 0);
+	iscsi_set_command_record(iscsi, NULL);
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	if (iscsi->outqueue_current != NULL && iscsi->outqueue_current->flags & ISCSI_PDU_DELETE_WHEN_SENT) {
 		iscsi->drv->free_pdu(iscsi, iscsi->outqueue_current);
@@ -390,6 +459,13 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
 	iscsi_free(iscsi, iscsi->opaque);
 
+	while (iscsi->rdma_bufs) {
+		struct iscsi_rdma_buf *b = iscsi->rdma_bufs;
+
+		ISCSI_LIST_REMOVE(&iscsi->rdma_bufs, b);
+		free(b);
+	}
+
 	if (iscsi->mallocs != iscsi->frees) {
 		ISCSI_LOG(iscsi,1,"%d memory blocks lost at iscsi_destroy_context() after %d malloc(s), %d realloc(s), %d free(s)",iscsi->mallocs-iscsi->frees,iscsi->mallocs,iscsi->reallocs,iscsi->frees);
 	} else {
@@ -403,6 +479,7 @@ iscsi_destroy_context(struct iscsi_context *iscsi)
 
         iscsi_mt_spin_destroy(&iscsi->iscsi_lock);
         iscsi_mt_mutex_destroy(&iscsi->iscsi_mutex);
+        iscsi_mt_spin_destroy(&iscsi->log_lock);
 
 	memset(iscsi, 0, sizeof(struct iscsi_context));
 	free(iscsi);
@@ -549,6 +626,9 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
 #ifdef HAVE_LINUX_ISER
 	int is_iser = 0;
 #endif
+#ifdef HAVE_KTLS
+	int is_tls = 0;
+#endif
 
 	if (strncmp(url, "iscsi://", 8)
 #ifdef HAVE_LINUX_ISER
@@ -642,6 +722,10 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
 				target_user = value;
 			} else if (!strcmp(key, "target_password")) {
 				target_passwd = value;
+#ifdef HAVE_KTLS
+			} else if (!strcmp(key, "tls")) {
+				is_tls = 1;
+#endif
 #ifdef HAVE_LINUX_ISER
 			} else if (!strcmp(key, "iser")) {
 				is_iser = 1;
@@ -754,6 +838,14 @@ iscsi_parse_url(struct iscsi_context *iscsi, const char *url, int full)
 	iscsi_url->transport = is_iser;
 #endif
 
+#ifdef HAVE_KTLS
+	if (is_tls) {
+		if (iscsi && iscsi_init_transport(iscsi, TLS_TRANSPORT))
+			iscsi_set_error(iscsi, "Cannot set transport to TLS");
+		iscsi_url->transport = TLS_TRANSPORT;
+	}
+#endif
+
 	if (full) {
 		strncpy(iscsi_url->target, target, MAX_STRING_SIZE);
 		iscsi_url->lun = l;
@@ -854,6 +946,25 @@ iscsi_set_initial_r2t(struct iscsi_context *iscsi, enum iscsi_initial_r2t initia
 	return 0;
 }
 
+int
+iscsi_set_error_recovery_level(struct iscsi_context *iscsi,
+			       enum iscsi_error_recovery_level level)
+{
+	if (iscsi->is_loggedin != 0) {
+		iscsi_set_error(iscsi, "Already logged in when trying to set error_recovery_level");
+		return -1;
+	}
+	if (level != ISCSI_ERROR_RECOVERY_LEVEL_0 &&
+	    level != ISCSI_ERROR_RECOVERY_LEVEL_1) {
+		iscsi_set_error(iscsi, "Unsupported error_recovery_level %d",
+				level);
+		return -1;
+	}
+
+	iscsi->want_error_recovery_level = level;
+	return 0;
+}
+
 int
 iscsi_set_timeout(struct iscsi_context *iscsi, int timeout)
 {
@@ -870,6 +981,68 @@ iscsi_set_fd_dup_cb(struct iscsi_context *iscsi,
 	iscsi->fd_dup_opaque = opaque;
 }
 
+void
+iscsi_set_rdma_mr_cache(struct iscsi_context *iscsi, int entries)
+{
+	iscsi->rdma_mr_cache_max = entries;
+	ISCSI_LOG(iscsi, 2, "RDMA MR cache size set to %d", entries);
+}
+
+int
+iscsi_register_buffer(struct iscsi_context *iscsi, void *buf, size_t len)
+{
+	struct iscsi_rdma_buf *b;
+
+	b = malloc(sizeof(*b));
+	if (b == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"buffer registration");
+		return -1;
+	}
+	b->buf = buf;
+	b->len = len;
+
+#ifdef HAVE_LINUX_ISER
+	if (iscsi->transport == ISER_TRANSPORT &&
+	    iser_mr_register(iscsi, buf, len) != 0) {
+		free(b);
+		return -1;
+	}
+#endif
+
+	ISCSI_LIST_ADD(&iscsi->rdma_bufs, b);
+	ISCSI_LOG(iscsi, 2, "registered buffer %p, %zu bytes", buf, len);
+	return 0;
+}
+
+int
+iscsi_unregister_buffer(struct iscsi_context *iscsi, void *buf, size_t len)
+{
+	struct iscsi_rdma_buf *b;
+
+	for (b = iscsi->rdma_bufs; b; b = b->next) {
+		if (b->buf == buf && b->len == len) {
+			break;
+		}
+	}
+	if (b == NULL) {
+		iscsi_set_error(iscsi, "Buffer %p, %zu bytes is not registered",
+				buf, len);
+		return -1;
+	}
+
+#ifdef HAVE_LINUX_ISER
+	if (iscsi->transport == ISER_TRANSPORT) {
+		iser_mr_unregister(iscsi, buf, len);
+	}
+#endif
+
+	ISCSI_LIST_REMOVE(&iscsi->rdma_bufs, b);
+	free(b);
+	ISCSI_LOG(iscsi, 2, "unregistered buffer %p", buf);
+	return 0;
+}
+
 enum iscsi_chap_auth
 iscsi_get_auth(struct iscsi_context *iscsi)
 {
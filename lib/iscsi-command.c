@@ -35,6 +35,7 @@
 #include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-probes.h"
 #include "scsi-lowlevel.h"
 #include "slist.h"
 
@@ -57,20 +58,29 @@ iscsi_scsi_response_cb(struct iscsi_context *iscsi, int status,
 	case SCSI_STATUS_ERROR:
 	case SCSI_STATUS_CANCELLED:
 	case SCSI_STATUS_TIMEOUT:
-		scsi_cbdata->task->status = status;
-		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
-			                      scsi_cbdata->private_data);
-		}
-		return;
+		break;
 	default:
-		scsi_cbdata->task->status = SCSI_STATUS_ERROR;
 		iscsi_set_error(iscsi, "Cant handle  scsi status %d yet.",
 		                status);
-		if (scsi_cbdata->callback) {
-			scsi_cbdata->callback(iscsi, SCSI_STATUS_ERROR, scsi_cbdata->task,
-			                      scsi_cbdata->private_data);
-		}
+		status = SCSI_STATUS_ERROR;
+	}
+
+	/* the kernel may still be sending from the task buffers, also if
+	 * the task failed, timed out or was cancelled */
+	if (iscsi->zc_sends != NULL &&
+	    iscsi_tcp_zerocopy_defer(iscsi, scsi_cbdata->task, status,
+				     scsi_cbdata->callback,
+				     scsi_cbdata->private_data)) {
+		return;
+	}
+
+	scsi_cbdata->task->status = status;
+	ISCSI_PROBE6(command_complete, iscsi, scsi_cbdata->task,
+		     scsi_cbdata->task->itt, scsi_cbdata->task->cmdsn,
+		     status, scsi_cbdata->task->residual);
+	if (scsi_cbdata->callback) {
+		scsi_cbdata->callback(iscsi, status, scsi_cbdata->task,
+		                      scsi_cbdata->private_data);
 	}
 }
 
@@ -164,6 +174,69 @@ int
 iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 			 struct scsi_task *task, iscsi_command_cb cb,
 			 struct iscsi_data *d, void *private_data)
+{
+	ISCSI_PROBE5(command_submit, iscsi, task, lun, task->cdb[0],
+		     task->expxferlen);
+
+	if (iscsi->recorder != NULL) {
+		iscsi_record_command(iscsi, lun, task, &cb, &private_data);
+	}
+
+	if (iscsi->coalesce != NULL) {
+		int ret;
+
+		ret = iscsi_coalesce_command(iscsi, lun, task, cb, d,
+					     private_data);
+		if (ret != 1) {
+			return ret;
+		}
+	}
+
+	return iscsi_scsi_command_submit(iscsi, lun, task, cb, d,
+					 private_data);
+}
+
+int
+iscsi_scsi_command_submit(struct iscsi_context *iscsi, int lun,
+			  struct scsi_task *task, iscsi_command_cb cb,
+			  struct iscsi_data *d, void *private_data)
+{
+	int ret;
+
+	if (iscsi->auto_split) {
+		ret = iscsi_split_command(iscsi, lun, task, cb, d,
+					  private_data);
+		if (ret != 1) {
+			return ret;
+		}
+	}
+
+	return iscsi_scsi_command_unsplit(iscsi, lun, task, cb, d,
+					  private_data);
+}
+
+int
+iscsi_scsi_command_unsplit(struct iscsi_context *iscsi, int lun,
+			   struct scsi_task *task, iscsi_command_cb cb,
+			   struct iscsi_data *d, void *private_data)
+{
+	int ret;
+
+	if (iscsi->read_cache != NULL) {
+		ret = iscsi_cache_command(iscsi, lun, task, cb, d,
+					  private_data);
+		if (ret != 1) {
+			return ret;
+		}
+	}
+
+	return iscsi_scsi_command_queue(iscsi, lun, task, cb, d, private_data);
+}
+
+int
+iscsi_scsi_command_queue(struct iscsi_context *iscsi, int lun,
+			 struct scsi_task *task, iscsi_command_cb cb,
+			 struct iscsi_data *d, void *private_data)
 {
 	struct iscsi_pdu *pdu;
 	int flags;
@@ -280,6 +353,8 @@ iscsi_scsi_command_async(struct iscsi_context *iscsi, int lun,
 	/* cdb */
 	iscsi_pdu_set_cdb(pdu, task);
 
+	ISCSI_PROBE5(command_queue, iscsi, task, pdu->itt, pdu->cmdsn, lun);
+
 	iscsi_queue_pdu(iscsi, pdu);
 
 	/* The F flag is not set. This means we haven't sent all the unsolicited
@@ -506,17 +581,50 @@ iscsi_process_scsi_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	return 0;
 }
 
+/*
+ * Data-In goes where its buffer offset says, which is the end of what there
+ * is unless a retransmission fills a hole.
+ */
+static int
+iscsi_place_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    uint32_t offset, const unsigned char *data, int dsl)
+{
+	size_t end = (size_t)offset + dsl;
+	unsigned char *buf;
+
+	if (offset == pdu->indata.size) {
+		return iscsi_add_data(iscsi, &pdu->indata, data, dsl, 0);
+	}
+	if (end > pdu->indata.size) {
+		if (pdu->indata.size == 0) {
+			buf = iscsi_malloc(iscsi, end);
+		} else {
+			buf = iscsi_realloc(iscsi, pdu->indata.data, end);
+		}
+		if (buf == NULL) {
+			return -1;
+		}
+		memset(buf + pdu->indata.size, 0, end - pdu->indata.size);
+		pdu->indata.data = buf;
+		pdu->indata.size = end;
+	}
+	memcpy(pdu->indata.data + offset, data, dsl);
+	return 0;
+}
+
 int
 iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			   struct iscsi_in_pdu *in, int *is_finished)
 {
-	uint32_t flags, status;
+	uint32_t flags, status, datasn;
 	struct iscsi_scsi_cbdata *scsi_cbdata = &pdu->scsi_cbdata;
 	struct scsi_task *task = scsi_cbdata->task;
-	int dsl;
+	unsigned char *hdr = in->hdr;
+	int dsl, ret;
 
 	flags = in->hdr[1];
-	if ((flags&ISCSI_PDU_DATA_ACK_REQUESTED) != 0) {
+	if ((flags&ISCSI_PDU_DATA_ACK_REQUESTED) != 0 &&
+	    iscsi->error_recovery_level == ISCSI_ERROR_RECOVERY_LEVEL_0) {
 		iscsi_set_error(iscsi, "scsi response asked for ACK "
 				"0x%02x.", flags);
 		if (pdu->callback) {
@@ -526,16 +634,37 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		return -1;
 	}
 	dsl = scsi_get_uint32(&in->hdr[4]) & 0x00ffffff;
+	datasn = scsi_get_uint32(&in->hdr[36]);
+
+	if (iscsi->error_recovery_level != ISCSI_ERROR_RECOVERY_LEVEL_0) {
+		ret = iscsi_snack_data_in(iscsi, pdu, datasn);
+		if (ret < 0) {
+			return -1;
+		}
+		if (ret > 0) {
+			/* a duplicate */
+			*is_finished = 0;
+			return 0;
+		}
+	}
 
 	/* Don't add to reassembly buffer if we already have a user buffer */
-	if (task->iovector_in.iov == NULL) {
-		if (iscsi_add_data(iscsi, &pdu->indata, in->data, dsl, 0) != 0) {
+	if (task->iovector_in.iov == NULL && dsl > 0) {
+		if (iscsi_place_data_in(iscsi, pdu, scsi_get_uint32(&in->hdr[40]),
+					in->data, dsl) != 0) {
 		    iscsi_set_error(iscsi, "Out-of-memory: failed to add data "
 				"to pdu in buffer.");
 			return -1;
 		}
 	}
 
+	if ((flags&ISCSI_PDU_DATA_ACK_REQUESTED) != 0 &&
+	    iscsi_send_snack(iscsi, ISCSI_SNACK_DATA_ACK, 0xffffffff,
+			     scsi_get_uint32(&in->hdr[20]), pdu->lun,
+			     datasn + 1, 0) != 0) {
+		return -1;
+	}
+
 	if ((flags&ISCSI_PDU_DATA_FINAL) == 0) {
 		*is_finished = 0;
 	}
@@ -543,6 +672,27 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		*is_finished = 0;
 	}
 
+	if (pdu->datasn_missing != 0) {
+		/* the status waits for the Data-In that was asked for again */
+		if (*is_finished) {
+			pdu->status_hdr = iscsi_malloc(iscsi, ISCSI_RAW_HEADER_SIZE);
+			if (pdu->status_hdr == NULL) {
+				iscsi_set_error(iscsi, "Out-of-memory: failed "
+						"to save data-in status");
+				return -1;
+			}
+			memcpy(pdu->status_hdr, in->hdr, ISCSI_RAW_HEADER_SIZE);
+		}
+		*is_finished = 0;
+		return 0;
+	}
+	if (*is_finished == 0 && pdu->status_hdr != NULL) {
+		/* that was the last one missing */
+		hdr = pdu->status_hdr;
+		flags = hdr[1];
+		*is_finished = 1;
+	}
+
 	if (*is_finished == 0) {
 		return 0;
 	}
@@ -554,7 +704,7 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	 * These flags should only be set if the S flag is also set
 	 */
 	if (flags & (ISCSI_PDU_DATA_RESIDUAL_OVERFLOW|ISCSI_PDU_DATA_RESIDUAL_UNDERFLOW)) {
-		task->residual = scsi_get_uint32(&in->hdr[44]);
+		task->residual = scsi_get_uint32(&hdr[44]);
 		if (flags & ISCSI_PDU_DATA_RESIDUAL_UNDERFLOW) {
 			task->residual_status = SCSI_RESIDUAL_UNDERFLOW;
 		} else {
@@ -566,7 +716,7 @@ iscsi_process_scsi_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	/* this was the final data-in packet in the sequence and it has
 	 * the s-bit set, so invoke the callback.
 	 */
-	status = in->hdr[3];
+	status = hdr[3];
 	task->datain.data = pdu->indata.data;
 	task->datain.size = pdu->indata.size;
 
@@ -596,6 +746,11 @@ iscsi_process_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	offset = scsi_get_uint32(&in->hdr[40]);
 	len    = scsi_get_uint32(&in->hdr[44]);
 
+	if (iscsi->error_recovery_level != ISCSI_ERROR_RECOVERY_LEVEL_0 &&
+	    iscsi_snack_r2t(iscsi, pdu, scsi_get_uint32(&in->hdr[36])) != 0) {
+		return -1;
+	}
+
 	pdu->datasn = 0;
 	iscsi_send_data_out(iscsi, pdu, ttt, offset, len);
 	return 0;
@@ -2691,6 +2846,23 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 	uint32_t cmdsn_gap = 0;
 	int ret = -1;
 
+	/* served by the read cache */
+	if (iscsi_cancel_completion(iscsi, task) == 0) {
+		return 0;
+	}
+	if (iscsi->read_cache != NULL &&
+	    iscsi_cache_cancel_task(iscsi, task) == 0) {
+		return 0;
+	}
+	if (iscsi->coalesce != NULL &&
+	    iscsi_coalesce_cancel_task(iscsi, task) == 0) {
+		return 0;
+	}
+	if (iscsi->splits != NULL &&
+	    iscsi_split_cancel_task(iscsi, task) == 0) {
+		return 0;
+	}
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
 		if (pdu->itt == task->itt) {
@@ -2726,7 +2898,7 @@ iscsi_scsi_cancel_task(struct iscsi_context *iscsi,
 				      pdu->private_data);
                 }
                 if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-                    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+                    ISCSI_PDU_HAS_CMDSN(pdu)) {
                         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
                         iscsi->cmdsn--;
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
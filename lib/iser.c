@@ -62,6 +62,8 @@ union socket_address {
 static int cq_handle(struct iser_conn *iser_conn);
 static int iscsi_iser_revive_queued_pdus(struct iscsi_context *iscsi);
 static int iscsi_iser_cm_event(struct iscsi_context *iscsi);
+static void iser_large_pool_trim(struct iscsi_context *iscsi,
+				 struct iser_conn *iser_conn);
 
 /*
  * iscsi_iser_get_fd() - Return completion queue
@@ -105,7 +107,7 @@ iscsi_iser_service(struct iscsi_context *iscsi, int revents)
 	struct iser_conn *iser_conn = iscsi->opaque;
 
 	if (iscsi->pending_reconnect) {
-		if (time(NULL) >= iscsi->next_reconnect) {
+		if (iscsi_clock_us() >= iscsi->next_reconnect) {
 			return iscsi_reconnect(iscsi);
 		} else {
 			if (iscsi->old_iscsi) {
@@ -127,6 +129,8 @@ iscsi_iser_service(struct iscsi_context *iscsi, int revents)
 		return iscsi_service_reconnect_if_loggedin(iscsi);
 	}
 
+	iser_large_pool_trim(iscsi, iser_conn);
+
 	return iscsi_iser_revive_queued_pdus(iscsi);
 }
 
@@ -204,24 +208,449 @@ iser_buf_chunk_alloc(struct iser_buf_chunk *chunk, int want) {
 	return result;
 }
 
+/*
+ * Registration cache of application memory.
+ *
+ * Entries are kept sorted by start address and never overlap, so the
+ * registration covering a buffer is found with a binary search. Entries
+ * created by iscsi_register_buffer() are pinned, others are created on
+ * demand when the cache is enabled and evicted in LRU order once there
+ * are more than iscsi->rdma_mr_cache_max of them.
+ */
+static int
+iser_mr_cache_find(struct iser_mr_cache *cache, uintptr_t addr)
+{
+	int lo = 0, hi = cache->count - 1, found = -1;
+
+	/* last entry starting at or below addr */
+	while (lo <= hi) {
+		int mid = lo + (hi - lo) / 2;
+
+		if (cache->entries[mid]->start <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	return found;
+}
+
+static struct iser_mr_entry *
+iser_mr_cache_lookup(struct iser_mr_cache *cache, uintptr_t addr, size_t len)
+{
+	int i = iser_mr_cache_find(cache, addr);
+
+	if (i < 0 || addr + len > cache->entries[i]->end) {
+		return NULL;
+	}
+	return cache->entries[i];
+}
+
 static void
-iser_tx_desc_free(struct iscsi_context *iscsi, struct iser_tx_desc *tx_desc)
+iser_mr_cache_remove(struct iscsi_context *iscsi, struct iser_conn *iser_conn,
+		     int i)
+{
+	struct iser_mr_cache *cache = &iser_conn->mr_cache;
+	struct iser_mr_entry *entry = cache->entries[i];
+
+	if (!entry->pinned) {
+		cache->cached--;
+	}
+	if (ibv_dereg_mr(entry->mr)) {
+		iscsi_set_error(iscsi, "Failed to deregister application buffer mr");
+	}
+	memmove(&cache->entries[i], &cache->entries[i + 1],
+		(cache->count - i - 1) * sizeof(*cache->entries));
+	cache->count--;
+	iscsi_free(iscsi, entry);
+}
+
+static void
+iser_mr_cache_trim(struct iscsi_context *iscsi)
 {
 	struct iser_conn *iser_conn = iscsi->opaque;
-	struct iser_buf_chunk *chunk = iser_conn->buf_chunk;
+	struct iser_mr_cache *cache = &iser_conn->mr_cache;
+
+	while (cache->cached > iscsi->rdma_mr_cache_max) {
+		int i, victim = -1;
 
-	if (tx_desc->data_mr != NULL) {
-		for (; chunk != NULL; chunk = chunk->next) {
-			if (chunk->mr == tx_desc->data_mr) {
-				iser_buf_chunk_free(chunk, tx_desc->data_buff);
-				break;
+		for (i = 0; i < cache->count; i++) {
+			struct iser_mr_entry *entry = cache->entries[i];
+
+			if (entry->pinned || entry->refcnt) {
+				continue;
+			}
+			if (victim == -1 ||
+			    entry->last_use < cache->entries[victim]->last_use) {
+				victim = i;
 			}
 		}
-		if (chunk == NULL) {
-			ibv_dereg_mr(tx_desc->data_mr);
-			iscsi_free(iscsi, tx_desc->data_buff);
+		if (victim == -1) {
+			break;
+		}
+		iser_mr_cache_remove(iscsi, iser_conn, victim);
+	}
+}
+
+static void
+iser_mr_cache_destroy(struct iscsi_context *iscsi, struct iser_conn *iser_conn)
+{
+	struct iser_mr_cache *cache = &iser_conn->mr_cache;
+
+	while (cache->count) {
+		iser_mr_cache_remove(iscsi, iser_conn, cache->count - 1);
+	}
+	iscsi_free(iscsi, cache->entries);
+	cache->entries = NULL;
+	cache->size = 0;
+}
+
+/*
+ * iser_mr_cache_insert() - register a range, absorbing the idle entries
+ *                          it overlaps
+ *
+ * Returns NULL if registration failed or an overlapped entry is in use.
+ */
+static struct iser_mr_entry *
+iser_mr_cache_insert(struct iscsi_context *iscsi, uintptr_t addr, size_t len,
+		     int pinned)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_mr_cache *cache = &iser_conn->mr_cache;
+	struct iser_mr_entry *entry;
+	uintptr_t start = addr & MASK_4K;
+	uintptr_t end = (addr + len + SIZE_4K - 1) & MASK_4K;
+	int first, last, i;
+
+	first = iser_mr_cache_find(cache, start);
+	if (first < 0 || cache->entries[first]->end <= start) {
+		first++;
+	}
+	for (last = first; last < cache->count &&
+		     cache->entries[last]->start < end; last++) {
+		entry = cache->entries[last];
+		if (entry->refcnt) {
+			return NULL;
+		}
+		start = entry->start < start ? entry->start : start;
+		end = entry->end > end ? entry->end : end;
+		pinned += entry->pinned;
+	}
+
+	if (cache->count + 1 > cache->size) {
+		int size = cache->size ? cache->size * 2 : 16;
+		struct iser_mr_entry **entries;
+
+		entries = iscsi_realloc(iscsi, cache->entries,
+					size * sizeof(*entries));
+		if (entries == NULL) {
+			iscsi_set_error(iscsi, "Out-Of-Memory, failed to grow mr cache");
+			return NULL;
+		}
+		cache->entries = entries;
+		cache->size = size;
+	}
+
+	entry = iscsi_zmalloc(iscsi, sizeof(*entry));
+	if (entry == NULL) {
+		iscsi_set_error(iscsi, "Out-Of-Memory, failed to allocate mr cache entry");
+		return NULL;
+	}
+	entry->mr = ibv_reg_mr(iser_conn->pd, (void *)start, end - start,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if (entry->mr == NULL) {
+		iscsi_set_error(iscsi, "Failed to register application buffer mr: %s",
+				strerror(errno));
+		iscsi_free(iscsi, entry);
+		return NULL;
+	}
+	entry->start = start;
+	entry->end = end;
+	entry->pinned = pinned;
+	entry->last_use = ++cache->tick;
+
+	for (i = first; i < last; i++) {
+		iser_mr_cache_remove(iscsi, iser_conn, first);
+	}
+	memmove(&cache->entries[first + 1], &cache->entries[first],
+		(cache->count - first) * sizeof(*cache->entries));
+	cache->entries[first] = entry;
+	cache->count++;
+	if (!entry->pinned) {
+		cache->cached++;
+	}
+
+	ISCSI_LOG(iscsi, 3, "registered application memory %p-%p",
+		  (void *)start, (void *)end);
+	return entry;
+}
+
+static struct iser_mr_entry *
+iser_mr_cache_get(struct iscsi_context *iscsi, void *buf, size_t len)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_mr_cache *cache = &iser_conn->mr_cache;
+	struct iser_mr_entry *entry;
+
+	entry = iser_mr_cache_lookup(cache, (uintptr_t)buf, len);
+	if (entry == NULL) {
+		if (iscsi->rdma_mr_cache_max <= 0) {
+			return NULL;
+		}
+		entry = iser_mr_cache_insert(iscsi, (uintptr_t)buf, len, 0);
+		if (entry == NULL) {
+			return NULL;
+		}
+	}
+	entry->refcnt++;
+	entry->last_use = ++cache->tick;
+	iser_mr_cache_trim(iscsi);
+
+	return entry;
+}
+
+static void
+iser_mr_cache_put(struct iscsi_context *iscsi, struct iser_mr_entry *entry)
+{
+	entry->refcnt--;
+	iser_mr_cache_trim(iscsi);
+}
+
+int
+iser_mr_register(struct iscsi_context *iscsi, void *buf, size_t len)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_mr_entry *entry;
+
+	if (iser_conn == NULL || iser_conn->pd == NULL) {
+		return 0;
+	}
+
+	entry = iser_mr_cache_lookup(&iser_conn->mr_cache, (uintptr_t)buf, len);
+	if (entry != NULL) {
+		if (!entry->pinned++) {
+			iser_conn->mr_cache.cached--;
+		}
+		return 0;
+	}
+	if (iser_mr_cache_insert(iscsi, (uintptr_t)buf, len, 1) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+void
+iser_mr_unregister(struct iscsi_context *iscsi, void *buf, size_t len)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_mr_entry *entry;
+
+	if (iser_conn == NULL || iser_conn->pd == NULL) {
+		return;
+	}
+
+	entry = iser_mr_cache_lookup(&iser_conn->mr_cache, (uintptr_t)buf, len);
+	if (entry == NULL || !entry->pinned) {
+		return;
+	}
+	if (!--entry->pinned) {
+		iser_conn->mr_cache.cached++;
+	}
+	iser_mr_cache_trim(iscsi);
+}
+
+/* (re)register the buffers of iscsi_register_buffer() with a new pd */
+static void
+iser_mr_cache_load(struct iscsi_context *iscsi)
+{
+	struct iscsi_rdma_buf *b;
+
+	for (b = iscsi->rdma_bufs; b; b = b->next) {
+		if (iser_mr_register(iscsi, b->buf, b->len)) {
+			ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+		}
+	}
+}
+
+/*
+ * iser_user_buffer() - application buffer a command can RDMA to or from
+ *                      directly
+ *
+ * Only a virtually contiguous buffer can be described by the single
+ * stag/va pair of the iSER header, scattered ones are bounced.
+ */
+static unsigned char *
+iser_user_buffer(struct iscsi_context *iscsi, struct iser_pdu *iser_pdu,
+		 size_t data_size)
+{
+	struct iscsi_pdu *pdu = &iser_pdu->iscsi_pdu;
+	struct scsi_task *task = pdu->scsi_cbdata.task;
+	struct scsi_iovector *iovector;
+	unsigned char *base;
+	size_t len = 0;
+	int i;
+
+	if (task == NULL || data_size == 0 ||
+	    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_SCSI_REQUEST) {
+		return NULL;
+	}
+
+	if (pdu->outdata.data[1] & BHSSC_FLAGS_R) {
+		iovector = &task->iovector_in;
+	} else if (pdu->outdata.data[1] & BHSSC_FLAGS_W) {
+		iovector = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
+	} else {
+		return NULL;
+	}
+
+	if (iovector == NULL || iovector->iov == NULL || iovector->niov == 0) {
+		return NULL;
+	}
+
+	base = iovector->iov[0].iov_base;
+	for (i = 0; i < iovector->niov; i++) {
+		if ((unsigned char *)iovector->iov[i].iov_base != base + len) {
+			return NULL;
+		}
+		len += iovector->iov[i].iov_len;
+	}
+
+	return len >= data_size ? base : NULL;
+}
+
+/*
+ * Power of two size class of a payload above DATA_BUFFER_CHUNK_SIZE,
+ * ISER_LARGE_POOL_ORDERS + 1 if it is too large to be pooled.
+ */
+static inline int
+iser_large_buf_order(size_t size)
+{
+	int order = fls((size - 1) >> DATA_BUFFER_CHUNK_SHIFT);
+
+	return order > ISER_LARGE_POOL_ORDERS ? ISER_LARGE_POOL_ORDERS + 1 : order;
+}
+
+static int
+iser_large_buf_get(struct iscsi_context *iscsi, struct iser_tx_desc *tx_desc,
+		   size_t data_size)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_large_buf *large;
+	int order = iser_large_buf_order(data_size);
+
+	if (order <= ISER_LARGE_POOL_ORDERS) {
+		large = iser_conn->large_pool[order];
+		if (large != NULL) {
+			ISCSI_LIST_REMOVE(&iser_conn->large_pool[order], large);
+			iser_conn->large_pool_count[order]--;
+			iser_conn->large_pool_bytes -= large->mr->length;
+			tx_desc->data_buff = (char *)large->buf;
+			tx_desc->data_mr = large->mr;
+			iscsi_free(iscsi, large);
+			return 0;
+		}
+		data_size = DATA_BUFFER_CHUNK_SIZE << order;
+	}
+
+	tx_desc->data_buff = iscsi_malloc(iscsi, data_size);
+	if (tx_desc->data_buff == NULL) {
+		iscsi_set_error(iscsi, "Out-Of-Memory, failed to allocate data buffer");
+		return -1;
+	}
+
+	tx_desc->data_mr = ibv_reg_mr(iser_conn->pd, tx_desc->data_buff, data_size,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
+	if (tx_desc->data_mr == NULL) {
+		iscsi_free(iscsi, tx_desc->data_buff);
+		iscsi_set_error(iscsi, "Failed to register data mr");
+		return -1;
+	}
+	return 0;
+}
+
+static void
+iser_large_buf_put(struct iscsi_context *iscsi, struct iser_tx_desc *tx_desc)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+	struct iser_large_buf *large;
+	size_t size = tx_desc->data_mr->length;
+	int order = iser_large_buf_order(size);
+
+	if (order <= ISER_LARGE_POOL_ORDERS &&
+	    iser_conn->large_pool_count[order] < ISER_LARGE_POOL_DEPTH &&
+	    iser_conn->large_pool_bytes + size <= ISER_LARGE_POOL_BYTES) {
+		large = iscsi_malloc(iscsi, sizeof(*large));
+		if (large != NULL) {
+			large->buf = (unsigned char *)tx_desc->data_buff;
+			large->mr = tx_desc->data_mr;
+			large->idle_since = iscsi_clock_us();
+			ISCSI_LIST_ADD(&iser_conn->large_pool[order], large);
+			iser_conn->large_pool_count[order]++;
+			iser_conn->large_pool_bytes += size;
+			return;
+		}
+	}
+
+	ibv_dereg_mr(tx_desc->data_mr);
+	iscsi_free(iscsi, tx_desc->data_buff);
+}
+
+/*
+ * Give back the pooled buffers that have not been used again for
+ * ISER_LARGE_POOL_IDLE_US. Buffers are taken from and returned to the
+ * head of their list, so the ones that sat idle longest are at the tail.
+ */
+static void
+iser_large_pool_trim(struct iscsi_context *iscsi, struct iser_conn *iser_conn)
+{
+	uint64_t now;
+	int i;
+
+	if (iser_conn == NULL || iser_conn->large_pool_bytes == 0) {
+		return;
+	}
+	now = iscsi_clock_us();
+	if (now - iser_conn->large_pool_trimmed < ISER_LARGE_POOL_IDLE_US / 2) {
+		return;
+	}
+	iser_conn->large_pool_trimmed = now;
+
+	for (i = 0; i <= ISER_LARGE_POOL_ORDERS; i++) {
+		struct iser_large_buf **plarge = &iser_conn->large_pool[i];
+
+		while (*plarge != NULL) {
+			struct iser_large_buf *large = *plarge;
+
+			if (now - large->idle_since < ISER_LARGE_POOL_IDLE_US) {
+				plarge = &large->next;
+				continue;
+			}
+			*plarge = large->next;
+			iser_conn->large_pool_count[i]--;
+			iser_conn->large_pool_bytes -= large->mr->length;
+			ibv_dereg_mr(large->mr);
+			iscsi_free(iscsi, large->buf);
+			iscsi_free(iscsi, large);
 		}
 	}
+}
+
+static void
+iser_tx_desc_free(struct iscsi_context *iscsi, struct iser_tx_desc *tx_desc)
+{
+	struct iser_conn *iser_conn = iscsi->opaque;
+
+	if (tx_desc->user_mr != NULL) {
+		iser_mr_cache_put(iscsi, tx_desc->user_mr);
+		tx_desc->user_mr = NULL;
+	} else if (tx_desc->chunk != NULL) {
+		iser_buf_chunk_free(tx_desc->chunk, tx_desc->data_buff);
+		iser_conn->chunk_hint = tx_desc->chunk;
+		tx_desc->chunk = NULL;
+	} else if (tx_desc->data_mr != NULL) {
+		iser_large_buf_put(iscsi, tx_desc);
+	}
 
 	ISCSI_LIST_ADD(&iser_conn->tx_desc, tx_desc);
 }
@@ -252,22 +681,15 @@ iser_tx_desc_alloc(struct iscsi_context *iscsi, size_t data_size) {
 		}
 	}
 
+	tx_desc->user_mr = NULL;
+	tx_desc->chunk = NULL;
+
 	if (data_size == 0) {
 		tx_desc->data_buff = NULL;
 		tx_desc->data_mr = NULL;
 		return tx_desc;
 	} else if (data_size > DATA_BUFFER_CHUNK_SIZE) {
-		tx_desc->data_buff = iscsi_malloc(iscsi, data_size);
-		if (tx_desc->data_buff == NULL) {
-			iscsi_set_error(iscsi, "Out-Of-Memory, failed to allocate data buffer");
-			goto release;
-		}
-
-		tx_desc->data_mr = ibv_reg_mr(iser_conn->pd, tx_desc->data_buff, data_size,
-				IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE);
-		if (tx_desc->data_mr == NULL) {
-			iscsi_free(iscsi, tx_desc->data_buff);
-			iscsi_set_error(iscsi, "Failed to register data mr");
+		if (iser_large_buf_get(iscsi, tx_desc, data_size)) {
 			goto release;
 		}
 		return tx_desc;
@@ -275,12 +697,18 @@ iser_tx_desc_alloc(struct iscsi_context *iscsi, size_t data_size) {
 
 	want = fls((data_size * 2 - 1) / DATA_BUFFER_UNIT_SIZE / 2) + 1;
 
+	/* the chunk something was last freed to is the likeliest to fit */
+	chunk = iser_conn->chunk_hint;
+	if (chunk != NULL && (buf = iser_buf_chunk_alloc(chunk, want)) != NULL) {
+		goto found;
+	}
+
 	for (; *buf_chunk != NULL; buf_chunk = &(*buf_chunk)->next) {
-		buf = iser_buf_chunk_alloc(*buf_chunk, want);
+		chunk = *buf_chunk;
+		buf = iser_buf_chunk_alloc(chunk, want);
 		if (buf != NULL) {
-			tx_desc->data_buff = buf;
-			tx_desc->data_mr = (*buf_chunk)->mr;
-			return tx_desc;
+			iser_conn->chunk_hint = chunk;
+			goto found;
 		}
 	}
 
@@ -291,7 +719,7 @@ iser_tx_desc_alloc(struct iscsi_context *iscsi, size_t data_size) {
 	}
 
 	chunk->buf = iscsi_malloc(iscsi, DATA_BUFFER_CHUNK_SIZE);
-	if (chunk == NULL) {
+	if (chunk->buf == NULL) {
 		iscsi_set_error(iscsi, "Out-Of-Memory, failed to allocate data buffer");
 		goto free_chunk;
 	}
@@ -310,9 +738,14 @@ iser_tx_desc_alloc(struct iscsi_context *iscsi, size_t data_size) {
 	}
 	chunk->next = NULL;
 	*buf_chunk = chunk;
+	iser_conn->chunk_hint = chunk;
+
+	buf = iser_buf_chunk_alloc(chunk, want);
 
-	tx_desc->data_buff = iser_buf_chunk_alloc(chunk, want);
+found:
+	tx_desc->data_buff = buf;
 	tx_desc->data_mr = chunk->mr;
+	tx_desc->chunk = chunk;
 
 	return tx_desc;
 
@@ -328,6 +761,49 @@ release:
 	return NULL;
 }
 
+/*
+ * Sent pdus are indexed by itt so that completions find their pdu without
+ * walking waitpdu. Must be called with iscsi_lock held.
+ */
+static void
+iser_itt_insert(struct iser_conn *iser_conn, struct iser_pdu *iser_pdu)
+{
+	struct iser_pdu **slot;
+
+	slot = &iser_conn->itt_hash[iser_pdu->iscsi_pdu.itt % ISER_ITT_HASH_SIZE];
+	iser_pdu->itt_next = *slot;
+	*slot = iser_pdu;
+}
+
+static void
+iser_itt_remove(struct iser_conn *iser_conn, struct iser_pdu *iser_pdu)
+{
+	struct iser_pdu **slot;
+
+	slot = &iser_conn->itt_hash[iser_pdu->iscsi_pdu.itt % ISER_ITT_HASH_SIZE];
+	for (; *slot; slot = &(*slot)->itt_next) {
+		if (*slot == iser_pdu) {
+			*slot = iser_pdu->itt_next;
+			break;
+		}
+	}
+	iser_pdu->itt_next = NULL;
+}
+
+static struct iser_pdu *
+iser_itt_lookup(struct iser_conn *iser_conn, uint32_t itt)
+{
+	struct iser_pdu *iser_pdu;
+
+	iser_pdu = iser_conn->itt_hash[itt % ISER_ITT_HASH_SIZE];
+	for (; iser_pdu; iser_pdu = iser_pdu->itt_next) {
+		if (iser_pdu->iscsi_pdu.itt == itt) {
+			break;
+		}
+	}
+	return iser_pdu;
+}
+
 static void
 iser_free_queued_pdu_tx_desc(struct iscsi_context *iscsi)
 {
@@ -380,6 +856,8 @@ iser_free_reg_mr(struct iser_conn *iser_conn)
 	struct iscsi_context *iscsi = iser_conn->cma_id->context;
 	struct iser_tx_desc *temp_tx_desc;
 	struct iser_buf_chunk *chunk, *temp_chunk;
+	struct iser_large_buf *large;
+	int i;
 
 	while (tx_desc) {
 		ibv_dereg_mr(tx_desc->hdr_mr);
@@ -399,6 +877,20 @@ iser_free_reg_mr(struct iser_conn *iser_conn)
 		iscsi_free(iscsi, temp_chunk);
 	}
 	iser_conn->buf_chunk = NULL;
+	iser_conn->chunk_hint = NULL;
+
+	for (i = 0; i <= ISER_LARGE_POOL_ORDERS; i++) {
+		while ((large = iser_conn->large_pool[i]) != NULL) {
+			ISCSI_LIST_REMOVE(&iser_conn->large_pool[i], large);
+			ibv_dereg_mr(large->mr);
+			iscsi_free(iscsi, large->buf);
+			iscsi_free(iscsi, large);
+		}
+		iser_conn->large_pool_count[i] = 0;
+	}
+	iser_conn->large_pool_bytes = 0;
+
+	iser_mr_cache_destroy(iscsi, iser_conn);
 }
 
 /*
@@ -573,6 +1065,9 @@ iscsi_iser_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 	if (iscsi->outqueue_current == pdu) {
 		iscsi->outqueue_current = NULL;
 	}
+	if (iscsi->opaque) {
+		iser_itt_remove(iscsi->opaque, iser_pdu);
+	}
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	iscsi_free(iscsi, iser_pdu);
@@ -728,12 +1223,31 @@ static int
 iser_initialize_headers(struct iser_pdu *iser_pdu, struct iscsi_context *iscsi)
 {
 	struct iser_tx_desc *tx_desc;
+	struct iser_mr_entry *user_mr = NULL;
+	size_t data_size = get_data_size(iser_pdu);
+	unsigned char *user_buf;
+
+	/* RDMA straight to or from the application buffer if it is
+	 * registered, or can be while the cache is enabled */
+	user_buf = iser_user_buffer(iscsi, iser_pdu, data_size);
+	if (user_buf != NULL) {
+		user_mr = iser_mr_cache_get(iscsi, user_buf, data_size);
+	}
 
-	tx_desc = iser_tx_desc_alloc(iscsi, get_data_size(iser_pdu));
+	tx_desc = iser_tx_desc_alloc(iscsi, user_mr ? 0 : data_size);
 	if (tx_desc == NULL) {
+		if (user_mr) {
+			iser_mr_cache_put(iscsi, user_mr);
+		}
 		return -1;
 	}
 
+	if (user_mr) {
+		tx_desc->user_mr = user_mr;
+		tx_desc->data_buff = (char *)user_buf;
+		tx_desc->data_mr = user_mr->mr;
+	}
+
 	iser_pdu->desc = tx_desc;
 
 	tx_desc->tx_sg[0].addr   = (uintptr_t)tx_desc;
@@ -809,7 +1323,7 @@ iser_prepare_write_cmd(struct iser_conn *iser_conn, struct iser_pdu *iser_pdu)
 
 	tx_desc->data_dir = DATA_WRITE;
 
-	for(i = 0 ; i < iovector->niov ; i++) {
+	for(i = 0 ; !tx_desc->user_mr && i < iovector->niov ; i++) {
 		memcpy(&tx_desc->data_buff[offset], iovector->iov[i].iov_base, iovector->iov[i].iov_len);
 		offset += iovector->iov[i].iov_len;
 	}
@@ -914,6 +1428,9 @@ iscsi_iser_send_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu) {
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	iscsi_pdu_set_expstatsn(pdu, iscsi->statsn + 1);
 	ISCSI_LIST_ADD_END(&iscsi->waitpdu, pdu);
+	if (iser_conn) {
+		iser_itt_insert(iser_conn, iser_pdu);
+	}
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
 	/*
@@ -939,6 +1456,7 @@ iscsi_iser_send_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu) {
 			return -1;
 		}
 	}
+	ISCSI_TRACE_PDU(iscsi, ISCSI_TRACE_TX, pdu->outdata.data);
 
 	return 0;
 }
@@ -1135,6 +1653,8 @@ static int iser_addr_handler(struct rdma_cm_id *cma_id) {
 		goto cq_error;
 	}
 
+	iser_mr_cache_load(iscsi);
+
 	return 0;
 
 cq_error:
@@ -1303,9 +1823,8 @@ iser_rcv_completion(struct iser_rx_desc *rx_desc,
 		    struct iser_conn *iser_conn)
 {
 	struct iscsi_in_pdu in;
-	int empty, err;
+	int err;
 	struct iscsi_context *iscsi = iser_conn->cma_id->context;
-	struct iscsi_pdu *iscsi_pdu;
 	struct iser_pdu *iser_pdu;
 
 	in.hdr = (unsigned char*)rx_desc->iscsi_header;
@@ -1315,6 +1834,8 @@ iser_rcv_completion(struct iser_rx_desc *rx_desc,
 	enum iscsi_opcode opcode = in.hdr[0] & 0x3f;
 	uint32_t itt = scsi_get_uint32(&in.hdr[16]);
 
+	ISCSI_TRACE_PDU(iscsi, ISCSI_TRACE_RX, in.hdr);
+
 	if (opcode == ISCSI_PDU_NOP_IN && itt == 0xffffffff)
 		goto no_waitpdu;
 
@@ -1322,19 +1843,19 @@ iser_rcv_completion(struct iser_rx_desc *rx_desc,
 		goto no_waitpdu;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	for (iscsi_pdu = iscsi->waitpdu ; iscsi_pdu ; iscsi_pdu = iscsi_pdu->next) {
-		if(iscsi_pdu->itt == itt)
-			break;
-	}
+	iser_pdu = iser_itt_lookup(iser_conn, itt);
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
-	iser_pdu = container_of(iscsi_pdu, struct iser_pdu, iscsi_pdu);
+	if (iser_pdu == NULL || iser_pdu->desc == NULL)
+		goto no_waitpdu;
 
 	/* in case of read completion we need to copy data     *
-	 * from pre-allocated buffers into application buffers */
+	 * from pre-allocated buffers into application buffers *
+	 * unless the target wrote to them directly            */
 
 	if (iser_pdu->desc->type == ISCSI_COMMAND &&
-		iser_pdu->desc->data_dir == DATA_READ) {
+		iser_pdu->desc->data_dir == DATA_READ &&
+		iser_pdu->desc->user_mr == NULL) {
 
 		int i, offset = 0;
 		struct scsi_task *task = iser_pdu->iscsi_pdu.scsi_cbdata.task;
@@ -1359,15 +1880,13 @@ no_waitpdu:
 	 * for the posted rx bufs refcount to become zero handles everything   */
 	iser_conn->post_recv_buf_count--;
 
+	/* regular receive buffers are reposted once per poll batch
+	 * by cq_event_handler() */
 	if ((unsigned char *)rx_desc != iser_conn->login_resp_buf) {
-		empty = iser_conn->qp_max_recv_dtos - iser_conn->post_recv_buf_count;
-		if (empty >= iser_conn->min_posted_rx) {
-			err = iser_post_recvm(iser_conn, empty);
-			if (err) {
-				return -1;
-			}
-		}
-	} else if (iscsi->is_loggedin) {
+		return iscsi_process_pdu(iscsi, &in);
+	}
+
+	if (iscsi->is_loggedin) {
 		if(iser_alloc_rx_descriptors(iser_conn, 255)) {
 			iscsi_set_error(iscsi, "iser_alloc_rx_descriptors Failed\n");
 			return -1;
@@ -1452,16 +1971,24 @@ static int iser_handle_wc(struct ibv_wc *wc,struct iser_conn *iser_conn)
  */
 static int cq_event_handler(struct iser_conn *iser_conn)
 {
-	struct ibv_wc wc[16];
+	struct ibv_wc wc[ISER_CQ_POLL_BATCH];
 	unsigned int i;
-	unsigned int n;
+	int n, empty;
 	unsigned int completed = 0;
 
-	while ((n = ibv_poll_cq(iser_conn->cq, 16, wc)) > 0) {
-		for (i = 0; i < n; i++)
+	while ((n = ibv_poll_cq(iser_conn->cq, ISER_CQ_POLL_BATCH, wc)) > 0) {
+		for (i = 0; i < (unsigned int)n; i++)
 			if (iser_handle_wc(&wc[i], iser_conn))
 				return -1;
 
+		/* replenish the receive queue with one post per batch */
+		if (iser_conn->rx_descs) {
+			empty = iser_conn->qp_max_recv_dtos - iser_conn->post_recv_buf_count;
+			if (empty >= iser_conn->min_posted_rx &&
+			    iser_post_recvm(iser_conn, empty))
+				return -1;
+		}
+
 		completed += n;
 		if (completed >= 512)
 			break;
@@ -0,0 +1,202 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Block Limits VPD of the LUNs used through a context, fetched in the
+ * background the first time somebody asks for them.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+struct iscsi_lun_limits_waiter {
+	struct iscsi_lun_limits_waiter *next;
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+static void
+iscsi_lun_limits_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_lun_limits *ll = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_block_limits *bl = NULL, *copy = NULL;
+	struct iscsi_lun_limits_waiter *waiters;
+	enum iscsi_lun_limits_state state;
+
+	switch (status) {
+	case SCSI_STATUS_GOOD:
+		bl = scsi_datain_unmarshall(task);
+		/* fall through */
+	case SCSI_STATUS_CHECK_CONDITION:
+		state = bl ? ISCSI_LUN_LIMITS_VALID : ISCSI_LUN_LIMITS_NONE;
+		status = SCSI_STATUS_GOOD;
+		ISCSI_LOG(iscsi, 2, "lun %d: maximum transfer length %u, "
+			  "optimal transfer length %u blocks%s", ll->lun,
+			  bl ? bl->max_xfer_len : 0,
+			  bl ? bl->opt_xfer_len : 0,
+			  bl ? "" : " (no Block Limits VPD)");
+		break;
+	default:
+		/* try again next time */
+		state = ISCSI_LUN_LIMITS_UNKNOWN;
+	}
+
+	if (bl != NULL) {
+		copy = malloc(sizeof(*copy));
+		if (copy == NULL) {
+			state = ISCSI_LUN_LIMITS_UNKNOWN;
+			status = SCSI_STATUS_ERROR;
+		} else {
+			*copy = *bl;
+		}
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	free(ll->bl);
+	ll->bl = copy;
+	ll->state = state;
+	waiters = ll->waiters;
+	ll->waiters = NULL;
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	scsi_free_scsi_task(task);
+
+	while (waiters) {
+		struct iscsi_lun_limits_waiter *w = waiters;
+
+		waiters = w->next;
+		w->cb(iscsi, status, NULL, w->private_data);
+		free(w);
+	}
+}
+
+int
+iscsi_lun_limits_get(struct iscsi_context *iscsi, int lun,
+		     struct scsi_inquiry_block_limits *bl,
+		     iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_lun_limits_waiter *w = NULL;
+	struct iscsi_lun_limits *ll;
+	struct scsi_task *task;
+	enum iscsi_lun_limits_state state;
+
+	if (cb != NULL) {
+		w = calloc(1, sizeof(*w));
+		if (w == NULL) {
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate Block Limits waiter");
+			return -1;
+		}
+		w->cb = cb;
+		w->private_data = private_data;
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (ll = iscsi->lun_limits; ll; ll = ll->next) {
+		if (ll->lun == lun) {
+			break;
+		}
+	}
+	if (ll == NULL) {
+		ll = calloc(1, sizeof(*ll));
+		if (ll == NULL) {
+			iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+			iscsi_set_error(iscsi, "Out-of-memory: failed to "
+					"allocate Block Limits");
+			free(w);
+			return -1;
+		}
+		ll->lun = lun;
+		ISCSI_LIST_ADD(&iscsi->lun_limits, ll);
+	}
+	state = ll->state;
+	switch (state) {
+	case ISCSI_LUN_LIMITS_VALID:
+	case ISCSI_LUN_LIMITS_NONE:
+		if (ll->bl != NULL) {
+			*bl = *ll->bl;
+		} else {
+			memset(bl, 0, sizeof(*bl));
+		}
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		free(w);
+		return 0;
+	case ISCSI_LUN_LIMITS_UNKNOWN:
+		ll->state = ISCSI_LUN_LIMITS_FETCHING;
+		break;
+	case ISCSI_LUN_LIMITS_FETCHING:
+		break;
+	}
+	if (w != NULL) {
+		ISCSI_LIST_ADD_END(&ll->waiters, w);
+	}
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	if (state == ISCSI_LUN_LIMITS_FETCHING) {
+		return 1;
+	}
+
+	task = scsi_cdb_inquiry(1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
+	if (task == NULL ||
+	    iscsi_scsi_command_queue(iscsi, lun, task, iscsi_lun_limits_cb,
+				     NULL, ll) != 0) {
+		iscsi_set_error(iscsi, "Failed to send Block Limits inquiry");
+		scsi_free_scsi_task(task);
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		ll->state = ISCSI_LUN_LIMITS_UNKNOWN;
+		if (w != NULL) {
+			ISCSI_LIST_REMOVE(&ll->waiters, w);
+		}
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		free(w);
+		return -1;
+	}
+	return 1;
+}
+
+void
+iscsi_lun_limits_free(struct iscsi_context *iscsi)
+{
+	while (iscsi->lun_limits) {
+		struct iscsi_lun_limits *ll = iscsi->lun_limits;
+
+		ISCSI_LIST_REMOVE(&iscsi->lun_limits, ll);
+		while (ll->waiters) {
+			struct iscsi_lun_limits_waiter *w = ll->waiters;
+
+			ISCSI_LIST_REMOVE(&ll->waiters, w);
+			w->cb(iscsi, SCSI_STATUS_CANCELLED, NULL,
+			      w->private_data);
+			free(w);
+		}
+		free(ll->bl);
+		free(ll);
+	}
+}
@@ -36,10 +36,64 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
 #include "scsi-lowlevel.h"
 
+/*
+ * The asynchronous log ring is a bounded multi-producer queue. Every slot
+ * has a sequence word: a producer may claim slot pos & mask when its
+ * sequence is pos, and marks it pos + 1 once the message is in it. The
+ * consumer delivers slots in order while they are marked and hands each
+ * back with pos + size, ready for the producer one lap later. A producer
+ * that finds the slot of the head still in use gives up and counts the
+ * message as dropped, so logging never waits.
+ *
+ * The ring is never freed once created since a producer may still be
+ * looking at it.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define HAVE_LOG_ASYNC 1
+#define LOG_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define LOG_STORE(p, v)		__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define LOG_ADD(p, v)		__atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define LOG_XCHG(p, v)		__atomic_exchange_n(p, v, __ATOMIC_RELAXED)
+#define LOG_CAS(p, o, n)	__atomic_compare_exchange_n(p, o, n, 0, \
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)
+#endif
+
+#define LOG_MESSAGE_SIZE	1024
+#define LOG_TARGET_SIZE		270	/* " [target/lun]" */
+#define LOG_DEFAULT_ENTRIES	1024
+#define LOG_POLL_NS		10000000
+
+struct iscsi_log_slot {
+	uint64_t seq;
+	int level;
+	iscsi_log_fn fn;
+	char message[LOG_MESSAGE_SIZE + LOG_TARGET_SIZE];
+};
+
+struct iscsi_log_ring {
+	uint64_t mask;
+	uint64_t head;		/* next position to claim */
+	uint64_t tail;		/* next position to deliver */
+	uint64_t dropped;
+	int enabled;
+	int background;
+#ifdef HAVE_PTHREAD
+	pthread_t thread;
+#endif
+	struct iscsi_log_slot slots[];
+};
+
+#ifdef HAVE_LOG_ASYNC
+static struct iscsi_log_ring *log_ring;
+#endif
+
 void
 iscsi_log_to_stderr(int level, const char *message)
 {
@@ -52,33 +106,312 @@ iscsi_set_log_fn(struct iscsi_context *iscsi, iscsi_log_fn fn)
 	iscsi->log_fn = fn;
 }
 
+void
+iscsi_set_log_rate_limit(struct iscsi_context *iscsi, int burst)
+{
+	iscsi_mt_spin_lock(&iscsi->log_lock);
+	iscsi->log_rate_limit = burst > 0 ? burst : 0;
+	memset(iscsi->log_limits, 0, sizeof(iscsi->log_limits));
+	iscsi_mt_spin_unlock(&iscsi->log_lock);
+}
+
+/*
+ * Returns -1 if the message from this call site is over the limit,
+ * otherwise the number of messages from it that were dropped before.
+ *
+ * Call sites are kept in a set associative table keyed by the format.
+ * An entry is only given to another call site once its window is over,
+ * so the ones sharing a set do not reset each other. If every entry of
+ * the set is still in its window the message is not limited.
+ */
+static int
+iscsi_log_limit(struct iscsi_context *iscsi, const char *format)
+{
+	struct iscsi_log_limit *set, *ll, *victim = NULL;
+	uint64_t now = iscsi_clock_us();
+	int i, suppressed = 0;
+
+	set = &iscsi->log_limits[((uintptr_t)format >> 3) %
+				 ISCSI_LOG_LIMIT_SETS * ISCSI_LOG_LIMIT_WAYS];
+
+	iscsi_mt_spin_lock(&iscsi->log_lock);
+	for (i = 0; i < ISCSI_LOG_LIMIT_WAYS; i++) {
+		ll = &set[i];
+		if (ll->format == format) {
+			break;
+		}
+		if (ll->format != NULL && now - ll->window < 1000000) {
+			continue;
+		}
+		/* prefer a free entry, then one with nothing left to
+		 * report, then the oldest */
+		if (victim == NULL ||
+		    (victim->format != NULL &&
+		     (ll->format == NULL ||
+		      ll->suppressed < victim->suppressed ||
+		      (ll->suppressed == victim->suppressed &&
+		       ll->window < victim->window)))) {
+			victim = ll;
+		}
+	}
+	if (i == ISCSI_LOG_LIMIT_WAYS) {
+		if (victim != NULL) {
+			victim->format = format;
+			victim->window = now;
+			victim->count = 1;
+			victim->suppressed = 0;
+		}
+	} else if (now - ll->window >= 1000000) {
+		suppressed = ll->suppressed;
+		ll->window = now;
+		ll->count = 1;
+		ll->suppressed = 0;
+	} else if (ll->count >= iscsi->log_rate_limit) {
+		ll->suppressed++;
+		suppressed = -1;
+	} else {
+		ll->count++;
+	}
+	iscsi_mt_spin_unlock(&iscsi->log_lock);
+
+	return suppressed;
+}
+
+static void
+iscsi_log_format(struct iscsi_context *iscsi, char *message, int suppressed,
+		 const char *format, va_list ap)
+{
+	int len = 0;
+
+	if (suppressed > 0) {
+		len = snprintf(message, LOG_MESSAGE_SIZE,
+			       "(%d similar messages suppressed) ", suppressed);
+	}
+	vsnprintf(message + len, LOG_MESSAGE_SIZE - len, format, ap);
+
+	if (iscsi->target_name[0]) {
+		len = strlen(message);
+		snprintf(message + len, LOG_TARGET_SIZE, " [%s/%d]",
+			 iscsi->target_name, iscsi->lun);
+	}
+}
+
+#ifdef HAVE_LOG_ASYNC
+/*
+ * Claim a slot for a message. Returns NULL if the ring is full.
+ */
+static struct iscsi_log_slot *
+iscsi_log_claim(struct iscsi_log_ring *ring, uint64_t *claimed)
+{
+	struct iscsi_log_slot *slot;
+	uint64_t pos, seq;
+
+	pos = LOG_LOAD(&ring->head);
+	for (;;) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = LOG_LOAD(&slot->seq);
+		if (seq == pos) {
+			if (LOG_CAS(&ring->head, &pos, pos + 1)) {
+				*claimed = pos;
+				return slot;
+			}
+			/* pos now holds the current head */
+		} else if ((int64_t)(seq - pos) < 0) {
+			LOG_ADD(&ring->dropped, 1);
+			return NULL;
+		} else {
+			pos = LOG_LOAD(&ring->head);
+		}
+	}
+}
+
+static int
+iscsi_log_deliver(struct iscsi_log_ring *ring)
+{
+	struct iscsi_log_slot *slot;
+	uint64_t dropped;
+	int count = 0;
+
+	for (;;) {
+		slot = &ring->slots[ring->tail & ring->mask];
+		if (LOG_LOAD(&slot->seq) != ring->tail + 1) {
+			break;
+		}
+		dropped = LOG_XCHG(&ring->dropped, 0);
+		if (dropped && slot->fn) {
+			char message[64];
+
+			snprintf(message, sizeof(message),
+				 "%llu log messages dropped",
+				 (unsigned long long)dropped);
+			slot->fn(1, message);
+		}
+		if (slot->fn) {
+			slot->fn(slot->level, slot->message);
+		}
+		LOG_STORE(&slot->seq, ring->tail + ring->mask + 1);
+		ring->tail++;
+		count++;
+	}
+
+	return count;
+}
+
+#ifdef HAVE_PTHREAD
+static void *
+iscsi_log_thread(void *arg)
+{
+	struct iscsi_log_ring *ring = arg;
+
+	while (LOG_LOAD(&ring->background)) {
+		if (iscsi_log_deliver(ring) == 0) {
+			struct timespec ts = {0, LOG_POLL_NS};
+
+			nanosleep(&ts, NULL);
+		}
+	}
+
+	return NULL;
+}
+#endif
+#endif /* HAVE_LOG_ASYNC */
+
+int
+iscsi_log_async_start(int entries, int background)
+{
+#ifdef HAVE_LOG_ASYNC
+	struct iscsi_log_ring *ring, *expected = NULL;
+	uint64_t size, i;
+
+#ifndef HAVE_PTHREAD
+	if (background) {
+		return -1;
+	}
+#endif
+	ring = LOG_LOAD(&log_ring);
+	if (ring != NULL && LOG_LOAD(&ring->enabled)) {
+		return 0;
+	}
+
+	if (ring == NULL) {
+		if (entries <= 0) {
+			entries = LOG_DEFAULT_ENTRIES;
+		}
+		for (size = 16; size < (uint64_t)entries; size <<= 1) {
+			;
+		}
+		ring = calloc(1, sizeof(*ring) +
+			      size * sizeof(struct iscsi_log_slot));
+		if (ring == NULL) {
+			return -1;
+		}
+		ring->mask = size - 1;
+		for (i = 0; i < size; i++) {
+			ring->slots[i].seq = i;
+		}
+		if (!LOG_CAS(&log_ring, &expected, ring)) {
+			/* somebody else got there first */
+			free(ring);
+			return 0;
+		}
+	}
+
+#ifdef HAVE_PTHREAD
+	if (background) {
+		LOG_STORE(&ring->background, 1);
+		if (pthread_create(&ring->thread, NULL, iscsi_log_thread,
+				   ring)) {
+			LOG_STORE(&ring->background, 0);
+			return -1;
+		}
+	}
+#endif
+	LOG_STORE(&ring->enabled, 1);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+int
+iscsi_log_async_drain(void)
+{
+#ifdef HAVE_LOG_ASYNC
+	struct iscsi_log_ring *ring = LOG_LOAD(&log_ring);
+
+	if (ring == NULL || LOG_LOAD(&ring->background)) {
+		return 0;
+	}
+	return iscsi_log_deliver(ring);
+#else
+	return 0;
+#endif
+}
+
+void
+iscsi_log_async_stop(void)
+{
+#ifdef HAVE_LOG_ASYNC
+	struct iscsi_log_ring *ring = LOG_LOAD(&log_ring);
+
+	if (ring == NULL || !LOG_LOAD(&ring->enabled)) {
+		return;
+	}
+	LOG_STORE(&ring->enabled, 0);
+#ifdef HAVE_PTHREAD
+	if (LOG_LOAD(&ring->background)) {
+		LOG_STORE(&ring->background, 0);
+		pthread_join(ring->thread, NULL);
+	}
+#endif
+	iscsi_log_deliver(ring);
+#endif
+}
+
 void
 iscsi_log_message(struct iscsi_context *iscsi, int level, const char *format, ...)
 {
         va_list ap;
-	static char message[1024];
-	int ret;
+	char message[LOG_MESSAGE_SIZE + LOG_TARGET_SIZE];
+	int suppressed = 0;
+#ifdef HAVE_LOG_ASYNC
+	struct iscsi_log_ring *ring;
+	struct iscsi_log_slot *slot;
+	uint64_t pos;
+#endif
 
 	if (iscsi->log_fn == NULL) {
 		return;
 	}
 
-        va_start(ap, format);
-	ret = vsnprintf(message, 1024, format, ap);
-        va_end(ap);
+	if (iscsi->log_rate_limit) {
+		suppressed = iscsi_log_limit(iscsi, format);
+		if (suppressed < 0) {
+			return;
+		}
+	}
 
-	if (ret < 0) {
+#ifdef HAVE_LOG_ASYNC
+	ring = LOG_LOAD(&log_ring);
+	if (ring != NULL && LOG_LOAD(&ring->enabled)) {
+		slot = iscsi_log_claim(ring, &pos);
+		if (slot == NULL) {
+			return;
+		}
+		slot->level = level;
+		slot->fn = iscsi->log_fn;
+		va_start(ap, format);
+		iscsi_log_format(iscsi, slot->message, suppressed, format, ap);
+		va_end(ap);
+		LOG_STORE(&slot->seq, pos + 1);
 		return;
 	}
+#endif
 
-	if (iscsi->target_name[0]) {
-		static char message2[1294];
+        va_start(ap, format);
+	iscsi_log_format(iscsi, message, suppressed, format, ap);
+        va_end(ap);
 
-		snprintf(message2, sizeof(message2), "%s [%s/%d]", message, iscsi->target_name, iscsi->lun);
-		iscsi->log_fn(level, message2);
-	}
-	else
-		iscsi->log_fn(level, message);
+	iscsi->log_fn(level, message);
 }
-
-
@@ -511,7 +511,17 @@ iscsi_login_add_errorrecoverylevel(struct iscsi_context *iscsi, struct iscsi_pdu
 		return 0;
 	}
 
-	strncpy(str,"ErrorRecoveryLevel=0",MAX_STRING_SIZE);
+	/* until the target says which one it takes */
+	iscsi->error_recovery_level = ISCSI_ERROR_RECOVERY_LEVEL_0;
+
+	/* SNACK has no meaning for iSER */
+	if (iscsi->transport == ISER_TRANSPORT) {
+		strncpy(str,"ErrorRecoveryLevel=0",MAX_STRING_SIZE);
+	} else if (snprintf(str, MAX_STRING_SIZE, "ErrorRecoveryLevel=%d",
+			    iscsi->want_error_recovery_level) == -1) {
+		iscsi_set_error(iscsi, "Out-of-memory: aprintf failed.");
+		return -1;
+	}
 	if (iscsi_pdu_add_data(iscsi, pdu, (unsigned char *)str, strlen(str)+1)
 	    != 0) {
 		iscsi_set_error(iscsi, "Out-of-memory: pdu add data failed.");
@@ -993,6 +1003,153 @@ iscsi_login_add_chap_response(struct iscsi_context *iscsi, struct iscsi_pdu *pdu
 	return 0;
 }
 
+/*
+ * Login profiles, see iscsi_set_login_cache().
+ */
+struct iscsi_login_cache {
+	libiscsi_mutex_t lock;
+	int refs;
+	struct iscsi_login_profile *profiles;
+};
+
+static struct iscsi_login_profile *
+iscsi_login_cache_find(struct iscsi_login_cache *cache,
+		       const char *initiator_name, const char *target_name)
+{
+	struct iscsi_login_profile *lp;
+
+	for (lp = cache->profiles; lp; lp = lp->next) {
+		if (!strcmp(lp->target_name, target_name)
+		&&  !strcmp(lp->initiator_name, initiator_name)) {
+			return lp;
+		}
+	}
+	return NULL;
+}
+
+static void
+iscsi_login_profile_forget(struct iscsi_context *iscsi)
+{
+	struct iscsi_login_cache *cache = iscsi->login_cache;
+	struct iscsi_login_profile *lp;
+
+	iscsi->login_profile.target_name[0] = '\0';
+	if (cache == NULL) {
+		return;
+	}
+	iscsi_mt_mutex_lock(&cache->lock);
+	lp = iscsi_login_cache_find(cache, iscsi->initiator_name,
+				    iscsi->target_name);
+	if (lp) {
+		lp->target_name[0] = '\0';
+	}
+	iscsi_mt_mutex_unlock(&cache->lock);
+}
+
+static void
+iscsi_login_profile_save(struct iscsi_context *iscsi)
+{
+	struct iscsi_login_cache *cache = iscsi->login_cache;
+	struct iscsi_login_profile *lp = &iscsi->login_profile, *clp;
+
+	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
+		return;
+	}
+
+	strncpy(lp->initiator_name, iscsi->initiator_name, MAX_ISCSI_NAME_SIZE);
+	strncpy(lp->target_name, iscsi->target_name, MAX_ISCSI_NAME_SIZE);
+	lp->auth_none = !iscsi->user[0] || iscsi->login_auth_none
+		|| iscsi->login_skipped_auth;
+	lp->header_digest = iscsi->header_digest;
+	lp->data_digest = iscsi->data_digest;
+
+	if (cache == NULL) {
+		return;
+	}
+	iscsi_mt_mutex_lock(&cache->lock);
+	clp = iscsi_login_cache_find(cache, lp->initiator_name,
+				     lp->target_name);
+	if (clp == NULL) {
+		/* one that was forgotten */
+		clp = iscsi_login_cache_find(cache, lp->initiator_name, "");
+	}
+	if (clp == NULL) {
+		clp = malloc(sizeof(*clp));
+		if (clp) {
+			clp->next = cache->profiles;
+			cache->profiles = clp;
+		}
+	}
+	if (clp) {
+		struct iscsi_login_profile *next = clp->next;
+
+		*clp = *lp;
+		clp->next = next;
+	}
+	iscsi_mt_mutex_unlock(&cache->lock);
+}
+
+/*
+ * At the start of a login, pick up the profile of the target and see what
+ * can be offered from it.
+ */
+static void
+iscsi_login_profile_apply(struct iscsi_context *iscsi)
+{
+	struct iscsi_login_cache *cache = iscsi->login_cache;
+	struct iscsi_login_profile *lp = &iscsi->login_profile, *clp;
+
+	iscsi->login_skipped_auth = 0;
+	iscsi->login_auth_none = 0;
+
+	if (iscsi->session_type != ISCSI_SESSION_NORMAL) {
+		return;
+	}
+	if (cache) {
+		iscsi_mt_mutex_lock(&cache->lock);
+		clp = iscsi_login_cache_find(cache, iscsi->initiator_name,
+					     iscsi->target_name);
+		if (clp) {
+			*lp = *clp;
+			lp->next = NULL;
+		}
+		iscsi_mt_mutex_unlock(&cache->lock);
+	}
+	if (!lp->target_name[0]
+	||  strcmp(lp->target_name, iscsi->target_name)
+	||  strcmp(lp->initiator_name, iscsi->initiator_name)) {
+		return;
+	}
+
+	switch (iscsi->want_header_digest) {
+	case ISCSI_HEADER_DIGEST_NONE_CRC32C:
+	case ISCSI_HEADER_DIGEST_CRC32C_NONE:
+		iscsi->want_header_digest = lp->header_digest;
+		break;
+	default:
+		break;
+	}
+	switch (iscsi->want_data_digest) {
+	case ISCSI_DATA_DIGEST_NONE_CRC32C:
+	case ISCSI_DATA_DIGEST_CRC32C_NONE:
+		iscsi->want_data_digest = lp->data_digest;
+		break;
+	default:
+		break;
+	}
+
+	/* With mutual CHAP we want the target to prove who it is, so
+	 * we can not leave it out even if it would let us.
+	 */
+	if (lp->auth_none && iscsi->user[0] && !iscsi->target_user[0]) {
+		ISCSI_LOG(iscsi, 2, "target %s did not ask for authentication "
+			  "at the last login, skipping the security "
+			  "negotiation", iscsi->target_name);
+		iscsi->current_phase = ISCSI_PDU_LOGIN_CSG_OPNEG;
+		iscsi->login_skipped_auth = 1;
+	}
+}
+
 int
 iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		  void *private_data)
@@ -1027,6 +1184,7 @@ iscsi_login_async(struct iscsi_context *iscsi, iscsi_command_cb cb,
 		iscsi->itt = (uint32_t) rand();
 		iscsi->cmdsn = (uint32_t) rand();
 		iscsi->expcmdsn = iscsi->maxcmdsn = iscsi->min_cmdsn_waiting = iscsi->cmdsn;
+		iscsi_login_profile_apply(iscsi);
 	}
 
 	pdu = iscsi_allocate_pdu(iscsi,
@@ -1388,6 +1546,13 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			iscsi->max_burst_length = strtol(ptr + 15, NULL, 10);
 		}
 
+		if (!strncmp(ptr, "ErrorRecoveryLevel=", 19)) {
+			if (strtol(ptr + 19, NULL, 10) > 0) {
+				iscsi->error_recovery_level =
+					iscsi->want_error_recovery_level;
+			}
+		}
+
 		if (!strncmp(ptr, "MaxRecvDataSegmentLength=", 25)) {
 			iscsi->target_max_recv_data_segment_length = strtol(ptr + 25, NULL, 10);
 		}
@@ -1407,6 +1572,9 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 			if (!strcmp(ptr + 11, "CHAP")) {
 				iscsi->secneg_phase = ISCSI_LOGIN_SECNEG_PHASE_SELECT_ALGORITHM;
 			}
+			if (!strcmp(ptr + 11, "None")) {
+				iscsi->login_auth_none = 1;
+			}
 		}
 
 		if (!strncmp(ptr, "CHAP_A=", 7)) {
@@ -1509,6 +1677,10 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 	}
 
 	if (status != 0) {
+		if (iscsi->login_skipped_auth) {
+			/* it does want to know who we are after all */
+			iscsi_login_profile_forget(iscsi);
+		}
 		iscsi_set_error(iscsi, "Failed to log in to target. Status: %s(%d)",
 				       login_error_str(status), status);
 		if (pdu->callback) {
@@ -1548,6 +1720,11 @@ iscsi_process_login_reply(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
 		iscsi_itt_post_increment(iscsi);
 		iscsi->header_digest  = iscsi->want_header_digest;
 		iscsi->data_digest  = iscsi->want_data_digest;
+		iscsi_login_profile_save(iscsi);
+		if (iscsi->record_env &&
+		    iscsi->session_type == ISCSI_SESSION_NORMAL) {
+			iscsi_record_env_start(iscsi);
+		}
 		ISCSI_LOG(iscsi, 2, "login successful");
 		pdu->callback(iscsi, SCSI_STATUS_GOOD, NULL, pdu->private_data);
 	} else {
@@ -1630,3 +1807,71 @@ iscsi_set_session_type(struct iscsi_context *iscsi,
 
 	return 0;
 }
+
+struct iscsi_login_cache *
+iscsi_create_login_cache(void)
+{
+	struct iscsi_login_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (cache == NULL) {
+		return NULL;
+	}
+	iscsi_mt_mutex_init(&cache->lock);
+	cache->refs = 1;
+
+	return cache;
+}
+
+static void
+iscsi_login_cache_put(struct iscsi_login_cache *cache)
+{
+	struct iscsi_login_profile *lp;
+	int refs;
+
+	iscsi_mt_mutex_lock(&cache->lock);
+	refs = --cache->refs;
+	iscsi_mt_mutex_unlock(&cache->lock);
+	if (refs) {
+		return;
+	}
+
+	while ((lp = cache->profiles)) {
+		cache->profiles = lp->next;
+		free(lp);
+	}
+	iscsi_mt_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+void
+iscsi_destroy_login_cache(struct iscsi_login_cache *cache)
+{
+	if (cache == NULL) {
+		return;
+	}
+	iscsi_login_cache_put(cache);
+}
+
+int
+iscsi_set_login_cache(struct iscsi_context *iscsi,
+		      struct iscsi_login_cache *cache)
+{
+	if (iscsi->is_loggedin) {
+		iscsi_set_error(iscsi, "trying to set login cache while "
+				"logged in");
+		return -1;
+	}
+
+	if (cache) {
+		iscsi_mt_mutex_lock(&cache->lock);
+		cache->refs++;
+		iscsi_mt_mutex_unlock(&cache->lock);
+	}
+	if (iscsi->login_cache) {
+		iscsi_login_cache_put(iscsi->login_cache);
+	}
+	iscsi->login_cache = cache;
+
+	return 0;
+}
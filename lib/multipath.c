@@ -0,0 +1,1347 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * ALUA aware multipath devices.
+ *
+ * Every path is a context of its own, logged in to the LU through one
+ * target port. The Device Identification VPD of each path names the LU,
+ * which has to be the same on all of them, and the target port group the
+ * path goes through. REPORT TARGET PORT GROUPS gives the ALUA state of
+ * every group and is asked again whenever a path reports that the states
+ * changed or are changing, or a path that was down is back.
+ *
+ * Commands go to the paths in the best state there is according to the
+ * policy. Those that fail because of their path are sent again on another
+ * one, or wait in the multipath device until one is usable.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef AROS
+#include "aros/aros_compat.h"
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+#define MPATH_RETRY_MS		1000	/* between tries to find a path */
+#define MPATH_IDLE_MS		100
+#define MPATH_RTPG_ALLOC	1024
+#define MPATH_RTPG_TRIES	3	/* when RTPG gets a UNIT ATTENTION */
+#define MPATH_LU_ID_LEN		256
+#define MPATH_EWMA_SHIFT	3	/* service time average over ~8 */
+
+struct iscsi_mpath_path {
+	struct iscsi_multipath *mp;
+	struct iscsi_context *iscsi;
+	char portal[MAX_STRING_SIZE + 1];
+	int lun;
+
+	int busy;		/* connecting or logging out */
+	int failed;		/* did not log in, or is another LU */
+	int was_up;
+	int tpg;		/* target port group, -1 if not known */
+
+	int in_flight;
+	struct iscsi_mpath_cmd *cmds;	/* in flight */
+	uint64_t service_us;	/* average time commands take */
+};
+
+struct iscsi_mpath_group {
+	int id;
+	int state;
+};
+
+struct iscsi_mpath_cmd {
+	struct iscsi_mpath_cmd *next;	/* while waiting for a path */
+	struct iscsi_mpath_cmd *prev_sent, *next_sent;	/* on path->cmds */
+	struct iscsi_multipath *mp;
+	struct iscsi_mpath_path *path;
+	int failover;		/* cancelled because its path went down */
+	struct scsi_task *task;
+	struct iscsi_data data;		/* until it is in the task */
+	iscsi_command_cb cb;
+	void *private_data;
+
+	int tries;
+	int status;		/* of the last try */
+	uint64_t start_us;	/* of the last try */
+	uint64_t deadline_us;	/* to find a path, 0 until it needs one */
+};
+
+struct iscsi_multipath {
+	char initiator_name[MAX_STRING_SIZE + 1];
+	struct iscsi_mpath_path **paths;
+	int count;
+	int next;		/* where the search for a path starts */
+	enum iscsi_multipath_policy policy;
+	int no_path_timeout;
+	int connected;
+
+	/* the LU designator all paths have to report */
+	unsigned char lu_id[MPATH_LU_ID_LEN];
+	int lu_id_len;
+	int lu_id_type;
+
+	struct iscsi_mpath_group *groups;
+	int ngroups;
+	int alua;		/* REPORT TARGET PORT GROUPS works */
+	int refresh;		/* the group states are stale */
+	uint64_t refresh_us;	/* not before */
+	int rtpg_in_flight;
+	int rtpg_tries;
+
+	struct iscsi_mpath_cmd *waiting;
+	uint64_t retry_us;
+
+	/* connect or logout of all paths */
+	iscsi_multipath_cb cb;
+	void *private_data;
+	int pending;
+	int status;
+	int starting;
+	int connecting;
+
+	int destroying;
+	char error[MAX_STRING_SIZE + 1];
+};
+
+struct iscsi_mpath_sync_state {
+	int finished;
+	int status;
+};
+
+static int mpath_send_rtpg(struct iscsi_multipath *mp, int alloc_len);
+static void mpath_dispatch_waiting(struct iscsi_multipath *mp);
+
+static void
+mpath_set_error(struct iscsi_multipath *mp, const char *error, ...)
+{
+	va_list ap;
+
+	va_start(ap, error);
+	vsnprintf(mp->error, sizeof(mp->error), error, ap);
+	va_end(ap);
+}
+
+static int
+mpath_index(struct iscsi_mpath_path *path)
+{
+	int i;
+
+	for (i = 0; i < path->mp->count; i++) {
+		if (path->mp->paths[i] == path) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+struct iscsi_multipath *
+iscsi_multipath_create(const char *initiator_name)
+{
+	struct iscsi_multipath *mp;
+
+	mp = calloc(1, sizeof(*mp));
+	if (mp == NULL) {
+		return NULL;
+	}
+	strncpy(mp->initiator_name, initiator_name, MAX_STRING_SIZE);
+	mp->policy = ISCSI_MULTIPATH_ROUND_ROBIN;
+	mp->no_path_timeout = 30;
+	mp->alua = 1;
+
+	return mp;
+}
+
+int
+iscsi_multipath_add_path(struct iscsi_multipath *mp, const char *url)
+{
+	struct iscsi_mpath_path *path, **paths;
+	struct iscsi_url *iscsi_url;
+
+	if (mp->connected || mp->connecting) {
+		mpath_set_error(mp, "Paths have to be added before "
+				"connecting");
+		return -1;
+	}
+
+	paths = realloc(mp->paths, (mp->count + 1) * sizeof(*paths));
+	if (paths == NULL) {
+		mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				"paths");
+		return -1;
+	}
+	mp->paths = paths;
+
+	path = calloc(1, sizeof(*path));
+	if (path == NULL) {
+		mpath_set_error(mp, "Out-of-memory: Failed to allocate path");
+		return -1;
+	}
+	path->mp = mp;
+	path->tpg = -1;
+	path->iscsi = iscsi_create_context(mp->initiator_name);
+	if (path->iscsi == NULL) {
+		mpath_set_error(mp, "Failed to create context");
+		free(path);
+		return -1;
+	}
+
+	iscsi_url = iscsi_parse_full_url(path->iscsi, url);
+	if (iscsi_url == NULL) {
+		mpath_set_error(mp, "Failed to parse URL: %s",
+				iscsi_get_error(path->iscsi));
+		iscsi_destroy_context(path->iscsi);
+		free(path);
+		return -1;
+	}
+	strncpy(path->portal, iscsi_url->portal, MAX_STRING_SIZE);
+	path->lun = iscsi_url->lun;
+	iscsi_destroy_url(iscsi_url);
+
+	iscsi_set_session_type(path->iscsi, ISCSI_SESSION_NORMAL);
+	path->iscsi->multipath = mp;
+
+	mp->paths[mp->count] = path;
+	return mp->count++;
+}
+
+static void
+mpath_cmd_finish(struct iscsi_mpath_cmd *cmd, struct iscsi_context *iscsi,
+		 int status)
+{
+	cmd->cb(iscsi, status, cmd->task, cmd->private_data);
+	free(cmd);
+}
+
+void
+iscsi_multipath_destroy(struct iscsi_multipath *mp)
+{
+	struct iscsi_mpath_cmd *cmd;
+	int i;
+
+	if (mp == NULL) {
+		return;
+	}
+
+	/* from here on everything completes as it is */
+	mp->destroying = 1;
+	while ((cmd = mp->waiting) != NULL) {
+		ISCSI_LIST_REMOVE(&mp->waiting, cmd);
+		mpath_cmd_finish(cmd, mp->paths[0]->iscsi,
+				 SCSI_STATUS_CANCELLED);
+	}
+	for (i = 0; i < mp->count; i++) {
+		iscsi_destroy_context(mp->paths[i]->iscsi);
+	}
+	for (i = 0; i < mp->count; i++) {
+		free(mp->paths[i]);
+	}
+	free(mp->paths);
+	free(mp->groups);
+	free(mp);
+}
+
+int
+iscsi_multipath_get_path_count(struct iscsi_multipath *mp)
+{
+	return mp->count;
+}
+
+struct iscsi_context *
+iscsi_multipath_get_context(struct iscsi_multipath *mp, int n)
+{
+	if (n < 0 || n >= mp->count) {
+		return NULL;
+	}
+	return mp->paths[n]->iscsi;
+}
+
+const char *
+iscsi_multipath_get_error(struct iscsi_multipath *mp)
+{
+	return mp->error;
+}
+
+void
+iscsi_multipath_set_policy(struct iscsi_multipath *mp,
+			   enum iscsi_multipath_policy policy)
+{
+	mp->policy = policy;
+}
+
+void
+iscsi_multipath_set_no_path_timeout(struct iscsi_multipath *mp,
+				    int seconds)
+{
+	mp->no_path_timeout = seconds;
+}
+
+static int
+mpath_path_up(struct iscsi_mpath_path *path)
+{
+	return !path->failed && path->iscsi->old_iscsi == NULL &&
+		iscsi_is_logged_in(path->iscsi);
+}
+
+static struct iscsi_mpath_group *
+mpath_find_group(struct iscsi_multipath *mp, int id)
+{
+	int i;
+
+	for (i = 0; i < mp->ngroups; i++) {
+		if (mp->groups[i].id == id) {
+			return &mp->groups[i];
+		}
+	}
+	return NULL;
+}
+
+static int
+mpath_path_state(struct iscsi_mpath_path *path)
+{
+	struct iscsi_multipath *mp = path->mp;
+	struct iscsi_mpath_group *group;
+
+	if (!mp->alua || path->tpg < 0) {
+		return SCSI_ALUA_ACTIVE_OPTIMIZED;
+	}
+	group = mpath_find_group(mp, path->tpg);
+	if (group == NULL) {
+		return SCSI_ALUA_ACTIVE_NONOPTIMIZED;
+	}
+	return group->state;
+}
+
+int
+iscsi_multipath_get_path_state(struct iscsi_multipath *mp, int n)
+{
+	if (n < 0 || n >= mp->count || !mpath_path_up(mp->paths[n])) {
+		return -1;
+	}
+	return mpath_path_state(mp->paths[n]);
+}
+
+/*
+ * Paths in a lower tier are preferred, those without one can not take
+ * commands.
+ */
+static int
+mpath_tier(int state)
+{
+	switch (state) {
+	case SCSI_ALUA_ACTIVE_OPTIMIZED:
+		return 0;
+	case SCSI_ALUA_ACTIVE_NONOPTIMIZED:
+	case SCSI_ALUA_LOGICAL_BLOCK_DEPENDENT:
+		return 1;
+	default:
+		return -1;
+	}
+}
+
+static struct iscsi_mpath_path *
+mpath_pick_path(struct iscsi_multipath *mp)
+{
+	struct iscsi_mpath_path *best = NULL;
+	uint64_t best_score = 0;
+	int best_tier = 0, best_index = 0;
+	int i;
+
+	for (i = 0; i < mp->count; i++) {
+		int index = (mp->next + i) % mp->count;
+		struct iscsi_mpath_path *path = mp->paths[index];
+		uint64_t score;
+		int tier;
+
+		if (!mpath_path_up(path)) {
+			continue;
+		}
+		tier = mpath_tier(mpath_path_state(path));
+		if (tier < 0) {
+			continue;
+		}
+
+		switch (mp->policy) {
+		case ISCSI_MULTIPATH_QUEUE_LENGTH:
+			score = path->in_flight;
+			break;
+		case ISCSI_MULTIPATH_SERVICE_TIME:
+			score = (uint64_t)(path->in_flight + 1) *
+				(path->service_us ? path->service_us : 1);
+			break;
+		default:
+			score = i;
+			break;
+		}
+		if (best == NULL || tier < best_tier ||
+		    (tier == best_tier && score < best_score)) {
+			best = path;
+			best_tier = tier;
+			best_score = score;
+			best_index = index;
+		}
+	}
+
+	if (best != NULL && mp->policy == ISCSI_MULTIPATH_ROUND_ROBIN) {
+		mp->next = (best_index + 1) % mp->count;
+	} else if (mp->count) {
+		/* so that ties do not always go to the same path */
+		mp->next = (mp->next + 1) % mp->count;
+	}
+	return best;
+}
+
+/*
+ * Connect and logout of all paths share the completion: it is done when
+ * the last path is.
+ */
+static void
+mpath_op_done(struct iscsi_multipath *mp)
+{
+	/* NULL if a sync caller gave up waiting */
+	if (mp->cb != NULL) {
+		mp->cb(mp, mp->status, mp->private_data);
+	}
+}
+
+static void
+mpath_connect_done(struct iscsi_multipath *mp)
+{
+	int i, usable = 0;
+
+	for (i = 0; i < mp->count; i++) {
+		if (mpath_path_up(mp->paths[i])) {
+			usable++;
+		}
+	}
+	if (usable == 0) {
+		mp->connecting = 0;
+		mp->status = SCSI_STATUS_ERROR;
+		mpath_op_done(mp);
+		return;
+	}
+
+	/* a path that failed does not fail the device */
+	mp->status = SCSI_STATUS_GOOD;
+	mp->connected = 1;
+	for (i = 0; i < mp->count; i++) {
+		mp->paths[i]->was_up = mpath_path_up(mp->paths[i]);
+	}
+	mp->rtpg_tries = 0;
+	if (mpath_send_rtpg(mp, MPATH_RTPG_ALLOC) != 0) {
+		mp->alua = 0;
+		mp->connecting = 0;
+		mpath_op_done(mp);
+	}
+}
+
+static void
+mpath_path_setup_done(struct iscsi_mpath_path *path)
+{
+	struct iscsi_multipath *mp = path->mp;
+
+	path->busy = 0;
+	if (--mp->pending == 0 && !mp->starting) {
+		mpath_connect_done(mp);
+	}
+}
+
+/*
+ * The designator the LU is identified by, the same way as for EXTENDED
+ * COPY: NAA before EUI-64 before T10 vendor ID.
+ */
+static struct scsi_inquiry_device_designator *
+mpath_lu_designator(struct scsi_inquiry_device_identification *inq)
+{
+	struct scsi_inquiry_device_designator *desig, *best = NULL;
+
+	for (desig = inq->designators; desig; desig = desig->next) {
+		if (desig->association != SCSI_ASSOCIATION_LOGICAL_UNIT ||
+		    desig->designator_length > MPATH_LU_ID_LEN) {
+			continue;
+		}
+		switch (desig->designator_type) {
+		case SCSI_DESIGNATOR_TYPE_T10_VENDORT_ID:
+		case SCSI_DESIGNATOR_TYPE_EUI_64:
+		case SCSI_DESIGNATOR_TYPE_NAA:
+		case SCSI_DESIGNATOR_TYPE_SCSI_NAME_STRING:
+			if (best == NULL ||
+			    (best->designator_type != SCSI_DESIGNATOR_TYPE_NAA &&
+			     best->designator_type < desig->designator_type)) {
+				best = desig;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	return best;
+}
+
+static void
+mpath_devid_cb(struct iscsi_context *iscsi, int status,
+	       void *command_data, void *private_data)
+{
+	struct iscsi_mpath_path *path = private_data;
+	struct iscsi_multipath *mp = path->mp;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_device_identification *inq = NULL;
+	struct scsi_inquiry_device_designator *desig;
+
+	if (status == SCSI_STATUS_GOOD) {
+		inq = scsi_datain_unmarshall(task);
+	}
+	if (inq == NULL) {
+		/* nothing to check the LU with, or to find its group */
+		ISCSI_LOG(iscsi, 1, "multipath: path %d has no device "
+			  "identification", mpath_index(path));
+		goto finished;
+	}
+
+	desig = mpath_lu_designator(inq);
+	if (desig != NULL) {
+		if (mp->lu_id_len == 0) {
+			memcpy(mp->lu_id, desig->designator,
+			       desig->designator_length);
+			mp->lu_id_len = desig->designator_length;
+			mp->lu_id_type = desig->designator_type;
+		} else if (mp->lu_id_type != (int)desig->designator_type ||
+			   mp->lu_id_len != desig->designator_length ||
+			   memcmp(mp->lu_id, desig->designator,
+				  mp->lu_id_len)) {
+			mpath_set_error(mp, "Path %d leads to another LU",
+					mpath_index(path));
+			path->failed = 1;
+			goto finished;
+		}
+	}
+
+	for (desig = inq->designators; desig; desig = desig->next) {
+		if (desig->association == SCSI_ASSOCIATION_TARGET_PORT &&
+		    desig->designator_type ==
+		    SCSI_DESIGNATOR_TYPE_TARGET_PORT_GROUP &&
+		    desig->designator_length >= 4) {
+			path->tpg = scsi_get_uint16((unsigned char *)
+						    &desig->designator[2]);
+		}
+	}
+
+ finished:
+	if (task != NULL) {
+		scsi_free_scsi_task(task);
+	}
+	mpath_path_setup_done(path);
+}
+
+static void
+mpath_connect_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	struct iscsi_mpath_path *path = private_data;
+	struct iscsi_multipath *mp = path->mp;
+
+	if (status != SCSI_STATUS_GOOD) {
+		mpath_set_error(mp, "Path %d: %s", mpath_index(path),
+				iscsi_get_error(iscsi));
+		path->failed = 1;
+		mpath_path_setup_done(path);
+		return;
+	}
+
+	if (iscsi_inquiry_task(iscsi, path->lun, 1,
+			       SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+			       255, mpath_devid_cb, path) == NULL) {
+		mpath_set_error(mp, "Path %d: %s", mpath_index(path),
+				iscsi_get_error(iscsi));
+		path->failed = 1;
+		mpath_path_setup_done(path);
+	}
+}
+
+int
+iscsi_multipath_connect_async(struct iscsi_multipath *mp,
+			      iscsi_multipath_cb cb, void *private_data)
+{
+	int i, started = 0;
+
+	if (mp->count == 0) {
+		mpath_set_error(mp, "No paths to connect");
+		return -1;
+	}
+
+	mp->cb = cb;
+	mp->private_data = private_data;
+	mp->status = SCSI_STATUS_GOOD;
+	mp->pending = 0;
+	mp->starting = 1;
+	mp->connecting = 1;
+
+	for (i = 0; i < mp->count; i++) {
+		struct iscsi_mpath_path *path = mp->paths[i];
+
+		if (iscsi_full_connect_async(path->iscsi, path->portal,
+					     path->lun, mpath_connect_cb,
+					     path) != 0) {
+			mpath_set_error(mp, "Path %d: %s", i,
+					iscsi_get_error(path->iscsi));
+			path->failed = 1;
+			continue;
+		}
+		path->busy = 1;
+		mp->pending++;
+		started++;
+	}
+
+	mp->starting = 0;
+	if (started == 0) {
+		mp->connecting = 0;
+		return -1;
+	}
+	if (mp->pending == 0) {
+		mpath_connect_done(mp);
+	}
+	return 0;
+}
+
+static void
+mpath_logout_cb(struct iscsi_context *iscsi, int status,
+		void *command_data, void *private_data)
+{
+	struct iscsi_mpath_path *path = private_data;
+	struct iscsi_multipath *mp = path->mp;
+
+	path->busy = 0;
+	if (status != SCSI_STATUS_GOOD) {
+		mpath_set_error(mp, "Path %d: %s", mpath_index(path),
+				iscsi_get_error(iscsi));
+		mp->status = status;
+	}
+	if (--mp->pending == 0 && !mp->starting) {
+		mpath_op_done(mp);
+	}
+}
+
+int
+iscsi_multipath_logout_async(struct iscsi_multipath *mp,
+			     iscsi_multipath_cb cb, void *private_data)
+{
+	int i, started = 0;
+
+	mp->cb = cb;
+	mp->private_data = private_data;
+	mp->status = SCSI_STATUS_GOOD;
+	mp->pending = 0;
+	mp->starting = 1;
+	mp->connected = 0;
+
+	for (i = 0; i < mp->count; i++) {
+		struct iscsi_mpath_path *path = mp->paths[i];
+
+		if (!iscsi_is_logged_in(path->iscsi)) {
+			continue;
+		}
+		if (iscsi_logout_async(path->iscsi, mpath_logout_cb,
+				       path) != 0) {
+			mpath_set_error(mp, "Path %d: %s", i,
+					iscsi_get_error(path->iscsi));
+			mp->status = SCSI_STATUS_ERROR;
+			continue;
+		}
+		path->busy = 1;
+		mp->pending++;
+		started++;
+	}
+
+	mp->starting = 0;
+	if (started == 0 && mp->status != SCSI_STATUS_GOOD) {
+		return -1;
+	}
+	if (mp->pending == 0) {
+		mpath_op_done(mp);
+	}
+	return 0;
+}
+
+/*
+ * ALUA states
+ */
+static void
+mpath_rtpg_cb(struct iscsi_context *iscsi, int status,
+	      void *command_data, void *private_data)
+{
+	struct iscsi_multipath *mp = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_report_target_port_groups *rtpg;
+	int full_size, i;
+
+	mp->rtpg_in_flight = 0;
+	if (mp->destroying) {
+		scsi_free_scsi_task(task);
+		return;
+	}
+
+	if (status == SCSI_STATUS_GOOD) {
+		full_size = scsi_datain_getfullsize(task);
+		if (full_size > task->datain.size &&
+		    full_size > MPATH_RTPG_ALLOC) {
+			scsi_free_scsi_task(task);
+			if (mpath_send_rtpg(mp, full_size) == 0) {
+				return;
+			}
+			goto retry;
+		}
+		rtpg = scsi_datain_unmarshall(task);
+		if (rtpg == NULL) {
+			goto unsupported;
+		}
+		free(mp->groups);
+		mp->groups = calloc(rtpg->num_groups ? rtpg->num_groups : 1,
+				    sizeof(*mp->groups));
+		mp->ngroups = 0;
+		if (mp->groups == NULL) {
+			scsi_free_scsi_task(task);
+			goto retry;
+		}
+		for (i = 0; i < rtpg->num_groups; i++) {
+			mp->groups[i].id = rtpg->groups[i].port_group;
+			/* not the bitfield, its layout is not portable */
+			mp->groups[i].state = rtpg->groups[i].byte0 & 0x0f;
+			ISCSI_LOG(iscsi, 2, "multipath: port group %d is %s",
+				  mp->groups[i].id,
+				  scsi_alua_state_to_str(mp->groups[i].state));
+		}
+		mp->ngroups = rtpg->num_groups;
+		mp->alua = 1;
+		mp->refresh = 0;
+		scsi_free_scsi_task(task);
+		goto done;
+	}
+
+	if (status == SCSI_STATUS_CHECK_CONDITION &&
+	    task->sense.key == SCSI_SENSE_UNIT_ATTENTION &&
+	    ++mp->rtpg_tries < MPATH_RTPG_TRIES) {
+		scsi_free_scsi_task(task);
+		if (mpath_send_rtpg(mp, MPATH_RTPG_ALLOC) == 0) {
+			return;
+		}
+		goto retry;
+	}
+	if (status == SCSI_STATUS_CHECK_CONDITION &&
+	    task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST) {
+		goto unsupported;
+	}
+	scsi_free_scsi_task(task);
+
+ retry:
+	/* keep the states we have, and ask again later */
+	mp->refresh = 1;
+	mp->refresh_us = iscsi_clock_us() + MPATH_RETRY_MS * 1000;
+	goto done;
+
+ unsupported:
+	/* no ALUA, all paths are the same */
+	ISCSI_LOG(iscsi, 2, "multipath: REPORT TARGET PORT GROUPS is not "
+		  "supported");
+	scsi_free_scsi_task(task);
+	mp->alua = 0;
+	mp->refresh = 0;
+
+ done:
+	if (mp->connecting) {
+		mp->connecting = 0;
+		mpath_op_done(mp);
+	}
+	mpath_dispatch_waiting(mp);
+}
+
+static int
+mpath_send_rtpg(struct iscsi_multipath *mp, int alloc_len)
+{
+	struct iscsi_mpath_path *path = NULL;
+	struct scsi_task *task;
+	int i;
+
+	/* any path will do, RTPG is allowed in every state */
+	for (i = 0; i < mp->count; i++) {
+		if (mpath_path_up(mp->paths[i])) {
+			path = mp->paths[i];
+			break;
+		}
+	}
+	if (path == NULL) {
+		return -1;
+	}
+
+	task = scsi_cdb_report_target_port_groups(alloc_len);
+	if (task == NULL) {
+		return -1;
+	}
+	if (iscsi_scsi_command_async(path->iscsi, path->lun, task,
+				     mpath_rtpg_cb, NULL, mp) != 0) {
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	mp->rtpg_in_flight = 1;
+	return 0;
+}
+
+static void
+mpath_refresh(struct iscsi_multipath *mp)
+{
+	mp->refresh = 1;
+	mp->refresh_us = 0;
+}
+
+/*
+ * Commands
+ */
+static void mpath_command_cb(struct iscsi_context *iscsi, int status,
+			     void *command_data, void *private_data);
+
+/*
+ * Returns 0 if the command was sent, 1 if there is no path for it and -1
+ * if it could not be queued on the path.
+ */
+static int
+mpath_cmd_send(struct iscsi_mpath_cmd *cmd)
+{
+	struct iscsi_multipath *mp = cmd->mp;
+	struct iscsi_mpath_path *path;
+	struct scsi_task *task = cmd->task;
+	struct iscsi_data *d = NULL;
+
+	path = mpath_pick_path(mp);
+	if (path == NULL) {
+		return 1;
+	}
+
+	if (cmd->tries++ == 0) {
+		if (cmd->data.data != NULL) {
+			d = &cmd->data;
+		}
+	} else {
+		/* as for a reconnect, the data is in the task by now */
+		free(task->datain.data);
+		task->datain.data = NULL;
+		task->datain.size = 0;
+		scsi_task_reset_iov(&task->iovector_in);
+		scsi_task_reset_iov(&task->iovector_out);
+	}
+
+	cmd->path = path;
+	cmd->failover = 0;
+	cmd->start_us = iscsi_clock_us();
+	if (iscsi_scsi_command_async(path->iscsi, path->lun, task,
+				     mpath_command_cb, d, cmd) != 0) {
+		mpath_set_error(mp, "Path %d: %s", mpath_index(path),
+				iscsi_get_error(path->iscsi));
+		return -1;
+	}
+	path->in_flight++;
+	cmd->prev_sent = NULL;
+	cmd->next_sent = path->cmds;
+	if (path->cmds != NULL) {
+		path->cmds->prev_sent = cmd;
+	}
+	path->cmds = cmd;
+	return 0;
+}
+
+static void
+mpath_cmd_wait(struct iscsi_mpath_cmd *cmd)
+{
+	struct iscsi_multipath *mp = cmd->mp;
+
+	if (cmd->deadline_us == 0) {
+		cmd->deadline_us = iscsi_clock_us() +
+			(uint64_t)mp->no_path_timeout * 1000000;
+	}
+	if (mp->waiting == NULL) {
+		mp->retry_us = iscsi_clock_us() + MPATH_RETRY_MS * 1000;
+	}
+	ISCSI_LIST_ADD_END(&mp->waiting, cmd);
+}
+
+/*
+ * Send it again on another path, right away while there are paths it did
+ * not go through yet and after a while once it has been through all.
+ */
+static void
+mpath_cmd_retry(struct iscsi_mpath_cmd *cmd)
+{
+	struct iscsi_multipath *mp = cmd->mp;
+
+	if (cmd->deadline_us == 0) {
+		cmd->deadline_us = iscsi_clock_us() +
+			(uint64_t)mp->no_path_timeout * 1000000;
+	}
+	if (cmd->tries % mp->count != 0 && mpath_cmd_send(cmd) == 0) {
+		return;
+	}
+	mpath_cmd_wait(cmd);
+}
+
+/*
+ * Whether a command failed because of the path it went through.
+ */
+static int
+mpath_path_failure(struct iscsi_mpath_cmd *cmd, int status)
+{
+	struct iscsi_multipath *mp = cmd->mp;
+	struct scsi_task *task = cmd->task;
+	struct iscsi_mpath_group *group;
+	int state;
+
+	if (cmd->failover) {
+		return 1;
+	}
+	switch (status) {
+	case SCSI_STATUS_ERROR:
+	case SCSI_STATUS_TIMEOUT:
+		return 1;
+	case SCSI_STATUS_CHECK_CONDITION:
+		break;
+	default:
+		return 0;
+	}
+
+	if (task->sense.key == SCSI_SENSE_UNIT_ATTENTION &&
+	    task->sense.ascq == SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED) {
+		mpath_refresh(mp);
+		return 1;
+	}
+	if (task->sense.key != SCSI_SENSE_NOT_READY) {
+		return 0;
+	}
+	switch (task->sense.ascq) {
+	case SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_TRANSITION:
+		state = SCSI_ALUA_TRANSITIONING;
+		break;
+	case SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY_STATE:
+		state = SCSI_ALUA_STANDBY;
+		break;
+	case SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE_STATE:
+		state = SCSI_ALUA_UNAVAILABLE;
+		break;
+	default:
+		return 0;
+	}
+
+	/* until RTPG says otherwise */
+	group = mpath_find_group(mp, cmd->path->tpg);
+	if (group != NULL) {
+		group->state = state;
+	}
+	mpath_refresh(mp);
+	return 1;
+}
+
+static void
+mpath_command_cb(struct iscsi_context *iscsi, int status,
+		 void *command_data, void *private_data)
+{
+	struct iscsi_mpath_cmd *cmd = private_data;
+	struct iscsi_multipath *mp = cmd->mp;
+	struct iscsi_mpath_path *path = cmd->path;
+
+	path->in_flight--;
+	if (cmd->prev_sent != NULL) {
+		cmd->prev_sent->next_sent = cmd->next_sent;
+	} else {
+		path->cmds = cmd->next_sent;
+	}
+	if (cmd->next_sent != NULL) {
+		cmd->next_sent->prev_sent = cmd->prev_sent;
+	}
+	if (status == SCSI_STATUS_GOOD) {
+		uint64_t us = iscsi_clock_us() - cmd->start_us;
+
+		if (path->service_us == 0) {
+			path->service_us = us;
+		} else {
+			path->service_us += (int64_t)(us - path->service_us) >>
+				MPATH_EWMA_SHIFT;
+		}
+	}
+
+	cmd->status = status;
+	if (!mp->destroying && mp->connected &&
+	    mpath_path_failure(cmd, status)) {
+		ISCSI_LOG(iscsi, 2, "multipath: command failed on path %d, "
+			  "trying again: %s", mpath_index(path),
+			  iscsi_get_error(iscsi));
+		mpath_cmd_retry(cmd);
+		return;
+	}
+
+	cmd->cb(iscsi, status, command_data, cmd->private_data);
+	free(cmd);
+}
+
+static void
+mpath_dispatch_waiting(struct iscsi_multipath *mp)
+{
+	struct iscsi_mpath_cmd *cmds = mp->waiting, *cmd;
+	uint64_t now = iscsi_clock_us();
+
+	mp->waiting = NULL;
+	while ((cmd = cmds) != NULL) {
+		ISCSI_LIST_REMOVE(&cmds, cmd);
+
+		if (mpath_cmd_send(cmd) == 0) {
+			continue;
+		}
+		if (now >= cmd->deadline_us) {
+			struct iscsi_context *iscsi = cmd->path ?
+				cmd->path->iscsi : mp->paths[0]->iscsi;
+
+			iscsi_set_error(iscsi, "No usable path to the LU");
+			mpath_cmd_finish(cmd, iscsi, cmd->status);
+			continue;
+		}
+		ISCSI_LIST_ADD_END(&mp->waiting, cmd);
+	}
+	if (mp->waiting != NULL) {
+		mp->retry_us = now + MPATH_RETRY_MS * 1000;
+	}
+}
+
+static struct iscsi_mpath_cmd *
+mpath_command_start(struct iscsi_multipath *mp,
+		    struct scsi_task *task, iscsi_command_cb cb,
+		    struct iscsi_data *data, void *private_data)
+{
+	struct iscsi_mpath_cmd *cmd;
+	int ret;
+
+	if (!mp->connected) {
+		mpath_set_error(mp, "Multipath device is not connected");
+		return NULL;
+	}
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (cmd == NULL) {
+		mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				"multipath command");
+		return NULL;
+	}
+	cmd->mp = mp;
+	cmd->task = task;
+	cmd->cb = cb;
+	cmd->private_data = private_data;
+	cmd->status = SCSI_STATUS_ERROR;
+	if (data != NULL) {
+		cmd->data = *data;
+	}
+
+	ret = mpath_cmd_send(cmd);
+	if (ret < 0) {
+		free(cmd);
+		return NULL;
+	}
+	if (ret > 0) {
+		mpath_cmd_wait(cmd);
+	}
+	return cmd;
+}
+
+int
+iscsi_multipath_command_async(struct iscsi_multipath *mp,
+			      struct scsi_task *task, iscsi_command_cb cb,
+			      struct iscsi_data *data, void *private_data)
+{
+	if (mpath_command_start(mp, task, cb, data, private_data) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * The commands of a path that went down would wait for it to reconnect,
+ * take them back to send them on another one.
+ */
+static void
+mpath_path_down(struct iscsi_mpath_path *path)
+{
+	struct iscsi_mpath_cmd *cmd, *next;
+
+	for (cmd = path->cmds; cmd; cmd = next) {
+		next = cmd->next_sent;
+		cmd->failover = 1;
+		if (iscsi_scsi_cancel_task(path->iscsi, cmd->task) != 0) {
+			cmd->failover = 0;
+		}
+	}
+}
+
+void
+iscsi_multipath_service(struct iscsi_context *iscsi)
+{
+	struct iscsi_multipath *mp = iscsi->multipath;
+	uint64_t now;
+	int i;
+
+	if (!mp->connected || mp->destroying) {
+		return;
+	}
+
+	for (i = 0; i < mp->count; i++) {
+		struct iscsi_mpath_path *path = mp->paths[i];
+		int up = mpath_path_up(path);
+
+		if (up && !path->was_up) {
+			ISCSI_LOG(iscsi, 2, "multipath: path %d is back", i);
+			mpath_refresh(mp);
+			mp->retry_us = 0;
+		}
+		if (!up && path->was_up) {
+			ISCSI_LOG(iscsi, 2, "multipath: path %d is down", i);
+			mpath_path_down(path);
+		}
+		path->was_up = up;
+	}
+
+	now = iscsi_clock_us();
+	if (mp->refresh && !mp->rtpg_in_flight && now >= mp->refresh_us) {
+		if (!mp->alua) {
+			mp->refresh = 0;
+		} else {
+			mp->rtpg_tries = 0;
+			if (mpath_send_rtpg(mp, MPATH_RTPG_ALLOC) != 0) {
+				mp->refresh_us = now + MPATH_RETRY_MS * 1000;
+			}
+		}
+	}
+	if (mp->waiting != NULL && !mp->rtpg_in_flight &&
+	    now >= mp->retry_us) {
+		mpath_dispatch_waiting(mp);
+	}
+}
+
+int
+iscsi_multipath_next_ms(struct iscsi_context *iscsi)
+{
+	struct iscsi_multipath *mp = iscsi->multipath;
+	uint64_t now, next = UINT64_MAX;
+
+	if (mp == NULL || !mp->connected || mp->destroying ||
+	    mp->rtpg_in_flight) {
+		return -1;
+	}
+	if (mp->refresh && mp->alua) {
+		next = mp->refresh_us;
+	}
+	if (mp->waiting != NULL && mp->retry_us < next) {
+		next = mp->retry_us;
+	}
+	if (next == UINT64_MAX) {
+		return -1;
+	}
+
+	now = iscsi_clock_us();
+	if (next <= now) {
+		return 0;
+	}
+	return (int)((next - now + 999) / 1000);
+}
+
+/*
+ * Synchronous multipath functions
+ */
+static int
+mpath_path_active(struct iscsi_mpath_path *path)
+{
+	return path->busy || path->iscsi->old_iscsi != NULL ||
+		(!path->failed && iscsi_is_logged_in(path->iscsi));
+}
+
+static int
+mpath_event_loop(struct iscsi_multipath *mp,
+		 struct iscsi_mpath_sync_state *state)
+{
+	struct pollfd *pfd;
+	int i, ret, timeout;
+
+	pfd = malloc(mp->count * sizeof(*pfd));
+	if (pfd == NULL) {
+		mpath_set_error(mp, "Out-of-memory: Failed to allocate "
+				"pollfds");
+		return -1;
+	}
+
+	while (state->finished == 0) {
+		timeout = -1;
+		for (i = 0; i < mp->count; i++) {
+			struct iscsi_context *iscsi = mp->paths[i]->iscsi;
+			int ms;
+
+			pfd[i].revents = 0;
+			if (!mpath_path_active(mp->paths[i])) {
+				pfd[i].fd = -1;
+				pfd[i].events = 0;
+				continue;
+			}
+			pfd[i].fd = iscsi_get_fd(iscsi);
+			pfd[i].events = iscsi_which_events(iscsi);
+
+			ms = iscsi_timeout_next(iscsi);
+			if (pfd[i].fd < 0 || pfd[i].events == 0) {
+				/* see iscsi_which_events() */
+				pfd[i].fd = -1;
+				if (ms < 0 || ms > MPATH_IDLE_MS) {
+					ms = MPATH_IDLE_MS;
+				}
+			}
+			if (ms >= 0 && (timeout < 0 || ms < timeout)) {
+				timeout = ms;
+			}
+		}
+
+		ret = poll(pfd, mp->count, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			mpath_set_error(mp, "Poll failed");
+			free(pfd);
+			return -1;
+		}
+
+		for (i = 0; i < mp->count; i++) {
+			struct iscsi_context *iscsi = mp->paths[i]->iscsi;
+
+			if (!mpath_path_active(mp->paths[i])) {
+				continue;
+			}
+			if (iscsi_service(iscsi, pfd[i].revents) < 0) {
+				/* the other paths carry on */
+				ISCSI_LOG(iscsi, 1, "multipath: path %d "
+					  "failed: %s", i,
+					  iscsi_get_error(iscsi));
+			}
+		}
+	}
+
+	free(pfd);
+	return 0;
+}
+
+static void
+mpath_sync_cb(struct iscsi_multipath *mp, int status,
+	      void *private_data)
+{
+	struct iscsi_mpath_sync_state *state = private_data;
+
+	state->status = status;
+	state->finished = 1;
+}
+
+static void
+mpath_command_sync_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct iscsi_mpath_sync_state *state = private_data;
+
+	state->status = status;
+	state->finished = 1;
+}
+
+int
+iscsi_multipath_connect_sync(struct iscsi_multipath *mp)
+{
+	struct iscsi_mpath_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_multipath_connect_async(mp, mpath_sync_cb, &state) != 0) {
+		return -1;
+	}
+	if (mpath_event_loop(mp, &state) != 0) {
+		mp->cb = NULL;
+		return -1;
+	}
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
+int
+iscsi_multipath_logout_sync(struct iscsi_multipath *mp)
+{
+	struct iscsi_mpath_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_multipath_logout_async(mp, mpath_sync_cb, &state) != 0) {
+		return -1;
+	}
+	if (mpath_event_loop(mp, &state) != 0) {
+		mp->cb = NULL;
+		return -1;
+	}
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
+struct scsi_task *
+iscsi_multipath_command_sync(struct iscsi_multipath *mp,
+			     struct scsi_task *task,
+			     struct iscsi_data *data)
+{
+	struct iscsi_mpath_sync_state state;
+	struct iscsi_mpath_cmd *cmd, *waiting;
+
+	memset(&state, 0, sizeof(state));
+
+	cmd = mpath_command_start(mp, task, mpath_command_sync_cb, data,
+				  &state);
+	if (cmd == NULL) {
+		return NULL;
+	}
+	if (mpath_event_loop(mp, &state) != 0) {
+		/* state is gone once we return */
+		for (waiting = mp->waiting; waiting; waiting = waiting->next) {
+			if (waiting == cmd) {
+				ISCSI_LIST_REMOVE(&mp->waiting, cmd);
+				free(cmd);
+				return NULL;
+			}
+		}
+		iscsi_scsi_cancel_task(cmd->path->iscsi, task);
+		return NULL;
+	}
+
+	return task;
+}
@@ -39,6 +39,7 @@
 #include <sys/time.h>
 #endif
 
+#include <stdlib.h>
 #include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
@@ -116,6 +117,9 @@ void iscsi_mt_service_thread_stop(struct iscsi_context* iscsi)
 int iscsi_mt_sem_init(libiscsi_sem_t* sem, int value)
 {
     *sem = CreateSemaphoreA(NULL, 0, 16, NULL);
+    if (*sem == NULL) {
+        return -1;
+    }
     return 0;
 }
 
@@ -137,6 +141,78 @@ int iscsi_mt_sem_wait(libiscsi_sem_t* sem)
     return 0;
 }
 
+struct iscsi_mt_waiter {
+    libiscsi_sem_t sem;
+};
+
+/*
+ * The waiter hangs off a fiber local storage slot, whose callback frees
+ * it when the thread exits like the destructor of a pthread key does.
+ */
+static DWORD waiter_fls = FLS_OUT_OF_INDEXES;
+static INIT_ONCE waiter_once = INIT_ONCE_STATIC_INIT;
+
+static void WINAPI iscsi_mt_waiter_destroy(void *arg)
+{
+    struct iscsi_mt_waiter *waiter = arg;
+
+    if (waiter == NULL) {
+        return;
+    }
+    iscsi_mt_sem_destroy(&waiter->sem);
+    free(waiter);
+}
+
+static BOOL CALLBACK iscsi_mt_waiter_fls_init(PINIT_ONCE once, PVOID param,
+                                              PVOID *context)
+{
+    waiter_fls = FlsAlloc(iscsi_mt_waiter_destroy);
+    return waiter_fls != FLS_OUT_OF_INDEXES;
+}
+
+struct iscsi_mt_waiter *iscsi_mt_waiter_get(void)
+{
+    struct iscsi_mt_waiter *waiter;
+
+    if (!InitOnceExecuteOnce(&waiter_once, iscsi_mt_waiter_fls_init,
+                             NULL, NULL)) {
+        return NULL;
+    }
+
+    waiter = FlsGetValue(waiter_fls);
+    if (waiter != NULL) {
+        return waiter;
+    }
+
+    waiter = malloc(sizeof(struct iscsi_mt_waiter));
+    if (waiter == NULL) {
+        return NULL;
+    }
+    if (iscsi_mt_sem_init(&waiter->sem, 0) != 0) {
+        free(waiter);
+        return NULL;
+    }
+    if (!FlsSetValue(waiter_fls, waiter)) {
+        iscsi_mt_waiter_destroy(waiter);
+        return NULL;
+    }
+    return waiter;
+}
+
+void iscsi_mt_waiter_arm(struct iscsi_mt_waiter *waiter)
+{
+}
+
+void iscsi_mt_waiter_wait(struct iscsi_mt_waiter *waiter)
+{
+    iscsi_mt_sem_wait(&waiter->sem);
+}
+
+void iscsi_mt_waiter_wake(struct iscsi_mt_waiter *waiter)
+{
+    iscsi_mt_sem_post(&waiter->sem);
+}
+
 #elif defined(HAVE_PTHREAD) /* WIN32 */
 
 #include <errno.h>
@@ -180,8 +256,32 @@ static void *iscsi_mt_service_thread(void *arg)
 		pfd.fd = iscsi_get_fd(iscsi);
 		pfd.events = iscsi_which_events(iscsi);
 		pfd.revents = 0;
-        
-		ret = poll(&pfd, 1, iscsi->poll_timeout);
+
+		ret = iscsi_busy_poll(iscsi, &pfd);
+		if (ret == 0) {
+			int timeout = iscsi_coalesce_next_ms(iscsi);
+			int next = iscsi_xcopy_next_ms(iscsi);
+
+			if (next >= 0 && (timeout < 0 || next < timeout)) {
+				timeout = next;
+			}
+			next = iscsi_multipath_next_ms(iscsi);
+			if (next >= 0 && (timeout < 0 || next < timeout)) {
+				timeout = next;
+			}
+			next = iscsi_reconnect_next_ms(iscsi);
+			if (next >= 0 && (timeout < 0 || next < timeout)) {
+				timeout = next;
+			}
+			next = iscsi_tcp_connect_next_ms(iscsi);
+			if (next >= 0 && (timeout < 0 || next < timeout)) {
+				timeout = next;
+			}
+			if (timeout < 0 || timeout > iscsi->poll_timeout) {
+				timeout = iscsi->poll_timeout;
+			}
+			ret = poll(&pfd, 1, timeout);
+		}
                 if (ret < 0 && errno == EINTR) {
                         /*
                          * Got a signal. Assume it is because we need to start writing new PDUs
@@ -273,6 +373,114 @@ int iscsi_mt_sem_wait(libiscsi_sem_t *sem)
 }
 #endif
 
+#ifdef HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+
+/*
+ * On Linux the waiter is just a futex word in thread local storage.
+ * Arming, waiting and waking are a store plus at most one syscall and
+ * nothing ever needs to be created or torn down.
+ */
+struct iscsi_mt_waiter {
+        uint32_t word;
+};
+
+static __thread struct iscsi_mt_waiter thread_waiter;
+
+struct iscsi_mt_waiter *iscsi_mt_waiter_get(void)
+{
+        return &thread_waiter;
+}
+
+void iscsi_mt_waiter_arm(struct iscsi_mt_waiter *waiter)
+{
+        __atomic_store_n(&waiter->word, 0, __ATOMIC_RELAXED);
+}
+
+void iscsi_mt_waiter_wait(struct iscsi_mt_waiter *waiter)
+{
+        while (__atomic_load_n(&waiter->word, __ATOMIC_ACQUIRE) == 0) {
+                syscall(SYS_futex, &waiter->word, FUTEX_WAIT_PRIVATE,
+                        0, NULL, NULL, 0);
+        }
+}
+
+void iscsi_mt_waiter_wake(struct iscsi_mt_waiter *waiter)
+{
+        __atomic_store_n(&waiter->word, 1, __ATOMIC_RELEASE);
+        syscall(SYS_futex, &waiter->word, FUTEX_WAKE_PRIVATE,
+                1, NULL, NULL, 0);
+}
+
+#else /* HAVE_LINUX_FUTEX_H */
+
+/*
+ * Everywhere else the waiter is a semaphore that is created once per
+ * thread and destroyed when the thread exits.
+ * Every wait consumes exactly one post so the count is back at zero
+ * once a sync call returns and the semaphore can simply be reused.
+ */
+struct iscsi_mt_waiter {
+        libiscsi_sem_t sem;
+};
+
+static pthread_key_t waiter_key;
+static pthread_once_t waiter_once = PTHREAD_ONCE_INIT;
+
+static void iscsi_mt_waiter_destroy(void *arg)
+{
+        struct iscsi_mt_waiter *waiter = arg;
+
+        iscsi_mt_sem_destroy(&waiter->sem);
+        free(waiter);
+}
+
+static void iscsi_mt_waiter_key_init(void)
+{
+        pthread_key_create(&waiter_key, iscsi_mt_waiter_destroy);
+}
+
+struct iscsi_mt_waiter *iscsi_mt_waiter_get(void)
+{
+        struct iscsi_mt_waiter *waiter;
+
+        pthread_once(&waiter_once, iscsi_mt_waiter_key_init);
+
+        waiter = pthread_getspecific(waiter_key);
+        if (waiter != NULL) {
+                return waiter;
+        }
+
+        waiter = malloc(sizeof(struct iscsi_mt_waiter));
+        if (waiter == NULL) {
+                return NULL;
+        }
+        if (iscsi_mt_sem_init(&waiter->sem, 0) != 0) {
+                free(waiter);
+                return NULL;
+        }
+        if (pthread_setspecific(waiter_key, waiter) != 0) {
+                iscsi_mt_waiter_destroy(waiter);
+                return NULL;
+        }
+        return waiter;
+}
+
+void iscsi_mt_waiter_arm(struct iscsi_mt_waiter *waiter)
+{
+}
+
+void iscsi_mt_waiter_wait(struct iscsi_mt_waiter *waiter)
+{
+        iscsi_mt_sem_wait(&waiter->sem);
+}
+
+void iscsi_mt_waiter_wake(struct iscsi_mt_waiter *waiter)
+{
+        iscsi_mt_sem_post(&waiter->sem);
+}
+#endif /* HAVE_LINUX_FUTEX_H */
+
 #endif /* HAVE_PTHREAD */
 
 #endif /* HAVE_MULTITHREADING */
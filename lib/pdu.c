@@ -26,6 +26,12 @@
 #include <arpa/inet.h>
 #endif
 
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#include <time.h>
+
 #ifdef HAVE_INTTYPES_H
 #include <inttypes.h>
 #else
@@ -46,6 +52,7 @@
 #include <string.h>
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-probes.h"
 #include "scsi-lowlevel.h"
 #include "slist.h"
 #include "utils.h"
@@ -100,6 +107,8 @@ iscsi_opcode_str(int opcode)
 			"DATA_OUT" },
 		{ ISCSI_PDU_LOGOUT_REQUEST,
 			"LOGOUT_REQUEST" },
+		{ ISCSI_PDU_SNACK_REQUEST,
+			"SNACK_REQUEST" },
 		{ ISCSI_PDU_NOP_IN,
 			"NOP_IN" },
 		{ ISCSI_PDU_SCSI_RESPONSE,
@@ -248,6 +257,8 @@ iscsi_tcp_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
         iscsi_free(iscsi, pdu->indata.data);
 	pdu->indata.data = NULL;
 
+	iscsi_snack_free_pdu(iscsi, pdu);
+
 	if (iscsi->outqueue_current == pdu) {
 		iscsi->outqueue_current = NULL;
 	}
@@ -474,6 +485,37 @@ int iscsi_process_reject(struct iscsi_context *iscsi,
 	return 0;
 }
 
+/*
+ * The responses that take a StatSN of their own, and so can go missing
+ * from the status sequence, and the PDUs that carry the next StatSN
+ * instead and so tell what has been sent.
+ */
+static int
+iscsi_pdu_statsn_event(struct iscsi_in_pdu *in,
+		       enum iscsi_statsn_event *event)
+{
+	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
+
+	switch (in->hdr[0] & 0x3f) {
+	case ISCSI_PDU_SCSI_RESPONSE:
+	case ISCSI_PDU_SCSI_TASK_MANAGEMENT_RESPONSE:
+	case ISCSI_PDU_TEXT_RESPONSE:
+	case ISCSI_PDU_DATA_IN:
+	case ISCSI_PDU_LOGOUT_RESPONSE:
+		*event = ISCSI_STATSN_RECEIVED;
+		return 1;
+	case ISCSI_PDU_NOP_IN:
+		*event = itt != 0xffffffff ? ISCSI_STATSN_RECEIVED :
+			ISCSI_STATSN_SENT;
+		return 1;
+	case ISCSI_PDU_R2T:
+		*event = ISCSI_STATSN_SENT;
+		return 1;
+	default:
+		return 0;
+	}
+}
+
 static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
 	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
@@ -483,6 +525,7 @@ static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_
 	uint16_t status = scsi_get_uint16(&in->hdr[36]);
 	uint8_t flags = in->hdr[1];
 	enum iscsi_opcode opcode = in->hdr[0] & 0x3f;
+	enum iscsi_statsn_event event;
 
 	/* RFC3720 10.13.5 (serials are invalid if status class != 0) */
 	if (opcode == ISCSI_PDU_LOGIN_RESPONSE && (status >> 8)) {
@@ -504,16 +547,91 @@ static void iscsi_process_pdu_serials(struct iscsi_context *iscsi, struct iscsi_
 		return;
 	}
 
-	if (itt == 0xffffffff) {
-		/* target will not increase statsn if itt == 0xffffffff */
+	if (itt == 0xffffffff || opcode == ISCSI_PDU_R2T) {
+		/* these carry the next StatSN, the target does not take
+		 * one for them */
 		statsn--;
 	}
+	if (iscsi->error_recovery_level != ISCSI_ERROR_RECOVERY_LEVEL_0 &&
+	    iscsi_pdu_statsn_event(in, &event)) {
+		uint32_t begrun, runlength;
+		int snack;
+
+		snack = iscsi_snack_statsn(iscsi, statsn, event, &begrun,
+					   &runlength);
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (snack) {
+			ISCSI_LOG(iscsi, 1, "StatSN gap: %u missing from "
+				  "%08x", runlength, begrun);
+			iscsi_send_snack(iscsi, ISCSI_SNACK_STATUS, 0xffffffff,
+					 0xffffffff, 0, begrun, runlength);
+		}
+		return;
+	}
+	if (iscsi->statsn_missing) {
+		/* ExpStatSN stays below the gap until it is filled */
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		return;
+	}
 	if (iscsi_serial32_compare(statsn, iscsi->statsn) > 0) {
 		iscsi->statsn = statsn;
 	}
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 }
 
+/*
+ * With ErrorRecoveryLevel 1 a PDU that fails its data digest is dropped
+ * and asked for again, if it is one that can be.
+ *
+ * Returns 0 if it was, -1 if the connection has to go.
+ */
+static int
+iscsi_data_digest_error(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
+{
+	uint32_t itt = scsi_get_uint32(&in->hdr[16]);
+	uint32_t begrun, runlength;
+	struct iscsi_pdu *pdu;
+	int snack;
+
+	if (iscsi->error_recovery_level == ISCSI_ERROR_RECOVERY_LEVEL_0 ||
+	    !iscsi->is_loggedin) {
+		return -1;
+	}
+
+	switch (in->hdr[0] & 0x3f) {
+	case ISCSI_PDU_DATA_IN:
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		for (pdu = iscsi->waitpdu; pdu; pdu = pdu->next) {
+			if (pdu->itt == itt) {
+				break;
+			}
+		}
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (pdu == NULL) {
+			return 0;
+		}
+		return iscsi_snack_data_lost(iscsi, pdu,
+					     scsi_get_uint32(&in->hdr[36]));
+	case ISCSI_PDU_SCSI_RESPONSE:
+		ISCSI_LOG(iscsi, 1, "SCSI response for itt %08x failed the "
+			  "data digest", itt);
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		snack = iscsi_snack_statsn(iscsi,
+					   scsi_get_uint32(&in->hdr[24]),
+					   ISCSI_STATSN_LOST,
+					   &begrun, &runlength);
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (snack) {
+			return iscsi_send_snack(iscsi, ISCSI_SNACK_STATUS,
+						0xffffffff, 0xffffffff, 0,
+						begrun, runlength);
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
 int
 iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 {
@@ -552,7 +670,7 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 			crc_rcvd |= in->data_digest_buf[3] << 24;
 			if (crc != crc_rcvd) {
 				iscsi_set_error(iscsi, "data checksum verification failed: calculated 0x%" PRIx32 " received 0x%" PRIx32, crc, crc_rcvd);
-				return -1;
+				return iscsi_data_digest_error(iscsi, in);
 			}
 		}
 	}
@@ -594,11 +712,13 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
 			return 0;
 		case 0x2:
 			ISCSI_LOG(iscsi, 2, "target will drop this connection. Time2Wait is %u seconds", param2);
-			iscsi->next_reconnect = time(NULL) + param2;
+			iscsi->next_reconnect = iscsi_clock_us() +
+				(uint64_t)param2 * 1000000;
 			return 0;
 		case 0x3:
 			ISCSI_LOG(iscsi, 2, "target will drop all connections of this session. Time2Wait is %u seconds", param2);
-			iscsi->next_reconnect = time(NULL) + param2;
+			iscsi->next_reconnect = iscsi_clock_us() +
+				(uint64_t)param2 * 1000000;
 			return 0;
 		case 0x4:
 			ISCSI_LOG(iscsi, 2, "target requests parameter renogitiation.");
@@ -629,11 +749,20 @@ iscsi_process_pdu(struct iscsi_context *iscsi, struct iscsi_in_pdu *in)
         }
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
         if (pdu == NULL) {
+                if (iscsi->error_recovery_level != ISCSI_ERROR_RECOVERY_LEVEL_0 &&
+                    (opcode == ISCSI_PDU_DATA_IN ||
+                     opcode == ISCSI_PDU_SCSI_RESPONSE)) {
+                        /* a retransmission we did not need after all */
+                        ISCSI_LOG(iscsi, 2, "Dropping response for "
+                                  "completed itt:%08x", itt);
+                        return 0;
+                }
                 iscsi_set_error(iscsi, "Got unsolicited response with "
                                 "itt:%d",
                                 itt);
                 return -1;
         }
+	ISCSI_PROBE5(pdu_match, iscsi, itt, pdu->cmdsn, pdu->lun, opcode);
         
         /* we have a special case with scsi-command opcodes,
          * they are replied to by either a scsi-response
@@ -930,7 +1059,7 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 			continue;
 		}
 		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		    ISCSI_PDU_HAS_CMDSN(pdu)) {
 			iscsi->cmdsn--;
 			cmdsn_gap++;
 		} else {
@@ -944,6 +1073,8 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 		ISCSI_LIST_REMOVE(&tmp, pdu);
 		iscsi_set_error(iscsi, "command timed out from outqueue");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
+		ISCSI_PROBE5(command_timeout, iscsi, pdu->itt, pdu->cmdsn,
+			     pdu->lun, pdu->outdata.data[0] & 0x3f);
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
 			              NULL, pdu->private_data);
@@ -975,6 +1106,8 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 		ISCSI_LIST_REMOVE(&tmp, pdu);
 		iscsi_set_error(iscsi, "command timed out from waitqueue");
 		iscsi_dump_pdu_header(iscsi, pdu->outdata.data);
+		ISCSI_PROBE5(command_timeout, iscsi, pdu->itt, pdu->cmdsn,
+			     pdu->lun, pdu->outdata.data[0] & 0x3f);
 		if (pdu->callback) {
 			pdu->callback(iscsi, SCSI_STATUS_TIMEOUT,
 			              NULL, pdu->private_data);
@@ -983,6 +1116,112 @@ iscsi_timeout_scan(struct iscsi_context *iscsi)
 	}
 }
 
+int
+iscsi_ms_until(time_t deadline)
+{
+#ifdef HAVE_SYS_TIME_H
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	if (deadline <= tv.tv_sec) {
+		return 0;
+	}
+	if (deadline - tv.tv_sec > 86400) {
+		return 86400 * 1000;
+	}
+	return (deadline - tv.tv_sec) * 1000 - tv.tv_usec / 1000;
+#else
+	time_t t = time(NULL);
+
+	if (deadline <= t) {
+		return 0;
+	}
+	if (deadline - t > 86400) {
+		return 86400 * 1000;
+	}
+	return (deadline - t) * 1000;
+#endif
+}
+
+uint64_t
+iscsi_clock_us(void)
+{
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#elif defined(HAVE_SYS_TIME_H)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#else
+	return (uint64_t)time(NULL) * 1000000;
+#endif
+}
+
+static time_t
+iscsi_first_pdu_timeout(struct iscsi_pdu *pdu, time_t first)
+{
+	for (; pdu; pdu = pdu->next) {
+		if (pdu->scsi_timeout == 0) {
+			continue;
+		}
+		if (first == 0 || pdu->scsi_timeout < first) {
+			first = pdu->scsi_timeout;
+		}
+	}
+	return first;
+}
+
+int
+iscsi_timeout_next(struct iscsi_context *iscsi)
+{
+	time_t first = 0;
+	int ms, next;
+
+	if (iscsi->completions != NULL) {
+		return 0;
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	first = iscsi_first_pdu_timeout(iscsi->outqueue, first);
+	first = iscsi_first_pdu_timeout(iscsi->waitpdu, first);
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	if (iscsi->old_iscsi) {
+		iscsi_mt_spin_lock(&iscsi->old_iscsi->iscsi_lock);
+		first = iscsi_first_pdu_timeout(iscsi->old_iscsi->outqueue, first);
+		first = iscsi_first_pdu_timeout(iscsi->old_iscsi->waitpdu, first);
+		iscsi_mt_spin_unlock(&iscsi->old_iscsi->iscsi_lock);
+	}
+
+	ms = first ? iscsi_ms_until(first) : -1;
+
+	next = iscsi_reconnect_next_ms(iscsi);
+	if (next >= 0 && (ms < 0 || next < ms)) {
+		ms = next;
+	}
+	next = iscsi_tcp_connect_next_ms(iscsi);
+	if (next >= 0 && (ms < 0 || next < ms)) {
+		ms = next;
+	}
+	next = iscsi_coalesce_next_ms(iscsi);
+	if (next >= 0 && (ms < 0 || next < ms)) {
+		ms = next;
+	}
+	next = iscsi_xcopy_next_ms(iscsi);
+	if (next >= 0 && (ms < 0 || next < ms)) {
+		ms = next;
+	}
+	next = iscsi_multipath_next_ms(iscsi);
+	if (next >= 0 && (ms < 0 || next < ms)) {
+		ms = next;
+	}
+	return ms;
+}
+
 void
 iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 {
@@ -992,22 +1231,25 @@ iscsi_queue_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 void
 iscsi_cancel_pdus(struct iscsi_context *iscsi)
 {
-	struct iscsi_pdu *pdu, *tmp;
+	struct iscsi_pdu *pdu, *tmp, *last = NULL;
 
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
-	while ((pdu = iscsi->outqueue)) {
-		ISCSI_LIST_REMOVE(&iscsi->outqueue, pdu);
-		if (pdu->callback) {
-			pdu->callback(iscsi, SCSI_STATUS_CANCELLED,
-			              NULL, pdu->private_data);
-		}
+	for (pdu = iscsi->outqueue; pdu; pdu = pdu->next) {
 		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		    ISCSI_PDU_HAS_CMDSN(pdu)) {
 			iscsi->cmdsn--;
 		}
-		iscsi->drv->free_pdu(iscsi, pdu);
+		last = pdu;
+	}
+	/* the callbacks run without the lock as they may queue or cancel
+	 * other commands, the ones never sent go first */
+	if (last != NULL) {
+		last->next = iscsi->waitpdu;
+		tmp = iscsi->outqueue;
+	} else {
+		tmp = iscsi->waitpdu;
 	}
-        tmp = iscsi->waitpdu;
+	iscsi->outqueue = NULL;
         iscsi->waitpdu = NULL;
         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
 
@@ -1042,7 +1284,7 @@ iscsi_cancel_lun_pdus(struct iscsi_context *iscsi, uint32_t lun)
 			continue;
 		}
 		if (!(pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) &&
-		    (pdu->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+		    ISCSI_PDU_HAS_CMDSN(pdu)) {
 			iscsi->cmdsn--;
 			cmdsn_gap++;
 		}
@@ -0,0 +1,622 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Session pools.
+ *
+ * Several sessions to the same target and LUN, each an ordinary context
+ * with its own ISID, used as one queue. Every command goes to the session
+ * with the fewest commands in flight. Reconnecting is left to each
+ * session, which keeps its commands queued while it is down, and new
+ * commands avoid such sessions for as long as another one is logged in.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef AROS
+#include "aros/aros_compat.h"
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+/* how long to sleep while a session has nothing to poll for */
+#define POOL_IDLE_MS	100
+
+struct iscsi_pool_session {
+	struct iscsi_session_pool *pool;
+	struct iscsi_context *iscsi;
+	int in_flight;		/* commands sent through the pool */
+	int busy;		/* connecting or logging out */
+};
+
+struct iscsi_session_pool {
+	char portal[MAX_STRING_SIZE + 1];
+	int lun;
+
+	struct iscsi_pool_session *sessions;
+	int count;
+	int next;		/* where the search for a session starts */
+	libiscsi_mutex_t lock;	/* in_flight and next */
+
+	/* connect or logout of all sessions */
+	iscsi_session_pool_cb cb;
+	void *private_data;
+	int pending;
+	int status;
+	int starting;
+
+	char error[MAX_STRING_SIZE + 1];
+};
+
+struct iscsi_pool_cmd {
+	struct iscsi_pool_session *s;
+	iscsi_command_cb cb;
+	void *private_data;
+};
+
+struct iscsi_pool_sync_state {
+	int finished;
+	int status;
+};
+
+static void
+pool_set_error(struct iscsi_session_pool *pool, const char *error, ...)
+{
+	va_list ap;
+
+	va_start(ap, error);
+	vsnprintf(pool->error, sizeof(pool->error), error, ap);
+	va_end(ap);
+}
+
+struct iscsi_session_pool *
+iscsi_session_pool_create(const char *initiator_name, const char *url,
+			  int sessions)
+{
+	struct iscsi_session_pool *pool;
+	struct iscsi_url *iscsi_url;
+	uint32_t rnd;
+	int i;
+
+	if (sessions < 1 || sessions > 0xffff) {
+		return NULL;
+	}
+
+	pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->sessions = calloc(sessions, sizeof(*pool->sessions));
+	if (pool->sessions == NULL) {
+		free(pool);
+		return NULL;
+	}
+	iscsi_mt_mutex_init(&pool->lock);
+
+	/* the same random ISID for all, with the session as qualifier */
+	rnd = rand();
+	for (i = 0; i < sessions; i++) {
+		struct iscsi_pool_session *s = &pool->sessions[i];
+
+		s->pool = pool;
+		s->iscsi = iscsi_create_context(initiator_name);
+		if (s->iscsi == NULL) {
+			goto failed;
+		}
+		pool->count++;
+
+		iscsi_url = iscsi_parse_full_url(s->iscsi, url);
+		if (iscsi_url == NULL) {
+			goto failed;
+		}
+		if (i == 0) {
+			strncpy(pool->portal, iscsi_url->portal, MAX_STRING_SIZE);
+			pool->lun = iscsi_url->lun;
+		}
+		iscsi_destroy_url(iscsi_url);
+
+		iscsi_set_session_type(s->iscsi, ISCSI_SESSION_NORMAL);
+		iscsi_set_isid_random(s->iscsi, rnd, i);
+	}
+
+	return pool;
+
+ failed:
+	iscsi_session_pool_destroy(pool);
+	return NULL;
+}
+
+void
+iscsi_session_pool_destroy(struct iscsi_session_pool *pool)
+{
+	int i;
+
+	if (pool == NULL) {
+		return;
+	}
+
+	/* this completes what is in flight, which still needs the pool */
+	for (i = 0; i < pool->count; i++) {
+		iscsi_destroy_context(pool->sessions[i].iscsi);
+	}
+	iscsi_mt_mutex_destroy(&pool->lock);
+	free(pool->sessions);
+	free(pool);
+}
+
+int
+iscsi_session_pool_get_count(struct iscsi_session_pool *pool)
+{
+	return pool->count;
+}
+
+struct iscsi_context *
+iscsi_session_pool_get_context(struct iscsi_session_pool *pool, int n)
+{
+	if (n < 0 || n >= pool->count) {
+		return NULL;
+	}
+	return pool->sessions[n].iscsi;
+}
+
+const char *
+iscsi_session_pool_get_error(struct iscsi_session_pool *pool)
+{
+	return pool->error;
+}
+
+void
+iscsi_session_pool_set_bind_interfaces(struct iscsi_session_pool *pool,
+				       const char *interfaces)
+{
+	char iface[MAX_STRING_SIZE + 1];
+	const char *p;
+	size_t len;
+	int count = 1;
+	int i, n;
+
+	for (p = interfaces; (p = strchr(p, ',')) != NULL; p++) {
+		count++;
+	}
+
+	for (i = 0; i < pool->count; i++) {
+		p = interfaces;
+		for (n = i % count; n > 0; n--) {
+			p = strchr(p, ',') + 1;
+		}
+		len = strcspn(p, ",");
+		if (len > MAX_STRING_SIZE) {
+			len = MAX_STRING_SIZE;
+		}
+		memcpy(iface, p, len);
+		iface[len] = 0;
+		iscsi_set_bind_interfaces(pool->sessions[i].iscsi, iface);
+	}
+}
+
+/*
+ * Connect and logout of all sessions share the completion: it is done
+ * when the last session is.
+ */
+static void
+pool_op_done(struct iscsi_session_pool *pool)
+{
+	/* NULL if a sync caller gave up waiting */
+	if (pool->cb != NULL) {
+		pool->cb(pool, pool->status, pool->private_data);
+	}
+}
+
+static void
+pool_op_cb(struct iscsi_context *iscsi, int status,
+	   void *command_data, void *private_data)
+{
+	struct iscsi_pool_session *s = private_data;
+	struct iscsi_session_pool *pool = s->pool;
+
+	s->busy = 0;
+	if (status != SCSI_STATUS_GOOD) {
+		pool_set_error(pool, "Session %d: %s",
+			       (int)(s - pool->sessions),
+			       iscsi_get_error(iscsi));
+		pool->status = status;
+	}
+
+	if (--pool->pending == 0 && !pool->starting) {
+		pool_op_done(pool);
+	}
+}
+
+int
+iscsi_session_pool_connect_async(struct iscsi_session_pool *pool,
+				 iscsi_session_pool_cb cb, void *private_data)
+{
+	int i, started = 0;
+
+	pool->cb = cb;
+	pool->private_data = private_data;
+	pool->status = SCSI_STATUS_GOOD;
+	pool->pending = 0;
+	pool->starting = 1;
+
+	for (i = 0; i < pool->count; i++) {
+		struct iscsi_pool_session *s = &pool->sessions[i];
+
+		if (iscsi_full_connect_async(s->iscsi, pool->portal, pool->lun,
+					     pool_op_cb, s) != 0) {
+			pool_set_error(pool, "Session %d: %s", i,
+				       iscsi_get_error(s->iscsi));
+			pool->status = SCSI_STATUS_ERROR;
+			continue;
+		}
+		s->busy = 1;
+		pool->pending++;
+		started++;
+	}
+
+	pool->starting = 0;
+	if (started == 0 && pool->status != SCSI_STATUS_GOOD) {
+		return -1;
+	}
+	if (pool->pending == 0) {
+		pool_op_done(pool);
+	}
+	return 0;
+}
+
+int
+iscsi_session_pool_logout_async(struct iscsi_session_pool *pool,
+				iscsi_session_pool_cb cb, void *private_data)
+{
+	int i, started = 0;
+
+	pool->cb = cb;
+	pool->private_data = private_data;
+	pool->status = SCSI_STATUS_GOOD;
+	pool->pending = 0;
+	pool->starting = 1;
+
+	for (i = 0; i < pool->count; i++) {
+		struct iscsi_pool_session *s = &pool->sessions[i];
+
+		if (!iscsi_is_logged_in(s->iscsi)) {
+			continue;
+		}
+		if (iscsi_logout_async(s->iscsi, pool_op_cb, s) != 0) {
+			pool_set_error(pool, "Session %d: %s", i,
+				       iscsi_get_error(s->iscsi));
+			pool->status = SCSI_STATUS_ERROR;
+			continue;
+		}
+		s->busy = 1;
+		pool->pending++;
+		started++;
+	}
+
+	pool->starting = 0;
+	if (started == 0 && pool->status != SCSI_STATUS_GOOD) {
+		return -1;
+	}
+	if (pool->pending == 0) {
+		pool_op_done(pool);
+	}
+	return 0;
+}
+
+/*
+ * The least loaded session that is logged in, or if none is, the least
+ * loaded one that is reconnecting and will send it once it is back.
+ */
+static struct iscsi_pool_session *
+pool_pick_session(struct iscsi_session_pool *pool)
+{
+	struct iscsi_pool_session *best = NULL;
+	int best_up = 0;
+	int i;
+
+	for (i = 0; i < pool->count; i++) {
+		struct iscsi_pool_session *s;
+		int up;
+
+		s = &pool->sessions[(pool->next + i) % pool->count];
+		up = s->iscsi->old_iscsi == NULL && iscsi_is_logged_in(s->iscsi);
+		if (!up && s->iscsi->old_iscsi == NULL) {
+			continue;
+		}
+		if (best == NULL || up > best_up ||
+		    (up == best_up && s->in_flight < best->in_flight)) {
+			best = s;
+			best_up = up;
+		}
+	}
+	/* so that ties do not always go to the same session */
+	pool->next = (pool->next + 1) % pool->count;
+
+	return best;
+}
+
+static void
+pool_command_cb(struct iscsi_context *iscsi, int status,
+		void *command_data, void *private_data)
+{
+	struct iscsi_pool_cmd *cmd = private_data;
+	struct iscsi_session_pool *pool = cmd->s->pool;
+	iscsi_command_cb cb = cmd->cb;
+	void *cb_data = cmd->private_data;
+
+	iscsi_mt_mutex_lock(&pool->lock);
+	cmd->s->in_flight--;
+	iscsi_mt_mutex_unlock(&pool->lock);
+	free(cmd);
+
+	cb(iscsi, status, command_data, cb_data);
+}
+
+/*
+ * Returns the session the task was sent on, or NULL.
+ */
+static struct iscsi_pool_session *
+pool_command_send(struct iscsi_session_pool *pool,
+		  struct scsi_task *task, iscsi_command_cb cb,
+		  struct iscsi_data *data, void *private_data)
+{
+	struct iscsi_pool_cmd *cmd;
+	struct iscsi_pool_session *s;
+
+	cmd = malloc(sizeof(*cmd));
+	if (cmd == NULL) {
+		pool_set_error(pool, "Out-of-memory: Failed to allocate "
+			       "pool command");
+		return NULL;
+	}
+
+	iscsi_mt_mutex_lock(&pool->lock);
+	s = pool_pick_session(pool);
+	if (s != NULL) {
+		s->in_flight++;
+	}
+	iscsi_mt_mutex_unlock(&pool->lock);
+	if (s == NULL) {
+		pool_set_error(pool, "No session of the pool is logged in");
+		free(cmd);
+		return NULL;
+	}
+
+	cmd->s = s;
+	cmd->cb = cb;
+	cmd->private_data = private_data;
+	if (iscsi_scsi_command_async(s->iscsi, pool->lun, task,
+				     pool_command_cb, data, cmd) != 0) {
+		pool_set_error(pool, "Session %d: %s",
+			       (int)(s - pool->sessions),
+			       iscsi_get_error(s->iscsi));
+		iscsi_mt_mutex_lock(&pool->lock);
+		s->in_flight--;
+		iscsi_mt_mutex_unlock(&pool->lock);
+		free(cmd);
+		return NULL;
+	}
+	return s;
+}
+
+int
+iscsi_session_pool_command_async(struct iscsi_session_pool *pool,
+				 struct scsi_task *task, iscsi_command_cb cb,
+				 struct iscsi_data *data, void *private_data)
+{
+	if (pool_command_send(pool, task, cb, data, private_data) == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+int
+iscsi_session_pool_queue_length(struct iscsi_session_pool *pool)
+{
+	int i, n = 0;
+
+	iscsi_mt_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->count; i++) {
+		n += pool->sessions[i].in_flight;
+	}
+	iscsi_mt_mutex_unlock(&pool->lock);
+
+	return n;
+}
+
+/*
+ * Synchronous pool functions
+ */
+static int
+pool_session_active(struct iscsi_pool_session *s)
+{
+	return s->busy || s->iscsi->old_iscsi != NULL ||
+		iscsi_is_logged_in(s->iscsi);
+}
+
+static int
+pool_event_loop(struct iscsi_session_pool *pool,
+		struct iscsi_pool_sync_state *state)
+{
+	struct pollfd *pfd;
+	int i, ret, timeout;
+
+	pfd = malloc(pool->count * sizeof(*pfd));
+	if (pfd == NULL) {
+		pool_set_error(pool, "Out-of-memory: Failed to allocate "
+			       "pollfds");
+		return -1;
+	}
+
+	while (state->finished == 0) {
+		timeout = -1;
+		for (i = 0; i < pool->count; i++) {
+			struct iscsi_context *iscsi = pool->sessions[i].iscsi;
+			int ms;
+
+			/*
+			 * Sessions that failed to log in or have logged out
+			 * are left alone, they would only fail to reconnect.
+			 */
+			if (!pool_session_active(&pool->sessions[i])) {
+				pfd[i].fd = -1;
+				pfd[i].events = 0;
+				pfd[i].revents = 0;
+				continue;
+			}
+			pfd[i].fd = iscsi_get_fd(iscsi);
+			pfd[i].events = iscsi_which_events(iscsi);
+			pfd[i].revents = 0;
+
+			ms = iscsi_timeout_next(iscsi);
+			if (pfd[i].fd < 0 || pfd[i].events == 0) {
+				/* see iscsi_which_events() */
+				pfd[i].fd = -1;
+				if (ms < 0 || ms > POOL_IDLE_MS) {
+					ms = POOL_IDLE_MS;
+				}
+			}
+			if (ms >= 0 && (timeout < 0 || ms < timeout)) {
+				timeout = ms;
+			}
+		}
+
+		ret = poll(pfd, pool->count, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			pool_set_error(pool, "Poll failed");
+			free(pfd);
+			return -1;
+		}
+
+		for (i = 0; i < pool->count; i++) {
+			struct iscsi_context *iscsi = pool->sessions[i].iscsi;
+
+			if (!pool_session_active(&pool->sessions[i])) {
+				continue;
+			}
+			if (iscsi_service(iscsi, pfd[i].revents) < 0) {
+				pool_set_error(pool, "Session %d: iscsi_service "
+					       "failed with : %s", i,
+					       iscsi_get_error(iscsi));
+				free(pfd);
+				return -1;
+			}
+		}
+	}
+
+	free(pfd);
+	return 0;
+}
+
+static void
+pool_sync_cb(struct iscsi_session_pool *pool, int status,
+	     void *private_data)
+{
+	struct iscsi_pool_sync_state *state = private_data;
+
+	state->status = status;
+	state->finished = 1;
+}
+
+static void
+pool_command_sync_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct iscsi_pool_sync_state *state = private_data;
+
+	state->status = status;
+	state->finished = 1;
+}
+
+int
+iscsi_session_pool_connect_sync(struct iscsi_session_pool *pool)
+{
+	struct iscsi_pool_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_session_pool_connect_async(pool, pool_sync_cb,
+					     &state) != 0) {
+		return -1;
+	}
+	if (pool_event_loop(pool, &state) != 0) {
+		pool->cb = NULL;
+		return -1;
+	}
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
+int
+iscsi_session_pool_logout_sync(struct iscsi_session_pool *pool)
+{
+	struct iscsi_pool_sync_state state;
+
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_session_pool_logout_async(pool, pool_sync_cb,
+					    &state) != 0) {
+		return -1;
+	}
+	if (pool_event_loop(pool, &state) != 0) {
+		pool->cb = NULL;
+		return -1;
+	}
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
+struct scsi_task *
+iscsi_session_pool_command_sync(struct iscsi_session_pool *pool,
+				struct scsi_task *task,
+				struct iscsi_data *data)
+{
+	struct iscsi_pool_sync_state state;
+	struct iscsi_pool_session *s;
+
+	memset(&state, 0, sizeof(state));
+
+	s = pool_command_send(pool, task, pool_command_sync_cb, data, &state);
+	if (s == NULL) {
+		return NULL;
+	}
+	if (pool_event_loop(pool, &state) != 0) {
+		/* state is gone once we return */
+		iscsi_scsi_cancel_task(s->iscsi, task);
+		return NULL;
+	}
+
+	return task;
+}
@@ -0,0 +1,349 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Command recording.
+ *
+ * When a command is submitted the callback of the application is swapped
+ * for one that remembers the submit time, so that on completion one
+ * record can be written with everything about the command in it. The
+ * state for that lives in the memory of the task and goes away with it.
+ * Records go through a large stdio buffer so that most completions do
+ * not make a system call, under the mutex of the context as commands that
+ * fail straight away complete on the thread of the application rather
+ * than on the service thread, and the application may stop recording
+ * while commands complete.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#define RECORD_BUFFER_SIZE	(256 * 1024)
+
+struct iscsi_recorder {
+	FILE *fp;
+	char *buf;
+	uint64_t start;		/* iscsi_clock_us() when started */
+	uint64_t start_realtime;
+	int failed;
+};
+
+/* contexts that started recording from LIBISCSI_RECORD */
+static int record_env_count;
+
+/* what the swapped in callback needs, allocated from the task */
+struct iscsi_record_cbdata {
+	iscsi_command_cb callback;
+	void *private_data;
+	uint64_t submit;
+	int lun;
+};
+
+/*
+ * The LBA and number of blocks of READ and WRITE type CDBs. Returns -1
+ * for other opcodes.
+ */
+static int
+iscsi_record_cdb_range(struct scsi_task *task, uint64_t *lba, uint32_t *num)
+{
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ6:
+		*lba = scsi_get_uint32(&task->cdb[0]) & 0x001fffff;
+		*num = task->cdb[4] ? task->cdb[4] : 256;
+		return 0;
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+	case SCSI_OPCODE_WRITE_VERIFY10:
+	case SCSI_OPCODE_WRITE_SAME10:
+	case SCSI_OPCODE_VERIFY10:
+	case SCSI_OPCODE_PREFETCH10:
+	case SCSI_OPCODE_SYNCHRONIZECACHE10:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint16(&task->cdb[7]);
+		return 0;
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+	case SCSI_OPCODE_WRITE_VERIFY12:
+	case SCSI_OPCODE_VERIFY12:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[6]);
+		return 0;
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+	case SCSI_OPCODE_WRITE_VERIFY16:
+	case SCSI_OPCODE_WRITE_SAME16:
+	case SCSI_OPCODE_VERIFY16:
+	case SCSI_OPCODE_PREFETCH16:
+	case SCSI_OPCODE_SYNCHRONIZECACHE16:
+	case SCSI_OPCODE_ORWRITE:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[10]);
+		return 0;
+	case SCSI_OPCODE_COMPARE_AND_WRITE:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = task->cdb[13];
+		return 0;
+	}
+	return -1;
+}
+
+static void
+iscsi_record_write(struct iscsi_context *iscsi, struct scsi_task *task,
+		   int status, struct iscsi_record_cbdata *rd)
+{
+	struct iscsi_recorder *rec = iscsi->recorder;
+	struct iscsi_command_record r;
+	uint64_t now = iscsi_clock_us();
+
+	memset(&r, 0, sizeof(r));
+	r.submit   = rd->submit - rec->start;
+	r.latency  = now - rd->submit;
+	r.lun      = rd->lun;
+	r.xferlen  = task->expxferlen;
+	r.status   = status;
+	r.opcode   = task->cdb[0];
+	r.xfer_dir = task->xfer_dir;
+	r.cdb_size = MIN(task->cdb_size, (int)sizeof(r.cdb));
+	memcpy(r.cdb, task->cdb, r.cdb_size);
+	if (iscsi_record_cdb_range(task, &r.lba, &r.blocks) != 0) {
+		r.lba = 0;
+		r.blocks = 0;
+	}
+	if (status == SCSI_STATUS_CHECK_CONDITION) {
+		r.sense_key = task->sense.key;
+		r.ascq      = task->sense.ascq;
+	}
+
+	if (!rec->failed && fwrite(&r, sizeof(r), 1, rec->fp) != 1) {
+		rec->failed = 1;
+		ISCSI_LOG(iscsi, 1, "Failed to write command record: %s",
+			  strerror(errno));
+	}
+}
+
+static void
+iscsi_record_cb(struct iscsi_context *iscsi, int status,
+		void *command_data, void *private_data)
+{
+	struct iscsi_record_cbdata *rd = private_data;
+	iscsi_command_cb callback = rd->callback;
+	void *cb_data = rd->private_data;
+
+	/* rd is freed with the task, which the callback may do */
+	iscsi_mt_mutex_lock(&iscsi->iscsi_mutex);
+	if (iscsi->recorder != NULL && command_data != NULL) {
+		iscsi_record_write(iscsi, command_data, status, rd);
+	}
+	iscsi_mt_mutex_unlock(&iscsi->iscsi_mutex);
+	if (callback) {
+		callback(iscsi, status, command_data, cb_data);
+	}
+}
+
+void
+iscsi_record_command(struct iscsi_context *iscsi, int lun,
+		     struct scsi_task *task, iscsi_command_cb *cb,
+		     void **private_data)
+{
+	struct iscsi_record_cbdata *rd;
+
+	rd = scsi_malloc(task, sizeof(*rd));
+	if (rd == NULL) {
+		return;
+	}
+	rd->callback     = *cb;
+	rd->private_data = *private_data;
+	rd->submit       = iscsi_clock_us();
+	rd->lun          = lun;
+
+	*cb = iscsi_record_cb;
+	*private_data = rd;
+}
+
+static void
+iscsi_record_header(struct iscsi_context *iscsi, struct iscsi_recorder *rec,
+		    struct iscsi_record_file_header *fh)
+{
+	memset(fh, 0, sizeof(*fh));
+	memcpy(fh->magic, ISCSI_RECORD_MAGIC, sizeof(fh->magic));
+	fh->version = ISCSI_RECORD_VERSION;
+	fh->record_size = sizeof(struct iscsi_command_record);
+	fh->start_realtime = rec->start_realtime;
+	snprintf(fh->target_name, sizeof(fh->target_name), "%s",
+		 iscsi->target_name);
+	snprintf(fh->target_address, sizeof(fh->target_address), "%s",
+		 iscsi->connected_portal);
+}
+
+static int
+iscsi_record_stop(struct iscsi_context *iscsi)
+{
+	struct iscsi_recorder *rec = iscsi->recorder;
+	struct iscsi_record_file_header fh;
+	int ret = 0;
+
+	iscsi->recorder = NULL;
+
+	/* the target was probably not known yet when the header was first
+	 * written */
+	iscsi_record_header(iscsi, rec, &fh);
+	if (rec->failed ||
+	    fseek(rec->fp, 0, SEEK_SET) != 0 ||
+	    fwrite(&fh, sizeof(fh), 1, rec->fp) != 1) {
+		ret = -1;
+	}
+	if (fclose(rec->fp) != 0) {
+		ret = -1;
+	}
+	if (ret != 0) {
+		iscsi_set_error(iscsi, "Failed to write command record");
+	}
+	free(rec->buf);
+	free(rec);
+
+	return ret;
+}
+
+static int
+iscsi_record_start(struct iscsi_context *iscsi, const char *path)
+{
+	struct iscsi_recorder *rec;
+	struct iscsi_record_file_header fh;
+	int ret = 0;
+
+	if (iscsi->recorder != NULL) {
+		ret = iscsi_record_stop(iscsi);
+	}
+	if (path == NULL) {
+		return ret;
+	}
+
+	rec = calloc(1, sizeof(*rec));
+	if (rec == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"command recorder");
+		return -1;
+	}
+	rec->buf = malloc(RECORD_BUFFER_SIZE);
+	if (rec->buf == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"command record buffer");
+		free(rec);
+		return -1;
+	}
+	rec->fp = fopen(path, "wb");
+	if (rec->fp == NULL) {
+		iscsi_set_error(iscsi, "Failed to open %s: %s", path,
+				strerror(errno));
+		free(rec->buf);
+		free(rec);
+		return -1;
+	}
+	setvbuf(rec->fp, rec->buf, _IOFBF, RECORD_BUFFER_SIZE);
+
+	rec->start = iscsi_clock_us();
+#ifdef HAVE_SYS_TIME_H
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		rec->start_realtime = (uint64_t)tv.tv_sec * 1000000 +
+			tv.tv_usec;
+	}
+#else
+	rec->start_realtime = (uint64_t)time(NULL) * 1000000;
+#endif
+
+	iscsi_record_header(iscsi, rec, &fh);
+	if (fwrite(&fh, sizeof(fh), 1, rec->fp) != 1) {
+		iscsi_set_error(iscsi, "Failed to write %s: %s", path,
+				strerror(errno));
+		fclose(rec->fp);
+		free(rec->buf);
+		free(rec);
+		return -1;
+	}
+	iscsi->recorder = rec;
+
+	return 0;
+}
+
+int
+iscsi_set_command_record(struct iscsi_context *iscsi, const char *path)
+{
+	int ret;
+
+	iscsi->record_env = 0;
+	iscsi_mt_mutex_lock(&iscsi->iscsi_mutex);
+	ret = iscsi_record_start(iscsi, path);
+	iscsi_mt_mutex_unlock(&iscsi->iscsi_mutex);
+
+	return ret;
+}
+
+void
+iscsi_record_env_start(struct iscsi_context *iscsi)
+{
+	const char *path = getenv("LIBISCSI_RECORD");
+	char *name;
+	int n;
+
+	iscsi->record_env = 0;
+	if (path == NULL || iscsi->recorder != NULL) {
+		return;
+	}
+#if defined(__GNUC__) || defined(__clang__)
+	n = __atomic_fetch_add(&record_env_count, 1, __ATOMIC_RELAXED);
+#else
+	n = record_env_count++;
+#endif
+	name = malloc(strlen(path) + 12);
+	if (name == NULL) {
+		return;
+	}
+	if (n == 0) {
+		strcpy(name, path);
+	} else {
+		sprintf(name, "%s.%d", path, n);
+	}
+	if (iscsi_set_command_record(iscsi, name) != 0) {
+		ISCSI_LOG(iscsi, 1, "Failed to start recording to %s: %s",
+			  name, iscsi_get_error(iscsi));
+	}
+	free(name);
+}
@@ -161,6 +161,12 @@ const char *
 scsi_sense_ascq_str(int ascq)
 {
 	static struct iscsi_value_string ascqs[] = {
+		{SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_TRANSITION,
+		 "ASYMMETRIC_ACCESS_STATE_TRANSITION"},
+		{SCSI_SENSE_ASCQ_TARGET_PORT_IN_STANDBY_STATE,
+		 "TARGET_PORT_IN_STANDBY_STATE"},
+		{SCSI_SENSE_ASCQ_TARGET_PORT_IN_UNAVAILABLE_STATE,
+		 "TARGET_PORT_IN_UNAVAILABLE_STATE"},
 		{SCSI_SENSE_ASCQ_SANITIZE_IN_PROGRESS,
 		 "SANITIZE_IN_PROGRESS"},
 		{SCSI_SENSE_ASCQ_WRITE_AFTER_SANITIZE_REQUIRED,
@@ -207,6 +213,8 @@ scsi_sense_ascq_str(int ascq)
 		 "TRANSCEIVER_MODE_CHANGED_TO_LVD"},
 		{SCSI_SENSE_ASCQ_MODE_PARAMETERS_CHANGED,
 		 "MODE PARAMETERS CHANGED"},
+		{SCSI_SENSE_ASCQ_ASYMMETRIC_ACCESS_STATE_CHANGED,
+		 "ASYMMETRIC ACCESS STATE CHANGED"},
 		{SCSI_SENSE_ASCQ_CAPACITY_DATA_HAS_CHANGED,
 		 "CAPACITY_DATA_HAS_CHANGED"},
 		{SCSI_SENSE_ASCQ_THIN_PROVISION_SOFT_THRES_REACHED,
@@ -0,0 +1,351 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * ErrorRecoveryLevel 1, RFC 7143 section 7.
+ *
+ * A Data-In or R2T PDU that is discarded because its data digest is wrong,
+ * or that is found missing from a gap in the DataSN or R2TSN of its task,
+ * is asked for again with a Data/R2T SNACK. Data-In is placed by its buffer
+ * offset, so the retransmission just fills the hole, and the status of the
+ * task is held back until it has. A gap in StatSN is asked for with a
+ * Status SNACK, and ExpStatSN stays below the gap until it is filled.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+int
+iscsi_send_snack(struct iscsi_context *iscsi, enum iscsi_snack_type type,
+		 uint32_t itt, uint32_t ttt, uint32_t lun,
+		 uint32_t begrun, uint32_t runlength)
+{
+	struct iscsi_pdu *pdu;
+
+	pdu = iscsi_allocate_pdu(iscsi,
+				 ISCSI_PDU_SNACK_REQUEST,
+				 ISCSI_PDU_NO_PDU,
+				 itt,
+				 ISCSI_PDU_DROP_ON_RECONNECT|ISCSI_PDU_DELETE_WHEN_SENT);
+	if (pdu == NULL) {
+		iscsi_set_error(iscsi, "Failed to allocate snack pdu");
+		return -1;
+	}
+
+	/* flags */
+	iscsi_pdu_set_pduflags(pdu, 0x80 | type);
+
+	/* lun */
+	iscsi_pdu_set_lun(pdu, lun);
+
+	/* ttt */
+	iscsi_pdu_set_ttt(pdu, ttt);
+
+	/* begrun and runlength */
+	scsi_set_uint32(&pdu->outdata.data[40], begrun);
+	scsi_set_uint32(&pdu->outdata.data[44], runlength);
+
+	/* a SNACK carries no CmdSN, this only queues it ahead of the
+	 * commands that are waiting for the window to open */
+	pdu->cmdsn = iscsi->expcmdsn - 1;
+
+	ISCSI_LOG(iscsi, 2, "SNACK type %d (itt %08x, begrun %08x, "
+		  "runlength %u)", type, itt, begrun, runlength);
+
+	iscsi_queue_pdu(iscsi, pdu);
+	return 0;
+}
+
+/*
+ * Data-In
+ */
+static int
+iscsi_snack_seen_grow(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      uint32_t datasn)
+{
+	uint32_t words = pdu->datasn_seen_words, *seen;
+	uint32_t i;
+
+	if (datasn / 32 < words) {
+		return 0;
+	}
+	if (words == 0) {
+		words = 4;
+	}
+	while (words <= datasn / 32) {
+		words *= 2;
+	}
+	if (pdu->datasn_seen == NULL) {
+		seen = iscsi_malloc(iscsi, words * sizeof(*seen));
+	} else {
+		seen = iscsi_realloc(iscsi, pdu->datasn_seen,
+				     words * sizeof(*seen));
+	}
+	if (seen == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"DataSN bitmap");
+		return -1;
+	}
+	memset(&seen[pdu->datasn_seen_words], 0,
+	       (words - pdu->datasn_seen_words) * sizeof(*seen));
+
+	if (pdu->datasn_seen == NULL) {
+		/* everything before the first gap arrived in order */
+		for (i = 0; i < pdu->expdatasn; i++) {
+			seen[i / 32] |= 1U << (i % 32);
+		}
+	}
+	pdu->datasn_seen = seen;
+	pdu->datasn_seen_words = words;
+	return 0;
+}
+
+static int
+iscsi_snack_seen(struct iscsi_pdu *pdu, uint32_t datasn)
+{
+	if (pdu->datasn_seen == NULL) {
+		return datasn < pdu->expdatasn;
+	}
+	if (datasn / 32 >= pdu->datasn_seen_words) {
+		return 0;
+	}
+	return !!(pdu->datasn_seen[datasn / 32] & (1U << (datasn % 32)));
+}
+
+/*
+ * Ask for the Data-In from pdu->expdatasn up to but not including datasn.
+ */
+static int
+iscsi_snack_data_gap(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		     uint32_t datasn)
+{
+	uint32_t count = datasn - pdu->expdatasn;
+
+	if (iscsi_snack_seen_grow(iscsi, pdu, datasn) != 0) {
+		return -1;
+	}
+	if (iscsi_send_snack(iscsi, ISCSI_SNACK_DATA_R2T, pdu->itt,
+			     0xffffffff, pdu->lun, pdu->expdatasn,
+			     count) != 0) {
+		return -1;
+	}
+	pdu->datasn_missing += count;
+	pdu->expdatasn = datasn;
+	return 0;
+}
+
+/*
+ * Account for a Data-In PDU of the task.
+ *
+ * Returns 0 if it is to be processed, 1 if it is a duplicate to drop and
+ * -1 on failure.
+ */
+int
+iscsi_snack_data_in(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		    uint32_t datasn)
+{
+	if (datasn == pdu->expdatasn && pdu->datasn_seen == NULL) {
+		pdu->expdatasn++;
+		return 0;
+	}
+
+	if (iscsi_serial32_compare(datasn, pdu->expdatasn) < 0) {
+		/* a retransmission */
+		if (iscsi_snack_seen(pdu, datasn)) {
+			return 1;
+		}
+		pdu->datasn_seen[datasn / 32] |= 1U << (datasn % 32);
+		pdu->datasn_missing--;
+		return 0;
+	}
+
+	if (datasn != pdu->expdatasn) {
+		ISCSI_LOG(iscsi, 1, "Data-In gap for itt %08x: expected "
+			  "DataSN %08x got %08x", pdu->itt, pdu->expdatasn,
+			  datasn);
+		if (iscsi_snack_data_gap(iscsi, pdu, datasn) != 0) {
+			return -1;
+		}
+	} else if (iscsi_snack_seen_grow(iscsi, pdu, datasn) != 0) {
+		return -1;
+	}
+	pdu->datasn_seen[datasn / 32] |= 1U << (datasn % 32);
+	pdu->expdatasn = datasn + 1;
+	return 0;
+}
+
+/*
+ * A Data-In PDU of the task failed its data digest.
+ */
+int
+iscsi_snack_data_lost(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		      uint32_t datasn)
+{
+	ISCSI_LOG(iscsi, 1, "Data-In for itt %08x DataSN %08x failed the "
+		  "data digest", pdu->itt, datasn);
+
+	if (iscsi_serial32_compare(datasn, pdu->expdatasn) < 0) {
+		if (iscsi_snack_seen(pdu, datasn)) {
+			return 0;
+		}
+		/* the retransmission was corrupted too */
+		return iscsi_send_snack(iscsi, ISCSI_SNACK_DATA_R2T, pdu->itt,
+					0xffffffff, pdu->lun, datasn, 1);
+	}
+	return iscsi_snack_data_gap(iscsi, pdu, datasn + 1);
+}
+
+/*
+ * R2T
+ */
+int
+iscsi_snack_r2t(struct iscsi_context *iscsi, struct iscsi_pdu *pdu,
+		uint32_t r2tsn)
+{
+	if (iscsi_serial32_compare(r2tsn, pdu->expr2tsn) < 0) {
+		return 0;
+	}
+	if (r2tsn != pdu->expr2tsn) {
+		ISCSI_LOG(iscsi, 1, "R2T gap for itt %08x: expected R2TSN "
+			  "%08x got %08x", pdu->itt, pdu->expr2tsn, r2tsn);
+		if (iscsi_send_snack(iscsi, ISCSI_SNACK_DATA_R2T, pdu->itt,
+				     0xffffffff, pdu->lun, pdu->expr2tsn,
+				     r2tsn - pdu->expr2tsn) != 0) {
+			return -1;
+		}
+	}
+	pdu->expr2tsn = r2tsn + 1;
+	return 0;
+}
+
+/*
+ * StatSN
+ */
+static int
+iscsi_snack_statsn_missing(struct iscsi_context *iscsi, uint32_t statsn)
+{
+	uint32_t bit = statsn % ISCSI_STATSN_WINDOW;
+
+	return !!(iscsi->statsn_gap[bit / 32] & (1U << (bit % 32)));
+}
+
+static void
+iscsi_snack_statsn_mark(struct iscsi_context *iscsi, uint32_t statsn,
+			int missing)
+{
+	uint32_t bit = statsn % ISCSI_STATSN_WINDOW;
+
+	if (missing) {
+		iscsi->statsn_gap[bit / 32] |= 1U << (bit % 32);
+		iscsi->statsn_missing++;
+	} else {
+		iscsi->statsn_gap[bit / 32] &= ~(1U << (bit % 32));
+		iscsi->statsn_missing--;
+	}
+}
+
+/*
+ * Called with iscsi_lock held. Returns 1 if the range in begrun and
+ * runlength is to be asked for with a Status SNACK once the lock is
+ * released.
+ *
+ * Every StatSN between iscsi->statsn and statsn_high that has not
+ * arrived yet has its bit set in statsn_gap, and iscsi->statsn, and so
+ * ExpStatSN, only moves up to the first one still missing.
+ */
+int
+iscsi_snack_statsn(struct iscsi_context *iscsi, uint32_t statsn,
+		   enum iscsi_statsn_event event,
+		   uint32_t *begrun, uint32_t *runlength)
+{
+	uint32_t next, i;
+
+	if (iscsi_serial32_compare(statsn, iscsi->statsn) <= 0) {
+		/* acknowledged already */
+		return 0;
+	}
+
+	next = (iscsi->statsn_missing ? iscsi->statsn_high : iscsi->statsn) + 1;
+
+	if (iscsi_serial32_compare(statsn, next) < 0) {
+		if (!iscsi_snack_statsn_missing(iscsi, statsn)) {
+			/* a duplicate, or asked for already */
+			return 0;
+		}
+		switch (event) {
+		case ISCSI_STATSN_LOST:
+			/* the retransmission was corrupted too */
+			*begrun = statsn;
+			*runlength = 1;
+			return 1;
+		case ISCSI_STATSN_SENT:
+			return 0;
+		case ISCSI_STATSN_RECEIVED:
+			break;
+		}
+		iscsi_snack_statsn_mark(iscsi, statsn, 0);
+		while (iscsi->statsn != iscsi->statsn_high &&
+		       !iscsi_snack_statsn_missing(iscsi, iscsi->statsn + 1)) {
+			iscsi->statsn++;
+		}
+		return 0;
+	}
+
+	if (event == ISCSI_STATSN_RECEIVED && statsn == next) {
+		if (!iscsi->statsn_missing) {
+			iscsi->statsn = statsn;
+		}
+		iscsi->statsn_high = statsn;
+		return 0;
+	}
+
+	/* a gap, up to and with statsn unless it was received */
+	*begrun = next;
+	*runlength = statsn - next +
+		(event == ISCSI_STATSN_RECEIVED ? 0 : 1);
+	if (statsn - iscsi->statsn >= ISCSI_STATSN_WINDOW) {
+		/* more than we can keep track of, give up on those */
+		ISCSI_LOG(iscsi, 1, "StatSN gap of %u is too large to "
+			  "recover, skipping it", *runlength);
+		memset(iscsi->statsn_gap, 0, sizeof(iscsi->statsn_gap));
+		iscsi->statsn_missing = 0;
+		iscsi->statsn = statsn -
+			(event == ISCSI_STATSN_RECEIVED ? 0 : 1);
+		iscsi->statsn_high = iscsi->statsn;
+		return 0;
+	}
+	for (i = 0; i < *runlength; i++) {
+		iscsi_snack_statsn_mark(iscsi, next + i, 1);
+	}
+	iscsi->statsn_high = statsn;
+	return 1;
+}
+
+void
+iscsi_snack_free_pdu(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
+{
+	iscsi_free(iscsi, pdu->datasn_seen);
+	pdu->datasn_seen = NULL;
+	pdu->datasn_seen_words = 0;
+	iscsi_free(iscsi, pdu->status_hdr);
+	pdu->status_hdr = NULL;
+}
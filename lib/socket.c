@@ -63,9 +63,14 @@
 #endif
 
 #ifdef HAVE_PTHREAD
+#include <pthread.h>
 #include <signal.h>
 #endif
 
+#ifdef HAVE_TCP_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -77,6 +82,7 @@
 #include "scsi-lowlevel.h"
 #include "iscsi.h"
 #include "iscsi-private.h"
+#include "iscsi-probes.h"
 #include "slist.h"
 
 static uint32_t iface_rr = 0;
@@ -118,7 +124,7 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
 
 	if (pdu->outdata.data[0] & ISCSI_PDU_IMMEDIATE) {
 		do {
-			if ((current->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+			if (ISCSI_PDU_HAS_CMDSN(current)) {
 				iscsi_pdu_set_cmdsn(pdu, current->cmdsn);
 				break;
 			}
@@ -152,7 +158,9 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
         
 #if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
         if(iscsi->multithreading_enabled) {
-                if (current == NULL && pdu == iscsi->outqueue) {
+                /* a busy polling service thread will see the pdu anyway */
+                if (current == NULL && pdu == iscsi->outqueue &&
+                    !iscsi->busy_polling) {
                         pthread_kill(iscsi->service_thread, SIGUSR1);
                 }
         } else {
@@ -167,6 +175,59 @@ iscsi_add_to_outqueue(struct iscsi_context *iscsi, struct iscsi_pdu *pdu)
         return;
 }
 
+void
+iscsi_outqueue_batch_begin(struct iscsi_context *iscsi)
+{
+	iscsi->outqueue_batching = 1;
+}
+
+void
+iscsi_outqueue_batch_end(struct iscsi_context *iscsi)
+{
+	struct iscsi_pdu *batch = iscsi->outqueue_batch;
+	struct iscsi_pdu *last, *pdu;
+
+	iscsi->outqueue_batching = 0;
+	iscsi->outqueue_batch = NULL;
+	iscsi->outqueue_batch_tail = NULL;
+	if (batch == NULL) {
+		return;
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (last = iscsi->outqueue; last && last->next; last = last->next) {
+	}
+	if (last != NULL &&
+	    iscsi_serial32_compare(last->cmdsn, batch->cmdsn) > 0) {
+		/* does not simply go at the end, sort it in one by one */
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		while ((pdu = batch) != NULL) {
+			batch = pdu->next;
+			pdu->next = NULL;
+			iscsi_add_to_outqueue(iscsi, pdu);
+		}
+		return;
+	}
+	if (last != NULL) {
+		last->next = batch;
+	} else {
+		iscsi->outqueue = batch;
+	}
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	if (iscsi->multithreading_enabled) {
+		if (last == NULL && !iscsi->busy_polling) {
+			pthread_kill(iscsi->service_thread, SIGUSR1);
+		}
+		return;
+	}
+#endif
+	if (last == NULL) {
+		iscsi->drv->service(iscsi, POLLOUT);
+	}
+}
+
 void iscsi_decrement_iface_rr() {
         /* TODO QQQ use an atomic here */
 	iface_rr--;
@@ -230,7 +291,7 @@ static int set_tcp_syncnt(struct iscsi_context *iscsi)
 	return 0;
 }
 
-static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa, int ai_family) {
+int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *sa, int ai_family) {
 
 	int socksize;
 
@@ -255,6 +316,12 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
 		return -1;
 	}
 
+	if (iscsi->old_iscsi) {
+		/* the old socket is replaced below, its zerocopy
+		 * notifications will never arrive */
+		iscsi_tcp_zerocopy_flush(iscsi, iscsi->old_iscsi);
+	}
+
 	if (iscsi->old_iscsi && iscsi->fd != iscsi->old_iscsi->fd) {
 		if (iscsi_dup2(iscsi, iscsi->fd, iscsi->old_iscsi->fd) == -1) {
 			return -1;
@@ -306,6 +373,43 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
 		ISCSI_LOG(iscsi,3,"TCP_NODELAY set to 1");
 	}
 
+#ifdef SO_BUSY_POLL
+	if (iscsi->busy_poll_socket_us > 0) {
+		if (setsockopt(iscsi->fd, SOL_SOCKET, SO_BUSY_POLL,
+			       &iscsi->busy_poll_socket_us,
+			       sizeof(iscsi->busy_poll_socket_us)) != 0) {
+			ISCSI_LOG(iscsi,1,"failed to set SO_BUSY_POLL sockopt: %s",strerror(errno));
+		} else {
+			ISCSI_LOG(iscsi,3,"SO_BUSY_POLL set to %d",iscsi->busy_poll_socket_us);
+		}
+#ifdef SO_PREFER_BUSY_POLL
+		{
+			int one = 1;
+
+			if (setsockopt(iscsi->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL,
+				       &one, sizeof(one)) != 0) {
+				ISCSI_LOG(iscsi,2,"failed to set SO_PREFER_BUSY_POLL sockopt: %s",strerror(errno));
+			}
+		}
+#endif
+	}
+#endif
+
+	iscsi->tcp_zerocopy = 0;
+	iscsi->zc_next_id = 0;
+#ifdef HAVE_TCP_ZEROCOPY
+	if (iscsi->tcp_zerocopy_threshold > 0) {
+		int one = 1;
+
+		if (setsockopt(iscsi->fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) != 0) {
+			ISCSI_LOG(iscsi,1,"failed to set SO_ZEROCOPY sockopt: %s",strerror(errno));
+		} else {
+			iscsi->tcp_zerocopy = 1;
+			ISCSI_LOG(iscsi,3,"SO_ZEROCOPY set, threshold %u bytes",iscsi->tcp_zerocopy_threshold);
+		}
+	}
+#endif
+
 	if (connect(iscsi->fd, &sa->sa, socksize) != 0
 #if defined(_WIN32)
             && WSAGetLastError() != WSAEWOULDBLOCK
@@ -322,57 +426,99 @@ static int iscsi_tcp_connect(struct iscsi_context *iscsi, union socket_address *
 }
 
 
-
-int
-iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
-		    iscsi_command_cb cb, void *private_data)
-{
-	int port = 3260;
-	char *str;
-	char *addr, *host;
-	struct addrinfo *ai = NULL;
+/*
+ * Connection establishment.
+ *
+ * A portal, and any alternate portals, may resolve into several addresses.
+ * These are attempted in parallel as described in RFC 8305 (Happy
+ * Eyeballs): a new attempt is started every ISCSI_CONNECT_ATTEMPT_DELAY_US,
+ * or as soon as the previous one failed, and the first socket that
+ * completes wins while the others are closed.
+ *
+ * The application only ever sees a single file descriptor. The first
+ * attempt (or, while a hostname is being resolved in the background, the
+ * read end of a pipe) owns iscsi->fd and whichever socket ends up winning
+ * is dup2()ed onto that same descriptor number.
+ */
+#define ISCSI_CONNECT_MAX_PORTALS	8
+#define ISCSI_CONNECT_MAX_ADDRS		16
+#define ISCSI_CONNECT_ATTEMPT_DELAY_US	250000
+/* how often the attempts the caller does not poll for are looked at */
+#define ISCSI_CONNECT_POLL_MS		20
+
+struct iscsi_connect_addr {
 	union socket_address sa;
-	int socksize;
-	bool portal_is_ip;
+	int family;
+	int portal;
+};
 
-	ISCSI_LOG(iscsi, 2, "connecting to portal %s",portal);
+struct iscsi_resolve_job;
+
+struct iscsi_connecting {
+	int nportals;
+	char portals[ISCSI_CONNECT_MAX_PORTALS][MAX_STRING_SIZE+1];
+	char hosts[ISCSI_CONNECT_MAX_PORTALS][MAX_STRING_SIZE+1];
+	int ports[ISCSI_CONNECT_MAX_PORTALS];
+
+	/* background name resolution, iscsi->fd is its pipe meanwhile */
+	struct iscsi_resolve_job *job;
+
+	int naddrs;
+	struct iscsi_connect_addr addrs[ISCSI_CONNECT_MAX_ADDRS];
+	int next_addr;
+	int primary;                        /* attempt behind iscsi->fd */
+	int fds[ISCSI_CONNECT_MAX_ADDRS];   /* other attempts in progress */
+	uint64_t next_attempt;
+	int last_err;
+	int with_alternates;
+	int cached;                         /* addrs from the portal cache */
+};
 
-	if (iscsi->fd != -1) {
-		iscsi_set_error(iscsi,
-				"Trying to connect but already connected.");
-		return -1;
-	}
+/*
+ * The addresses the portals resolved into at the last successful connect.
+ * A reconnect to the same portals starts connecting to them right away
+ * rather than waiting for the resolver, and only resolves the names again
+ * if none of them can be reached.
+ */
+struct iscsi_portal_cache {
+	char portal[MAX_STRING_SIZE+1];
+	char alternate_portals[MAX_STRING_SIZE+1];
+	int naddrs;
+	struct iscsi_connect_addr addrs[ISCSI_CONNECT_MAX_ADDRS];
+};
 
-	addr = iscsi_strdup(iscsi, portal);
-	if (addr == NULL) {
-		iscsi_set_error(iscsi, "Out-of-memory: "
-				"Failed to strdup portal address.");
-		return -1;
-	}
-	host = addr;
+/*
+ * Split a portal of the form host[:port][,tpgt] or [ipv6][:port][,tpgt]
+ * into its host and port.
+ */
+static int
+iscsi_parse_portal(struct iscsi_context *iscsi, const char *portal,
+		   char *host, int *port)
+{
+	char addr[MAX_STRING_SIZE+1];
+	char *str, *h = addr;
+
+	*port = 3260;
+	strncpy(addr, portal, MAX_STRING_SIZE);
+	addr[MAX_STRING_SIZE] = 0;
 
 	/* check if we have a target portal group tag */
-	str = strrchr(host, ',');
+	str = strrchr(h, ',');
 	if (str != NULL) {
 		str[0] = 0;
 	}
 
-	str = strrchr(host, ':');
-	if (str != NULL) {
-		if (strchr(str, ']') == NULL) {
-			if (str != NULL) {
-				port = atoi(str+1);
-				str[0] = 0;
-			}
-		}
+	str = strrchr(h, ':');
+	if (str != NULL && strchr(str, ']') == NULL) {
+		*port = atoi(str+1);
+		str[0] = 0;
 	}
 
 	/* ipv6 in [...] form ? */
-	if (host[0] == '[') {
-		host ++;
-		str = strchr(host, ']');
+	if (h[0] == '[') {
+		h ++;
+		str = strchr(h, ']');
 		if (str == NULL) {
-			iscsi_free(iscsi, addr);
 			iscsi_set_error(iscsi, "Invalid target:%s  "
 				"Missing ']' in IPv6 address", portal);
 			return -1;
@@ -380,58 +526,695 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 		*str = 0;
 	}
 
-        /* check if we got an ip address or hostname for portal */
-	portal_is_ip = inet_pton(AF_INET, host, &sa) == 1 ||
-		       inet_pton(AF_INET6, host, &sa) == 1;
+	strcpy(host, h);
+	return 0;
+}
 
-	/* is it a hostname ? */
-	if (getaddrinfo(host, NULL, NULL, &ai) != 0) {
-		iscsi_free(iscsi, addr);
-		iscsi_set_error(iscsi, "Invalid target:%s  "
-			"Can not resolv into IPv4/v6.", portal);
-		return -1;
-	}
-	iscsi_free(iscsi, addr);
+static int
+iscsi_fill_socket_address(union socket_address *sa, const struct addrinfo *ai,
+			  int port)
+{
+	int socksize;
 
-	memset(&sa, 0, sizeof(sa));
+	memset(sa, 0, sizeof(*sa));
 	switch (ai->ai_family) {
 	case AF_INET:
 		socksize = sizeof(struct sockaddr_in);
-		memcpy(&sa.sin, ai->ai_addr, socksize);
-                sa.sin.sin_family = AF_INET;
-		sa.sin.sin_port = htons(port);
+		memcpy(&sa->sin, ai->ai_addr, socksize);
+		sa->sin.sin_family = AF_INET;
+		sa->sin.sin_port = htons(port);
 #ifdef HAVE_SOCK_SIN_LEN
-		sa.sin.sin_len = socksize;
+		sa->sin.sin_len = socksize;
 #endif
-		if (!portal_is_ip) {
-			char ip[INET_ADDRSTRLEN];
-			inet_ntop(AF_INET, &sa.sin.sin_addr, ip, sizeof(ip));
-			ISCSI_LOG(iscsi, 2, "portal resolved to ipv4 address %s", ip);
-		}
-		break;
+		return 0;
 #ifdef HAVE_SOCKADDR_IN6
 	case AF_INET6:
 		socksize = sizeof(struct sockaddr_in6);
-		memcpy(&sa.sin6, ai->ai_addr, socksize);
-                sa.sin6.sin6_family = AF_INET6;
-		sa.sin6.sin6_port = htons(port);
+		memcpy(&sa->sin6, ai->ai_addr, socksize);
+		sa->sin6.sin6_family = AF_INET6;
+		sa->sin6.sin6_port = htons(port);
 #ifdef HAVE_SOCK_SIN_LEN
-		sa.sin6.sin6_len = socksize;
+		sa->sin6.sin6_len = socksize;
+#endif
+		return 0;
+#endif
+	}
+	return -1;
+}
+
+static const char *
+iscsi_connect_addr_str(struct iscsi_connect_addr *a, char *buf, size_t size)
+{
+	const void *src = &a->sa.sin.sin_addr;
+
+#ifdef HAVE_SOCKADDR_IN6
+	if (a->family == AF_INET6) {
+		src = &a->sa.sin6.sin6_addr;
+	}
 #endif
-		if (!portal_is_ip) {
+	if (inet_ntop(a->family, src, buf, size) == NULL) {
+		return "?";
+	}
+	return buf;
+}
+
+/*
+ * Append the addresses a portal resolved into, alternating between the
+ * address families starting with the one the resolver preferred.
+ */
+static void
+iscsi_connecting_add(struct iscsi_context *iscsi, struct iscsi_connecting *c,
+		     int portal, struct addrinfo *res)
+{
+	struct addrinfo *first[ISCSI_CONNECT_MAX_ADDRS];
+	struct addrinfo *other[ISCSI_CONNECT_MAX_ADDRS];
+	struct addrinfo *ai;
+	int nfirst = 0, nother = 0, i;
+
+	for (ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family == res->ai_family) {
+			if (nfirst < ISCSI_CONNECT_MAX_ADDRS) {
+				first[nfirst++] = ai;
+			}
+		} else if (nother < ISCSI_CONNECT_MAX_ADDRS) {
+			other[nother++] = ai;
+		}
+	}
+
+	for (i = 0; (i < nfirst || i < nother) &&
+		    c->naddrs < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		struct addrinfo *pick[2] = { i < nfirst ? first[i] : NULL,
+					     i < nother ? other[i] : NULL };
+		int j;
+
+		for (j = 0; j < 2 && c->naddrs < ISCSI_CONNECT_MAX_ADDRS; j++) {
+			struct iscsi_connect_addr *a = &c->addrs[c->naddrs];
 			char ip[INET6_ADDRSTRLEN];
-			inet_ntop(AF_INET6, &sa.sin6.sin6_addr, ip, sizeof(ip));
-			ISCSI_LOG(iscsi, 2, "portal resolved to ipv6 address %s", ip);
+
+			if (pick[j] == NULL ||
+			    iscsi_fill_socket_address(&a->sa, pick[j],
+						      c->ports[portal]) != 0) {
+				continue;
+			}
+			a->family = pick[j]->ai_family;
+			a->portal = portal;
+			c->naddrs++;
+			ISCSI_LOG(iscsi, 2, "portal %s resolved to address %s",
+				  c->portals[portal],
+				  iscsi_connect_addr_str(a, ip, sizeof(ip)));
+		}
+	}
+}
+
+static void
+iscsi_connecting_resolve_hints(struct addrinfo *hints)
+{
+	memset(hints, 0, sizeof(*hints));
+	hints->ai_family = AF_UNSPEC;
+	hints->ai_socktype = SOCK_STREAM;
+}
+
+static int
+iscsi_connecting_no_addrs(struct iscsi_context *iscsi,
+			  struct iscsi_connecting *c)
+{
+	if (c->naddrs == 0) {
+		iscsi_set_error(iscsi, "Invalid target:%s  "
+			"Can not resolv into IPv4/v6.", c->portals[0]);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+iscsi_connecting_resolve(struct iscsi_context *iscsi,
+			 struct iscsi_connecting *c)
+{
+	struct addrinfo hints, *ai;
+	int i, ret;
+
+	iscsi_connecting_resolve_hints(&hints);
+	for (i = 0; i < c->nportals; i++) {
+		ret = getaddrinfo(c->hosts[i], NULL, &hints, &ai);
+		if (ret != 0) {
+			ISCSI_LOG(iscsi, 1, "failed to resolve %s: %s",
+				  c->hosts[i], gai_strerror(ret));
+			continue;
+		}
+		iscsi_connecting_add(iscsi, c, i, ai);
+		freeaddrinfo(ai);
+	}
+	return iscsi_connecting_no_addrs(iscsi, c);
+}
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+/*
+ * getaddrinfo() has no asynchronous interface, hostnames are resolved by a
+ * detached thread which signals completion by writing to a pipe. If the
+ * connection attempt is abandoned first, the thread frees the job itself.
+ */
+struct iscsi_resolve_job {
+	pthread_mutex_t lock;
+	int done;
+	int abandoned;
+	int wfd;
+	int nhosts;
+	char hosts[ISCSI_CONNECT_MAX_PORTALS][MAX_STRING_SIZE+1];
+	struct addrinfo *ai[ISCSI_CONNECT_MAX_PORTALS];
+	int err[ISCSI_CONNECT_MAX_PORTALS];
+};
+
+static void
+iscsi_resolve_job_free(struct iscsi_resolve_job *job)
+{
+	int i;
+
+	for (i = 0; i < job->nhosts; i++) {
+		if (job->ai[i]) {
+			freeaddrinfo(job->ai[i]);
+		}
+	}
+	close(job->wfd);
+	pthread_mutex_destroy(&job->lock);
+	free(job);
+}
+
+static void *
+iscsi_resolve_thread(void *arg)
+{
+	struct iscsi_resolve_job *job = arg;
+	struct addrinfo hints;
+	int i, abandoned;
+
+	iscsi_connecting_resolve_hints(&hints);
+	for (i = 0; i < job->nhosts; i++) {
+		job->err[i] = getaddrinfo(job->hosts[i], NULL, &hints,
+					  &job->ai[i]);
+		if (job->err[i] != 0) {
+			job->ai[i] = NULL;
+		}
+	}
+
+	pthread_mutex_lock(&job->lock);
+	job->done = 1;
+	abandoned = job->abandoned;
+	if (!abandoned) {
+		char c = 0;
+
+		if (write(job->wfd, &c, 1) != 1) {
+			/* the pipe is only used to wake up the poller */
+		}
+	}
+	pthread_mutex_unlock(&job->lock);
+
+	if (abandoned) {
+		iscsi_resolve_job_free(job);
+	}
+	return NULL;
+}
+
+static void
+iscsi_resolve_cancel(struct iscsi_resolve_job *job)
+{
+	int done;
+
+	pthread_mutex_lock(&job->lock);
+	done = job->done;
+	job->abandoned = 1;
+	pthread_mutex_unlock(&job->lock);
+
+	if (done) {
+		iscsi_resolve_job_free(job);
+	}
+}
+
+static int iscsi_tcp_adopt_fd(struct iscsi_context *iscsi, int fd);
+
+static int
+iscsi_resolve_start(struct iscsi_context *iscsi, struct iscsi_connecting *c)
+{
+	struct iscsi_resolve_job *job;
+	pthread_t thread;
+	int fds[2];
+	int i;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: "
+				"Failed to allocate resolver job.");
+		return -1;
+	}
+	if (pipe(fds) != 0) {
+		iscsi_set_error(iscsi, "Failed to create resolver pipe. "
+				"Errno:%s(%d).", strerror(errno), errno);
+		free(job);
+		return -1;
+	}
+	set_nonblocking(fds[0]);
+
+	job->wfd = fds[1];
+	job->nhosts = c->nportals;
+	for (i = 0; i < c->nportals; i++) {
+		strcpy(job->hosts[i], c->hosts[i]);
+	}
+	pthread_mutex_init(&job->lock, NULL);
+
+	if (iscsi_tcp_adopt_fd(iscsi, fds[0]) != 0) {
+		iscsi_resolve_job_free(job);
+		return -1;
+	}
+	if (pthread_create(&thread, NULL, iscsi_resolve_thread, job) != 0) {
+		iscsi_set_error(iscsi, "Failed to start resolver thread.");
+		iscsi_resolve_job_free(job);
+		return -1;
+	}
+	pthread_detach(thread);
+	c->job = job;
+
+	ISCSI_LOG(iscsi, 3, "resolving portal %s in the background",
+		  c->portals[0]);
+	return 0;
+}
+
+/* Returns 0 while resolving, 1 once done or -1 if nothing resolved. */
+static int
+iscsi_resolve_collect(struct iscsi_context *iscsi, struct iscsi_connecting *c)
+{
+	struct iscsi_resolve_job *job = c->job;
+	char buf;
+	int i, done;
+
+	pthread_mutex_lock(&job->lock);
+	done = job->done;
+	pthread_mutex_unlock(&job->lock);
+	if (!done) {
+		return 0;
+	}
+
+	if (read(iscsi->fd, &buf, 1) < 0) {
+		/* only used for wakeups */
+	}
+	for (i = 0; i < job->nhosts; i++) {
+		if (job->err[i] != 0) {
+			ISCSI_LOG(iscsi, 1, "failed to resolve %s: %s",
+				  job->hosts[i], gai_strerror(job->err[i]));
+			continue;
 		}
-		break;
+		iscsi_connecting_add(iscsi, c, i, job->ai[i]);
+	}
+	iscsi_resolve_job_free(job);
+	c->job = NULL;
+
+	return iscsi_connecting_no_addrs(iscsi, c) ? -1 : 1;
+}
+#else
+static void
+iscsi_resolve_cancel(struct iscsi_resolve_job *job)
+{
+}
+
+static int
+iscsi_resolve_collect(struct iscsi_context *iscsi,
+		      struct iscsi_connecting *c)
+{
+	return 1;
+}
 #endif
-	default:
+
+/*
+ * Move fd onto the descriptor the application is polling: iscsi->fd, or
+ * while reconnecting the descriptor of the old context.
+ */
+static int
+iscsi_tcp_adopt_fd(struct iscsi_context *iscsi, int fd)
+{
+	int target = iscsi->fd;
+
+	if (target == -1 && iscsi->old_iscsi) {
+		/* the old socket is replaced below, its zerocopy
+		 * notifications will never arrive */
+		iscsi_tcp_zerocopy_flush(iscsi, iscsi->old_iscsi);
+#ifdef HAVE_KTLS
+		iscsi_tls_release(iscsi->old_iscsi);
+#endif
+		target = iscsi->old_iscsi->fd;
+	}
+
+	if (target != -1 && target != fd) {
+		if (iscsi_dup2(iscsi, fd, target) == -1) {
+			iscsi_set_error(iscsi, "dup2 failed. "
+					"Errno:%s(%d).", strerror(errno), errno);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		fd = target;
+	}
+	iscsi->fd = fd;
+	return 0;
+}
+
+static void
+iscsi_connecting_free(struct iscsi_context *iscsi)
+{
+	struct iscsi_connecting *c = iscsi->connecting;
+	int i;
+
+	if (c == NULL) {
+		return;
+	}
+	if (c->job) {
+		iscsi_resolve_cancel(c->job);
+	}
+	for (i = 0; i < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		if (c->fds[i] != -1) {
+			close(c->fds[i]);
+		}
+	}
+	iscsi_free(iscsi, c);
+	iscsi->connecting = NULL;
+}
+
+void
+iscsi_tcp_connect_cancel(struct iscsi_context *iscsi)
+{
+	iscsi_connecting_free(iscsi);
+}
+
+/*
+ * Start connecting to the next address. The new socket replaces iscsi->fd
+ * if no attempt owns it. Returns -1 if there is no address left to try.
+ */
+static int
+iscsi_connecting_next(struct iscsi_context *iscsi, struct iscsi_connecting *c)
+{
+	struct iscsi_context *old_iscsi = iscsi->old_iscsi;
+	int fd = iscsi->fd;
+
+	while (c->next_addr < c->naddrs) {
+		int idx = c->next_addr++;
+		struct iscsi_connect_addr *a = &c->addrs[idx];
+		char ip[INET6_ADDRSTRLEN];
+		int ret, s;
+
+		ISCSI_LOG(iscsi, 2, "connecting to %s port %d",
+			  iscsi_connect_addr_str(a, ip, sizeof(ip)),
+			  c->ports[a->portal]);
+
+		/* let the transport open a fresh socket */
+		iscsi->fd = -1;
+		iscsi->old_iscsi = NULL;
+		ret = iscsi->drv->connect(iscsi, &a->sa, a->family);
+		s = iscsi->fd;
+		iscsi->fd = fd;
+		iscsi->old_iscsi = old_iscsi;
+
+		if (ret != 0) {
+			c->last_err = errno;
+			ISCSI_LOG(iscsi, 2, "%s", iscsi_get_error(iscsi));
+			continue;
+		}
+
+		c->next_attempt = iscsi_clock_us() +
+			ISCSI_CONNECT_ATTEMPT_DELAY_US;
+		if (c->primary == -1) {
+			if (iscsi_tcp_adopt_fd(iscsi, s) != 0) {
+				return -1;
+			}
+			c->primary = idx;
+		} else {
+			c->fds[idx] = s;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+void
+iscsi_tcp_portal_cache_free(struct iscsi_context *iscsi)
+{
+	iscsi_free(iscsi, iscsi->portal_cache);
+	iscsi->portal_cache = NULL;
+}
+
+static const char *
+iscsi_connecting_alternates(struct iscsi_context *iscsi,
+			    struct iscsi_connecting *c)
+{
+	return c->with_alternates ? iscsi->alternate_portals : "";
+}
+
+static int
+iscsi_portal_cache_lookup(struct iscsi_context *iscsi,
+			  struct iscsi_connecting *c)
+{
+	struct iscsi_portal_cache *pc = iscsi->portal_cache;
+
+	if (pc == NULL || strcmp(pc->portal, c->portals[0]) ||
+	    strcmp(pc->alternate_portals,
+		   iscsi_connecting_alternates(iscsi, c))) {
+		return 0;
+	}
+	memcpy(c->addrs, pc->addrs, pc->naddrs * sizeof(pc->addrs[0]));
+	c->naddrs = pc->naddrs;
+	c->cached = 1;
+
+	ISCSI_LOG(iscsi, 2, "using the %d addresses portal %s resolved into "
+		  "at the last connect", c->naddrs, c->portals[0]);
+	return 1;
+}
+
+static void
+iscsi_portal_cache_save(struct iscsi_context *iscsi,
+			struct iscsi_connecting *c)
+{
+	struct iscsi_portal_cache *pc = iscsi->portal_cache;
+
+	if (c->cached) {
+		return;
+	}
+	if (pc == NULL) {
+		pc = iscsi_malloc(iscsi, sizeof(*pc));
+		if (pc == NULL) {
+			/* we will just resolve them again */
+			return;
+		}
+		iscsi->portal_cache = pc;
+	}
+	strcpy(pc->portal, c->portals[0]);
+	strcpy(pc->alternate_portals, iscsi_connecting_alternates(iscsi, c));
+	memcpy(pc->addrs, c->addrs, c->naddrs * sizeof(c->addrs[0]));
+	pc->naddrs = c->naddrs;
+}
+
+static int
+iscsi_connecting_failed(struct iscsi_context *iscsi)
+{
+	/* the names may resolve into other addresses now */
+	iscsi_tcp_portal_cache_free(iscsi);
+	iscsi_connecting_free(iscsi);
+	if (iscsi->socket_status_cb) {
+		iscsi->socket_status_cb(iscsi, SCSI_STATUS_ERROR, NULL,
+					iscsi->connect_data);
+		iscsi->socket_status_cb = NULL;
+	}
+	return iscsi_service_reconnect_if_loggedin(iscsi);
+}
+
+static int
+iscsi_connecting_service(struct iscsi_context *iscsi)
+{
+	struct iscsi_connecting *c = iscsi->connecting;
+	struct pollfd pfd[ISCSI_CONNECT_MAX_ADDRS];
+	int idx[ISCSI_CONNECT_MAX_ADDRS];
+	int i, n = 0, winner = -1;
+
+	if (c->job) {
+		int ret = iscsi_resolve_collect(iscsi, c);
+
+		if (ret == 0) {
+			return 0;
+		}
+		if (ret < 0 || iscsi_connecting_next(iscsi, c) != 0) {
+			return iscsi_connecting_failed(iscsi);
+		}
+	}
+
+	/* the primary attempt is polled here too so that we do not depend
+	 * on what the caller polled for */
+	if (c->primary != -1) {
+		pfd[n].fd = iscsi->fd;
+		idx[n++] = c->primary;
+	}
+	for (i = 0; i < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		if (c->fds[i] != -1) {
+			pfd[n].fd = c->fds[i];
+			idx[n++] = i;
+		}
+	}
+	for (i = 0; i < n; i++) {
+		pfd[i].events = POLLOUT;
+		pfd[i].revents = 0;
+	}
+	if (n && poll(pfd, n, 0) < 0) {
+		return 0;
+	}
+
+	for (i = 0; i < n; i++) {
+		int err = 0;
+		socklen_t err_size = sizeof(err);
+		char ip[INET6_ADDRSTRLEN];
+
+		if (!pfd[i].revents) {
+			continue;
+		}
+		if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+			       (char *)&err, &err_size) != 0) {
+			err = errno;
+		}
+		if (err == 0 && !(pfd[i].revents & (POLLERR|POLLHUP))) {
+			winner = idx[i];
+			break;
+		}
+		if (err == 0) {
+			err = ECONNRESET;
+		}
+		c->last_err = err;
+		ISCSI_LOG(iscsi, 2, "connect to %s failed: %s(%d)",
+			  iscsi_connect_addr_str(&c->addrs[idx[i]], ip,
+						 sizeof(ip)),
+			  strerror(err), err);
+		if (idx[i] == c->primary) {
+			/* stays in iscsi->fd until replaced */
+			c->primary = -1;
+		} else {
+			close(c->fds[idx[i]]);
+			c->fds[idx[i]] = -1;
+		}
+	}
+
+	if (winner != -1) {
+		if (winner != c->primary) {
+			int s = c->fds[winner];
+
+			c->fds[winner] = -1;
+			if (iscsi_tcp_adopt_fd(iscsi, s) != 0) {
+				return iscsi_connecting_failed(iscsi);
+			}
+		}
+		strncpy(iscsi->connected_portal,
+			c->portals[c->addrs[winner].portal], MAX_STRING_SIZE);
+		iscsi_portal_cache_save(iscsi, c);
+		iscsi_connecting_free(iscsi);
+		return iscsi_tcp_service(iscsi, POLLOUT);
+	}
+
+	/* promote an attempt still in progress if the primary one failed */
+	for (i = 0; c->primary == -1 && i < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		if (c->fds[i] != -1) {
+			int s = c->fds[i];
+
+			c->fds[i] = -1;
+			if (iscsi_tcp_adopt_fd(iscsi, s) != 0) {
+				return iscsi_connecting_failed(iscsi);
+			}
+			c->primary = i;
+		}
+	}
+
+	if (c->primary == -1 ||
+	    (c->next_addr < c->naddrs && iscsi_clock_us() >= c->next_attempt)) {
+		iscsi_connecting_next(iscsi, c);
+	}
+
+	if (c->primary == -1) {
+		iscsi_set_error(iscsi, "iscsi_service: socket error "
+				"%s(%d) while connecting.",
+				strerror(c->last_err), c->last_err);
+		return iscsi_connecting_failed(iscsi);
+	}
+	return 0;
+}
+
+int
+iscsi_tcp_connect_next_ms(struct iscsi_context *iscsi)
+{
+	struct iscsi_connecting *c = iscsi->connecting;
+	uint64_t now;
+	int i, ms = -1;
+
+	if (c == NULL || c->job) {
+		return -1;
+	}
+
+	/* only iscsi->fd is polled by the caller, so come back soon to see
+	 * if one of the other attempts connected first */
+	for (i = 0; i < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		if (c->fds[i] != -1) {
+			ms = ISCSI_CONNECT_POLL_MS;
+			break;
+		}
+	}
+
+	if (c->next_addr < c->naddrs) {
+		int next;
+
+		now = iscsi_clock_us();
+		if (now >= c->next_attempt) {
+			return 0;
+		}
+		next = (int)((c->next_attempt - now + 999) / 1000);
+		if (ms < 0 || next < ms) {
+			ms = next;
+		}
+	}
+	return ms;
+}
+
+static int
+iscsi_connecting_add_portal(struct iscsi_context *iscsi,
+			    struct iscsi_connecting *c, const char *portal)
+{
+	if (c->nportals == ISCSI_CONNECT_MAX_PORTALS) {
+		ISCSI_LOG(iscsi, 1, "too many portals, ignoring %s", portal);
+		return 0;
+	}
+	if (iscsi_parse_portal(iscsi, portal, c->hosts[c->nportals],
+			       &c->ports[c->nportals]) != 0) {
+		return -1;
+	}
+	strncpy(c->portals[c->nportals], portal, MAX_STRING_SIZE);
+	c->nportals++;
+	return 0;
+}
+
+/* iSER resolves and connects in one go through the RDMA CM */
+static int
+iscsi_connect_async_single(struct iscsi_context *iscsi, const char *portal,
+			   iscsi_command_cb cb, void *private_data)
+{
+	char host[MAX_STRING_SIZE+1];
+	struct addrinfo hints, *ai = NULL;
+	union socket_address sa;
+	int port;
+
+	if (iscsi_parse_portal(iscsi, portal, host, &port) != 0) {
+		return -1;
+	}
+
+	iscsi_connecting_resolve_hints(&hints);
+	if (getaddrinfo(host, NULL, &hints, &ai) != 0) {
+		iscsi_set_error(iscsi, "Invalid target:%s  "
+			"Can not resolv into IPv4/v6.", portal);
+		return -1;
+	}
+
+	if (iscsi_fill_socket_address(&sa, ai, port) != 0) {
 		iscsi_set_error(iscsi, "Unknown address family :%d. "
 				"Only IPv4/IPv6 supported so far.",
 				ai->ai_family);
 		freeaddrinfo(ai);
 		return -1;
-
 	}
 
 	iscsi->socket_status_cb  = cb;
@@ -449,9 +1232,103 @@ iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
 	return 0;
 }
 
-static int
+int
+iscsi_connect_async(struct iscsi_context *iscsi, const char *portal,
+		    iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_connecting *c;
+	int i, numeric = 1, cached;
+
+	ISCSI_LOG(iscsi, 2, "connecting to portal %s",portal);
+
+	if (iscsi->fd != -1 || iscsi->connecting) {
+		iscsi_set_error(iscsi,
+				"Trying to connect but already connected.");
+		return -1;
+	}
+
+	if (iscsi->transport == ISER_TRANSPORT) {
+		return iscsi_connect_async_single(iscsi, portal, cb,
+						  private_data);
+	}
+
+	c = iscsi_zmalloc(iscsi, sizeof(*c));
+	if (c == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: "
+				"Failed to allocate connection state.");
+		return -1;
+	}
+	c->primary = -1;
+	for (i = 0; i < ISCSI_CONNECT_MAX_ADDRS; i++) {
+		c->fds[i] = -1;
+	}
+
+	if (iscsi_connecting_add_portal(iscsi, c, portal) != 0) {
+		iscsi_free(iscsi, c);
+		return -1;
+	}
+	/* a redirect names the one portal to use */
+	if (strcmp(portal, iscsi->target_address)) {
+		char portals[MAX_STRING_SIZE+1];
+		char *tok, *saveptr = NULL;
+
+		c->with_alternates = 1;
+		strcpy(portals, iscsi->alternate_portals);
+		for (tok = strtok_r(portals, " \t", &saveptr); tok;
+		     tok = strtok_r(NULL, " \t", &saveptr)) {
+			if (iscsi_connecting_add_portal(iscsi, c, tok) != 0) {
+				iscsi_free(iscsi, c);
+				return -1;
+			}
+		}
+	}
+
+	for (i = 0; i < c->nportals; i++) {
+		unsigned char buf[sizeof(struct in6_addr)];
+
+		if (inet_pton(AF_INET, c->hosts[i], buf) != 1 &&
+		    inet_pton(AF_INET6, c->hosts[i], buf) != 1) {
+			numeric = 0;
+		}
+	}
+
+	iscsi->socket_status_cb  = cb;
+	iscsi->connect_data      = private_data;
+	iscsi->connecting        = c;
+	strncpy(iscsi->connected_portal, portal, MAX_STRING_SIZE);
+
+	cached = iscsi_portal_cache_lookup(iscsi, c);
+
+#if defined(HAVE_PTHREAD) && !defined(_WIN32)
+	if (!numeric && !cached) {
+		if (iscsi_resolve_start(iscsi, c) != 0) {
+			iscsi_connecting_free(iscsi);
+			return -1;
+		}
+		return 0;
+	}
+#endif
+
+	if (!cached && iscsi_connecting_resolve(iscsi, c) != 0) {
+		iscsi_connecting_free(iscsi);
+		return -1;
+	}
+	if (iscsi_connecting_next(iscsi, c) != 0) {
+		iscsi_set_error(iscsi, "Couldn't connect transport: %s",
+                                iscsi_get_error(iscsi));
+		iscsi_tcp_portal_cache_free(iscsi);
+		iscsi_connecting_free(iscsi);
+		return -1;
+	}
+	return 0;
+}
+
+int
 iscsi_tcp_disconnect(struct iscsi_context *iscsi)
 {
+	iscsi_tcp_zerocopy_flush(iscsi, iscsi);
+	iscsi_connecting_free(iscsi);
+
 	if (iscsi->fd == -1) {
 		iscsi_set_error(iscsi, "Trying to disconnect "
 				"but not connected");
@@ -486,7 +1363,7 @@ iscsi_disconnect(struct iscsi_context *iscsi)
         return iscsi->drv->disconnect(iscsi);
 }
 
-static int
+int
 iscsi_tcp_get_fd(struct iscsi_context *iscsi)
 {
 	if (iscsi->old_iscsi) {
@@ -501,16 +1378,21 @@ iscsi_get_fd(struct iscsi_context *iscsi)
 	return iscsi->drv->get_fd(iscsi);
 }
 
-static int
+int
 iscsi_tcp_which_events(struct iscsi_context *iscsi)
 {
 	int events = iscsi->is_connected ? POLLIN : POLLOUT;
 
 	if (iscsi->pending_reconnect && iscsi->old_iscsi &&
-		time(NULL) < iscsi->next_reconnect) {
+		iscsi_clock_us() < iscsi->next_reconnect) {
 		return 0;
 	}
 
+	if (iscsi->connecting && iscsi->connecting->job) {
+		/* wait for the resolver pipe */
+		return POLLIN;
+	}
+
         iscsi_mt_spin_lock(&iscsi->iscsi_lock);
 	if (iscsi->outqueue_current ||
 	    (iscsi->outqueue && !iscsi->is_corked &&
@@ -527,7 +1409,13 @@ iscsi_tcp_which_events(struct iscsi_context *iscsi)
 int
 iscsi_which_events(struct iscsi_context *iscsi)
 {
-	return iscsi->drv->which_events(iscsi);
+	int events = iscsi->drv->which_events(iscsi);
+
+	/* the socket is almost always writable, get us into iscsi_service() */
+	if (iscsi->completions != NULL) {
+		events |= POLLOUT;
+	}
+	return events;
 }
 
 int
@@ -566,6 +1454,199 @@ iscsi_out_queue_length(struct iscsi_context *iscsi)
 	return i;
 }
 
+static int
+iscsi_tcp_zerocopy_busy(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_zc_send *zs;
+
+	for (zs = iscsi->zc_sends; zs; zs = zs->next) {
+		if (zs->task == task) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+iscsi_tcp_zerocopy_run(struct iscsi_context *iscsi, struct iscsi_context *owner,
+		       struct iscsi_zc_deferred *ready)
+{
+	while (ready) {
+		struct iscsi_zc_deferred *zd = ready;
+		struct scsi_task *task = zd->task;
+		iscsi_command_cb callback = zd->callback;
+		void *private_data = zd->private_data;
+		int status = zd->status;
+
+		ready = zd->next;
+		iscsi_free(owner, zd);
+
+		task->status = status;
+		if (callback) {
+			callback(iscsi, status, task, private_data);
+		}
+	}
+}
+
+/* Remember that task has data in the zerocopy send with notification id. */
+static int
+iscsi_tcp_zerocopy_track(struct iscsi_context *iscsi, struct scsi_task *task,
+			 uint32_t id)
+{
+	struct iscsi_zc_send *zs;
+
+	zs = iscsi_malloc(iscsi, sizeof(*zs));
+	if (zs == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"zerocopy send");
+		return -1;
+	}
+	zs->task = task;
+	zs->id = id;
+	ISCSI_LIST_ADD(&iscsi->zc_sends, zs);
+	return 0;
+}
+
+/* The kernel released the pages of the sends lo..hi (inclusive). */
+static void
+iscsi_tcp_zerocopy_complete(struct iscsi_context *iscsi, uint32_t lo,
+			    uint32_t hi)
+{
+	struct iscsi_zc_send **pzs = &iscsi->zc_sends;
+	struct iscsi_zc_deferred **pzd = &iscsi->zc_deferred;
+	struct iscsi_zc_deferred *ready = NULL, **tail = &ready;
+
+	while (*pzs) {
+		struct iscsi_zc_send *zs = *pzs;
+
+		if ((uint32_t)(zs->id - lo) <= (uint32_t)(hi - lo)) {
+			*pzs = zs->next;
+			iscsi_free(iscsi, zs);
+		} else {
+			pzs = &zs->next;
+		}
+	}
+
+	while (*pzd) {
+		struct iscsi_zc_deferred *zd = *pzd;
+
+		if (iscsi_tcp_zerocopy_busy(iscsi, zd->task)) {
+			pzd = &zd->next;
+			continue;
+		}
+		*pzd = zd->next;
+		zd->next = NULL;
+		*tail = zd;
+		tail = &zd->next;
+	}
+
+	iscsi_tcp_zerocopy_run(iscsi, iscsi, ready);
+}
+
+/*
+ * Drain the socket error queue. Returns the number of zerocopy
+ * notifications processed or -1 on error.
+ */
+static int
+iscsi_tcp_zerocopy_reap(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_TCP_ZEROCOPY
+	char control[128];
+	int reaped = 0;
+
+	for (;;) {
+		struct msghdr msg;
+		struct cmsghdr *cm;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(iscsi->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				break;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			iscsi_set_error(iscsi, "Failed to read socket error "
+					"queue: %s(%d)", strerror(errno), errno);
+			return -1;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err serr;
+
+			if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+				continue;
+			}
+			memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+			if (serr.ee_errno != 0 ||
+			    serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+				continue;
+			}
+			if ((serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) &&
+			    iscsi->tcp_zerocopy) {
+				/* e.g. loopback or a device without
+				 * scatter-gather, zerocopy only adds overhead */
+				ISCSI_LOG(iscsi, 2, "kernel copied zerocopy "
+					  "payload, disabling SO_ZEROCOPY");
+				iscsi->tcp_zerocopy = 0;
+			}
+			iscsi_tcp_zerocopy_complete(iscsi, serr.ee_info,
+						    serr.ee_data);
+			reaped++;
+		}
+	}
+	return reaped;
+#else
+	return 0;
+#endif
+}
+
+int
+iscsi_tcp_zerocopy_defer(struct iscsi_context *iscsi,
+			 struct scsi_task *task, int status,
+			 iscsi_command_cb callback, void *private_data)
+{
+	struct iscsi_zc_deferred *zd;
+
+	if (!iscsi_tcp_zerocopy_busy(iscsi, task)) {
+		return 0;
+	}
+
+	zd = iscsi_malloc(iscsi, sizeof(*zd));
+	if (zd == NULL) {
+		/* better complete early than never */
+		return 0;
+	}
+	zd->task = task;
+	zd->status = status;
+	zd->callback = callback;
+	zd->private_data = private_data;
+	zd->next = NULL;
+	ISCSI_LIST_ADD_END(&iscsi->zc_deferred, zd);
+	return 1;
+}
+
+void
+iscsi_tcp_zerocopy_flush(struct iscsi_context *iscsi,
+			 struct iscsi_context *owner)
+{
+	struct iscsi_zc_deferred *ready;
+
+	while (owner->zc_sends) {
+		struct iscsi_zc_send *zs = owner->zc_sends;
+
+		owner->zc_sends = zs->next;
+		iscsi_free(owner, zs);
+	}
+
+	ready = owner->zc_deferred;
+	owner->zc_deferred = NULL;
+	iscsi_tcp_zerocopy_run(iscsi, owner, ready);
+}
+
 ssize_t
 iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *iovector, uint32_t pos, ssize_t count, uint32_t *data_digest_ptr, int do_write)
 {
@@ -646,6 +1727,22 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 	iov->iov_len -= pos;
 
 	if (do_write) {
+#ifdef HAVE_TCP_ZEROCOPY
+		if (iscsi->tcp_zerocopy && count >= (ssize_t)iscsi->tcp_zerocopy_threshold) {
+			struct msghdr msg;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = (struct iovec*) iov;
+			msg.msg_iovlen = niov;
+			n = sendmsg(iscsi->fd, &msg, MSG_ZEROCOPY);
+			if (n > 0) {
+				iscsi->zc_next_id++;
+			} else if (n == -1 && errno == ENOBUFS) {
+				/* too many notifications pending, copy this one */
+				n = writev(iscsi->fd, (struct iovec*) iov, niov);
+			}
+		} else
+#endif
 		n = writev(iscsi->fd, (struct iovec*) iov, niov);
 	} else {
 		n = readv(iscsi->fd, (struct iovec*) iov, niov);
@@ -680,6 +1777,21 @@ iscsi_iovector_readv_writev(struct iscsi_context *iscsi, struct scsi_iovector *i
 	return n;
 }
 
+/*
+ * A read failed. With kernel TLS this may just be a TLS control record
+ * in the way, see iscsi_tls_recv_control().
+ */
+static int
+iscsi_recv_control(struct iscsi_context *iscsi)
+{
+#ifdef HAVE_KTLS
+	if (errno == EIO && iscsi->tls != NULL) {
+		return iscsi_tls_recv_control(iscsi);
+	}
+#endif
+	return 0;
+}
+
 static int
 iscsi_read_from_socket(struct iscsi_context *iscsi)
 {
@@ -723,11 +1835,25 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 				if (errno == EINTR || errno == EAGAIN) {
 					break;
 				}
-				iscsi_set_error(iscsi, "read from socket failed, "
-					"errno:%d", errno);
+				ret = iscsi_recv_control(iscsi);
+				if (ret > 0) {
+					continue;
+				}
+				if (ret == 0) {
+					iscsi_set_error(iscsi, "read from socket "
+						"failed, errno:%d", errno);
+				}
+				ret = -1;
                                 goto finished;
 			}
 			in->hdr_pos  += count;
+			if (in->hdr_pos == hdr_size) {
+				ISCSI_PROBE5(pdu_recv, iscsi,
+					     scsi_get_uint32(&in->hdr[16]),
+					     scsi_get_uint32(&in->hdr[24]),
+					     in->hdr[0] & 0x3f,
+					     iscsi_get_pdu_data_size(&in->hdr[0]));
+			}
 		}
 
 		if (in->hdr_pos < hdr_size) {
@@ -778,6 +1904,9 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 				if (errno == EINTR || errno == EAGAIN) {
 					break;
 				}
+				if (iscsi_recv_control(iscsi) > 0) {
+					continue;
+				}
                                 goto finished;
 			}
 			in->data_pos += count;
@@ -800,6 +1929,9 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 				if (errno == EINTR || errno == EAGAIN) {
 					break;
 				}
+				if (iscsi_recv_control(iscsi) > 0) {
+					continue;
+				}
                                 goto finished;
 			}
 			in->received_data_digest_bytes += count;
@@ -810,6 +1942,7 @@ iscsi_read_from_socket(struct iscsi_context *iscsi)
 		}
 
                 iscsi->incoming = NULL;
+		ISCSI_TRACE_PDU(iscsi, ISCSI_TRACE_RX, in->hdr);
 		if (iscsi_process_pdu(iscsi, in) != 0) {
 			iscsi_free_iscsi_in_pdu(iscsi, in);
                         goto finished;
@@ -881,7 +2014,7 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 
 			/* pop first element of the outqueue */
 			if (iscsi_serial32_compare(iscsi->outqueue->cmdsn, iscsi->expcmdsn) < 0 &&
-				(iscsi->outqueue->outdata.data[0] & 0x3f) != ISCSI_PDU_DATA_OUT) {
+				ISCSI_PDU_HAS_CMDSN(iscsi->outqueue)) {
 				iscsi_set_error(iscsi, "iscsi_write_to_socket: outqueue[0]->cmdsn < expcmdsn (%08x < %08x) opcode %02x",
 				                iscsi->outqueue->cmdsn, iscsi->expcmdsn, iscsi->outqueue->outdata.data[0] & 0x3f);
 				return -1;
@@ -912,6 +2045,11 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 				ISCSI_LIST_ADD_END(&iscsi->waitpdu, iscsi->outqueue_current);
 			}
                         iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+			ISCSI_PROBE5(pdu_send, iscsi, iscsi->outqueue_current->itt,
+				     iscsi->outqueue_current->cmdsn,
+				     iscsi->outqueue_current->outdata.data[0] & 0x3f,
+				     iscsi->outqueue_current->outdata.size +
+				     iscsi->outqueue_current->payload_len);
 		}
 
 		pdu = iscsi->outqueue_current;
@@ -933,6 +2071,10 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 				return -1;
 			}
 			pdu->outdata_written += count;
+			if (pdu->outdata_written == pdu->outdata.size) {
+				ISCSI_TRACE_PDU(iscsi, ISCSI_TRACE_TX,
+						pdu->outdata.data);
+			}
 		}
 		/* if we havent written the full header yet. */
 		if (pdu->outdata_written != pdu->outdata.size) {
@@ -960,6 +2102,7 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 		/* Write any iovectors that might have been passed to us */
 		while (pdu->payload_written < pdu->payload_len) {
 			struct scsi_iovector* iovector_out;
+			uint32_t zc_id = iscsi->zc_next_id;
 
 			iovector_out = iscsi_get_scsi_task_iovector_out(iscsi, pdu);
 
@@ -978,6 +2121,10 @@ iscsi_write_to_socket(struct iscsi_context *iscsi)
 				}
 				return -1;
 			}
+			if (zc_id != iscsi->zc_next_id &&
+			    iscsi_tcp_zerocopy_track(iscsi, pdu->scsi_cbdata.task, zc_id) != 0) {
+				return -1;
+			}
 
 			pdu->payload_written += count;
 		}
@@ -1076,7 +2223,7 @@ iscsi_service_reconnect_if_loggedin(struct iscsi_context *iscsi)
 	return -1;
 }
 
-static int
+int
 iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 {
 	if (iscsi->fd < 0) {
@@ -1084,7 +2231,7 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 	}
 
 	if (iscsi->pending_reconnect) {
-		if (time(NULL) >= iscsi->next_reconnect) {
+		if (iscsi_clock_us() >= iscsi->next_reconnect) {
 			return iscsi_reconnect(iscsi);
 		} else {
 			if (iscsi->old_iscsi) {
@@ -1093,6 +2240,36 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 		}
 	}
 
+	if (iscsi->connecting) {
+		int ret = iscsi_connecting_service(iscsi);
+
+		if (ret != 0 || iscsi->connecting == NULL) {
+			return ret;
+		}
+		goto check_timeout;
+	}
+
+	if ((revents & POLLERR) && (iscsi->tcp_zerocopy || iscsi->zc_sends)) {
+		/* zerocopy completions are signalled through POLLERR too,
+		 * only treat it as an error if it persists after reaping */
+		int ret = iscsi_tcp_zerocopy_reap(iscsi);
+
+		if (ret < 0) {
+			ISCSI_LOG(iscsi, 1, "%s", iscsi_get_error(iscsi));
+			return iscsi_service_reconnect_if_loggedin(iscsi);
+		}
+		if (ret > 0) {
+			struct pollfd pfd;
+
+			pfd.fd = iscsi->fd;
+			pfd.events = 0;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLERR)) {
+				revents &= ~POLLERR;
+			}
+		}
+	}
+
 	if (revents & POLLERR) {
 		int err = 0;
 		socklen_t err_size = sizeof(err);
@@ -1158,6 +2335,11 @@ iscsi_tcp_service(struct iscsi_context *iscsi, int revents)
 		}
 
 		iscsi->is_connected = 1;
+#ifdef HAVE_KTLS
+		if (iscsi->transport == TLS_TRANSPORT) {
+			return iscsi_tls_handshake_start(iscsi);
+		}
+#endif
 		if (iscsi->socket_status_cb) {
 			iscsi->socket_status_cb(iscsi, SCSI_STATUS_GOOD, NULL,
 						iscsi->connect_data);
@@ -1190,15 +2372,129 @@ check_timeout:
 	return 0;
 }
 
+int
+iscsi_scsi_task_complete_later(struct iscsi_context *iscsi,
+			       struct scsi_task *task, int status,
+			       iscsi_command_cb callback, void *private_data)
+{
+	struct iscsi_completion *c;
+
+	c = malloc(sizeof(*c));
+	if (c == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"completion");
+		return -1;
+	}
+	c->task = task;
+	c->status = status;
+	c->callback = callback;
+	c->private_data = private_data;
+	c->next = NULL;
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	ISCSI_LIST_ADD_END(&iscsi->completions, c);
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	if (iscsi->multithreading_enabled && !iscsi->busy_polling) {
+		pthread_kill(iscsi->service_thread, SIGUSR1);
+	}
+#endif
+	return 0;
+}
+
+void
+iscsi_run_completions(struct iscsi_context *iscsi)
+{
+	struct iscsi_completion *ready;
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	ready = iscsi->completions;
+	iscsi->completions = NULL;
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	/* completions queued by the callbacks run on the next round */
+	while (ready) {
+		struct iscsi_completion *c = ready;
+
+		ready = c->next;
+		if (c->task != NULL) {
+			c->task->status = c->status;
+		}
+		if (c->callback) {
+			c->callback(iscsi, c->status, c->task,
+				    c->private_data);
+		}
+		free(c);
+	}
+}
+
+int
+iscsi_cancel_completion(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_completion *c;
+
+	if (iscsi->completions == NULL) {
+		return -1;
+	}
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (c = iscsi->completions; c; c = c->next) {
+		if (c->task == task) {
+			ISCSI_LIST_REMOVE(&iscsi->completions, c);
+			break;
+		}
+	}
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	if (c == NULL) {
+		return -1;
+	}
+	task->status = SCSI_STATUS_CANCELLED;
+	if (c->callback) {
+		c->callback(iscsi, SCSI_STATUS_CANCELLED, task,
+			    c->private_data);
+	}
+	free(c);
+	return 0;
+}
+
 int
 iscsi_service(struct iscsi_context *iscsi, int revents)
 {
+	if (iscsi->completions != NULL) {
+		iscsi_run_completions(iscsi);
+	}
+	if (iscsi->coalesce != NULL) {
+		iscsi_coalesce_service(iscsi);
+	}
+	if (iscsi->xcopies != NULL) {
+		iscsi_xcopy_service(iscsi);
+	}
+	if (iscsi->multipath != NULL) {
+		iscsi_multipath_service(iscsi);
+	}
 	return iscsi->drv->service(iscsi, revents);
 }
 
-static void iscsi_tcp_queue_pdu(struct iscsi_context *iscsi,
-                               struct iscsi_pdu *pdu)
+void iscsi_tcp_queue_pdu(struct iscsi_context *iscsi,
+                         struct iscsi_pdu *pdu)
 {
+	if (iscsi->outqueue_batching) {
+		if (iscsi->scsi_timeout > 0) {
+			pdu->scsi_timeout = time(NULL) + iscsi->scsi_timeout;
+		} else {
+			pdu->scsi_timeout = 0;
+		}
+		pdu->next = NULL;
+		if (iscsi->outqueue_batch_tail != NULL) {
+			iscsi->outqueue_batch_tail->next = pdu;
+		} else {
+			iscsi->outqueue_batch = pdu;
+		}
+		iscsi->outqueue_batch_tail = pdu;
+		return;
+	}
 	iscsi_add_to_outqueue(iscsi, pdu);
 }
 
@@ -1277,6 +2573,17 @@ int iscsi_set_tcp_keepalive(struct iscsi_context *iscsi, int idle, int count, in
 	return 0;
 }
 
+void iscsi_set_tcp_zerocopy(struct iscsi_context *iscsi, int threshold)
+{
+	iscsi->tcp_zerocopy_threshold = threshold > 0 ? threshold : 0;
+#ifdef HAVE_TCP_ZEROCOPY
+	ISCSI_LOG(iscsi, 2, "MSG_ZEROCOPY threshold will be set to %d on next socket creation",
+		  threshold > 0 ? threshold : 0);
+#else
+	ISCSI_LOG(iscsi, 2, "MSG_ZEROCOPY is not supported on this platform");
+#endif
+}
+
 void iscsi_set_bind_interfaces(struct iscsi_context *iscsi, char * interfaces)
 {
 #if __linux
@@ -1296,6 +2603,84 @@ void iscsi_set_bind_interfaces(struct iscsi_context *iscsi, char * interfaces)
 #endif
 }
 
+void iscsi_set_busy_poll(struct iscsi_context *iscsi, int spin_us, int socket_us)
+{
+	iscsi->busy_poll_us = spin_us > 0 ? spin_us : 0;
+	iscsi->busy_poll_socket_us = socket_us > 0 ? socket_us : 0;
+	ISCSI_LOG(iscsi, 2, "busy polling set to %dus, SO_BUSY_POLL will be set to %d on next socket creation",
+		  iscsi->busy_poll_us, iscsi->busy_poll_socket_us);
+}
+
+void iscsi_get_busy_poll_stats(struct iscsi_context *iscsi,
+			       struct iscsi_busy_poll_stats *stats)
+{
+	*stats = iscsi->busy_poll_stats;
+}
+
+int
+iscsi_busy_poll(struct iscsi_context *iscsi, struct pollfd *pfd)
+{
+	uint64_t start, now;
+	int ret;
+
+	if (iscsi->busy_poll_us <= 0) {
+		return 0;
+	}
+
+	iscsi->busy_polling = 1;
+	iscsi->busy_poll_stats.spins++;
+	start = now = iscsi_clock_us();
+	do {
+		pfd->fd = iscsi_get_fd(iscsi);
+		pfd->events = iscsi_which_events(iscsi);
+		pfd->revents = 0;
+		ret = poll(pfd, 1, 0);
+		if (ret != 0) {
+			break;
+		}
+#ifdef MSG_DONTWAIT
+		if (iscsi->busy_poll_socket_us > 0 && (pfd->events & POLLIN)) {
+			char c;
+
+			/* lets the kernel poll the NIC for SO_BUSY_POLL */
+			if (recv(pfd->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0) {
+				pfd->revents = POLLIN;
+				ret = 1;
+				break;
+			}
+		}
+#endif
+		now = iscsi_clock_us();
+	} while (now - start < (uint64_t)iscsi->busy_poll_us);
+	iscsi->busy_polling = 0;
+
+	iscsi->busy_poll_stats.spin_us += iscsi_clock_us() - start;
+	if (ret != 0) {
+		iscsi->busy_poll_stats.hits++;
+		return ret;
+	}
+	iscsi->busy_poll_stats.sleeps++;
+
+#if defined(HAVE_MULTITHREADING) && defined(HAVE_PTHREAD)
+	/* pairs with the check in iscsi_add_to_outqueue() */
+	__sync_synchronize();
+#endif
+	pfd->events = iscsi_which_events(iscsi);
+	return 0;
+}
+
+void iscsi_set_tls_ca_file(struct iscsi_context *iscsi, const char *ca_file)
+{
+	strncpy(iscsi->tls_ca_file, ca_file ? ca_file : "", MAX_STRING_SIZE);
+	ISCSI_LOG(iscsi, 2, "TLS CA file will be set to '%s' on next handshake", iscsi->tls_ca_file);
+}
+
+void iscsi_set_alternate_portals(struct iscsi_context *iscsi, const char *portals)
+{
+	strncpy(iscsi->alternate_portals, portals ? portals : "", MAX_STRING_SIZE);
+	ISCSI_LOG(iscsi, 2, "alternate portals will be set to '%s' on next connect", iscsi->alternate_portals);
+}
+
 #if defined(_MSC_VER) && _MSC_VER < 1900
 static iscsi_transport iscsi_transport_tcp = {
 	iscsi_tcp_connect,
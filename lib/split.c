@@ -0,0 +1,536 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Splitting of reads and writes that are larger than the maximum transfer
+ * length of the LUN.
+ *
+ * The pieces are READ16/WRITE16 commands that each cover a slice of the
+ * data buffer of the original task and are all sent at once. Unless the
+ * maximum transfer length is smaller, pieces are a multiple of the
+ * optimal transfer length and start on a multiple of it. The original
+ * task completes once all pieces have, with the status and sense data of
+ * the lowest failing piece.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+struct iscsi_split_piece {
+	struct iscsi_split *split;
+	struct scsi_task *task;
+	int done;
+};
+
+struct iscsi_split {
+	struct iscsi_split *next;
+	struct iscsi_context *iscsi;
+	int lun;
+	struct scsi_task *task;
+	iscsi_command_cb cb;
+	struct iscsi_data d;
+	void *private_data;
+
+	int pending;		/* pieces in flight, plus one while sending */
+	int npieces;
+	struct iscsi_split_piece *pieces;
+	unsigned char *buf;	/* datain of a read without an iovector */
+};
+
+/* The LBA and number of blocks of a read or write, -1 for anything else. */
+static int
+iscsi_split_range(struct scsi_task *task, uint64_t *lba, uint32_t *num,
+		  int *group)
+{
+	/* the layout of protection information depends on the LUN */
+	if (task->cdb[1] & 0xe0) {
+		return -1;
+	}
+	switch (task->cdb[0]) {
+	case SCSI_OPCODE_READ10:
+	case SCSI_OPCODE_WRITE10:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint16(&task->cdb[7]);
+		*group = task->cdb[6] & 0x1f;
+		break;
+	case SCSI_OPCODE_READ12:
+	case SCSI_OPCODE_WRITE12:
+		*lba = scsi_get_uint32(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[6]);
+		*group = task->cdb[10] & 0x1f;
+		break;
+	case SCSI_OPCODE_READ16:
+	case SCSI_OPCODE_WRITE16:
+		*lba = scsi_get_uint64(&task->cdb[2]);
+		*num = scsi_get_uint32(&task->cdb[10]);
+		*group = task->cdb[14] & 0x1f;
+		break;
+	default:
+		return -1;
+	}
+	if (*num == 0 || task->expxferlen <= 0 || task->expxferlen % *num) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Point piece at len bytes of the iovector starting at offset. The iovecs
+ * are allocated from the memory of the piece.
+ */
+static int
+iscsi_split_slice(struct scsi_task *piece, struct scsi_iovector *from,
+		  size_t offset, size_t len, int in)
+{
+	struct scsi_iovec *iov;
+	size_t left;
+	int i, first, niov;
+
+	for (i = 0; i < from->niov && offset >= from->iov[i].iov_len; i++) {
+		offset -= from->iov[i].iov_len;
+	}
+	first = i;
+	left = offset + len;
+	for (niov = 0; i < from->niov && left > 0; i++, niov++) {
+		left -= MIN(left, from->iov[i].iov_len);
+	}
+	if (left > 0) {
+		/* the iovector is shorter than the transfer */
+		return -1;
+	}
+
+	iov = scsi_malloc(piece, niov * sizeof(*iov));
+	if (iov == NULL) {
+		return -1;
+	}
+	left = len;
+	for (i = 0; i < niov; i++) {
+		iov[i] = from->iov[first + i];
+		if (i == 0) {
+			iov[i].iov_base = (char *)iov[i].iov_base + offset;
+			iov[i].iov_len -= offset;
+		}
+		if (iov[i].iov_len > left) {
+			iov[i].iov_len = left;
+		}
+		left -= iov[i].iov_len;
+	}
+	if (in) {
+		scsi_task_set_iov_in(piece, iov, niov);
+	} else {
+		scsi_task_set_iov_out(piece, iov, niov);
+	}
+	return 0;
+}
+
+static void
+iscsi_split_free(struct iscsi_split *split)
+{
+	int i;
+
+	for (i = 0; i < split->npieces; i++) {
+		scsi_free_scsi_task(split->pieces[i].task);
+	}
+	free(split->pieces);
+	free(split->buf);
+	free(split);
+}
+
+/* Build the task of the original command out of those of the pieces. */
+static void
+iscsi_split_complete(struct iscsi_split *split)
+{
+	struct scsi_task *task = split->task;
+	struct scsi_task *failed = NULL;
+	size_t residual = 0;
+	int i, status = SCSI_STATUS_GOOD;
+
+	for (i = 0; i < split->npieces; i++) {
+		struct scsi_task *piece = split->pieces[i].task;
+
+		if (piece->status != SCSI_STATUS_GOOD) {
+			if (failed == NULL) {
+				failed = piece;
+				status = piece->status;
+			}
+			residual += piece->expxferlen;
+		} else if (piece->residual_status == SCSI_RESIDUAL_UNDERFLOW) {
+			residual += piece->residual;
+		}
+	}
+
+	task->status = status;
+	task->residual_status = residual ? SCSI_RESIDUAL_UNDERFLOW :
+		SCSI_RESIDUAL_NO_RESIDUAL;
+	task->residual = residual;
+	if (split->buf != NULL && status == SCSI_STATUS_GOOD) {
+		/* the read data, in the buffer the pieces read into */
+		task->datain.data = split->buf;
+		task->datain.size = task->expxferlen - residual;
+		split->buf = NULL;
+	}
+	if (failed != NULL) {
+		task->sense = failed->sense;
+		if (status == SCSI_STATUS_CHECK_CONDITION &&
+		    failed->datain.size > 0) {
+			/* the sense data, like a task that was not split */
+			task->datain.data = failed->datain.data;
+			task->datain.size = failed->datain.size;
+			failed->datain.data = NULL;
+			failed->datain.size = 0;
+		}
+	}
+
+	iscsi_mt_spin_lock(&split->iscsi->iscsi_lock);
+	ISCSI_LIST_REMOVE(&split->iscsi->splits, split);
+	iscsi_mt_spin_unlock(&split->iscsi->iscsi_lock);
+
+	if (split->cb) {
+		split->cb(split->iscsi, status, task, split->private_data);
+	}
+	iscsi_split_free(split);
+}
+
+static void
+iscsi_split_put(struct iscsi_split *split)
+{
+	int pending;
+
+	iscsi_mt_spin_lock(&split->iscsi->iscsi_lock);
+	pending = --split->pending;
+	iscsi_mt_spin_unlock(&split->iscsi->iscsi_lock);
+	if (pending == 0) {
+		iscsi_split_complete(split);
+	}
+}
+
+static void
+iscsi_split_piece_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct iscsi_split_piece *piece = private_data;
+
+	piece->task->status = status;
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	piece->done = 1;
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	iscsi_split_put(piece->split);
+}
+
+/* Create and send the pieces. */
+static int
+iscsi_split_send(struct iscsi_split *split, uint64_t lba, uint32_t num,
+		 uint32_t chunk, int group)
+{
+	struct iscsi_context *iscsi = split->iscsi;
+	struct scsi_task *task = split->task;
+	uint32_t blocksize = task->expxferlen / num;
+	struct scsi_iovector from;
+	struct scsi_iovec iov;
+	uint64_t end = lba + num;
+	size_t offset = 0;
+	int i, in = task->xfer_dir == SCSI_XFER_READ;
+
+	/* the pieces start on a multiple of chunk */
+	split->npieces = (end + chunk - 1) / chunk - lba / chunk;
+	split->pieces = calloc(split->npieces, sizeof(*split->pieces));
+	if (split->pieces == NULL) {
+		return -1;
+	}
+
+	if (in && task->iovector_in.iov == NULL) {
+		split->buf = malloc(task->expxferlen);
+		if (split->buf == NULL) {
+			return -1;
+		}
+	}
+	if (split->buf != NULL || split->d.data != NULL) {
+		iov.iov_base = split->buf ? split->buf : split->d.data;
+		iov.iov_len = task->expxferlen;
+		from.iov = &iov;
+		from.niov = 1;
+	} else {
+		from = in ? task->iovector_in : task->iovector_out;
+	}
+
+	for (i = 0; i < split->npieces; i++) {
+		struct iscsi_split_piece *piece = &split->pieces[i];
+		uint64_t next = MIN((lba / chunk + 1) * chunk, end);
+		uint32_t len = (next - lba) * blocksize;
+
+		piece->split = split;
+		if (in) {
+			piece->task = scsi_cdb_read16(lba, len, blocksize, 0,
+						      task->cdb[1] & 0x10,
+						      task->cdb[1] & 0x08, 0,
+						      group);
+		} else {
+			piece->task = scsi_cdb_write16(lba, len, blocksize, 0,
+						       task->cdb[1] & 0x10,
+						       task->cdb[1] & 0x08, 0,
+						       group);
+		}
+		if (piece->task == NULL ||
+		    iscsi_split_slice(piece->task, &from, offset, len,
+				      in) != 0) {
+			return -1;
+		}
+		offset += len;
+		lba = next;
+	}
+
+	for (i = 0; i < split->npieces; i++) {
+		struct iscsi_split_piece *piece = &split->pieces[i];
+
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		split->pending++;
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (iscsi_scsi_command_submit(iscsi, split->lun, piece->task,
+					      iscsi_split_piece_cb, NULL,
+					      piece) != 0) {
+			iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+			split->pending--;
+			iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+			if (i == 0) {
+				return -1;
+			}
+			ISCSI_LOG(iscsi, 1, "failed to send piece %d of %d "
+				  "of a split command: %s", i,
+				  split->npieces, iscsi_get_error(iscsi));
+			/* the command fails once the pieces sent are done */
+			iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+			for (; i < split->npieces; i++) {
+				split->pieces[i].task->status =
+					SCSI_STATUS_ERROR;
+				split->pieces[i].done = 1;
+			}
+			iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+			break;
+		}
+	}
+	return 0;
+}
+
+/* The largest piece, in blocks, or 0 if commands are not split. */
+static uint32_t
+iscsi_split_max(struct iscsi_context *iscsi,
+		struct scsi_inquiry_block_limits *bl)
+{
+	uint32_t max = bl->max_xfer_len;
+
+	if (iscsi->auto_split > 1 &&
+	    (max == 0 || (uint32_t)iscsi->auto_split < max)) {
+		max = iscsi->auto_split;
+	}
+	return max;
+}
+
+static int
+iscsi_split_start(struct iscsi_split *split)
+{
+	struct iscsi_context *iscsi = split->iscsi;
+	struct scsi_task *task = split->task;
+	struct scsi_inquiry_block_limits bl;
+	uint32_t num, chunk;
+	uint64_t lba;
+	int group;
+
+	if (iscsi_lun_limits_get(iscsi, split->lun, &bl, NULL, NULL) != 0 ||
+	    iscsi_split_range(task, &lba, &num, &group) != 0) {
+		return 1;
+	}
+	chunk = iscsi_split_max(iscsi, &bl);
+	if (chunk == 0 || num <= chunk) {
+		return 1;
+	}
+
+	if (bl.opt_xfer_len != 0 && bl.opt_xfer_len <= chunk) {
+		chunk -= chunk % bl.opt_xfer_len;
+	}
+	ISCSI_LOG(iscsi, 2, "splitting %u blocks at lba %" PRIu64 " into "
+		  "pieces of %u blocks", num, lba, chunk);
+
+	split->pending = 1;
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	ISCSI_LIST_ADD(&iscsi->splits, split);
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+
+	if (iscsi_split_send(split, lba, num, chunk, group) != 0) {
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		ISCSI_LIST_REMOVE(&iscsi->splits, split);
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		iscsi_set_error(iscsi, "Failed to split command of %u "
+				"blocks", num);
+		return -1;
+	}
+	iscsi_split_put(split);
+	return 0;
+}
+
+/* The Block Limits of the LUN are known, or could not be fetched. */
+static void
+iscsi_split_limits_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct iscsi_split *split = private_data;
+	struct scsi_task *task = split->task;
+	int ret = -1;
+
+	if (status == SCSI_STATUS_GOOD) {
+		ret = iscsi_split_start(split);
+	} else if (status != SCSI_STATUS_CANCELLED) {
+		/* the limits are fetched again for a later command, this
+		 * one is sent as it is */
+		ret = 1;
+	}
+	if (ret == 1) {
+		/* no need to split it after all, or the limits are still
+		 * unknown and looking at them again would only wait for
+		 * them once more */
+		ret = iscsi_scsi_command_unsplit(split->iscsi, split->lun,
+						 task, split->cb,
+						 split->d.data ? &split->d :
+						 NULL, split->private_data);
+		if (ret == 0) {
+			iscsi_split_free(split);
+		}
+	}
+	if (ret == 0) {
+		return;
+	}
+
+	if (status != SCSI_STATUS_CANCELLED) {
+		status = SCSI_STATUS_ERROR;
+	}
+	task->status = status;
+	if (split->cb) {
+		split->cb(split->iscsi, status, task, split->private_data);
+	}
+	iscsi_split_free(split);
+}
+
+int
+iscsi_split_command(struct iscsi_context *iscsi, int lun,
+		    struct scsi_task *task, iscsi_command_cb cb,
+		    struct iscsi_data *d, void *private_data)
+{
+	struct scsi_inquiry_block_limits bl;
+	struct iscsi_split *split;
+	uint64_t lba;
+	uint32_t num;
+	int group, ret;
+
+	if (iscsi_split_range(task, &lba, &num, &group) != 0) {
+		return 1;
+	}
+	ret = iscsi_lun_limits_get(iscsi, lun, &bl, NULL, NULL);
+	if (ret < 0 ||
+	    (ret == 0 && (iscsi_split_max(iscsi, &bl) == 0 ||
+			  num <= iscsi_split_max(iscsi, &bl)))) {
+		return 1;
+	}
+
+	split = calloc(1, sizeof(*split));
+	if (split == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"split command");
+		return -1;
+	}
+	split->iscsi = iscsi;
+	split->lun = lun;
+	split->task = task;
+	split->cb = cb;
+	split->private_data = private_data;
+	if (d != NULL && d->data != NULL) {
+		split->d = *d;
+	}
+	task->lun = lun;
+	task->itt = 0xffffffff;
+
+	if (ret == 1) {
+		/* wait for the Block Limits to know if it needs splitting */
+		ret = iscsi_lun_limits_get(iscsi, lun, &bl,
+					   iscsi_split_limits_cb, split);
+		if (ret == 1) {
+			return 0;
+		}
+		if (ret < 0) {
+			/* send it as it is */
+			iscsi_split_free(split);
+			return 1;
+		}
+	}
+	ret = iscsi_split_start(split);
+	if (ret != 0) {
+		iscsi_split_free(split);
+	}
+	return ret;
+}
+
+int
+iscsi_split_cancel_task(struct iscsi_context *iscsi, struct scsi_task *task)
+{
+	struct iscsi_split *split;
+	int i;
+
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (split = iscsi->splits; split; split = split->next) {
+		if (split->task == task) {
+			/* keep it around while we cancel the pieces */
+			split->pending++;
+			break;
+		}
+	}
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	if (split == NULL) {
+		return -1;
+	}
+
+	for (i = 0; i < split->npieces; i++) {
+		int done;
+
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		done = split->pieces[i].done;
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (!done) {
+			iscsi_scsi_cancel_task(iscsi, split->pieces[i].task);
+		}
+	}
+	iscsi_split_put(split);
+	return 0;
+}
+
+int
+iscsi_set_auto_split(struct iscsi_context *iscsi, int enable)
+{
+	iscsi->auto_split = enable > 0 ? enable : 0;
+	ISCSI_LOG(iscsi, 2, "automatic splitting of large I/O %s",
+		  enable ? "enabled" : "disabled");
+	return 0;
+}
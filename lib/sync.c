@@ -49,7 +49,7 @@ struct iscsi_sync_state {
         void *ptr;
         struct scsi_task *task;
 #ifdef HAVE_MULTITHREADING
-        libiscsi_sem_t wait_sem;
+        struct iscsi_mt_waiter *waiter;
 #endif /* HAVE_MULTITHREADING */
 };
 
@@ -57,15 +57,34 @@ static void
 event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 {
         struct pollfd pfd;
-	int scsi_timeout;
+	time_t scsi_timeout;
+	int timeout;
 	int ret;
-	time_t t;
 
 #ifdef HAVE_MULTITHREADING
         if(iscsi->multithreading_enabled) {
-                /* TODO QQQ Must make sure the service thread event loop handle timeouts properly */
-                iscsi_mt_sem_wait(&state->wait_sem);
-                iscsi_mt_sem_destroy(&state->wait_sem);
+                /*
+                 * The service thread does the timeout scanning for us and
+                 * will complete the command with SCSI_STATUS_TIMEOUT if it
+                 * expires so we can just block until we are woken up.
+                 */
+                /* see iscsi_set_busy_poll() */
+                if (iscsi->busy_poll_us > 0) {
+                        uint64_t start = iscsi_clock_us();
+
+                        while (*(volatile int *)&state->finished == 0 &&
+                               iscsi_clock_us() - start < (uint64_t)iscsi->busy_poll_us) {
+                        }
+                }
+                if (state->waiter != NULL) {
+                        iscsi_mt_waiter_wait(state->waiter);
+                        return;
+                }
+                /* no waiter could be allocated for this thread */
+                while (*(volatile int *)&state->finished == 0) {
+                        struct timespec ts = {0, 1000000};
+                        nanosleep(&ts, NULL);
+                }
                 return;
         }
 #endif
@@ -80,8 +99,7 @@ event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 		short revents;
 
 		if (scsi_timeout) {
-			t = time(NULL);
-			if (t > scsi_timeout) {
+			if (time(NULL) > scsi_timeout) {
 				iscsi_timeout_scan(iscsi);
 
 				if (iscsi->old_iscsi) {
@@ -97,7 +115,24 @@ event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 		pfd.fd = iscsi_get_fd(iscsi);
 		pfd.events = iscsi_which_events(iscsi);
 
-		if ((ret = poll(&pfd, 1, 1000)) < 0) {
+		/*
+		 * Sleep until there is socket activity or until the next
+		 * PDU timeout/reconnect is due instead of waking up every
+		 * second just to check the clock.
+		 */
+		timeout = iscsi_timeout_next(iscsi);
+		if (scsi_timeout) {
+			ret = iscsi_ms_until(scsi_timeout + 1);
+			if (timeout < 0 || ret < timeout) {
+				timeout = ret;
+			}
+		}
+
+		ret = iscsi_busy_poll(iscsi, &pfd);
+		if (ret == 0) {
+			ret = poll(&pfd, 1, timeout);
+		}
+		if (ret < 0) {
 			iscsi_set_error(iscsi, "Poll failed");
 			state->status = -1;
 			return;
@@ -119,6 +154,29 @@ event_loop(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
 	}
 }
 
+/*
+ * Mark the sync state as finished and wake up the thread that is
+ * waiting for it in event_loop().
+ */
+static void
+iscsi_sync_finish(struct iscsi_context *iscsi, struct iscsi_sync_state *state)
+{
+#ifdef HAVE_MULTITHREADING
+        if(iscsi->multithreading_enabled) {
+                struct iscsi_mt_waiter *waiter = state->waiter;
+
+                /* state lives on the waiting thread's stack and may be
+                 * gone as soon as the waiter has been woken up. */
+                *(volatile int *)&state->finished = 1;
+                if (waiter != NULL) {
+                        iscsi_mt_waiter_wake(waiter);
+                }
+                return;
+        }
+#endif
+        state->finished = 1;
+}
+
 /*
  * Synchronous iSCSI commands
  */
@@ -129,12 +187,7 @@ iscsi_sync_cb(struct iscsi_context *iscsi, int status,
 	struct iscsi_sync_state *state = private_data;
 
 	state->status    = status;
-	state->finished = 1;
-#ifdef HAVE_MULTITHREADING
-        if(iscsi->multithreading_enabled) {
-                iscsi_mt_sem_post(&state->wait_sem);
-        }
-#endif
+	iscsi_sync_finish(iscsi, state);
 }
 
 static void
@@ -144,11 +197,14 @@ iscsi_init_sync_state(struct iscsi_context *iscsi, struct iscsi_sync_state *stat
 #ifdef HAVE_MULTITHREADING
         if(iscsi->multithreading_enabled) {
                 /*
-                 * Create a semaphore and initialize it to zero. So that we
-                 * can wait for it and immetiately block until the service thread
-                 * has received the reply.
+                 * Use the waiter of the calling thread. It is created the
+                 * first time this thread does a sync call and reused for
+                 * every call after that.
                  */
-                iscsi_mt_sem_init(&state->wait_sem, 0);
+                state->waiter = iscsi_mt_waiter_get();
+                if (state->waiter != NULL) {
+                        iscsi_mt_waiter_arm(state->waiter);
+                }
         }
 #endif /* HAVE_MULTITHREADING */
 }
@@ -207,6 +263,49 @@ iscsi_full_connect_sync(struct iscsi_context *iscsi,
 	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
 }
 
+int
+iscsi_get_block_limits_sync(struct iscsi_context *iscsi, int lun,
+			    struct scsi_inquiry_block_limits *bl)
+{
+	struct iscsi_sync_state state;
+	int ret;
+
+	iscsi_init_sync_state(iscsi, &state);
+
+	ret = iscsi_lun_limits_get(iscsi, lun, bl, iscsi_sync_cb, &state);
+	if (ret != 1) {
+		return ret;
+	}
+
+	event_loop(iscsi, &state);
+
+	if (state.status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iscsi, "Failed to fetch the Block Limits VPD "
+				"of lun %d: %s", lun, iscsi_get_error(iscsi));
+		return -1;
+	}
+	return iscsi_lun_limits_get(iscsi, lun, bl, NULL, NULL) == 0 ? 0 : -1;
+}
+
+int
+iscsi_discard_sync(struct iscsi_context *iscsi, int lun,
+		   struct unmap_list *list, int list_len,
+		   uint32_t block_size, int flags)
+{
+	struct iscsi_sync_state state;
+
+	iscsi_init_sync_state(iscsi, &state);
+
+	if (iscsi_discard_async(iscsi, lun, list, list_len, block_size, flags,
+				iscsi_sync_cb, &state) != 0) {
+		return -1;
+	}
+
+	event_loop(iscsi, &state);
+
+	return (state.status == SCSI_STATUS_GOOD) ? 0 : -1;
+}
+
 int iscsi_login_sync(struct iscsi_context *iscsi)
 {
 	struct iscsi_sync_state state;
@@ -311,7 +410,6 @@ iscsi_task_mgmt_sync_cb(struct iscsi_context *iscsi, int status,
 	struct iscsi_sync_state *state = private_data;
 
 	state->status   = status;
-	state->finished = 1;
 
 	/* The task mgmt command might have completed successfully
 	 * but the target might have responded with
@@ -337,6 +435,8 @@ iscsi_task_mgmt_sync_cb(struct iscsi_context *iscsi, int status,
 
                 state->status = SCSI_STATUS_ERROR;
 	}
+
+	iscsi_sync_finish(iscsi, state);
 }
 
 int
@@ -427,13 +527,8 @@ scsi_sync_cb(struct iscsi_context *iscsi, int status, void *command_data,
 	task->status    = status;
 
 	state->status   = status;
-	state->finished = 1;
 	state->task     = task;
-#ifdef HAVE_MULTITHREADING
-        if(iscsi->multithreading_enabled) {
-                iscsi_mt_sem_post(&state->wait_sem);
-        }
-#endif
+	iscsi_sync_finish(iscsi, state);
 }
 
 struct scsi_task *
@@ -1906,20 +2001,8 @@ iscsi_modesense10_sync(struct iscsi_context *iscsi, int lun, int llbaa, int dbd,
 void iscsi_free_discovery_data(struct iscsi_context *iscsi,
                                struct iscsi_discovery_address *da)
 {
-        while (da) {
-                struct iscsi_discovery_address *danext = da->next;
-
-                while (da->portals) {
-                        struct iscsi_target_portal *ponext = da->portals->next;
-
-                        free(da->portals->portal);
-                        free(da->portals);
-                        da->portals = ponext;
-                }
-                free(da->target_name);
-                free(da);
-                da = danext;
-        }
+        /* see iscsi_discovery_copy() */
+        free(da);
 }
 
 static void
@@ -1927,34 +2010,10 @@ iscsi_discovery_cb(struct iscsi_context *iscsi, int status,
 	      void *command_data, void *private_data)
 {
 	struct iscsi_sync_state *state = private_data;
-        struct iscsi_discovery_address *da;
-        struct iscsi_discovery_address *dahead = NULL;
-        struct iscsi_target_portal *po;
-
-        for (da = command_data; da != NULL; da = da->next) {
-                struct iscsi_discovery_address *datmp;
-
-                datmp = malloc(sizeof(struct iscsi_discovery_address));
-                memset(datmp, 0, sizeof(struct iscsi_discovery_address));
-                datmp->target_name = strdup(da->target_name);
-                datmp->next = dahead;
-                dahead = datmp;
-
-                for (po = da->portals; po != NULL; po = po->next) {
-                        struct iscsi_target_portal *potmp;
-
-                        potmp = malloc(sizeof(struct iscsi_target_portal));
-                        memset(potmp, 0, sizeof(struct iscsi_target_portal));
-                        potmp->portal = strdup(po->portal);
-
-                        potmp->next = dahead->portals;
-                        dahead->portals = potmp;
-                }
-        }
 
 	state->status    = status;
-	state->finished = 1;
-	state->ptr = dahead;
+	state->ptr = iscsi_discovery_copy(iscsi, command_data);
+	iscsi_sync_finish(iscsi, state);
 }
 
 struct iscsi_discovery_address *
@@ -1974,3 +2033,116 @@ iscsi_discovery_sync(struct iscsi_context *iscsi)
 
 	return state.ptr;
 }
+
+struct iscsi_extent_iter {
+	struct iscsi_context *iscsi;
+	struct iscsi_extent_map *map;	/* until the final callback */
+	struct iscsi_lba_extent *extents;
+	int head, count, alloc;
+	int status;
+	int failed;		/* extents were lost */
+	struct iscsi_sync_state *state;
+};
+
+static void
+iscsi_extent_iter_cb(struct iscsi_context *iscsi, int status,
+		     struct iscsi_lba_extent *extents, int num_extents,
+		     void *private_data)
+{
+	struct iscsi_extent_iter *iter = private_data;
+
+	if (num_extents == 0) {
+		iter->map = NULL;
+		iter->status = status;
+	} else if (!iter->failed) {
+		if (iter->head == iter->count) {
+			iter->head = iter->count = 0;
+		}
+		if (iter->count + num_extents > iter->alloc) {
+			int n = iter->count + num_extents;
+			struct iscsi_lba_extent *p;
+
+			p = realloc(iter->extents, n * sizeof(*p));
+			if (p == NULL) {
+				iscsi_set_error(iscsi, "Out-of-memory: failed "
+						"to queue extents");
+				iter->failed = 1;
+				goto finish;
+			}
+			iter->extents = p;
+			iter->alloc = n;
+		}
+		memcpy(&iter->extents[iter->count], extents,
+		       num_extents * sizeof(*extents));
+		iter->count += num_extents;
+	}
+ finish:
+	if (iter->state != NULL) {
+		struct iscsi_sync_state *state = iter->state;
+
+		iter->state = NULL;
+		iscsi_sync_finish(iscsi, state);
+	}
+}
+
+struct iscsi_extent_iter *
+iscsi_extent_iter_open(struct iscsi_context *iscsi, int lun, uint64_t lba,
+		       uint64_t num_blocks)
+{
+	struct iscsi_extent_iter *iter;
+
+	iter = calloc(1, sizeof(*iter));
+	if (iter == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"extent iterator");
+		return NULL;
+	}
+	iter->iscsi = iscsi;
+	iter->map = iscsi_extent_map_async(iscsi, lun, lba, num_blocks,
+					   iscsi_extent_iter_cb, iter);
+	if (iter->map == NULL) {
+		free(iter);
+		return NULL;
+	}
+	return iter;
+}
+
+int
+iscsi_extent_iter_next_sync(struct iscsi_extent_iter *iter,
+			    struct iscsi_lba_extent *extent)
+{
+	if (iter->failed) {
+		return -1;
+	}
+	while (iter->head == iter->count && iter->map != NULL) {
+		struct iscsi_sync_state state;
+
+		iscsi_init_sync_state(iter->iscsi, &state);
+		iter->state = &state;
+		event_loop(iter->iscsi, &state);
+		iter->state = NULL;
+		if (state.status != 0 || iter->failed) {
+			return -1;
+		}
+	}
+	if (iter->head < iter->count) {
+		*extent = iter->extents[iter->head++];
+		return 1;
+	}
+	if (iter->status != SCSI_STATUS_GOOD) {
+		iscsi_set_error(iter->iscsi, "Failed to get the LBA status: "
+				"%s", iscsi_get_error(iter->iscsi));
+		return -1;
+	}
+	return 0;
+}
+
+void
+iscsi_extent_iter_close(struct iscsi_extent_iter *iter)
+{
+	if (iter->map != NULL) {
+		iscsi_extent_map_cancel(iter->iscsi, iter->map);
+	}
+	free(iter->extents);
+	free(iter);
+}
@@ -0,0 +1,720 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * TLS transport.
+ *
+ * This is the TCP transport with a TLS handshake done by gnutls once the
+ * TCP connection is up. After the handshake the traffic keys are handed
+ * to kernel TLS, so the socket carries plain iSCSI PDUs from our point of
+ * view and all of socket.c is used unchanged.
+ *
+ * The target may still send handshake records once kernel TLS has taken
+ * over: TLS 1.3 session tickets and key updates. The kernel fails a plain
+ * read on those with EIO and socket.c hands them to
+ * iscsi_tls_recv_control(). For key updates the application traffic
+ * secrets are kept after the gnutls session is gone.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/tls.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/crypto.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+/* only offer ciphers the kernel can take over */
+#define ISCSI_TLS_PRIORITY "NORMAL:-CIPHER-ALL:+AES-256-GCM:+AES-128-GCM:" \
+	"-VERS-ALL:+VERS-TLS1.3:+VERS-TLS1.2"
+
+/* record content types */
+#define TLS_RECORD_ALERT	21
+#define TLS_RECORD_HANDSHAKE	22
+
+/* handshake message types */
+#define TLS_HS_NEW_SESSION_TICKET	4
+#define TLS_HS_KEY_UPDATE		24
+
+#define TLS_ALERT_CLOSE_NOTIFY	0
+
+#define TLS_MAX_RECORD		16384
+#define TLS_MAX_SECRET		48
+#define TLS_GCM_IV_SIZE		12
+
+struct iscsi_tls {
+	/* only while handshaking */
+	gnutls_session_t session;
+	gnutls_certificate_credentials_t cred;
+	char host[MAX_STRING_SIZE + 1];	/* gnutls keeps a pointer to it */
+
+	/* once kernel TLS has taken over */
+	gnutls_cipher_algorithm_t cipher;
+	int tls13;
+	unsigned char rx_secret[TLS_MAX_SECRET];
+	unsigned char tx_secret[TLS_MAX_SECRET];
+	size_t secret_size;
+	unsigned char *hs;	/* partial handshake message */
+	size_t hs_len;
+};
+
+void
+iscsi_tls_release(struct iscsi_context *iscsi)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+
+	if (tls == NULL) {
+		return;
+	}
+	if (tls->session) {
+		gnutls_deinit(tls->session);
+	}
+	if (tls->cred) {
+		gnutls_certificate_free_credentials(tls->cred);
+	}
+	free(tls->hs);
+	memset(tls, 0, sizeof(*tls));
+	iscsi_free(iscsi, tls);
+	iscsi->tls = NULL;
+}
+
+/* done with the handshake, only keep what a key update needs */
+static void
+iscsi_tls_handshake_release(struct iscsi_tls *tls)
+{
+	gnutls_deinit(tls->session);
+	tls->session = NULL;
+	gnutls_certificate_free_credentials(tls->cred);
+	tls->cred = NULL;
+}
+
+static int
+iscsi_tls_secret_cb(gnutls_session_t session,
+		    gnutls_record_encryption_level_t level,
+		    const void *secret_read, const void *secret_write,
+		    size_t secret_size)
+{
+	struct iscsi_tls *tls = gnutls_session_get_ptr(session);
+
+	if (level != GNUTLS_ENCRYPTION_LEVEL_APPLICATION) {
+		return 0;
+	}
+	if (secret_size > TLS_MAX_SECRET) {
+		return -1;
+	}
+	tls->secret_size = secret_size;
+	if (secret_read) {
+		memcpy(tls->rx_secret, secret_read, secret_size);
+	}
+	if (secret_write) {
+		memcpy(tls->tx_secret, secret_write, secret_size);
+	}
+	return 0;
+}
+
+/* host part of a "host[:port][,tpgt]" or "[v6addr][:port][,tpgt]" portal */
+static void
+iscsi_tls_portal_host(const char *portal, char *host, size_t size)
+{
+	char *str;
+
+	strncpy(host, portal, size - 1);
+	host[size - 1] = 0;
+
+	str = strrchr(host, ',');
+	if (str != NULL) {
+		*str = 0;
+	}
+	if (host[0] == '[') {
+		str = strchr(host, ']');
+		if (str != NULL) {
+			*str = 0;
+		}
+		memmove(host, host + 1, strlen(host));
+		return;
+	}
+	str = strrchr(host, ':');
+	if (str != NULL) {
+		*str = 0;
+	}
+}
+
+#define ISCSI_TLS_FILL_GCM(ci, bits, tls13, iv, key, seq)		\
+	do {								\
+		(ci).info.cipher_type = TLS_CIPHER_AES_GCM_##bits;	\
+		memcpy((ci).key, (key).data,				\
+		       TLS_CIPHER_AES_GCM_##bits##_KEY_SIZE);		\
+		memcpy((ci).salt, (iv).data,				\
+		       TLS_CIPHER_AES_GCM_##bits##_SALT_SIZE);		\
+		memcpy((ci).iv, (tls13) ? (iv).data +			\
+		       TLS_CIPHER_AES_GCM_##bits##_SALT_SIZE : (seq),	\
+		       TLS_CIPHER_AES_GCM_##bits##_IV_SIZE);		\
+		memcpy((ci).rec_seq, (seq),				\
+		       TLS_CIPHER_AES_GCM_##bits##_REC_SEQ_SIZE);	\
+	} while (0)
+
+static int
+iscsi_tls_set_crypto(struct iscsi_context *iscsi, unsigned read,
+		     const gnutls_datum_t *ivp, const gnutls_datum_t *keyp,
+		     const unsigned char *seq)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+	gnutls_datum_t iv = *ivp, key = *keyp;
+	union {
+		struct tls12_crypto_info_aes_gcm_128 gcm128;
+		struct tls12_crypto_info_aes_gcm_256 gcm256;
+	} ci;
+	socklen_t len;
+	int tls13 = tls->tls13;
+	int ret;
+
+	memset(&ci, 0, sizeof(ci));
+	switch (tls->cipher) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE ||
+		    iv.size < TLS_CIPHER_AES_GCM_128_SALT_SIZE +
+		    (tls13 ? TLS_CIPHER_AES_GCM_128_IV_SIZE : 0)) {
+			goto bad_state;
+		}
+		ci.gcm128.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+		ISCSI_TLS_FILL_GCM(ci.gcm128, 128, tls13, iv, key, seq);
+		len = sizeof(ci.gcm128);
+		break;
+	case GNUTLS_CIPHER_AES_256_GCM:
+		if (key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE ||
+		    iv.size < TLS_CIPHER_AES_GCM_256_SALT_SIZE +
+		    (tls13 ? TLS_CIPHER_AES_GCM_256_IV_SIZE : 0)) {
+			goto bad_state;
+		}
+		ci.gcm256.info.version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+		ISCSI_TLS_FILL_GCM(ci.gcm256, 256, tls13, iv, key, seq);
+		len = sizeof(ci.gcm256);
+		break;
+	default:
+		iscsi_set_error(iscsi, "TLS: cipher %s can not be offloaded "
+				"to kernel TLS", gnutls_cipher_get_name(tls->cipher));
+		return -1;
+	}
+
+	ret = setsockopt(iscsi->fd, SOL_TLS, read ? TLS_RX : TLS_TX, &ci, len);
+	memset(&ci, 0, sizeof(ci));
+	if (ret != 0) {
+		iscsi_set_error(iscsi, "TLS: failed to set kernel TLS %s state: "
+				"%s(%d)", read ? "rx" : "tx", strerror(errno),
+				errno);
+		return -1;
+	}
+	return 0;
+
+ bad_state:
+	iscsi_set_error(iscsi, "TLS: unexpected key/iv size %u/%u",
+			key.size, iv.size);
+	return -1;
+}
+
+static int
+iscsi_tls_offload_dir(struct iscsi_context *iscsi, unsigned read)
+{
+	gnutls_datum_t iv, key;
+	unsigned char seq[8];
+	int ret;
+
+	ret = gnutls_record_get_state(iscsi->tls->session, read, NULL,
+				      &iv, &key, seq);
+	if (ret < 0) {
+		iscsi_set_error(iscsi, "TLS: failed to get record state: %s",
+				gnutls_strerror(ret));
+		return -1;
+	}
+	return iscsi_tls_set_crypto(iscsi, read, &iv, &key, seq);
+}
+
+static int
+iscsi_tls_offload(struct iscsi_context *iscsi)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+
+	tls->cipher = gnutls_cipher_get(tls->session);
+	tls->tls13 = gnutls_protocol_get_version(tls->session) == GNUTLS_TLS1_3;
+	if (tls->tls13 && tls->secret_size == 0) {
+		iscsi_set_error(iscsi, "TLS: no application traffic secrets");
+		return -1;
+	}
+
+	if (gnutls_record_check_pending(tls->session) > 0) {
+		iscsi_set_error(iscsi, "TLS: target sent data during the "
+				"handshake");
+		return -1;
+	}
+
+	if (setsockopt(iscsi->fd, IPPROTO_TCP, TCP_ULP, "tls",
+		       sizeof("tls")) != 0) {
+		iscsi_set_error(iscsi, "TLS: kernel TLS is not available: "
+				"%s(%d)", strerror(errno), errno);
+		return -1;
+	}
+
+	if (iscsi_tls_offload_dir(iscsi, 0) != 0 ||
+	    iscsi_tls_offload_dir(iscsi, 1) != 0) {
+		return -1;
+	}
+
+	if (iscsi->tcp_zerocopy) {
+		/* kernel TLS encrypts into its own buffers */
+		ISCSI_LOG(iscsi, 2, "SO_ZEROCOPY disabled for kernel TLS");
+		iscsi->tcp_zerocopy = 0;
+	}
+	return 0;
+}
+
+/* HKDF-Expand-Label from RFC 8446 7.1, with an empty context */
+static int
+iscsi_tls_expand_label(struct iscsi_tls *tls, unsigned char *secret,
+		       const char *label, unsigned char *out, size_t len)
+{
+	gnutls_mac_algorithm_t mac = tls->cipher == GNUTLS_CIPHER_AES_128_GCM ?
+		GNUTLS_MAC_SHA256 : GNUTLS_MAC_SHA384;
+	unsigned char info[2 + 1 + 255 + 1];
+	size_t label_len = strlen(label) + 6;
+	gnutls_datum_t key, data;
+
+	info[0] = len >> 8;
+	info[1] = len & 0xff;
+	info[2] = label_len;
+	memcpy(&info[3], "tls13 ", 6);
+	memcpy(&info[9], label, label_len - 6);
+	info[3 + label_len] = 0;
+
+	key.data = secret;
+	key.size = tls->secret_size;
+	data.data = info;
+	data.size = 3 + label_len + 1;
+	return gnutls_hkdf_expand(mac, &key, &data, out, len);
+}
+
+/* move one direction on to the next application traffic secret */
+static int
+iscsi_tls_update_key(struct iscsi_context *iscsi, unsigned read)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+	unsigned char *secret = read ? tls->rx_secret : tls->tx_secret;
+	unsigned char next[TLS_MAX_SECRET];
+	unsigned char key_buf[TLS_CIPHER_AES_GCM_256_KEY_SIZE];
+	unsigned char iv_buf[TLS_GCM_IV_SIZE];
+	unsigned char seq[8];
+	gnutls_datum_t key, iv;
+	int ret;
+
+	key.data = key_buf;
+	key.size = tls->cipher == GNUTLS_CIPHER_AES_128_GCM ?
+		TLS_CIPHER_AES_GCM_128_KEY_SIZE :
+		TLS_CIPHER_AES_GCM_256_KEY_SIZE;
+	iv.data = iv_buf;
+	iv.size = sizeof(iv_buf);
+	memset(seq, 0, sizeof(seq));
+
+	if (iscsi_tls_expand_label(tls, secret, "traffic upd", next,
+				   tls->secret_size) < 0 ||
+	    iscsi_tls_expand_label(tls, next, "key", key.data, key.size) < 0 ||
+	    iscsi_tls_expand_label(tls, next, "iv", iv.data, iv.size) < 0) {
+		iscsi_set_error(iscsi, "TLS: failed to derive the next "
+				"traffic keys");
+		ret = -1;
+		goto out;
+	}
+	memcpy(secret, next, tls->secret_size);
+	ret = iscsi_tls_set_crypto(iscsi, read, &iv, &key, seq);
+
+ out:
+	memset(next, 0, sizeof(next));
+	memset(key_buf, 0, sizeof(key_buf));
+	memset(iv_buf, 0, sizeof(iv_buf));
+	return ret;
+}
+
+/* send a KeyUpdate not asking for one back, then switch our tx key */
+static int
+iscsi_tls_send_key_update(struct iscsi_context *iscsi)
+{
+	unsigned char msg[5] = { TLS_HS_KEY_UPDATE, 0, 0, 1, 0 };
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	struct pollfd pfd;
+	ssize_t count;
+
+	memset(&mh, 0, sizeof(mh));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_TLS;
+	cmsg->cmsg_type = TLS_SET_RECORD_TYPE;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(unsigned char));
+	*CMSG_DATA(cmsg) = TLS_RECORD_HANDSHAKE;
+
+	for (;;) {
+		count = sendmsg(iscsi->fd, &mh, MSG_NOSIGNAL);
+		if (count == sizeof(msg)) {
+			break;
+		}
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count < 0 && errno == EAGAIN) {
+			/* a 5 byte record, the socket drains quickly */
+			pfd.fd = iscsi->fd;
+			pfd.events = POLLOUT;
+			if (poll(&pfd, 1, 1000) > 0) {
+				continue;
+			}
+		}
+		iscsi_set_error(iscsi, "TLS: failed to send KeyUpdate: %s(%d)",
+				strerror(errno), errno);
+		return -1;
+	}
+	return iscsi_tls_update_key(iscsi, 0);
+}
+
+/* hs holds one complete handshake message of len bytes */
+static int
+iscsi_tls_handshake_message(struct iscsi_context *iscsi,
+			    const unsigned char *hs, size_t len)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+
+	switch (tls->tls13 ? hs[0] : -1) {
+	case TLS_HS_NEW_SESSION_TICKET:
+		/* we never resume, so tickets are of no use */
+		ISCSI_LOG(iscsi, 3, "TLS: ignoring a session ticket");
+		return 0;
+	case TLS_HS_KEY_UPDATE:
+		if (len != 5 || hs[4] > 1) {
+			break;
+		}
+		ISCSI_LOG(iscsi, 2, "TLS: target updated its traffic key%s",
+			  hs[4] ? ", updating ours" : "");
+		if (iscsi_tls_update_key(iscsi, 1) != 0) {
+			return -1;
+		}
+		if (hs[4] && iscsi_tls_send_key_update(iscsi) != 0) {
+			return -1;
+		}
+		return 0;
+	}
+	iscsi_set_error(iscsi, "TLS: unexpected handshake message %u after "
+			"the handshake", hs[0]);
+	return -1;
+}
+
+int
+iscsi_tls_recv_control(struct iscsi_context *iscsi)
+{
+	struct iscsi_tls *tls = iscsi->tls;
+	unsigned char buf[TLS_MAX_RECORD];
+	char cbuf[CMSG_SPACE(sizeof(unsigned char))];
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	unsigned char type = 0;
+	unsigned char *hs;
+	size_t pos, len;
+	ssize_t count;
+
+	if (tls == NULL || tls->session != NULL) {
+		return 0;
+	}
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+	count = recvmsg(iscsi->fd, &mh, 0);
+	if (count < 0) {
+		if (errno == EINTR || errno == EAGAIN) {
+			return 1;
+		}
+		iscsi_set_error(iscsi, "read from socket failed, errno:%d",
+				errno);
+		return -1;
+	}
+	if (count == 0) {
+		/* remote side has closed the socket. */
+		return -1;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_TLS &&
+		    cmsg->cmsg_type == TLS_GET_RECORD_TYPE) {
+			type = *CMSG_DATA(cmsg);
+		}
+	}
+
+	switch (type) {
+	case TLS_RECORD_HANDSHAKE:
+		break;
+	case TLS_RECORD_ALERT:
+		if (count == 2 && buf[1] == TLS_ALERT_CLOSE_NOTIFY) {
+			iscsi_set_error(iscsi, "TLS: target closed the session");
+		} else {
+			iscsi_set_error(iscsi, "TLS: target sent alert %d",
+					count == 2 ? buf[1] : -1);
+		}
+		return -1;
+	default:
+		iscsi_set_error(iscsi, "TLS: unexpected record type %u",
+				type);
+		return -1;
+	}
+
+	/* handshake messages may span records */
+	hs = realloc(tls->hs, tls->hs_len + count);
+	if (hs == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to buffer a TLS "
+				"handshake message");
+		return -1;
+	}
+	memcpy(hs + tls->hs_len, buf, count);
+	tls->hs = hs;
+	tls->hs_len += count;
+
+	pos = 0;
+	while (tls->hs_len - pos >= 4) {
+		len = 4 + ((hs[pos + 1] << 16) | (hs[pos + 2] << 8) |
+			   hs[pos + 3]);
+		if (len > tls->hs_len - pos) {
+			if (len > 4 * TLS_MAX_RECORD) {
+				iscsi_set_error(iscsi, "TLS: handshake message "
+						"too large");
+				return -1;
+			}
+			break;
+		}
+		if (iscsi_tls_handshake_message(iscsi, &hs[pos], len) != 0) {
+			return -1;
+		}
+		pos += len;
+	}
+	tls->hs_len -= pos;
+	memmove(hs, hs + pos, tls->hs_len);
+	return 1;
+}
+
+static int
+iscsi_tls_failed(struct iscsi_context *iscsi)
+{
+	iscsi_tls_release(iscsi);
+	if (iscsi->socket_status_cb) {
+		iscsi->socket_status_cb(iscsi, SCSI_STATUS_ERROR, NULL,
+					iscsi->connect_data);
+		iscsi->socket_status_cb = NULL;
+	}
+	return iscsi_service_reconnect_if_loggedin(iscsi);
+}
+
+static int
+iscsi_tls_service(struct iscsi_context *iscsi, int revents)
+{
+	gnutls_session_t session;
+	int ret;
+
+	if (iscsi->tls == NULL || iscsi->tls->session == NULL ||
+	    iscsi->fd < 0) {
+		return iscsi_tcp_service(iscsi, revents);
+	}
+
+	if (revents & (POLLERR | POLLHUP)) {
+		iscsi_tls_release(iscsi);
+		return iscsi_tcp_service(iscsi, revents);
+	}
+
+	session = iscsi->tls->session;
+	ret = gnutls_handshake(session);
+	if (ret < 0 && !gnutls_error_is_fatal(ret)) {
+		iscsi_timeout_scan(iscsi);
+		if (iscsi->old_iscsi) {
+			iscsi_timeout_scan(iscsi->old_iscsi);
+		}
+		return 0;
+	}
+	if (ret < 0) {
+		iscsi_set_error(iscsi, "TLS handshake with %s failed: %s",
+				iscsi->connected_portal, gnutls_strerror(ret));
+		return iscsi_tls_failed(iscsi);
+	}
+	if (iscsi_tls_offload(iscsi) != 0) {
+		return iscsi_tls_failed(iscsi);
+	}
+
+	ISCSI_LOG(iscsi, 2, "TLS established with %s (%s, %s)",
+		  iscsi->connected_portal,
+		  gnutls_protocol_get_name(gnutls_protocol_get_version(session)),
+		  gnutls_cipher_get_name(gnutls_cipher_get(session)));
+
+	iscsi_tls_handshake_release(iscsi->tls);
+	if (iscsi->socket_status_cb) {
+		iscsi->socket_status_cb(iscsi, SCSI_STATUS_GOOD, NULL,
+					iscsi->connect_data);
+		iscsi->socket_status_cb = NULL;
+	}
+	return 0;
+}
+
+int
+iscsi_tls_handshake_start(struct iscsi_context *iscsi)
+{
+	struct iscsi_tls *tls;
+	char *host;
+	unsigned char addr[sizeof(struct in6_addr)];
+	int ret;
+
+	iscsi_tls_release(iscsi);
+
+	tls = iscsi_zmalloc(iscsi, sizeof(*tls));
+	if (tls == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"TLS state");
+		return iscsi_tls_failed(iscsi);
+	}
+	iscsi->tls = tls;
+
+	ret = gnutls_certificate_allocate_credentials(&tls->cred);
+	if (ret < 0) {
+		goto failed;
+	}
+	if (iscsi->tls_ca_file[0]) {
+		ret = gnutls_certificate_set_x509_trust_file(tls->cred,
+				iscsi->tls_ca_file, GNUTLS_X509_FMT_PEM);
+	} else {
+		ret = gnutls_certificate_set_x509_system_trust(tls->cred);
+	}
+	if (ret < 0) {
+		goto failed;
+	}
+
+	ret = gnutls_init(&tls->session,
+			  GNUTLS_CLIENT | GNUTLS_NONBLOCK | GNUTLS_NO_TICKETS);
+	if (ret < 0) {
+		goto failed;
+	}
+	gnutls_session_set_ptr(tls->session, tls);
+	gnutls_handshake_set_secret_function(tls->session,
+					     iscsi_tls_secret_cb);
+	ret = gnutls_priority_set_direct(tls->session, ISCSI_TLS_PRIORITY, NULL);
+	if (ret < 0) {
+		goto failed;
+	}
+	ret = gnutls_credentials_set(tls->session, GNUTLS_CRD_CERTIFICATE,
+				     tls->cred);
+	if (ret < 0) {
+		goto failed;
+	}
+
+	host = tls->host;
+	iscsi_tls_portal_host(iscsi->connected_portal, host, sizeof(tls->host));
+	if (inet_pton(AF_INET, host, addr) != 1 &&
+	    inet_pton(AF_INET6, host, addr) != 1) {
+		ret = gnutls_server_name_set(tls->session, GNUTLS_NAME_DNS,
+					     host, strlen(host));
+		if (ret < 0) {
+			goto failed;
+		}
+	}
+	gnutls_session_set_verify_cert(tls->session, host, 0);
+	gnutls_transport_set_int(tls->session, iscsi->fd);
+	gnutls_handshake_set_timeout(tls->session,
+				     GNUTLS_DEFAULT_HANDSHAKE_TIMEOUT);
+
+	ISCSI_LOG(iscsi, 3, "starting TLS handshake with %s", host);
+
+	return iscsi_tls_service(iscsi, POLLOUT);
+
+ failed:
+	iscsi_set_error(iscsi, "TLS: failed to set up session: %s",
+			gnutls_strerror(ret));
+	return iscsi_tls_failed(iscsi);
+}
+
+static int
+iscsi_tls_connect(struct iscsi_context *iscsi, union socket_address *sa,
+		  int ai_family)
+{
+	if (iscsi->old_iscsi) {
+		/* its socket is about to be replaced */
+		iscsi_tls_release(iscsi->old_iscsi);
+	}
+	return iscsi_tcp_connect(iscsi, sa, ai_family);
+}
+
+static int
+iscsi_tls_disconnect(struct iscsi_context *iscsi)
+{
+	iscsi_tls_release(iscsi);
+	return iscsi_tcp_disconnect(iscsi);
+}
+
+static int
+iscsi_tls_which_events(struct iscsi_context *iscsi)
+{
+	if (iscsi->tls == NULL || iscsi->tls->session == NULL) {
+		return iscsi_tcp_which_events(iscsi);
+	}
+	return gnutls_record_get_direction(iscsi->tls->session) ?
+		POLLOUT : POLLIN;
+}
+
+static iscsi_transport iscsi_transport_tls = {
+	.connect      = iscsi_tls_connect,
+	.queue_pdu    = iscsi_tcp_queue_pdu,
+	.new_pdu      = iscsi_tcp_new_pdu,
+	.disconnect   = iscsi_tls_disconnect,
+	.free_pdu     = iscsi_tcp_free_pdu,
+	.service      = iscsi_tls_service,
+	.get_fd       = iscsi_tcp_get_fd,
+	.which_events = iscsi_tls_which_events,
+};
+
+void iscsi_init_tls_transport(struct iscsi_context *iscsi)
+{
+	iscsi->drv = &iscsi_transport_tls;
+	iscsi->transport = TLS_TRANSPORT;
+}
@@ -0,0 +1,338 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * PDU trace ring.
+ *
+ * Every PDU header that is sent or received is copied into the next slot
+ * of a power of two sized ring together with a timestamp, overwriting the
+ * oldest record once the ring is full. Writers claim a slot with a single
+ * atomic add on the head and publish it by storing the position of the
+ * record into the slot's sequence word once it is complete, so tracing
+ * never takes a lock and never allocates. Readers copy a slot and only
+ * keep it if the sequence word still says the same thing afterwards, so a
+ * record that was overwritten while it was being copied is skipped rather
+ * than returned torn.
+ *
+ * The latency of a received PDU is the time since the request with the
+ * same ITT was sent. The send times live in a small table indexed by the
+ * low bits of the ITT, with the ITT and the time packed into one word so
+ * that they are always read together.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include "win32/win32_compat.h"
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TRACE_LOAD(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define TRACE_STORE(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define TRACE_CLAIM(p)		__atomic_fetch_add(p, 1, __ATOMIC_RELAXED)
+#define TRACE_READ_FENCE()	__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define TRACE_WRITE_FENCE()	__atomic_thread_fence(__ATOMIC_RELEASE)
+#else
+/* without the builtins the ring is only safe from a single thread */
+#define TRACE_LOAD(p)		(*(p))
+#define TRACE_STORE(p, v)	(*(p) = (v))
+#define TRACE_CLAIM(p)		((*(p))++)
+#define TRACE_READ_FENCE()
+#define TRACE_WRITE_FENCE()
+#endif
+
+#define TRACE_MIN_ENTRIES	16
+#define TRACE_MAX_ENTRIES	(1 << 24)
+#define TRACE_SENT_SLOTS	256
+
+struct iscsi_trace_slot {
+	uint64_t seq;		/* position + 1 once published, 0 while written */
+	struct iscsi_trace_record rec;
+};
+
+struct iscsi_trace_ring {
+	uint64_t mask;
+	uint64_t head;		/* next position to write */
+	uint64_t tail;		/* first position not drained yet */
+	uint64_t start;		/* iscsi_clock_us() when created */
+	uint64_t sent[TRACE_SENT_SLOTS];	/* itt << 32 | send time */
+	struct iscsi_trace_slot slots[];
+};
+
+void
+iscsi_trace_pdu(struct iscsi_context *iscsi, int direction,
+		const unsigned char *hdr)
+{
+	struct iscsi_trace_ring *ring = iscsi->trace;
+	struct iscsi_trace_slot *slot;
+	uint64_t pos, now, sent;
+	uint32_t itt;
+	uint8_t opcode;
+
+	now = iscsi_clock_us();
+	opcode = hdr[0] & 0x3f;
+	itt = scsi_get_uint32(&hdr[16]);
+
+	pos = TRACE_CLAIM(&ring->head);
+	slot = &ring->slots[pos & ring->mask];
+	TRACE_STORE(&slot->seq, 0);
+	/* the release store above does not keep the plain stores below
+	 * from being seen before it */
+	TRACE_WRITE_FENCE();
+
+	slot->rec.timestamp   = now;
+	slot->rec.latency     = 0;
+	slot->rec.itt         = itt;
+	slot->rec.sn          = scsi_get_uint32(&hdr[24]);
+	slot->rec.data_length = iscsi_get_pdu_data_size(hdr);
+	slot->rec.lun         = (uint64_t)scsi_get_uint32(&hdr[8]) << 32 |
+				scsi_get_uint32(&hdr[12]);
+	slot->rec.direction   = direction;
+	slot->rec.opcode      = opcode;
+	memset(slot->rec.reserved, 0, sizeof(slot->rec.reserved));
+	memcpy(slot->rec.bhs, hdr, ISCSI_RAW_HEADER_SIZE);
+
+	if (itt != 0xffffffff) {
+		uint64_t *s = &ring->sent[itt % TRACE_SENT_SLOTS];
+		uint32_t t = (uint32_t)(now - ring->start);
+
+		if (direction == ISCSI_TRACE_TX) {
+			/* Data-Out and SNACK carry the ITT of the command */
+			if (opcode != ISCSI_PDU_DATA_OUT &&
+			    opcode != ISCSI_PDU_SNACK_REQUEST) {
+				TRACE_STORE(s, (uint64_t)itt << 32 | t);
+			}
+		} else {
+			sent = TRACE_LOAD(s);
+			if (sent >> 32 == itt) {
+				slot->rec.latency = t - (uint32_t)sent;
+			}
+		}
+	}
+
+	TRACE_STORE(&slot->seq, pos + 1);
+}
+
+/*
+ * Copy the records from position from onwards into records. Returns the
+ * number copied and sets *next to the position after the last one that
+ * was looked at.
+ *
+ * A slot whose sequence word is behind its position has been claimed by
+ * a writer that has not published it yet. A snapshot skips it, a drain
+ * stops there so that the record is returned by the next drain instead
+ * of never. Slots that are ahead of their position have been lapped and
+ * are skipped either way.
+ */
+static int
+trace_copy(struct iscsi_trace_ring *ring, uint64_t from,
+	   struct iscsi_trace_record *records, int max, int drain,
+	   uint64_t *next)
+{
+	uint64_t head, pos, seq;
+	int count = 0;
+
+	head = TRACE_LOAD(&ring->head);
+	if (head - from > ring->mask + 1) {
+		/* those have been overwritten already */
+		from = head - (ring->mask + 1);
+	}
+
+	for (pos = from; pos != head && count < max; pos++) {
+		struct iscsi_trace_slot *slot = &ring->slots[pos & ring->mask];
+
+		seq = TRACE_LOAD(&slot->seq);
+		if (seq < pos + 1 && drain) {
+			break;
+		}
+		if (seq != pos + 1) {
+			continue;
+		}
+		records[count] = slot->rec;
+		TRACE_READ_FENCE();
+		if (TRACE_LOAD(&slot->seq) != pos + 1) {
+			/* overwritten while we copied it */
+			continue;
+		}
+		count++;
+	}
+	*next = pos;
+
+	return count;
+}
+
+int
+iscsi_set_pdu_trace(struct iscsi_context *iscsi, int entries)
+{
+	struct iscsi_trace_ring *ring;
+	uint64_t size;
+
+	if (entries < 0 || entries > TRACE_MAX_ENTRIES) {
+		iscsi_set_error(iscsi, "Invalid PDU trace size %d", entries);
+		return -1;
+	}
+
+	if (iscsi->trace != NULL) {
+		ring = iscsi->trace;
+		iscsi->trace = NULL;
+		free(ring);
+	}
+	if (entries == 0) {
+		return 0;
+	}
+
+	for (size = TRACE_MIN_ENTRIES; size < (uint64_t)entries; size <<= 1) {
+		;
+	}
+	ring = calloc(1, sizeof(*ring) +
+		      size * sizeof(struct iscsi_trace_slot));
+	if (ring == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"PDU trace of %d entries", entries);
+		return -1;
+	}
+	ring->mask = size - 1;
+	ring->start = iscsi_clock_us();
+	iscsi->trace = ring;
+
+	return 0;
+}
+
+int
+iscsi_pdu_trace_snapshot(struct iscsi_context *iscsi,
+			 struct iscsi_trace_record *records, int max)
+{
+	struct iscsi_trace_ring *ring = iscsi->trace;
+	uint64_t head, next;
+
+	if (ring == NULL || max <= 0) {
+		return 0;
+	}
+
+	/* the newest max records */
+	head = TRACE_LOAD(&ring->head);
+	if (head > (uint64_t)max) {
+		head -= max;
+	} else {
+		head = 0;
+	}
+
+	return trace_copy(ring, head, records, max, 0, &next);
+}
+
+int
+iscsi_pdu_trace_drain(struct iscsi_context *iscsi,
+		      struct iscsi_trace_record *records, int max)
+{
+	struct iscsi_trace_ring *ring = iscsi->trace;
+	int count;
+
+	if (ring == NULL || max <= 0) {
+		return 0;
+	}
+
+	count = trace_copy(ring, ring->tail, records, max, 1, &ring->tail);
+
+	return count;
+}
+
+int
+iscsi_pdu_trace_save(struct iscsi_context *iscsi, const char *path)
+{
+	struct iscsi_trace_ring *ring = iscsi->trace;
+	struct iscsi_trace_file_header fh;
+	struct iscsi_trace_record *records;
+	uint64_t realtime;
+	FILE *fp;
+	int count;
+
+	if (ring == NULL) {
+		iscsi_set_error(iscsi, "PDU tracing is not enabled");
+		return -1;
+	}
+
+	records = malloc((ring->mask + 1) * sizeof(*records));
+	if (records == NULL) {
+		iscsi_set_error(iscsi, "Out-of-memory: failed to allocate "
+				"PDU trace snapshot");
+		return -1;
+	}
+	count = iscsi_pdu_trace_snapshot(iscsi, records, ring->mask + 1);
+
+#ifdef HAVE_SYS_TIME_H
+	{
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		realtime = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+#else
+	realtime = (uint64_t)time(NULL) * 1000000;
+#endif
+
+	memset(&fh, 0, sizeof(fh));
+	memcpy(fh.magic, ISCSI_TRACE_MAGIC, sizeof(fh.magic));
+	fh.version = ISCSI_TRACE_VERSION;
+	fh.record_size = sizeof(struct iscsi_trace_record);
+	fh.count = count;
+	fh.realtime_offset = (int64_t)(realtime - iscsi_clock_us());
+	snprintf(fh.target_address, sizeof(fh.target_address), "%s",
+		 iscsi->connected_portal);
+
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		iscsi_set_error(iscsi, "Failed to open %s: %s", path,
+				strerror(errno));
+		free(records);
+		return -1;
+	}
+	if (fwrite(&fh, sizeof(fh), 1, fp) != 1 ||
+	    (count && fwrite(records, sizeof(*records), count, fp) !=
+	     (size_t)count)) {
+		iscsi_set_error(iscsi, "Failed to write %s: %s", path,
+				strerror(errno));
+		fclose(fp);
+		free(records);
+		return -1;
+	}
+	free(records);
+	if (fclose(fp) != 0) {
+		iscsi_set_error(iscsi, "Failed to write %s: %s", path,
+				strerror(errno));
+		return -1;
+	}
+
+	return count;
+}
@@ -0,0 +1,823 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU Lesser General Public License as published by
+   the Free Software Foundation; either version 2.1 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Copies offloaded to the copy manager of the source LUN with EXTENDED
+ * COPY.
+ *
+ * The source and destination are named by their Device Identification
+ * designators and the range is cut into block to block segments as large
+ * as RECEIVE COPY RESULTS OPERATING PARAMETERS allow. Several EXTENDED
+ * COPYs are kept in flight and RECEIVE COPY STATUS is polled for how far
+ * each of them got. Whatever the copy manager refuses to copy goes through
+ * the initiator with READ16 and WRITE16 instead.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_SYS_TYPES_H
+#include <sys/types.h>
+#endif
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iscsi.h"
+#include "iscsi-private.h"
+#include "scsi-lowlevel.h"
+#include "slist.h"
+
+#define XCOPY_IN_FLIGHT		4	/* EXTENDED COPYs per copy */
+#define XCOPY_MAX_SEGMENTS	64	/* per EXTENDED COPY */
+#define XCOPY_HOST_IN_FLIGHT	8	/* READ16/WRITE16 pairs per copy */
+#define XCOPY_HOST_CHUNK	(1024 * 1024)
+#define XCOPY_POLL_US		500000
+#define XCOPY_TGT_DESC_LEN	32
+#define XCOPY_SEG_DESC_LEN	28
+#define XCOPY_DESIGNATOR_LEN	20
+
+struct iscsi_xcopy_desig {
+	int code_set;
+	int association;
+	int type;
+	int length;		/* 0 if there is no usable one */
+	unsigned char designator[XCOPY_DESIGNATOR_LEN];
+};
+
+/* An EXTENDED COPY in flight. */
+struct iscsi_xcopy_cmd {
+	struct iscsi_xcopy_cmd *next;
+	struct iscsi_xcopy *xc;
+	int list_id;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint64_t num;
+	uint64_t progress;	/* blocks copied according to COPY STATUS */
+	struct iscsi_data data;
+};
+
+/* A RECEIVE COPY STATUS in flight. */
+struct iscsi_xcopy_poll {
+	struct iscsi_xcopy *xc;
+	int list_id;
+};
+
+/* A READ16 and then WRITE16 in flight. */
+struct iscsi_xcopy_host {
+	struct iscsi_xcopy *xc;
+	struct scsi_task *read;
+	uint64_t dst_lba;
+	uint32_t num;
+};
+
+/* Blocks the copy manager did not copy. */
+struct iscsi_xcopy_range {
+	struct iscsi_xcopy_range *next;
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint64_t num;
+};
+
+struct iscsi_xcopy {
+	struct iscsi_xcopy *next;	/* on src->xcopies */
+	struct iscsi_context *src;
+	struct iscsi_context *dst;
+	int src_lun;
+	int dst_lun;
+	uint32_t block_size;
+	iscsi_command_cb cb;
+	void *private_data;
+
+	/* the blocks not handed out yet */
+	uint64_t src_lba;
+	uint64_t dst_lba;
+	uint64_t left;
+
+	int setup;		/* setup replies still to come */
+	int offload;
+	struct iscsi_xcopy_desig desig[2];	/* source, destination */
+	uint32_t seg_blocks;
+	int max_segments;
+	int depth;
+
+	struct iscsi_xcopy_cmd *cmds;
+	int ncmds;
+	struct iscsi_xcopy_range *host;	/* to copy through us */
+	int host_in_flight;
+	int polls;
+	uint64_t next_poll;
+
+	uint64_t copied;
+	uint64_t offloaded;
+	int status;
+	int starting;
+	int busy;
+};
+
+static void iscsi_xcopy_send(struct iscsi_xcopy *xc);
+
+static void
+iscsi_xcopy_fail(struct iscsi_xcopy *xc, int status)
+{
+	if (xc->status == SCSI_STATUS_GOOD) {
+		xc->status = status;
+	}
+}
+
+static int
+iscsi_xcopy_in_flight(struct iscsi_xcopy *xc)
+{
+	return xc->setup + xc->ncmds + xc->host_in_flight + xc->polls;
+}
+
+static void
+iscsi_xcopy_free(struct iscsi_xcopy *xc)
+{
+	while (xc->host) {
+		struct iscsi_xcopy_range *r = xc->host;
+
+		xc->host = r->next;
+		free(r);
+	}
+	free(xc);
+}
+
+static void
+iscsi_xcopy_set_desig(struct iscsi_xcopy_desig *d, struct scsi_task *task)
+{
+	struct scsi_inquiry_device_identification *inq;
+	struct scsi_inquiry_device_designator *desig, *best = NULL;
+
+	inq = scsi_datain_unmarshall(task);
+	if (inq == NULL) {
+		return;
+	}
+	/* the same preference as the copy managers we know of */
+	for (desig = inq->designators; desig; desig = desig->next) {
+		if (desig->association != SCSI_ASSOCIATION_LOGICAL_UNIT ||
+		    desig->designator_length > XCOPY_DESIGNATOR_LEN) {
+			continue;
+		}
+		switch (desig->designator_type) {
+		case SCSI_DESIGNATOR_TYPE_VENDOR_SPECIFIC:
+		case SCSI_DESIGNATOR_TYPE_T10_VENDORT_ID:
+		case SCSI_DESIGNATOR_TYPE_EUI_64:
+		case SCSI_DESIGNATOR_TYPE_NAA:
+			if (best == NULL ||
+			    best->designator_type <= desig->designator_type) {
+				best = desig;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	if (best == NULL) {
+		return;
+	}
+	d->code_set = best->code_set;
+	d->association = best->association;
+	d->type = best->designator_type;
+	d->length = best->designator_length;
+	memcpy(d->designator, best->designator, best->designator_length);
+}
+
+static void
+iscsi_xcopy_setup_done(struct iscsi_xcopy *xc)
+{
+	if (--xc->setup > 0) {
+		return;
+	}
+	if (xc->offload &&
+	    (xc->desig[0].length == 0 || xc->desig[1].length == 0)) {
+		ISCSI_LOG(xc->src, 2, "lun %d: no designator to name %s by in "
+			  "EXTENDED COPY", xc->src_lun,
+			  xc->desig[0].length ? "the destination" :
+			  "the source");
+		xc->offload = 0;
+	}
+	if (!xc->offload) {
+		ISCSI_LOG(xc->src, 2, "lun %d: copying through the initiator",
+			  xc->src_lun);
+	}
+	iscsi_xcopy_send(xc);
+}
+
+static void
+iscsi_xcopy_desig_cb(struct iscsi_xcopy *xc, int i, int status,
+		     struct scsi_task *task)
+{
+	if (status == SCSI_STATUS_GOOD) {
+		iscsi_xcopy_set_desig(&xc->desig[i], task);
+	} else if (status == SCSI_STATUS_CANCELLED) {
+		iscsi_xcopy_fail(xc, status);
+	}
+	scsi_free_scsi_task(task);
+	iscsi_xcopy_setup_done(xc);
+}
+
+static void
+iscsi_xcopy_src_desig_cb(struct iscsi_context *iscsi, int status,
+			 void *command_data, void *private_data)
+{
+	iscsi_xcopy_desig_cb(private_data, 0, status, command_data);
+}
+
+static void
+iscsi_xcopy_dst_desig_cb(struct iscsi_context *iscsi, int status,
+			 void *command_data, void *private_data)
+{
+	iscsi_xcopy_desig_cb(private_data, 1, status, command_data);
+}
+
+static void
+iscsi_xcopy_params_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct iscsi_xcopy *xc = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_copy_results_op_params *op = NULL;
+	uint32_t max_list, segments;
+
+	if (status == SCSI_STATUS_GOOD) {
+		op = scsi_datain_unmarshall(task);
+	} else if (status == SCSI_STATUS_CANCELLED) {
+		iscsi_xcopy_fail(xc, status);
+	}
+	if (op == NULL || op->max_target_desc_count < 2 ||
+	    op->max_segment_desc_count < 1) {
+		ISCSI_LOG(iscsi, 2, "lun %d: the copy manager can not do "
+			  "block to block EXTENDED COPY", xc->src_lun);
+		xc->offload = 0;
+		goto finished;
+	}
+
+	segments = op->max_segment_desc_count;
+	max_list = op->max_desc_list_length;
+	if (max_list) {
+		if (max_list < 2 * XCOPY_TGT_DESC_LEN + XCOPY_SEG_DESC_LEN) {
+			xc->offload = 0;
+			goto finished;
+		}
+		max_list = (max_list - 2 * XCOPY_TGT_DESC_LEN) /
+			XCOPY_SEG_DESC_LEN;
+		if (segments > max_list) {
+			segments = max_list;
+		}
+	}
+	xc->max_segments = segments < XCOPY_MAX_SEGMENTS ?
+		segments : XCOPY_MAX_SEGMENTS;
+
+	xc->seg_blocks = 0xffff;
+	if (op->max_segment_length &&
+	    op->max_segment_length / xc->block_size < xc->seg_blocks) {
+		xc->seg_blocks = op->max_segment_length / xc->block_size;
+	}
+	if (xc->seg_blocks == 0) {
+		xc->offload = 0;
+		goto finished;
+	}
+
+	if (op->total_concurrent_copies &&
+	    op->total_concurrent_copies < xc->depth) {
+		xc->depth = op->total_concurrent_copies;
+	}
+	ISCSI_LOG(iscsi, 2, "lun %d: EXTENDED COPY of up to %d segments of "
+		  "%u blocks, %d in flight", xc->src_lun, xc->max_segments,
+		  xc->seg_blocks, xc->depth);
+
+ finished:
+	scsi_free_scsi_task(task);
+	iscsi_xcopy_setup_done(xc);
+}
+
+static int
+iscsi_xcopy_add_host(struct iscsi_xcopy *xc, uint64_t src_lba,
+		     uint64_t dst_lba, uint64_t num)
+{
+	struct iscsi_xcopy_range *r;
+
+	r = malloc(sizeof(*r));
+	if (r == NULL) {
+		iscsi_set_error(xc->src, "Out-of-memory: failed to allocate "
+				"copy range");
+		return -1;
+	}
+	r->src_lba = src_lba;
+	r->dst_lba = dst_lba;
+	r->num = num;
+	ISCSI_LIST_ADD(&xc->host, r);
+	return 0;
+}
+
+static void
+iscsi_xcopy_write_cb(struct iscsi_context *iscsi, int status,
+		     void *command_data, void *private_data)
+{
+	struct iscsi_xcopy_host *h = private_data;
+	struct iscsi_xcopy *xc = h->xc;
+
+	if (status == SCSI_STATUS_GOOD) {
+		xc->copied += h->num;
+	} else {
+		iscsi_set_error(xc->src, "WRITE16 of the copy failed: %s",
+				iscsi_get_error(iscsi));
+		iscsi_xcopy_fail(xc, status);
+	}
+	scsi_free_scsi_task(command_data);
+	scsi_free_scsi_task(h->read);
+	free(h);
+	xc->host_in_flight--;
+	iscsi_xcopy_send(xc);
+}
+
+static void
+iscsi_xcopy_read_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_xcopy_host *h = private_data;
+	struct iscsi_xcopy *xc = h->xc;
+	struct scsi_task *task = command_data;
+
+	if (status == SCSI_STATUS_GOOD) {
+		h->read = task;
+		if (iscsi_write16_task(xc->dst, xc->dst_lun, h->dst_lba,
+				       task->datain.data, task->datain.size,
+				       xc->block_size, 0, 0, 0, 0, 0,
+				       iscsi_xcopy_write_cb, h) != NULL) {
+			return;
+		}
+		status = SCSI_STATUS_ERROR;
+		iscsi_set_error(xc->src, "Failed to send WRITE16 of the "
+				"copy: %s", iscsi_get_error(xc->dst));
+	} else {
+		iscsi_set_error(xc->src, "READ16 of the copy failed: %s",
+				iscsi_get_error(iscsi));
+	}
+	iscsi_xcopy_fail(xc, status);
+	scsi_free_scsi_task(task);
+	free(h);
+	xc->host_in_flight--;
+	iscsi_xcopy_send(xc);
+}
+
+/* Copy the next chunk of r through the initiator. */
+static int
+iscsi_xcopy_send_host(struct iscsi_xcopy *xc, struct iscsi_xcopy_range *r)
+{
+	struct iscsi_xcopy_host *h;
+	uint32_t num = XCOPY_HOST_CHUNK / xc->block_size;
+
+	if (num == 0) {
+		num = 1;
+	}
+	if (num > r->num) {
+		num = r->num;
+	}
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		iscsi_set_error(xc->src, "Out-of-memory: failed to allocate "
+				"copy read");
+		return -1;
+	}
+	h->xc = xc;
+	h->read = NULL;
+	h->dst_lba = r->dst_lba;
+	h->num = num;
+	if (iscsi_read16_task(xc->src, xc->src_lun, r->src_lba,
+			      num * xc->block_size, xc->block_size,
+			      0, 0, 0, 0, 0, iscsi_xcopy_read_cb, h) == NULL) {
+		free(h);
+		return -1;
+	}
+	xc->host_in_flight++;
+	r->src_lba += num;
+	r->dst_lba += num;
+	r->num -= num;
+	return 0;
+}
+
+static void
+iscsi_xcopy_cmd_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	struct iscsi_xcopy_cmd *cmd = private_data;
+	struct iscsi_xcopy *xc = cmd->xc;
+	struct scsi_task *task = command_data;
+
+	if (status == SCSI_STATUS_GOOD) {
+		xc->copied += cmd->num;
+		xc->offloaded += cmd->num;
+	} else if (status == SCSI_STATUS_CHECK_CONDITION) {
+		ISCSI_LOG(iscsi, 2, "lun %d: EXTENDED COPY of %" PRIu64
+			  " blocks from %" PRIu64 " failed with %s(0x%04x), "
+			  "copying them through the initiator", xc->src_lun,
+			  cmd->num, cmd->src_lba,
+			  scsi_sense_ascq_str(task->sense.ascq),
+			  task->sense.ascq);
+		if (task->sense.key == SCSI_SENSE_ILLEGAL_REQUEST &&
+		    task->sense.ascq == SCSI_SENSE_ASCQ_INVALID_OPERATION_CODE) {
+			xc->offload = 0;
+		}
+		if (iscsi_xcopy_add_host(xc, cmd->src_lba, cmd->dst_lba,
+					 cmd->num) != 0) {
+			iscsi_xcopy_fail(xc, SCSI_STATUS_ERROR);
+		}
+	} else {
+		iscsi_set_error(xc->src, "EXTENDED COPY failed: %s",
+				iscsi_get_error(iscsi));
+		iscsi_xcopy_fail(xc, status);
+	}
+
+	ISCSI_LIST_REMOVE(&xc->cmds, cmd);
+	xc->ncmds--;
+	free(cmd->data.data);
+	free(cmd);
+	scsi_free_scsi_task(task);
+	iscsi_xcopy_send(xc);
+}
+
+static void
+iscsi_xcopy_put_tgt_desc(unsigned char *desc, struct iscsi_xcopy_desig *d,
+			 uint32_t block_size)
+{
+	desc[0] = IDENT_DESCR_TGT_DESCR;
+	desc[4] = d->code_set;
+	desc[5] = (d->type & 0xf) | ((d->association & 3) << 4);
+	desc[7] = d->length;
+	memcpy(desc + 8, d->designator, d->length);
+	desc[29] = (block_size >> 16) & 0xff;
+	desc[30] = (block_size >> 8) & 0xff;
+	desc[31] = block_size & 0xff;
+}
+
+/* Hand the next segments out to an EXTENDED COPY. */
+static int
+iscsi_xcopy_send_cmd(struct iscsi_xcopy *xc)
+{
+	struct iscsi_xcopy_cmd *cmd;
+	unsigned char *buf, *seg;
+	uint64_t left = xc->left;
+	int i, nsegs;
+
+	nsegs = (left + xc->seg_blocks - 1) / xc->seg_blocks;
+	if (nsegs > xc->max_segments) {
+		nsegs = xc->max_segments;
+	}
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (cmd == NULL) {
+		goto oom;
+	}
+	cmd->data.size = XCOPY_DESC_OFFSET + 2 * XCOPY_TGT_DESC_LEN +
+		nsegs * XCOPY_SEG_DESC_LEN;
+	cmd->data.data = calloc(1, cmd->data.size);
+	if (cmd->data.data == NULL) {
+		free(cmd);
+		goto oom;
+	}
+	cmd->xc = xc;
+	cmd->list_id = xc->src->xcopy_list_id++ & 0xff;
+	cmd->src_lba = xc->src_lba;
+	cmd->dst_lba = xc->dst_lba;
+
+	buf = cmd->data.data;
+	iscsi_xcopy_put_tgt_desc(buf + XCOPY_DESC_OFFSET, &xc->desig[0],
+				 xc->block_size);
+	iscsi_xcopy_put_tgt_desc(buf + XCOPY_DESC_OFFSET + XCOPY_TGT_DESC_LEN,
+				 &xc->desig[1], xc->block_size);
+	seg = buf + XCOPY_DESC_OFFSET + 2 * XCOPY_TGT_DESC_LEN;
+	for (i = 0; i < nsegs; i++, seg += XCOPY_SEG_DESC_LEN) {
+		uint32_t num = left < xc->seg_blocks ? left : xc->seg_blocks;
+
+		seg[0] = BLK_TO_BLK_SEG_DESCR;
+		scsi_set_uint16(&seg[2], XCOPY_SEG_DESC_LEN -
+				SEG_DESC_SRC_INDEX_OFFSET);
+		scsi_set_uint16(&seg[4], 0);
+		scsi_set_uint16(&seg[6], 1);
+		scsi_set_uint16(&seg[10], num);
+		scsi_set_uint64(&seg[12], cmd->src_lba + cmd->num);
+		scsi_set_uint64(&seg[20], cmd->dst_lba + cmd->num);
+		cmd->num += num;
+		left -= num;
+	}
+
+	buf[0] = cmd->list_id;
+	buf[1] = (LIST_ID_USAGE_DISCARD & 3) << 3;
+	scsi_set_uint16(&buf[2], 2 * XCOPY_TGT_DESC_LEN);
+	scsi_set_uint32(&buf[8], nsegs * XCOPY_SEG_DESC_LEN);
+
+	if (iscsi_extended_copy_task(xc->src, xc->src_lun, &cmd->data,
+				     iscsi_xcopy_cmd_cb, cmd) == NULL) {
+		free(cmd->data.data);
+		free(cmd);
+		return -1;
+	}
+	ISCSI_LIST_ADD(&xc->cmds, cmd);
+	xc->ncmds++;
+	xc->src_lba += cmd->num;
+	xc->dst_lba += cmd->num;
+	xc->left = left;
+	if (xc->next_poll == 0) {
+		xc->next_poll = iscsi_clock_us() + XCOPY_POLL_US;
+	}
+	return 0;
+
+ oom:
+	iscsi_set_error(xc->src, "Out-of-memory: failed to allocate "
+			"EXTENDED COPY");
+	return -1;
+}
+
+/*
+ * Keep the EXTENDED COPYs and host copies going and finish once all of it
+ * is copied, or once everything in flight is back after a failure.
+ */
+static void
+iscsi_xcopy_send(struct iscsi_xcopy *xc)
+{
+	if (xc->busy || xc->setup) {
+		return;
+	}
+	xc->busy = 1;
+
+	while (xc->status == SCSI_STATUS_GOOD) {
+		if (xc->host != NULL &&
+		    xc->host_in_flight < XCOPY_HOST_IN_FLIGHT) {
+			struct iscsi_xcopy_range *r = xc->host;
+
+			if (iscsi_xcopy_send_host(xc, r) != 0) {
+				iscsi_xcopy_fail(xc, SCSI_STATUS_ERROR);
+				break;
+			}
+			if (r->num == 0) {
+				ISCSI_LIST_REMOVE(&xc->host, r);
+				free(r);
+			}
+			continue;
+		}
+		if (xc->left == 0) {
+			break;
+		}
+		if (xc->offload) {
+			if (xc->ncmds >= xc->depth) {
+				break;
+			}
+			if (iscsi_xcopy_send_cmd(xc) != 0) {
+				iscsi_xcopy_fail(xc, SCSI_STATUS_ERROR);
+				break;
+			}
+			continue;
+		}
+		if (xc->host_in_flight >= XCOPY_HOST_IN_FLIGHT) {
+			break;
+		}
+		/* hand the rest to the host copy */
+		if (iscsi_xcopy_add_host(xc, xc->src_lba, xc->dst_lba,
+					 xc->left) != 0) {
+			iscsi_xcopy_fail(xc, SCSI_STATUS_ERROR);
+			break;
+		}
+		xc->src_lba += xc->left;
+		xc->dst_lba += xc->left;
+		xc->left = 0;
+	}
+
+	xc->busy = 0;
+	if (iscsi_xcopy_in_flight(xc) > 0 || xc->starting) {
+		return;
+	}
+
+	iscsi_mt_spin_lock(&xc->src->iscsi_lock);
+	ISCSI_LIST_REMOVE(&xc->src->xcopies, xc);
+	iscsi_mt_spin_unlock(&xc->src->iscsi_lock);
+	if (xc->cb) {
+		xc->cb(xc->src, xc->status, NULL, xc->private_data);
+	}
+	iscsi_xcopy_free(xc);
+}
+
+struct iscsi_xcopy *
+iscsi_xcopy_async(struct iscsi_context *src, int src_lun, uint64_t src_lba,
+		  struct iscsi_context *dst, int dst_lun, uint64_t dst_lba,
+		  uint64_t num_blocks, uint32_t block_size,
+		  iscsi_command_cb cb, void *private_data)
+{
+	struct iscsi_xcopy *xc;
+
+	if (num_blocks == 0 || block_size == 0) {
+		iscsi_set_error(src, "Empty copy");
+		return NULL;
+	}
+
+	xc = calloc(1, sizeof(*xc));
+	if (xc == NULL) {
+		iscsi_set_error(src, "Out-of-memory: failed to allocate copy");
+		return NULL;
+	}
+	xc->src = src;
+	xc->dst = dst;
+	xc->src_lun = src_lun;
+	xc->dst_lun = dst_lun;
+	xc->block_size = block_size;
+	xc->cb = cb;
+	xc->private_data = private_data;
+	xc->src_lba = src_lba;
+	xc->dst_lba = dst_lba;
+	xc->left = num_blocks;
+	xc->status = SCSI_STATUS_GOOD;
+	xc->offload = 1;
+	xc->depth = XCOPY_IN_FLIGHT;
+
+	iscsi_mt_spin_lock(&src->iscsi_lock);
+	ISCSI_LIST_ADD(&src->xcopies, xc);
+	iscsi_mt_spin_unlock(&src->iscsi_lock);
+
+	/*
+	 * Find out whether the copy manager can do it, and copy through
+	 * the initiator if any of this fails.
+	 */
+	xc->starting = 1;
+	xc->setup = 3;
+	if (iscsi_receive_copy_results_task(src, src_lun,
+					    SCSI_COPY_RESULTS_OP_PARAMS, 0,
+					    1024, iscsi_xcopy_params_cb,
+					    xc) == NULL) {
+		xc->offload = 0;
+		xc->setup--;
+	}
+	if (iscsi_inquiry_task(src, src_lun, 1,
+			       SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+			       255, iscsi_xcopy_src_desig_cb, xc) == NULL) {
+		xc->offload = 0;
+		xc->setup--;
+	}
+	if (iscsi_inquiry_task(dst, dst_lun, 1,
+			       SCSI_INQUIRY_PAGECODE_DEVICE_IDENTIFICATION,
+			       255, iscsi_xcopy_dst_desig_cb, xc) == NULL) {
+		xc->offload = 0;
+		xc->setup--;
+	}
+	if (xc->setup == 0) {
+		iscsi_xcopy_send(xc);
+	}
+	xc->starting = 0;
+
+	if (iscsi_xcopy_in_flight(xc) == 0) {
+		/* we could not send anything */
+		iscsi_mt_spin_lock(&src->iscsi_lock);
+		ISCSI_LIST_REMOVE(&src->xcopies, xc);
+		iscsi_mt_spin_unlock(&src->iscsi_lock);
+		iscsi_xcopy_free(xc);
+		return NULL;
+	}
+	return xc;
+}
+
+void
+iscsi_xcopy_get_progress(struct iscsi_xcopy *xc, uint64_t *copied,
+			 uint64_t *offloaded)
+{
+	struct iscsi_xcopy_cmd *cmd;
+	uint64_t progress = 0;
+
+	for (cmd = xc->cmds; cmd; cmd = cmd->next) {
+		progress += cmd->progress;
+	}
+	if (copied != NULL) {
+		*copied = xc->copied + progress;
+	}
+	if (offloaded != NULL) {
+		*offloaded = xc->offloaded + progress;
+	}
+}
+
+static void
+iscsi_xcopy_poll_cb(struct iscsi_context *iscsi, int status,
+		    void *command_data, void *private_data)
+{
+	struct iscsi_xcopy_poll *poll = private_data;
+	struct iscsi_xcopy *xc = poll->xc;
+	struct scsi_task *task = command_data;
+	struct scsi_copy_results_copy_status *cs = NULL;
+	struct iscsi_xcopy_cmd *cmd;
+
+	if (status == SCSI_STATUS_GOOD) {
+		cs = scsi_datain_unmarshall(task);
+	}
+	for (cmd = xc->cmds; cs && cmd; cmd = cmd->next) {
+		uint64_t blocks;
+
+		if (cmd->list_id != poll->list_id) {
+			continue;
+		}
+		if (cs->transfer_count_units <= 6) {
+			blocks = ((uint64_t)cs->transfer_count <<
+				  (10 * cs->transfer_count_units)) /
+				xc->block_size;
+		} else if (cs->transfer_count_units == 0xf1) {
+			blocks = cs->transfer_count;
+		} else {
+			break;
+		}
+		cmd->progress = blocks < cmd->num ? blocks : cmd->num;
+		break;
+	}
+	scsi_free_scsi_task(task);
+	free(poll);
+	xc->polls--;
+	iscsi_xcopy_send(xc);
+}
+
+/* Ask how far the EXTENDED COPYs in flight got. */
+static void
+iscsi_xcopy_poll(struct iscsi_xcopy *xc)
+{
+	struct iscsi_xcopy_cmd *cmd;
+
+	for (cmd = xc->cmds; cmd; cmd = cmd->next) {
+		struct iscsi_xcopy_poll *poll;
+
+		poll = malloc(sizeof(*poll));
+		if (poll == NULL) {
+			return;
+		}
+		poll->xc = xc;
+		poll->list_id = cmd->list_id;
+		if (iscsi_receive_copy_results_task(xc->src, xc->src_lun,
+					SCSI_COPY_RESULTS_COPY_STATUS,
+					cmd->list_id, 12,
+					iscsi_xcopy_poll_cb, poll) == NULL) {
+			free(poll);
+			return;
+		}
+		xc->polls++;
+	}
+}
+
+void
+iscsi_xcopy_service(struct iscsi_context *iscsi)
+{
+	for (;;) {
+		struct iscsi_xcopy *xc;
+		uint64_t now = iscsi_clock_us();
+
+		iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+		for (xc = iscsi->xcopies; xc; xc = xc->next) {
+			if (xc->ncmds > 0 && xc->polls == 0 &&
+			    now >= xc->next_poll) {
+				xc->next_poll = now + XCOPY_POLL_US;
+				break;
+			}
+		}
+		iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+		if (xc == NULL) {
+			return;
+		}
+		iscsi_xcopy_poll(xc);
+	}
+}
+
+int
+iscsi_xcopy_next_ms(struct iscsi_context *iscsi)
+{
+	struct iscsi_xcopy *xc;
+	uint64_t now;
+	int ms = -1;
+
+	if (iscsi->xcopies == NULL) {
+		return -1;
+	}
+	now = iscsi_clock_us();
+	iscsi_mt_spin_lock(&iscsi->iscsi_lock);
+	for (xc = iscsi->xcopies; xc; xc = xc->next) {
+		int next;
+
+		if (xc->ncmds == 0 || xc->polls > 0) {
+			continue;
+		}
+		next = now >= xc->next_poll ? 0 :
+			(int)((xc->next_poll - now + 999) / 1000);
+		if (ms < 0 || next < ms) {
+			ms = next;
+		}
+	}
+	iscsi_mt_spin_unlock(&iscsi->iscsi_lock);
+	return ms;
+}
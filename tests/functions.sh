@@ -32,6 +32,10 @@ enable_header_digest() {
     ${TGTADM} --op update --mode target --tid 1 -n HeaderDigest -v CRC32C
 }
 
+enable_data_digest() {
+    ${TGTADM} --op update --mode target --tid 1 -n DataDigest -v CRC32C
+}
+
 create_lun() {
     # Setup LUN
     truncate --size=100M ${TGTLUN}
@@ -0,0 +1,235 @@
+/* 
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-auto-split";
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_auto_split [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test reading and writing "
+		"with large commands split into smaller ones\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_auto_split [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+#define NUM_BLOCKS 37
+#define MAX_BLOCKS 4
+
+int splits;
+
+void split_log(int level, const char *message)
+{
+	if (strstr(message, "splitting") != NULL) {
+		splits++;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	static int show_help = 0, show_usage = 0, debug = 0;
+	struct scsi_task *task;
+	unsigned int i;
+	int c;
+	unsigned char *data;
+	struct scsi_readcapacity10 *rc10;
+	uint32_t block_size;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?uUdi:s", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n", 
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun)
+	    != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	task = iscsi_readcapacity10_sync(iscsi, iscsi_url->lun, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc10 = scsi_datain_unmarshall(task);
+	if (rc10 == NULL || rc10->block_size == 0) {
+		fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
+		exit(10);
+	}
+	block_size = rc10->block_size;
+	scsi_free_scsi_task(task);
+
+	/* pieces of at most MAX_BLOCKS, whatever the LUN allows */
+	iscsi_set_auto_split(iscsi, MAX_BLOCKS);
+	if (debug == 0) {
+		iscsi_set_log_level(iscsi, 2);
+		iscsi_set_log_fn(iscsi, split_log);
+	}
+
+	data = malloc(NUM_BLOCKS * block_size);
+	for (i = 0; i < NUM_BLOCKS * block_size; i++) {
+		data[i] = (i / block_size) ^ (i & 0xff);
+	}
+	task = iscsi_write16_sync(iscsi, iscsi_url->lun, 0, data,
+				  NUM_BLOCKS * block_size, block_size,
+				  0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Failed to send WRITE16\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_read10_sync(iscsi, iscsi_url->lun, 0,
+				 NUM_BLOCKS * block_size, block_size,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Failed to send READ10\n");
+		exit(10);
+	}
+	if (task->datain.size != (int)(NUM_BLOCKS * block_size) ||
+	    task->residual != 0 ||
+	    memcmp(task->datain.data, data, NUM_BLOCKS * block_size)) {
+		fprintf(stderr, "Data mismatch\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	if (debug == 0 && splits != 2) {
+		fprintf(stderr, "Expected 2 commands to be split, got %d\n",
+			splits);
+		exit(10);
+	}
+
+	free(data);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
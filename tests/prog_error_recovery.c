@@ -0,0 +1,346 @@
+/* 
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-error-recovery";
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_error_recovery [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name] [-s|--snack]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test reading and writing "
+		"with ErrorRecoveryLevel 1 offered to the target\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_error_recovery [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "  -s, --snack                       "
+		"Fail unless Data and Status SNACKs were needed\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+#define NUM_BYTES (1024 * 1024)
+#define NUM_TASKS 32
+#define TASK_BYTES (64 * 1024)
+
+int data_snacks, status_snacks;
+
+void snack_log(int level, const char *message)
+{
+	if (strstr(message, "SNACK type 0") != NULL) {
+		data_snacks++;
+	}
+	if (strstr(message, "SNACK type 1") != NULL) {
+		status_snacks++;
+	}
+	if (level <= 1) {
+		fprintf(stderr, "%s\n", message);
+	}
+}
+
+struct client_state {
+	int finished;
+	int status;
+	unsigned char *data;
+	uint32_t block_size;
+};
+
+void event_loop(struct iscsi_context *iscsi, struct client_state *state)
+{
+	struct pollfd pfd;
+
+	while (state->finished < NUM_TASKS) {
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+
+		if (poll(&pfd, 1, 1000) < 0) {
+			fprintf(stderr, "Poll failed");
+			exit(10);
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+}
+
+void write_cb(struct iscsi_context *iscsi, int status,
+	      void *command_data, void *private_data)
+{
+	struct client_state *state = (struct client_state *)private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "WRITE16 failed\n");
+		state->status = status;
+	}
+	scsi_free_scsi_task(command_data);
+	state->finished++;
+}
+
+void read_cb(struct iscsi_context *iscsi, int status,
+	     void *command_data, void *private_data)
+{
+	struct client_state *state = (struct client_state *)private_data;
+	struct scsi_task *task = command_data;
+	uint32_t lba = scsi_get_uint32(&task->cdb[6]);
+
+	/* each task reads back what it wrote, lba 0 is the 1MiB test */
+	if (status != SCSI_STATUS_GOOD || task->datain.size != TASK_BYTES ||
+	    memcmp(task->datain.data,
+		   state->data + (lba * state->block_size - NUM_BYTES),
+		   TASK_BYTES)) {
+		fprintf(stderr, "READ16 failed or data mismatch\n");
+		state->status = SCSI_STATUS_ERROR;
+	}
+	scsi_free_scsi_task(task);
+	state->finished++;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	char *url = NULL;
+	static int show_help = 0, show_usage = 0, debug = 0, expect_snack = 0;
+	struct client_state state;
+	struct scsi_task *task;
+	unsigned int i;
+	int c;
+	unsigned char *data;
+	struct scsi_readcapacity10 *rc10;
+	uint32_t block_size;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"snack",          no_argument,          NULL,        's'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?uUdi:s", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 's':
+			expect_snack = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	} else {
+		iscsi_set_log_level(iscsi, 2);
+		iscsi_set_log_fn(iscsi, snack_log);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n", 
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_error_recovery_level(iscsi, ISCSI_ERROR_RECOVERY_LEVEL_1);
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun)
+	    != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	task = iscsi_readcapacity10_sync(iscsi, iscsi_url->lun, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc10 = scsi_datain_unmarshall(task);
+	if (rc10 == NULL || rc10->block_size == 0) {
+		fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
+		exit(10);
+	}
+	block_size = rc10->block_size;
+	scsi_free_scsi_task(task);
+
+	/* large enough for several Data-In and R2T per command */
+	data = malloc(NUM_BYTES);
+	for (i = 0; i < NUM_BYTES; i++) {
+		data[i] = (i / block_size) ^ (i & 0xff);
+	}
+	task = iscsi_write16_sync(iscsi, iscsi_url->lun, 0, data,
+				  NUM_BYTES, block_size, 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Failed to send WRITE16\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	task = iscsi_read16_sync(iscsi, iscsi_url->lun, 0, NUM_BYTES,
+				 block_size, 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Failed to send READ16\n");
+		exit(10);
+	}
+	if (task->datain.size != NUM_BYTES || task->residual != 0 ||
+	    memcmp(task->datain.data, data, NUM_BYTES)) {
+		fprintf(stderr, "Data mismatch\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+	free(data);
+
+	/* many tasks at once, so a lost status is noticed from the
+	 * StatSN of the PDUs for the others */
+	memset(&state, 0, sizeof(state));
+	state.block_size = block_size;
+	state.data = malloc(NUM_TASKS * TASK_BYTES);
+	for (i = 0; i < NUM_TASKS * TASK_BYTES; i++) {
+		state.data[i] = (i / block_size) ^ (i & 0xff) ^ 0x5a;
+	}
+	for (i = 0; i < NUM_TASKS; i++) {
+		if (iscsi_write16_task(iscsi, iscsi_url->lun,
+				       (NUM_BYTES + i * TASK_BYTES) / block_size,
+				       state.data + i * TASK_BYTES, TASK_BYTES,
+				       block_size, 0, 0, 0, 0, 0,
+				       write_cb, &state) == NULL) {
+			fprintf(stderr, "Failed to send WRITE16\n");
+			exit(10);
+		}
+	}
+	event_loop(iscsi, &state);
+	if (state.status != SCSI_STATUS_GOOD) {
+		exit(10);
+	}
+
+	state.finished = 0;
+	for (i = 0; i < NUM_TASKS; i++) {
+		if (iscsi_read16_task(iscsi, iscsi_url->lun,
+				      (NUM_BYTES + i * TASK_BYTES) / block_size,
+				      TASK_BYTES, block_size, 0, 0, 0, 0, 0,
+				      read_cb, &state) == NULL) {
+			fprintf(stderr, "Failed to send READ16\n");
+			exit(10);
+		}
+	}
+	event_loop(iscsi, &state);
+	if (state.status != SCSI_STATUS_GOOD) {
+		exit(10);
+	}
+	free(state.data);
+
+	if (expect_snack && (data_snacks == 0 || status_snacks == 0)) {
+		fprintf(stderr, "Expected recovery through SNACK, got %d "
+			"Data and %d Status SNACKs\n", data_snacks,
+			status_snacks);
+		exit(10);
+	}
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
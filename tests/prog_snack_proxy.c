@@ -0,0 +1,645 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * A proxy in front of an iSCSI target that makes the initiator use
+ * ErrorRecoveryLevel 1 recovery. It turns ErrorRecoveryLevel=0 in the
+ * login response into 1, drops or corrupts the data digest of Data-In
+ * PDUs and drops SCSI Response PDUs on the way to the initiator, and
+ * answers the Data and Status SNACKs that follow from what it has
+ * sent, so the target itself only has to do ErrorRecoveryLevel 0.
+ * It can also lower the MaxRecvDataSegmentLength the initiator
+ * declares, for more Data-In per command.
+ *
+ * When a dropped status leaves the connection idle it sends a NOP-In
+ * with the next StatSN, like a target pinging an idle initiator would.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#define OP_NOP_IN	0x20
+#define OP_SCSI_RSP	0x21
+#define OP_LOGIN_RSP	0x23
+#define OP_DATA_IN	0x25
+#define OP_LOGIN_REQ	0x03
+#define OP_SNACK	0x10
+
+#define CACHE_SIZE	4096
+
+static int drop_data;
+static int drop_status;
+static int corrupt_data;
+static int max_recv;
+static int debug;
+
+struct stream {
+	int fd;
+	unsigned char *buf;
+	size_t len, size;
+};
+
+struct cached {
+	unsigned char *buf;
+	size_t len;
+	uint32_t itt;
+	uint32_t sn;		/* DataSN, or StatSN of a response */
+	int status;
+};
+
+struct conn {
+	struct stream ini, tgt;
+	int header_digest, data_digest;
+	int ffp;		/* digests are on from here */
+	struct cached cache[CACHE_SIZE];
+	unsigned int cache_next;
+	unsigned int data_in, responses;
+	uint32_t next_statsn, expcmdsn, maxcmdsn;
+	int status_lost;	/* dropped and not asked for yet */
+	unsigned int data_snacks, status_snacks;
+};
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_snack_proxy [-?|--help] [--usage] "
+		"[-D|--drop-data=n] [-S|--drop-status=n] "
+		"[-C|--corrupt-data=n] [-m|--max-recv=n]\n"
+		"\t\t<listen-port> <target-ip:port>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command loses PDUs between an iSCSI target "
+		"and initiator\n");
+}
+
+static void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_snack_proxy [OPTION...] <listen-port> "
+		"<target-ip:port>\n");
+	fprintf(stderr, "  -D, --drop-data=n                 "
+		"Drop every n-th Data-In without status\n");
+	fprintf(stderr, "  -S, --drop-status=n               "
+		"Drop every n-th SCSI Response\n");
+	fprintf(stderr, "  -C, --corrupt-data=n              "
+		"Corrupt the data digest of every n-th Data-In\n");
+	fprintf(stderr, "  -m, --max-recv=n                  "
+		"Declare MaxRecvDataSegmentLength=n for the initiator\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+}
+
+static uint32_t get_uint32(const unsigned char *c)
+{
+	return ((uint32_t)c[0] << 24) | (c[1] << 16) | (c[2] << 8) | c[3];
+}
+
+static void set_uint32(unsigned char *c, uint32_t val)
+{
+	c[0] = val >> 24;
+	c[1] = val >> 16;
+	c[2] = val >> 8;
+	c[3] = val;
+}
+
+/* CRC32C, for the header digest of the NOP-In we make up */
+static uint32_t crc32c(const unsigned char *buf, size_t len)
+{
+	uint32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+		}
+	}
+	return ~crc;
+}
+
+static int serial_gt(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) > 0;
+}
+
+static int write_all(int fd, const unsigned char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int connect_target(const char *target)
+{
+	struct sockaddr_in sin;
+	char host[64], *port;
+	int fd;
+
+	strncpy(host, target, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		fprintf(stderr, "Bad target address %s\n", target);
+		return -1;
+	}
+	*port++ = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(port));
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		fprintf(stderr, "Bad target address %s\n", target);
+		return -1;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		fprintf(stderr, "Failed to connect to %s: %s\n", target,
+			strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+/* the length of the PDU at the start of the stream, 0 if incomplete */
+static size_t pdu_length(struct conn *c, struct stream *s)
+{
+	size_t len, dsl;
+
+	if (s->len < 48) {
+		return 0;
+	}
+	dsl = get_uint32(&s->buf[4]) & 0x00ffffff;
+	len = 48 + s->buf[4] * 4 + ((dsl + 3) & ~3);
+	if (c->ffp && c->header_digest) {
+		len += 4;
+	}
+	if (c->ffp && c->data_digest && dsl) {
+		len += 4;
+	}
+	return s->len >= len ? len : 0;
+}
+
+static void cache_pdu(struct conn *c, const unsigned char *buf, size_t len,
+		      uint32_t itt, uint32_t sn, int status)
+{
+	struct cached *e = &c->cache[c->cache_next++ % CACHE_SIZE];
+
+	free(e->buf);
+	e->buf = malloc(len);
+	if (e->buf == NULL) {
+		exit(10);
+	}
+	memcpy(e->buf, buf, len);
+	e->len = len;
+	e->itt = itt;
+	e->sn = sn;
+	e->status = status;
+}
+
+/* resend what a SNACK asks for, returns the number of PDUs */
+static int snack(struct conn *c, const unsigned char *hdr)
+{
+	int type = hdr[1] & 0x0f;
+	uint32_t itt = get_uint32(&hdr[16]);
+	uint32_t begrun = get_uint32(&hdr[40]);
+	uint32_t runlength = get_uint32(&hdr[44]);
+	uint32_t sn;
+	int i, count = 0;
+
+	for (sn = begrun; runlength == 0 || sn - begrun < runlength; sn++) {
+		for (i = 0; i < CACHE_SIZE; i++) {
+			struct cached *e = &c->cache[i];
+
+			if (e->buf == NULL || e->sn != sn ||
+			    e->status != (type == 1) ||
+			    (type == 0 && e->itt != itt)) {
+				continue;
+			}
+			if (write_all(c->ini.fd, e->buf, e->len) != 0) {
+				exit(10);
+			}
+			count++;
+			break;
+		}
+		if (i == CACHE_SIZE) {
+			if (runlength == 0) {
+				break;
+			}
+			fprintf(stderr, "SNACK type %d for %08x not in "
+				"the cache\n", type, sn);
+			exit(10);
+		}
+	}
+	if (type == 1) {
+		c->status_snacks++;
+		c->status_lost = 0;
+	} else {
+		c->data_snacks++;
+	}
+	if (debug) {
+		fprintf(stderr, "SNACK type %d itt %08x begrun %u runlength "
+			"%u: resent %d\n", type, itt, begrun, runlength,
+			count);
+	}
+	return count;
+}
+
+static void login_response(struct conn *c, unsigned char *pdu, size_t len)
+{
+	char *text = (char *)&pdu[48];
+	size_t dsl = get_uint32(&pdu[4]) & 0x00ffffff;
+	size_t pos;
+
+	for (pos = 0; pos < dsl; pos += strlen(&text[pos]) + 1) {
+		if (!strcmp(&text[pos], "ErrorRecoveryLevel=0")) {
+			text[pos + strlen("ErrorRecoveryLevel=")] = '1';
+		} else if (!strcmp(&text[pos], "HeaderDigest=CRC32C")) {
+			c->header_digest = 1;
+		} else if (!strcmp(&text[pos], "DataDigest=CRC32C")) {
+			c->data_digest = 1;
+		}
+	}
+	/* transit to full feature phase */
+	if ((pdu[1] & 0x83) == 0x83 && pdu[36] == 0) {
+		c->ffp = 1;
+	}
+}
+
+static void from_target(struct conn *c, unsigned char *pdu, size_t len)
+{
+	int opcode = pdu[0] & 0x3f;
+	uint32_t itt = get_uint32(&pdu[16]);
+	uint32_t statsn = get_uint32(&pdu[24]);
+	uint32_t dsl = get_uint32(&pdu[4]) & 0x00ffffff;
+	unsigned char *bad;
+
+	if (opcode == OP_LOGIN_RSP) {
+		login_response(c, pdu, len);
+	}
+	if (c->ffp && opcode != OP_LOGIN_RSP) {
+		if (serial_gt(get_uint32(&pdu[28]), c->expcmdsn)) {
+			c->expcmdsn = get_uint32(&pdu[28]);
+		}
+		if (serial_gt(get_uint32(&pdu[32]), c->maxcmdsn)) {
+			c->maxcmdsn = get_uint32(&pdu[32]);
+		}
+	}
+
+	switch (opcode) {
+	case OP_DATA_IN:
+		if (pdu[1] & 0x01) {
+			/* status is in there, do not lose it */
+			c->next_statsn = statsn + 1;
+			break;
+		}
+		cache_pdu(c, pdu, len, itt, get_uint32(&pdu[36]), 0);
+		c->data_in++;
+		if (drop_data && c->data_in % drop_data == 0) {
+			if (debug) {
+				fprintf(stderr, "drop Data-In itt %08x "
+					"DataSN %u\n", itt,
+					get_uint32(&pdu[36]));
+			}
+			return;
+		}
+		if (corrupt_data && c->data_digest && dsl &&
+		    c->data_in % corrupt_data == 0) {
+			bad = malloc(len);
+			if (bad == NULL) {
+				exit(10);
+			}
+			memcpy(bad, pdu, len);
+			bad[len - 1] ^= 0x5a;
+			if (debug) {
+				fprintf(stderr, "corrupt Data-In itt %08x "
+					"DataSN %u\n", itt,
+					get_uint32(&pdu[36]));
+			}
+			if (write_all(c->ini.fd, bad, len) != 0) {
+				exit(10);
+			}
+			free(bad);
+			return;
+		}
+		break;
+	case OP_SCSI_RSP:
+		cache_pdu(c, pdu, len, itt, statsn, 1);
+		c->next_statsn = statsn + 1;
+		c->responses++;
+		if (drop_status && c->responses % drop_status == 0) {
+			if (debug) {
+				fprintf(stderr, "drop status itt %08x StatSN "
+					"%u\n", itt, statsn);
+			}
+			c->status_lost = 1;
+			return;
+		}
+		break;
+	}
+
+	if (write_all(c->ini.fd, pdu, len) != 0) {
+		exit(10);
+	}
+}
+
+/* a NOP-In the initiator need not answer, it carries the next StatSN */
+static void send_nop_in(struct conn *c)
+{
+	unsigned char nop[52];
+	uint32_t crc;
+
+	memset(nop, 0, sizeof(nop));
+	nop[0] = OP_NOP_IN;
+	nop[1] = 0x80;
+	set_uint32(&nop[16], 0xffffffff);
+	set_uint32(&nop[20], 0xffffffff);
+	set_uint32(&nop[24], c->next_statsn);
+	set_uint32(&nop[28], c->expcmdsn);
+	set_uint32(&nop[32], c->maxcmdsn);
+	crc = crc32c(nop, 48);
+	nop[48] = crc;
+	nop[49] = crc >> 8;
+	nop[50] = crc >> 16;
+	nop[51] = crc >> 24;
+	if (debug) {
+		fprintf(stderr, "NOP-In StatSN %u\n", c->next_statsn);
+	}
+	if (write_all(c->ini.fd, nop, c->header_digest ? 52 : 48) != 0) {
+		exit(10);
+	}
+}
+
+/* login PDUs carry no digests, so the text can just be rebuilt */
+static void login_request(struct conn *c, unsigned char *pdu, size_t len)
+{
+	const char *text = (const char *)&pdu[48];
+	size_t dsl = get_uint32(&pdu[4]) & 0x00ffffff;
+	unsigned char *out;
+	size_t pos, olen = 0;
+
+	out = calloc(1, len + 64);
+	if (out == NULL) {
+		exit(10);
+	}
+	memcpy(out, pdu, 48);
+	for (pos = 0; pos < dsl && text[pos]; pos += strlen(&text[pos]) + 1) {
+		if (!strncmp(&text[pos], "MaxRecvDataSegmentLength=", 25)) {
+			olen += sprintf((char *)&out[48 + olen],
+					"MaxRecvDataSegmentLength=%d",
+					max_recv) + 1;
+		} else {
+			strcpy((char *)&out[48 + olen], &text[pos]);
+			olen += strlen(&text[pos]) + 1;
+		}
+	}
+	set_uint32(&out[4], (out[4] << 24) | olen);
+	if (write_all(c->tgt.fd, out, 48 + ((olen + 3) & ~3)) != 0) {
+		exit(10);
+	}
+	free(out);
+}
+
+static void from_initiator(struct conn *c, unsigned char *pdu, size_t len)
+{
+	if (c->ffp && (pdu[0] & 0x3f) == OP_SNACK) {
+		snack(c, pdu);
+		return;
+	}
+	if (max_recv && (pdu[0] & 0x3f) == OP_LOGIN_REQ) {
+		login_request(c, pdu, len);
+		return;
+	}
+	if (write_all(c->tgt.fd, pdu, len) != 0) {
+		exit(10);
+	}
+}
+
+/* read what there is, returns -1 on EOF */
+static int fill(struct stream *s)
+{
+	ssize_t count;
+
+	if (s->size - s->len < 65536) {
+		s->size = s->size * 2 + 65536;
+		s->buf = realloc(s->buf, s->size);
+		if (s->buf == NULL) {
+			exit(10);
+		}
+	}
+	count = read(s->fd, s->buf + s->len, s->size - s->len);
+	if (count < 0 && errno == EINTR) {
+		return 0;
+	}
+	if (count <= 0) {
+		return -1;
+	}
+	s->len += count;
+	return 0;
+}
+
+static void drain(struct conn *c, struct stream *s,
+		  void (*fn)(struct conn *, unsigned char *, size_t))
+{
+	size_t len;
+
+	while ((len = pdu_length(c, s)) != 0) {
+		fn(c, s->buf, len);
+		s->len -= len;
+		memmove(s->buf, s->buf + len, s->len);
+	}
+}
+
+static int proxy(int cfd, const char *target)
+{
+	struct conn *c;
+	struct pollfd pfd[2];
+	int ret;
+
+	c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		return 10;
+	}
+	c->ini.fd = cfd;
+	c->tgt.fd = connect_target(target);
+	if (c->tgt.fd < 0) {
+		return 10;
+	}
+
+	pfd[0].fd = c->ini.fd;
+	pfd[1].fd = c->tgt.fd;
+	pfd[0].events = pfd[1].events = POLLIN;
+	for (;;) {
+		ret = poll(pfd, 2, 200);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 10;
+		}
+		if (ret == 0) {
+			if (c->status_lost) {
+				send_nop_in(c);
+			}
+			continue;
+		}
+		if (pfd[0].revents) {
+			if (fill(&c->ini) != 0) {
+				break;
+			}
+			drain(c, &c->ini, from_initiator);
+		}
+		if (pfd[1].revents) {
+			if (fill(&c->tgt) != 0) {
+				break;
+			}
+			drain(c, &c->tgt, from_target);
+		}
+	}
+
+	fprintf(stderr, "prog_snack_proxy: %u Data-In, %u responses, "
+		"%u Data SNACKs, %u Status SNACKs\n", c->data_in,
+		c->responses, c->data_snacks, c->status_snacks);
+	close(c->tgt.fd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static int show_help = 0, show_usage = 0;
+	struct sockaddr_in sin;
+	int lfd, cfd, c, one = 1;
+	int option_index;
+	pid_t pid;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"drop-data",      required_argument,    NULL,        'D'},
+		{"drop-status",    required_argument,    NULL,        'S'},
+		{"corrupt-data",   required_argument,    NULL,        'C'},
+		{"max-recv",       required_argument,    NULL,        'm'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "h?udD:S:C:m:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'D':
+			drop_data = atoi(optarg);
+			break;
+		case 'S':
+			drop_status = atoi(optarg);
+			break;
+		case 'C':
+			corrupt_data = atoi(optarg);
+			break;
+		case 'm':
+			max_recv = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc - 2) {
+		print_usage();
+		exit(10);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[optind]));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		exit(10);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(lfd, 8) != 0) {
+		fprintf(stderr, "Failed to listen on port %s: %s\n",
+			argv[optind], strerror(errno));
+		exit(10);
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		cfd = accept(lfd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			exit(10);
+		}
+		pid = fork();
+		if (pid == 0) {
+			close(lfd);
+			exit(proxy(cfd, argv[optind + 1]));
+		}
+		close(cfd);
+	}
+}
@@ -0,0 +1,405 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * A TLS 1.3 terminating proxy in front of a plain iSCSI target, for
+ * testing the TLS transport. Every connection gets a session ticket
+ * right after the handshake and a KeyUpdate, asking for one back, each
+ * time --update-bytes more bytes have been sent to the initiator. Those
+ * are the records kernel TLS can not handle on its own.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <gnutls/gnutls.h>
+
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+
+static const char *cert_file;
+static const char *key_file;
+static size_t update_bytes = 1024;
+static int debug;
+
+static void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_tls_proxy [-?|--help] [--usage] "
+		"[-c|--cert=file] [-k|--key=file] [-b|--update-bytes=n] "
+		"[--check-ktls]\n"
+		"\t\t<listen-port> <target-ip:port>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command terminates TLS 1.3 in front of an "
+		"iSCSI target\n");
+}
+
+static void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_tls_proxy [OPTION...] <listen-port> "
+		"<target-ip:port>\n");
+	fprintf(stderr, "  -c, --cert=file                   "
+		"PEM certificate to present\n");
+	fprintf(stderr, "  -k, --key=file                    "
+		"PEM private key of the certificate\n");
+	fprintf(stderr, "  -b, --update-bytes=n              "
+		"Send a KeyUpdate every n bytes (1024)\n");
+	fprintf(stderr, "  -K, --check-ktls                  "
+		"Exit 0 if kernel TLS is available\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+}
+
+/* kernel TLS needs the tls ULP, which needs a connected socket */
+static int check_ktls(void)
+{
+	struct sockaddr_in sin;
+	socklen_t len = sizeof(sin);
+	int lfd, cfd, ret = 1;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	cfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0 || cfd < 0 ||
+	    bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(lfd, 1) != 0 ||
+	    getsockname(lfd, (struct sockaddr *)&sin, &len) != 0 ||
+	    connect(cfd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		goto out;
+	}
+	if (setsockopt(cfd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) == 0) {
+		ret = 0;
+	}
+ out:
+	if (lfd >= 0) {
+		close(lfd);
+	}
+	if (cfd >= 0) {
+		close(cfd);
+	}
+	return ret;
+}
+
+static int connect_target(const char *target)
+{
+	struct sockaddr_in sin;
+	char host[64], *port;
+	int fd;
+
+	strncpy(host, target, sizeof(host) - 1);
+	host[sizeof(host) - 1] = 0;
+	port = strrchr(host, ':');
+	if (port == NULL) {
+		fprintf(stderr, "Bad target address %s\n", target);
+		return -1;
+	}
+	*port++ = 0;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(port));
+	if (inet_pton(AF_INET, host, &sin.sin_addr) != 1) {
+		fprintf(stderr, "Bad target address %s\n", target);
+		return -1;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+		fprintf(stderr, "Failed to connect to %s: %s\n", target,
+			strerror(errno));
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = write(fd, buf, len);
+		if (count < 0 && errno == EINTR) {
+			continue;
+		}
+		if (count <= 0) {
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+static int send_all(gnutls_session_t session, const char *buf, size_t len)
+{
+	ssize_t count;
+
+	while (len > 0) {
+		count = gnutls_record_send(session, buf, len);
+		if (count == GNUTLS_E_AGAIN || count == GNUTLS_E_INTERRUPTED) {
+			continue;
+		}
+		if (count < 0) {
+			fprintf(stderr, "TLS send failed: %s\n",
+				gnutls_strerror(count));
+			return -1;
+		}
+		buf += count;
+		len -= count;
+	}
+	return 0;
+}
+
+/* relay one initiator connection, returns the exit status */
+static int proxy(int cfd, const char *target,
+		 gnutls_certificate_credentials_t cred,
+		 const gnutls_datum_t *ticket_key)
+{
+	gnutls_session_t session;
+	struct pollfd pfd[2];
+	char buf[65536];
+	size_t sent = 0;
+	ssize_t count;
+	int tfd, ret;
+
+	tfd = connect_target(target);
+	if (tfd < 0) {
+		return 10;
+	}
+
+	if (gnutls_init(&session, GNUTLS_SERVER) < 0 ||
+	    gnutls_priority_set_direct(session, "NORMAL:-VERS-ALL:+VERS-TLS1.3",
+				       NULL) < 0 ||
+	    gnutls_credentials_set(session, GNUTLS_CRD_CERTIFICATE,
+				   cred) < 0 ||
+	    gnutls_session_ticket_enable_server(session, ticket_key) < 0) {
+		fprintf(stderr, "Failed to set up the TLS session\n");
+		return 10;
+	}
+	gnutls_transport_set_int(session, cfd);
+
+	do {
+		ret = gnutls_handshake(session);
+	} while (ret < 0 && !gnutls_error_is_fatal(ret));
+	if (ret < 0) {
+		fprintf(stderr, "TLS handshake failed: %s\n",
+			gnutls_strerror(ret));
+		return 10;
+	}
+	if (debug) {
+		fprintf(stderr, "TLS established (%s)\n",
+			gnutls_cipher_get_name(gnutls_cipher_get(session)));
+	}
+
+	pfd[0].fd = cfd;
+	pfd[1].fd = tfd;
+	for (;;) {
+		pfd[0].events = POLLIN;
+		pfd[1].events = POLLIN;
+		if (gnutls_record_check_pending(session) > 0) {
+			pfd[0].revents = POLLIN;
+			pfd[1].revents = 0;
+		} else if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return 10;
+		}
+
+		if (pfd[0].revents) {
+			count = gnutls_record_recv(session, buf, sizeof(buf));
+			if (count == GNUTLS_E_AGAIN ||
+			    count == GNUTLS_E_INTERRUPTED) {
+				continue;
+			}
+			if (count <= 0) {
+				/* initiator logged out or went away */
+				if (count < 0 && debug) {
+					fprintf(stderr, "TLS recv: %s\n",
+						gnutls_strerror(count));
+				}
+				break;
+			}
+			if (write_all(tfd, buf, count) != 0) {
+				return 10;
+			}
+		}
+
+		if (pfd[1].revents) {
+			count = read(tfd, buf, sizeof(buf));
+			if (count <= 0) {
+				break;
+			}
+			if (send_all(session, buf, count) != 0) {
+				return 10;
+			}
+			sent += count;
+			if (sent >= update_bytes) {
+				ret = gnutls_session_key_update(session,
+							GNUTLS_KU_PEER);
+				if (ret < 0) {
+					fprintf(stderr, "KeyUpdate failed: "
+						"%s\n", gnutls_strerror(ret));
+					return 10;
+				}
+				if (debug) {
+					fprintf(stderr, "sent KeyUpdate\n");
+				}
+				sent = 0;
+			}
+		}
+	}
+
+	gnutls_bye(session, GNUTLS_SHUT_WR);
+	gnutls_deinit(session);
+	close(tfd);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	static int show_help = 0, show_usage = 0, ktls = 0;
+	gnutls_certificate_credentials_t cred;
+	gnutls_datum_t ticket_key;
+	struct sockaddr_in sin;
+	int lfd, cfd, c, one = 1;
+	int option_index;
+	pid_t pid;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"cert",           required_argument,    NULL,        'c'},
+		{"key",            required_argument,    NULL,        'k'},
+		{"update-bytes",   required_argument,    NULL,        'b'},
+		{"check-ktls",     no_argument,          NULL,        'K'},
+		{0, 0, 0, 0}
+	};
+
+	while ((c = getopt_long(argc, argv, "h?udc:k:b:K", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'c':
+			cert_file = optarg;
+			break;
+		case 'k':
+			key_file = optarg;
+			break;
+		case 'b':
+			update_bytes = strtoul(optarg, NULL, 0);
+			break;
+		case 'K':
+			ktls = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (ktls) {
+		exit(check_ktls());
+	}
+
+	if (optind != argc - 2 || cert_file == NULL || key_file == NULL) {
+		print_usage();
+		exit(10);
+	}
+
+	if (gnutls_certificate_allocate_credentials(&cred) < 0 ||
+	    gnutls_certificate_set_x509_key_file(cred, cert_file, key_file,
+						 GNUTLS_X509_FMT_PEM) < 0 ||
+	    gnutls_session_ticket_key_generate(&ticket_key) < 0) {
+		fprintf(stderr, "Failed to load %s/%s\n", cert_file, key_file);
+		exit(10);
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(atoi(argv[optind]));
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		exit(10);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (bind(lfd, (struct sockaddr *)&sin, sizeof(sin)) != 0 ||
+	    listen(lfd, 8) != 0) {
+		fprintf(stderr, "Failed to listen on port %s: %s\n",
+			argv[optind], strerror(errno));
+		exit(10);
+	}
+
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+	for (;;) {
+		cfd = accept(lfd, NULL, NULL);
+		if (cfd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			exit(10);
+		}
+		pid = fork();
+		if (pid == 0) {
+			close(lfd);
+			exit(proxy(cfd, argv[optind + 1], cred, &ticket_key));
+		}
+		close(cfd);
+	}
+}
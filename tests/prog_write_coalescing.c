@@ -0,0 +1,278 @@
+/* 
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+   
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+   
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef HAVE_POLL_H
+#include <poll.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:prog-write-coalescing";
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: prog_write_coalescing [-?|--help] [--usage] "
+		"[-i|--initiator-name=iqn-name]\n"
+		"\t\t<iscsi-portal-url>\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "This command is used to test that small writes "
+		"merged by write coalescing all reach the LUN\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: prog_write_coalescing [OPTION...] <iscsi-url>\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     "
+		"Initiatorname to use\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        "
+		"Show this help message\n");
+	fprintf(stderr, "      --usage                       "
+		"Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "iSCSI Portal URL format : %s\n",
+		ISCSI_PORTAL_URL_SYNTAX);
+	fprintf(stderr, "\n");
+	fprintf(stderr, "<host> is either of:\n");
+	fprintf(stderr, "  \"hostname\"       iscsi.example\n");
+	fprintf(stderr, "  \"ipv4-address\"   10.1.1.27\n");
+	fprintf(stderr, "  \"ipv6-address\"   [fce0::1]\n");
+}
+
+#define NUM_WRITES 64
+
+struct client_state {
+	int finished;
+	int status;
+};
+
+void event_loop(struct iscsi_context *iscsi, struct client_state *state)
+{
+	struct pollfd pfd;
+
+	while (state->finished < NUM_WRITES) {
+		pfd.fd = iscsi_get_fd(iscsi);
+		pfd.events = iscsi_which_events(iscsi);
+
+		if (poll(&pfd, 1, 1000) < 0) {
+			fprintf(stderr, "Poll failed");
+			exit(10);
+		}
+		if (iscsi_service(iscsi, pfd.revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+	}
+}
+
+void write_cb(struct iscsi_context *iscsi, int status,
+	      void *command_data, void *private_data)
+{
+	struct client_state *state = (struct client_state *)private_data;
+
+	if (status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "WRITE10 failed\n");
+		state->status = status;
+	}
+	scsi_free_scsi_task(command_data);
+	state->finished++;
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_context *iscsi;
+	struct iscsi_url *iscsi_url = NULL;
+	struct client_state state;
+	struct scsi_inquiry_block_limits bl;
+	char *url = NULL;
+	static int show_help = 0, show_usage = 0, debug = 0;
+	struct scsi_task *task;
+	unsigned int i;
+	int c;
+	unsigned char *data;
+	struct scsi_readcapacity10 *rc10;
+	uint32_t block_size;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"debug",          no_argument,          NULL,        'd'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?uUdi:s", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'd':
+			debug = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind != argc -1) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] != NULL) {
+		url = strdup(argv[optind]);
+	}
+	if (url == NULL) {
+		fprintf(stderr, "You must specify iscsi target portal.\n");
+		print_usage();
+		exit(10);
+	}
+
+	iscsi = iscsi_create_context(initiator);
+	if (iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	if (debug > 0) {
+		iscsi_set_log_level(iscsi, debug);
+		iscsi_set_log_fn(iscsi, iscsi_log_to_stderr);
+	}
+
+	iscsi_url = iscsi_parse_full_url(iscsi, url);
+
+	free(url);
+
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n", 
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
+
+	if (iscsi_full_connect_sync(iscsi, iscsi_url->portal, iscsi_url->lun)
+	    != 0) {
+		fprintf(stderr, "iscsi_connect failed. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	task = iscsi_readcapacity10_sync(iscsi, iscsi_url->lun, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "failed to send readcapacity command\n");
+		exit(10);
+	}
+	rc10 = scsi_datain_unmarshall(task);
+	if (rc10 == NULL || rc10->block_size == 0) {
+		fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
+		exit(10);
+	}
+	block_size = rc10->block_size;
+	scsi_free_scsi_task(task);
+	memset(&state, 0, sizeof(state));
+
+	if (iscsi_set_write_coalescing(iscsi, 64 * 1024, 1000) != 0) {
+		fprintf(stderr, "Failed to enable write coalescing. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	/* writes are only merged once the Block Limits are known */
+	if (iscsi_get_block_limits_sync(iscsi, iscsi_url->lun, &bl) != 0) {
+		fprintf(stderr, "Failed to read the Block Limits. %s\n",
+			iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	/* queue one block writes to consecutive blocks, all but the first
+	 * are held back and merged while the first is in flight */
+	data = malloc(NUM_WRITES * block_size);
+	for (i = 0; i < NUM_WRITES * block_size; i++) {
+		data[i] = (i / block_size) ^ (i & 0xff);
+	}
+	for (i = 0; i < NUM_WRITES; i++) {
+		if (iscsi_write10_task(iscsi, iscsi_url->lun, 100 + i,
+				       data + i * block_size, block_size,
+				       block_size, 0, 0, 0, 0, 0,
+				       write_cb, &state) == NULL) {
+			fprintf(stderr, "Failed to send WRITE10\n");
+			exit(10);
+		}
+	}
+	event_loop(iscsi, &state);
+	if (state.status != SCSI_STATUS_GOOD) {
+		exit(10);
+	}
+
+	/* read it back without merging */
+	iscsi_set_write_coalescing(iscsi, 0, 0);
+	task = iscsi_read16_sync(iscsi, iscsi_url->lun, 100,
+				 NUM_WRITES * block_size, block_size,
+				 0, 0, 0, 0, 0);
+	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+		fprintf(stderr, "Failed to send READ16\n");
+		exit(10);
+	}
+	if (task->datain.size != (int)(NUM_WRITES * block_size) ||
+	    memcmp(task->datain.data, data, NUM_WRITES * block_size)) {
+		fprintf(stderr, "Data mismatch\n");
+		exit(10);
+	}
+	scsi_free_scsi_task(task);
+
+	free(data);
+	iscsi_logout_sync(iscsi);
+	iscsi_destroy_url(iscsi_url);
+	iscsi_destroy_context(iscsi);
+
+	return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Discovery tests with a SendTargets reply of several PDUs"
+
+# enough targets with long names that the reply does not fit in one PDU
+NUM_TARGETS=1200
+PAD=`printf '%0180d' 0`
+
+start_target
+create_lun
+
+tid=2
+while [ ${tid} -le `expr ${NUM_TARGETS} + 1` ]; do
+    ${TGTADM} --op new --mode target --tid ${tid} -T ${IQNTARGET}.${PAD}.${tid}
+    ${TGTADM} --op bind --mode target --tid ${tid} -I ALL
+    tid=`expr ${tid} + 1`
+done
+
+TEST_TMP=${0}.tmp
+echo -n "Test discovery of ${NUM_TARGETS} extra targets ... "
+../utils/iscsi-ls -i ${IQNINITIATOR} iscsi://${TGTPORTAL} > ${TEST_TMP} &&
+grep "Target:${IQNTARGET} " ${TEST_TMP} > /dev/null &&
+[ `grep "${PAD}" ${TEST_TMP} | sed -e "s/ Portal:.*//" | sort -u | wc -l` -eq ${NUM_TARGETS} ] || failure
+success
+
+tid=2
+while [ ${tid} -le `expr ${NUM_TARGETS} + 1` ]; do
+    ${TGTADM} --op delete --force --mode target --tid ${tid}
+    tid=`expr ${tid} + 1`
+done
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Read cache tests"
+
+start_target
+create_lun
+
+echo -n "Test reading after a write through the read cache ... "
+./prog_read_cache -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
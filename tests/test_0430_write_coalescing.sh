@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Write coalescing tests"
+
+start_target
+create_lun
+
+echo -n "Test reading back small writes that were coalesced ... "
+./prog_write_coalescing -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "Auto split tests"
+
+start_target
+create_lun
+
+echo -n "Test read/write split into commands of 4 blocks ... "
+./prog_auto_split -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 || failure
+success
+
+shutdown_target
+delete_lun
+
+exit 0
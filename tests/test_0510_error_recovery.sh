@@ -0,0 +1,45 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "ErrorRecoveryLevel tests"
+
+start_target
+create_lun
+enable_data_digest
+
+echo -n "Test read/write with ErrorRecoveryLevel 1 offered ... "
+./prog_error_recovery -i ${IQNINITIATOR} iscsi://${TGTPORTAL}/${IQNTARGET}/1 || failure
+success
+
+# Drops every 7th Data-In, corrupts the data digest of every 6th and
+# drops every 5th SCSI Response. All of it has to come back by SNACK.
+SNACKPORT=3275
+./prog_snack_proxy --drop-data=7 --corrupt-data=6 --drop-status=5 \
+    --max-recv=8192 ${SNACKPORT} ${TGTPORTAL} &
+PROXYPID=$!
+sleep 1
+
+echo -n "Test recovering lost and corrupted PDUs through SNACK ... "
+./prog_error_recovery -i ${IQNINITIATOR} --snack \
+    "iscsi://127.0.0.1:${SNACKPORT}/${IQNTARGET}/1?data_digest=crc32c" || { kill ${PROXYPID}; failure; }
+success
+
+# Every status is lost, the gaps are found from the StatSN of the
+# following PDUs and of the NOP-In the proxy sends when idle.
+kill ${PROXYPID}
+./prog_snack_proxy --drop-status=1 ${SNACKPORT} ${TGTPORTAL} &
+PROXYPID=$!
+sleep 1
+
+echo -n "Test recovering every status through SNACK ... "
+./prog_error_recovery -i ${IQNINITIATOR} \
+    "iscsi://127.0.0.1:${SNACKPORT}/${IQNTARGET}/1" || { kill ${PROXYPID}; failure; }
+success
+
+kill ${PROXYPID}
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -0,0 +1,48 @@
+#!/bin/sh
+
+. ./functions.sh
+
+echo "TLS transport tests"
+
+if [ ! -x ./prog_tls_proxy ]; then
+    echo "Built without kernel TLS support, skipping"
+    exit 0
+fi
+if ! ./prog_tls_proxy --check-ktls; then
+    echo "Kernel TLS is not available, skipping"
+    exit 0
+fi
+if ! openssl version >/dev/null 2>&1; then
+    echo "openssl is needed to make a certificate, skipping"
+    exit 0
+fi
+
+TLSPORT=3270
+TLSDIR=`pwd`/tls.$$
+mkdir -p ${TLSDIR}
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 \
+    -keyout ${TLSDIR}/key.pem -out ${TLSDIR}/cert.pem \
+    -subj /CN=127.0.0.1 -addext subjectAltName=IP:127.0.0.1 \
+    >/dev/null 2>&1 || failure
+
+start_target
+create_lun
+
+./prog_tls_proxy -c ${TLSDIR}/cert.pem -k ${TLSDIR}/key.pem \
+    ${TLSPORT} ${TGTPORTAL} &
+PROXYPID=$!
+sleep 1
+
+echo -n "Test TLS 1.3 with session tickets and key updates ... "
+LIBISCSI_TLS_CA_FILE=${TLSDIR}/cert.pem \
+    ./prog_readwrite_iov -i ${IQNINITIATOR} \
+    "iscsi://127.0.0.1:${TLSPORT}/${IQNTARGET}/1?tls" || failure
+success
+
+kill ${PROXYPID}
+rm -rf ${TLSDIR}
+
+shutdown_target
+delete_lun
+
+exit 0
@@ -30,57 +30,6 @@
 
 const char *initiator = "iqn.2007-10.com.github:sahlberg:libiscsi:iscsi-discard";
 
-/* query unmap/write zero max blocks */
-static uint64_t inquiry_max_blocks(struct iscsi_context *iscsi, int lun, int zeroout)
-{
-	struct scsi_task *task;
-	int full_size;
-	struct scsi_inquiry_block_limits *inq;
-	uint64_t max_blocks = 0;
-
-	/* See how big this inquiry data is */
-	task = iscsi_inquiry_sync(iscsi, lun, 1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "Inquiry command failed : %s\n", iscsi_get_error(iscsi));
-		exit(EIO);
-	}
-
-	full_size = scsi_datain_getfullsize(task);
-	if (full_size > task->datain.size) {
-		scsi_free_scsi_task(task);
-
-		/* we need more data for the full list */
-		if ((task = iscsi_inquiry_sync(iscsi, lun, 1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, full_size)) == NULL) {
-			fprintf(stderr, "Inquiry command failed : %s\n", iscsi_get_error(iscsi));
-			exit(EIO);
-		}
-	}
-
-	inq = scsi_datain_unmarshall(task);
-	if (inq == NULL) {
-		fprintf(stderr, "failed to unmarshall inquiry datain blob\n");
-		exit(EIO);
-	}
-
-	if (zeroout) {
-		/* A MAXIMUM WRITE SAME LENGTH field set to zero indicates
-		   that the device server does not report a limit on the number
-		   of logical blocks that may be requested for a single
-		   WRITE SAME command */
-		max_blocks = inq->max_ws_len;
-		if (!max_blocks)
-			max_blocks = (uint64_t)-1ULL;
-	} else {
-		/* A MAXIMUM UNMAP LBA COUNT field set to 0000_0000h indicates
-		   that the device server does not implement the UNMAP command */
-		max_blocks = inq->max_unmap;
-	}
-
-	scsi_free_scsi_task(task);
-
-	return max_blocks;
-}
-
 void print_help(void)
 {
 	fprintf(stderr, "Usage: iscsi_readcapacity16 [OPTION...] <iscsi-url>\n");
@@ -120,7 +69,8 @@ int main(int argc, char *argv[])
 	int debug = 0, zeroout = 0;
 	int option_index, c;
 	unsigned int block_length;
-	uint64_t offset = 0, length = 0, capacity, lba, blocks, max_blocks;
+	uint64_t offset = 0, length = 0, capacity, lba, blocks, nlist, i;
+	struct unmap_list *list;
 	struct scsi_task *task;
 	struct scsi_readcapacity16 *rc16;
 	int ret = EINVAL;
@@ -231,46 +181,32 @@ int main(int argc, char *argv[])
 	/* free readcapacity16 task */
 	scsi_free_scsi_task(task);
 
-	max_blocks = inquiry_max_blocks(iscsi, iscsi_url->lun, zeroout);
-	if (!max_blocks) {
-		fprintf(stderr, "Operation not supported\n");
-		exit(EOPNOTSUPP);
-	}
-
 	lba = offset / block_length;
 	blocks = length / block_length;
-	for (uint64_t endlba = lba + blocks; lba < endlba; ) {
-		uint64_t towrite = MIN(max_blocks, endlba - lba);
-
-		if (zeroout) {
-			static void *zerobuf;
 
-			if (!zerobuf) {
-				zerobuf = calloc(block_length, 1);
-				assert(zerobuf);
-			}
-
-			task = iscsi_writesame16_sync(iscsi, iscsi_url->lun, lba, zerobuf,
-					block_length, towrite, 0, 0, 0, 0);
-			if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-				fprintf(stderr,"Failed to execute writesame16 command\n");
-				goto out;
-			}
-		} else {
-			struct unmap_list list;
-
-			list.lba = lba;
-			list.num = towrite;
-			task = iscsi_unmap_sync(iscsi, iscsi_url->lun, 0, 0, &list, 1);
-			if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-				fprintf(stderr,"Failed to execute unmap command\n");
-				goto out;
-			}
-		}
+	/* an UNMAP descriptor holds up to 2^32 - 1 blocks */
+	nlist = (blocks + 0xfffffffe) / 0xffffffff;
+	list = calloc(nlist ? nlist : 1, sizeof(*list));
+	if (list == NULL) {
+		fprintf(stderr, "Failed to allocate the range list\n");
+		goto out;
+	}
+	for (i = 0; i < nlist; i++) {
+		list[i].lba = lba;
+		list[i].num = MIN(blocks, 0xffffffff);
+		lba += list[i].num;
+		blocks -= list[i].num;
+	}
 
-		lba += towrite;
-		scsi_free_scsi_task(task);
+	if (nlist && iscsi_discard_sync(iscsi, iscsi_url->lun, list, nlist,
+					block_length,
+					zeroout ? ISCSI_DISCARD_WRITE_ZEROES : 0) != 0) {
+		fprintf(stderr, "Failed to %s : %s\n",
+			zeroout ? "zero-fill" : "discard", iscsi_get_error(iscsi));
+		free(list);
+		goto out;
 	}
+	free(list);
 
 	ret = 0;
 	goto out;
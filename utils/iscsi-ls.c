@@ -36,6 +36,7 @@ WSADATA wsaData;
 #endif
 
 #include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
@@ -55,6 +56,33 @@ struct client_state {
        int type;
        const char *username;
        const char *password;
+       struct iscsi_bulk_login *bulk;
+       struct target_portal *portals, **tail;
+       struct target_portal **sessions;	/* indexed by bulk login session */
+};
+
+/* a portal of a discovered target, logged in to and probed in parallel for -s */
+struct target_portal {
+	struct target_portal *next;
+	char *target;
+	char *portal;
+	int session;	/* in the bulk login, -1 if skipped */
+	int done;
+	int pending;	/* luns still being probed */
+	int report_size;
+	int num_luns;
+	struct lun_probe *luns;
+	char error[256];	/* printed in place of the luns */
+};
+
+/* what show_lun() prints, filled in by the async probe of one lun */
+struct lun_probe {
+	struct target_portal *tp;
+	int lun;
+	int type;
+	int no_media;
+	long long size;
+	int size_pf;
 };
 
 
@@ -82,105 +110,181 @@ void event_loop(struct iscsi_context *iscsi, struct client_state *state)
 	}
 }
 
-void show_lun(struct iscsi_context *iscsi, int lun)
+void lun_probe_done(struct lun_probe *probe)
 {
-	struct scsi_task *task;
-	struct scsi_inquiry_standard *inq;
-	int type, no_media;
-	long long size = 0;
-	int size_pf = 0;
-	static const char sf[] = {' ', 'k', 'M', 'G', 'T' };
+	struct target_portal *tp = probe->tp;
 
-	/* check we can talk to the lun */
-tur_try_again:
-	if ((task = iscsi_testunitready_sync(iscsi, lun)) == NULL) {
-		fprintf(stderr, "testunitready failed\n");
-		exit(10);
+	if (--tp->pending == 0) {
+		tp->done = 1;
 	}
-	if (task->status == SCSI_STATUS_CHECK_CONDITION) {
-		if (task->sense.key == SCSI_SENSE_UNIT_ATTENTION && task->sense.ascq == SCSI_SENSE_ASCQ_BUS_RESET) {
-			scsi_free_scsi_task(task);
-			goto tur_try_again;
-		}
+}
+
+void portal_failed(struct target_portal *tp)
+{
+	tp->done = 1;
+}
+
+void readcapacity10_cb(struct iscsi_context *iscsi, int status,
+		       void *command_data, void *private_data)
+{
+	struct lun_probe *probe = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_readcapacity10 *rc10;
+
+	if (probe->tp->done) {
+		scsi_free_scsi_task(task);
+		return;
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to send readcapacity command\n");
+		scsi_free_scsi_task(task);
+		portal_failed(probe->tp);
+		return;
 	}
 
-	no_media = 0;
-	if (task->status     == SCSI_STATUS_CHECK_CONDITION
-	&&  task->sense.key  == SCSI_SENSE_NOT_READY
-	&&  task->sense.ascq == SCSI_SENSE_ASCQ_MEDIUM_NOT_PRESENT) {
-	    	/* not an error, just a cdrom without a disk most likely */
-		no_media = 1;
-	} else if (task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "TESTUNITREADY failed with %s\n", iscsi_get_error(iscsi));
-		exit(10);
+	rc10 = scsi_datain_unmarshall(task);
+	if (rc10 == NULL) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to unmarshall readcapacity10 data\n");
+		scsi_free_scsi_task(task);
+		portal_failed(probe->tp);
+		return;
 	}
-	scsi_free_scsi_task(task);
 
+	probe->size  = rc10->block_size;
+	probe->size *= rc10->lba;
 
+	for (probe->size_pf=0; probe->size_pf<4 && probe->size > 1024; probe->size_pf++) {
+		probe->size /= 1024;
+	}
 
-	/* check what type of lun we have */
-	task = iscsi_inquiry_sync(iscsi, lun, 0, 0, 64);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-		fprintf(stderr, "failed to send inquiry command : %s\n", iscsi_get_error(iscsi));
-		exit(10);
+	scsi_free_scsi_task(task);
+	lun_probe_done(probe);
+}
+
+void inquiry_cb(struct iscsi_context *iscsi, int status,
+		void *command_data, void *private_data)
+{
+	struct lun_probe *probe = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_inquiry_standard *inq;
+
+	if (probe->tp->done) {
+		scsi_free_scsi_task(task);
+		return;
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to send inquiry command : %s\n",
+			 iscsi_get_error(iscsi));
+		scsi_free_scsi_task(task);
+		portal_failed(probe->tp);
+		return;
 	}
 	inq = scsi_datain_unmarshall(task);
 	if (inq == NULL) {
-		fprintf(stderr, "failed to unmarshall inquiry datain blob\n");
-		exit(10);
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to unmarshall inquiry datain blob\n");
+		scsi_free_scsi_task(task);
+		portal_failed(probe->tp);
+		return;
 	}
-	type = inq->device_type;
+	probe->type = inq->device_type;
 	scsi_free_scsi_task(task);
 
+	if (probe->type != SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
+		lun_probe_done(probe);
+		return;
+	}
+	if (iscsi_readcapacity10_task(iscsi, probe->lun, 0, 0,
+				      readcapacity10_cb, probe) == NULL) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to send readcapacity command\n");
+		portal_failed(probe->tp);
+	}
+}
 
+void testunitready_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct lun_probe *probe = private_data;
+	struct scsi_task *task = command_data;
 
-	if (type == SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
-		struct scsi_readcapacity10 *rc10;
-
-		task = iscsi_readcapacity10_sync(iscsi, lun, 0, 0);
-		if (task == NULL || task->status != SCSI_STATUS_GOOD) {
-			fprintf(stderr, "failed to send readcapacity command\n");
-			exit(10);
-		}
-
-		rc10 = scsi_datain_unmarshall(task);
-		if (rc10 == NULL) {
-			fprintf(stderr, "failed to unmarshall readcapacity10 data\n");
-			exit(10);
-		}
-
-		size  = rc10->block_size;
-		size *= rc10->lba;
-
-		for (size_pf=0; size_pf<4 && size > 1024; size_pf++) {
-			size /= 1024;
+	if (probe->tp->done) {
+		scsi_free_scsi_task(task);
+		return;
+	}
+	if (status == SCSI_STATUS_CHECK_CONDITION
+	&&  task->sense.key  == SCSI_SENSE_UNIT_ATTENTION
+	&&  task->sense.ascq == SCSI_SENSE_ASCQ_BUS_RESET) {
+		scsi_free_scsi_task(task);
+		if (iscsi_testunitready_task(iscsi, probe->lun,
+					     testunitready_cb, probe) == NULL) {
+			snprintf(probe->tp->error, sizeof(probe->tp->error),
+				 "testunitready failed\n");
+			portal_failed(probe->tp);
 		}
+		return;
+	}
 
+	if (status == SCSI_STATUS_CHECK_CONDITION
+	&&  task->sense.key  == SCSI_SENSE_NOT_READY
+	&&  task->sense.ascq == SCSI_SENSE_ASCQ_MEDIUM_NOT_PRESENT) {
+		/* not an error, just a cdrom without a disk most likely */
+		probe->no_media = 1;
+	} else if (status != SCSI_STATUS_GOOD) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "TESTUNITREADY failed with %s\n",
+			 iscsi_get_error(iscsi));
 		scsi_free_scsi_task(task);
+		portal_failed(probe->tp);
+		return;
 	}
+	scsi_free_scsi_task(task);
+
+	/* check what type of lun we have */
+	if (iscsi_inquiry_task(iscsi, probe->lun, 0, 0, 64,
+			       inquiry_cb, probe) == NULL) {
+		snprintf(probe->tp->error, sizeof(probe->tp->error),
+			 "failed to send inquiry command : %s\n",
+			 iscsi_get_error(iscsi));
+		portal_failed(probe->tp);
+	}
+}
 
+void show_lun(struct lun_probe *probe)
+{
+	static const char sf[] = {' ', 'k', 'M', 'G', 'T' };
 
-	printf("Lun:%-4d Type:%s", lun, scsi_devtype_to_str(type));
-	if (type == SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
-		printf(" (Size:%lld%c)", size, sf[size_pf]);
+	printf("Lun:%-4d Type:%s", probe->lun, scsi_devtype_to_str(probe->type));
+	if (probe->type == SCSI_INQUIRY_PERIPHERAL_DEVICE_TYPE_DIRECT_ACCESS) {
+		printf(" (Size:%lld%c)", probe->size, sf[probe->size_pf]);
 	}
-	if (no_media) {
+	if (probe->no_media) {
 		printf(" (No media loaded)");
 	}
 	printf("\n");
 }
 
-void list_luns(struct client_state *clnt, const char *target, const char *portal,
-               enum iscsi_chap_auth auth)
+void add_target_portal(struct client_state *clnt, const char *target,
+		       const char *portal, enum iscsi_chap_auth auth)
 {
 	struct iscsi_context *iscsi;
-	struct scsi_task *task;
-	struct scsi_reportluns_list *list;
-	int full_report_size;
-	int i;
+	struct target_portal *tp;
+
+	tp = calloc(1, sizeof(*tp));
+	if (tp == NULL) {
+		fprintf(stderr, "Failed to allocate target portal\n");
+		exit(10);
+	}
+	tp->target = strdup(target);
+	tp->portal = strdup(portal);
+	tp->session = -1;
+	*clnt->tail = tp;
+	clnt->tail = &tp->next;
 
 	if (strncasecmp(portal, "[fe80:", 6) == 0) {
-		fprintf(stderr, "skipping link-local address\n");
 		return;
 	}
 
@@ -199,41 +303,233 @@ void list_luns(struct client_state *clnt, const char *target, const char *portal
 	iscsi_set_session_type(iscsi, ISCSI_SESSION_NORMAL);
 	iscsi_set_header_digest(iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
 
-	if (iscsi_full_connect_sync(iscsi, portal, -1) != 0) {
-		printf("list_luns: iscsi_connect failed. %s\n",
-                       iscsi_get_error(iscsi));
+	tp->session = iscsi_bulk_login_add_context(clnt->bulk, iscsi, portal, -1);
+	if (tp->session < 0) {
+		fprintf(stderr, "Failed to add session : %s\n",
+			iscsi_get_error(iscsi));
 		exit(10);
 	}
+}
 
-	/* get initial reportluns data, all targets can report 16 bytes but some
-	 * fail if we ask for too much.
-	 */
-	if ((task = iscsi_reportluns_sync(iscsi, 0, 16)) == NULL) {
-		fprintf(stderr, "reportluns failed : %s\n", iscsi_get_error(iscsi));
-		exit(10);
+void reportluns_cb(struct iscsi_context *iscsi, int status,
+		   void *command_data, void *private_data)
+{
+	struct target_portal *tp = private_data;
+	struct scsi_task *task = command_data;
+	struct scsi_reportluns_list *list;
+	int full_report_size;
+	int i;
+
+	if (tp->done) {
+		scsi_free_scsi_task(task);
+		return;
+	}
+	if (status != SCSI_STATUS_GOOD) {
+		snprintf(tp->error, sizeof(tp->error),
+			 "reportluns failed : %s\n", iscsi_get_error(iscsi));
+		scsi_free_scsi_task(task);
+		portal_failed(tp);
+		return;
 	}
+
 	full_report_size = scsi_datain_getfullsize(task);
-	if (full_report_size > task->datain.size) {
+	if (full_report_size > task->datain.size &&
+	    full_report_size > tp->report_size) {
 		scsi_free_scsi_task(task);
 
 		/* we need more data for the full list */
-		if ((task = iscsi_reportluns_sync(iscsi, 0, full_report_size)) == NULL) {
-			fprintf(stderr, "reportluns failed : %s\n", iscsi_get_error(iscsi));
-			exit(10);
+		tp->report_size = full_report_size;
+		if (iscsi_reportluns_task(iscsi, 0, full_report_size,
+					  reportluns_cb, tp) == NULL) {
+			snprintf(tp->error, sizeof(tp->error),
+				 "reportluns failed : %s\n",
+				 iscsi_get_error(iscsi));
+			portal_failed(tp);
 		}
+		return;
 	}
 
 	list = scsi_datain_unmarshall(task);
 	if (list == NULL) {
-		fprintf(stderr, "failed to unmarshall reportluns datain blob\n");
+		snprintf(tp->error, sizeof(tp->error),
+			 "failed to unmarshall reportluns datain blob\n");
+		scsi_free_scsi_task(task);
+		portal_failed(tp);
+		return;
+	}
+
+	tp->num_luns = list->num;
+	tp->luns = calloc(tp->num_luns + 1, sizeof(*tp->luns));
+	if (tp->luns == NULL) {
+		fprintf(stderr, "Failed to allocate luns\n");
 		exit(10);
 	}
-	for (i=0; i < (int)list->num; i++) {
-		show_lun(iscsi, list->luns[i]);
+	for (i=0; i < tp->num_luns; i++) {
+		tp->luns[i].tp  = tp;
+		tp->luns[i].lun = list->luns[i];
 	}
-
 	scsi_free_scsi_task(task);
-	iscsi_destroy_context(iscsi);
+
+	/* probe all the luns of the session at once */
+	tp->pending = tp->num_luns;
+	if (tp->pending == 0) {
+		tp->done = 1;
+	}
+	for (i=0; i < tp->num_luns && !tp->done; i++) {
+		if (iscsi_testunitready_task(iscsi, tp->luns[i].lun,
+					     testunitready_cb,
+					     &tp->luns[i]) == NULL) {
+			snprintf(tp->error, sizeof(tp->error),
+				 "testunitready failed\n");
+			portal_failed(tp);
+		}
+	}
+}
+
+void bulk_login_cb(struct iscsi_bulk_login *bulk, int n, int status,
+		   void *private_data)
+{
+	struct client_state *clnt = private_data;
+	struct target_portal *tp = clnt->sessions[n];
+	struct iscsi_context *iscsi;
+
+	if (tp->done) {
+		return;
+	}
+
+	iscsi = iscsi_bulk_login_get_context(bulk, n);
+	if (status != SCSI_STATUS_GOOD) {
+		snprintf(tp->error, sizeof(tp->error),
+			 "list_luns: iscsi_connect failed. %s\n",
+			 iscsi_get_error(iscsi));
+		portal_failed(tp);
+		return;
+	}
+
+	/* get initial reportluns data, all targets can report 16 bytes but some
+	 * fail if we ask for too much.
+	 */
+	tp->report_size = 16;
+	if (iscsi_reportluns_task(iscsi, 0, 16, reportluns_cb, tp) == NULL) {
+		snprintf(tp->error, sizeof(tp->error),
+			 "reportluns failed : %s\n", iscsi_get_error(iscsi));
+		portal_failed(tp);
+	}
+}
+
+void list_all_luns(struct client_state *clnt)
+{
+	struct target_portal *tp;
+	struct pollfd *pfd;
+	int *idx;
+	int count, i, n, active, timeout;
+
+	count = iscsi_bulk_login_get_count(clnt->bulk);
+	clnt->sessions = calloc(count + 1, sizeof(*clnt->sessions));
+	pfd = calloc(count + 1, sizeof(*pfd));
+	idx = calloc(count + 1, sizeof(*idx));
+	if (clnt->sessions == NULL || pfd == NULL || idx == NULL) {
+		fprintf(stderr, "Failed to allocate sessions\n");
+		exit(10);
+	}
+	for (tp = clnt->portals; tp; tp = tp->next) {
+		if (tp->session < 0) {
+			tp->done = 1;
+			continue;
+		}
+		clnt->sessions[tp->session] = tp;
+	}
+
+	/*
+	 * Log in to all of them at once and probe each session as soon as it
+	 * has logged in, all from this one loop. They are listed in order
+	 * once every session is done.
+	 */
+	iscsi_bulk_login_async(clnt->bulk, bulk_login_cb, clnt);
+
+	for (;;) {
+		timeout = -1;
+		if (iscsi_bulk_login_remaining(clnt->bulk) > 0) {
+			timeout = iscsi_bulk_login_service(clnt->bulk);
+		}
+
+		n = 0;
+		active = 0;
+		for (i = 0; i < count; i++) {
+			struct iscsi_context *iscsi;
+
+			tp = clnt->sessions[i];
+			if (tp->done) {
+				continue;
+			}
+			active++;
+			iscsi = iscsi_bulk_login_get_context(clnt->bulk, i);
+			pfd[n].fd = iscsi_get_fd(iscsi);
+			pfd[n].events = iscsi_which_events(iscsi);
+			pfd[n].revents = 0;
+			idx[n++] = i;
+
+			/* not started yet, or waiting to reconnect */
+			if (pfd[n - 1].fd < 0 || pfd[n - 1].events == 0) {
+				pfd[n - 1].fd = -1;
+				if (timeout < 0 || timeout > 100) {
+					timeout = 100;
+				}
+			}
+		}
+		if (active == 0) {
+			break;
+		}
+		/* let the contexts check for timed out logins and commands */
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Poll failed");
+			exit(10);
+		}
+
+		for (i = 0; i < n; i++) {
+			struct iscsi_context *iscsi;
+
+			tp = clnt->sessions[idx[i]];
+			iscsi = iscsi_bulk_login_get_context(clnt->bulk, idx[i]);
+			if (iscsi_service(iscsi, pfd[i].revents) < 0 &&
+			    !tp->done) {
+				snprintf(tp->error, sizeof(tp->error),
+					 "iscsi_service failed with : %s\n",
+					 iscsi_get_error(iscsi));
+				portal_failed(tp);
+			}
+		}
+	}
+	free(pfd);
+	free(idx);
+
+	while ((tp = clnt->portals) != NULL) {
+		printf("Target:%s Portal:%s\n", tp->target, tp->portal);
+		if (tp->session < 0) {
+			fprintf(stderr, "skipping link-local address\n");
+		} else if (tp->error[0] != '\0') {
+			fprintf(stderr, "%s", tp->error);
+			exit(10);
+		}
+		for (i = 0; i < tp->num_luns; i++) {
+			show_lun(&tp->luns[i]);
+		}
+
+		clnt->portals = tp->next;
+		free(tp->luns);
+		free(tp->target);
+		free(tp->portal);
+		free(tp);
+	}
+	free(clnt->sessions);
+	clnt->sessions = NULL;
 }
 
 
@@ -256,20 +552,18 @@ void discoverylogout_cb(struct iscsi_context *iscsi, int status, void *command_d
 	state->finished = 1;
 }
 
-void discovery_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+void show_targets(struct iscsi_context *iscsi, struct client_state *clnt,
+		  struct iscsi_discovery_address *targets)
 {
 	struct iscsi_discovery_address *addr;
 
-	if (status != 0) {
-		fprintf(stderr, "Failed to do discovery on target. : %s\n", iscsi_get_error(iscsi));
-		exit(10);
-	}
-
-	for(addr=command_data; addr; addr=addr->next) {
+	for(addr=targets; addr; addr=addr->next) {
 		struct iscsi_target_portal *portal = addr->portals;
 
 		while (portal != NULL) {
-			if (useurls == 1 && showluns == 0) {
+			if (showluns != 0) {
+				add_target_portal(clnt, addr->target_name, portal->portal, iscsi_get_auth(iscsi));
+			} else if (useurls == 1) {
 				char *str = strrchr(portal->portal, ',');
 				if (str != NULL) {
 					str[0] = 0;
@@ -278,12 +572,19 @@ void discovery_cb(struct iscsi_context *iscsi, int status, void *command_data, v
 			} else {
 				printf("Target:%s Portal:%s\n", addr->target_name, portal->portal);
 			}
-			if (showluns != 0) {
-				list_luns(private_data, addr->target_name, portal->portal, iscsi_get_auth(iscsi));
-			}
 			portal = portal->next;
 		}
 	}
+}
+
+void discovery_cb(struct iscsi_context *iscsi, int status, void *command_data, void *private_data)
+{
+	if (status != 0) {
+		fprintf(stderr, "Failed to do discovery on target. : %s\n", iscsi_get_error(iscsi));
+		exit(10);
+	}
+
+	show_targets(iscsi, private_data, command_data);
 
 	if (iscsi_logout_async(iscsi, discoverylogout_cb, private_data) != 0) {
 		fprintf(stderr, "iscsi_logout_async failed : %s\n", iscsi_get_error(iscsi));
@@ -322,7 +623,8 @@ void print_usage(void)
 {
 	fprintf(stderr, "Usage: iscsi-ls [-?|--help] [-d|--debug] "
                 "[--usage] [-i|--initiator-name=iqn-name]\n"
-                "\t\t[-s|--show-luns] <iscsi-portal-url>\n");
+                "\t\t[-s|--show-luns] [-c|--discovery-cache=file]\n"
+                "\t\t[-t|--cache-ttl=seconds] <iscsi-portal-url>\n");
 }
 
 void print_help(void)
@@ -333,6 +635,8 @@ void print_help(void)
 	fprintf(stderr, "  -s, --show-luns                   Show the luns for each target\n");
 	fprintf(stderr, "  -U, --url                         Output targets in URL format\n");
 	fprintf(stderr, "                                    (does not work with -s)\n");
+	fprintf(stderr, "  -c, --discovery-cache=file        Reuse recent discoveries kept in file\n");
+	fprintf(stderr, "  -t, --cache-ttl=seconds           How long they are used, default 300\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Help options:\n");
 	fprintf(stderr, "  -?, --help                        Show this help message\n");
@@ -351,7 +655,10 @@ int main(int argc, char *argv[])
 	struct iscsi_context *iscsi;
 	struct iscsi_url *iscsi_url = NULL;
 	struct client_state state;
+	struct iscsi_discovery_address *cached = NULL;
 	char *url = NULL;
+	const char *cache = NULL;
+	int cache_ttl = 300;
 	int c;
 	int option_index;
 	static int show_help = 0, show_usage = 0, debug = 0;
@@ -370,10 +677,12 @@ int main(int argc, char *argv[])
 		{"initiator-name", required_argument,    NULL,        'i'},
 		{"show-luns",      no_argument,          NULL,        's'},
 		{"url",            no_argument,          NULL,        'U'},
+		{"discovery-cache", required_argument,   NULL,        'c'},
+		{"cache-ttl",      required_argument,    NULL,        't'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "h?udi:sU", long_options,
+	while ((c = getopt_long(argc, argv, "h?udi:sUc:t:", long_options,
 				&option_index)) != -1) {
 		switch (c) {
 		case 'h':
@@ -395,6 +704,12 @@ int main(int argc, char *argv[])
 		case 'U':
 			useurls = 1;
 			break;
+		case 'c':
+			cache = optarg;
+			break;
+		case 't':
+			cache_ttl = atoi(optarg);
+			break;
 		default:
 			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
 			print_help();
@@ -449,14 +764,35 @@ int main(int argc, char *argv[])
 
 	state.username = iscsi_url->user;
 	state.password = iscsi_url->passwd;
-
-	if (iscsi_connect_async(iscsi, iscsi_url->portal, discoveryconnect_cb, &state) != 0) {
-		fprintf(stderr, "connect_async: iscsi_connect failed. %s\n",
-                        iscsi_get_error(iscsi));
+	state.tail = &state.portals;
+	state.bulk = iscsi_bulk_login_create(initiator, NULL, 0);
+	if (state.bulk == NULL) {
+		fprintf(stderr, "Failed to create bulk login\n");
 		exit(10);
 	}
 
-	event_loop(iscsi, &state);
+	if (cache != NULL) {
+		iscsi_set_discovery_cache(iscsi, cache, cache_ttl);
+		cached = iscsi_discovery_cache_lookup(iscsi, iscsi_url->portal);
+	}
+
+	if (cached != NULL) {
+		show_targets(iscsi, &state, cached);
+		iscsi_free_discovery_data(iscsi, cached);
+	} else {
+		if (iscsi_connect_async(iscsi, iscsi_url->portal, discoveryconnect_cb, &state) != 0) {
+			fprintf(stderr, "connect_async: iscsi_connect failed. %s\n",
+				iscsi_get_error(iscsi));
+			exit(10);
+		}
+
+		event_loop(iscsi, &state);
+	}
+
+	if (showluns != 0) {
+		list_all_luns(&state);
+	}
+	iscsi_bulk_login_destroy(state.bulk);
 
 	iscsi_destroy_url(iscsi_url);
 	iscsi_destroy_context(iscsi);
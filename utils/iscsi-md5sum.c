@@ -360,6 +360,10 @@ static void print_help(const char *prog)
 			"If the specified value extends past the end of the device, "
 			"%s will stop at the device size boundary. "
 			"The default value extends to the end of the device.\n", prog);
+	fprintf(stderr, "  -s, --sparse                      "
+			"Do not read blocks that GET LBA STATUS reports as "
+			"deallocated or anchored, they read as zeros on LUNs "
+			"with LBPRZ set.\n");
 	fprintf(stderr, "  -d, --debug=integer               debug level (0=disabled)\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Help options:\n");
@@ -393,39 +397,16 @@ void inquiry_block_limits(struct scsi_inquiry_block_limits *inq)
 
 static unsigned long inquiry_xfer_len(struct iscsi_context *iscsi, int lun, unsigned int block_length)
 {
-	struct scsi_task *task;
-	int full_size;
-	struct scsi_inquiry_block_limits *inq;
+	struct scsi_inquiry_block_limits inq;
 	unsigned long max_xfer_len = 1024 * 1024;	/* default size 1M */
 
-	/* See how big this inquiry data is */
-	task = iscsi_inquiry_sync(iscsi, lun, 1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, 64);
-	if (task == NULL || task->status != SCSI_STATUS_GOOD) {
+	if (iscsi_get_block_limits_sync(iscsi, lun, &inq) != 0) {
 		fprintf(stderr, "Inquiry command failed : %s\n", iscsi_get_error(iscsi));
 		exit(EIO);
 	}
 
-	full_size = scsi_datain_getfullsize(task);
-	if (full_size > task->datain.size) {
-		scsi_free_scsi_task(task);
-
-		/* we need more data for the full list */
-		if ((task = iscsi_inquiry_sync(iscsi, lun, 1, SCSI_INQUIRY_PAGECODE_BLOCK_LIMITS, full_size)) == NULL) {
-			fprintf(stderr, "Inquiry command failed : %s\n", iscsi_get_error(iscsi));
-			exit(EIO);
-		}
-	}
-
-	inq = scsi_datain_unmarshall(task);
-	if (inq == NULL) {
-		fprintf(stderr, "failed to unmarshall inquiry datain blob\n");
-		exit(EIO);
-	}
-
-	if (inq->max_xfer_len)
-		max_xfer_len = MIN(max_xfer_len, inq->max_xfer_len * block_length);
-
-	scsi_free_scsi_task(task);
+	if (inq.max_xfer_len)
+		max_xfer_len = MIN(max_xfer_len, inq.max_xfer_len * block_length);
 
 	return max_xfer_len;
 }
@@ -444,12 +425,50 @@ static void pread16(struct iscsi_context *iscsi, int lun, void *buf, uint64_t lb
 	scsi_free_scsi_task(task);
 }
 
+/* Hash [offset, offset + length) reading only the mapped extents. */
+static void md5_sparse(struct iscsi_context *iscsi, int lun, unsigned char *buf,
+		       long long offset, long long length, long long max_xfer_len,
+		       unsigned int block_size, struct libiscsi_md5_ctx *ctx)
+{
+	struct iscsi_extent_iter *iter;
+	struct iscsi_lba_extent ext;
+	int ret;
+
+	iter = iscsi_extent_iter_open(iscsi, lun, offset / block_size,
+				      length / block_size);
+	if (iter == NULL) {
+		fprintf(stderr, "Failed to start GET LBA STATUS : %s\n", iscsi_get_error(iscsi));
+		exit(EIO);
+	}
+
+	while ((ret = iscsi_extent_iter_next_sync(iter, &ext)) == 1) {
+		long long pos = ext.lba * block_size;
+		long long end = pos + ext.num_blocks * block_size;
+		int mapped = ext.provisioning == SCSI_PROVISIONING_TYPE_MAPPED;
+
+		if (!mapped)
+			memset(buf, 0, max_xfer_len);
+		for (; pos < end; pos += max_xfer_len) {
+			long long _len = MIN(end - pos, max_xfer_len);
+
+			if (mapped)
+				pread16(iscsi, lun, buf, pos / block_size, _len, block_size);
+			libiscsi_md5_process_bytes(buf, _len, ctx);
+		}
+	}
+	if (ret < 0) {
+		fprintf(stderr, "GET LBA STATUS failed : %s\n", iscsi_get_error(iscsi));
+		exit(EIO);
+	}
+	iscsi_extent_iter_close(iter);
+}
+
 int main(int argc, char *argv[])
 {
 	struct iscsi_context *iscsi;
 	char *url = NULL;
 	struct iscsi_url *iscsi_url = NULL;
-	int debug = 0;
+	int debug = 0, sparse = 0;
 	int option_index, c;
 	unsigned int block_length;
 	long long offset = 0, length = 0, capacity, max_xfer_len, end;
@@ -463,13 +482,14 @@ int main(int argc, char *argv[])
 	static struct option long_options[] = {
 		{"offset",         required_argument,    NULL,        'o'},
 		{"length",         required_argument,    NULL,        'l'},
+		{"sparse",         no_argument,          NULL,        's'},
 		{"debug",          required_argument,    NULL,        'd'},
 		{"help",           no_argument,          NULL,        'h'},
 		{"initiator-name", required_argument,    NULL,        'i'},
 		{0, 0, 0, 0}
 	};
 
-	while ((c = getopt_long(argc, argv, "o:l:d:i:h?", long_options,
+	while ((c = getopt_long(argc, argv, "o:l:sd:i:h?", long_options,
 					&option_index)) != -1) {
 		switch (c) {
 			case 'o':
@@ -478,6 +498,9 @@ int main(int argc, char *argv[])
 			case 'l':
 				length = strtoll(optarg, NULL, 0);
 				break;
+			case 's':
+				sparse = 1;
+				break;
 			case 'd':
 				debug = strtol(optarg, NULL, 0);
 				break;
@@ -559,13 +582,27 @@ int main(int argc, char *argv[])
 		length = block_length * (rc16->returned_lba + 1) - offset;
 	}
 
+	if (sparse && !rc16->lbprz) {
+		fprintf(stderr, "LUN does not read unmapped blocks as zeros, "
+			"reading all of it\n");
+		sparse = 0;
+	}
+
 	/* free readcapacity16 task */
 	scsi_free_scsi_task(task);
 
 	libiscsi_md5_init_ctx(&ctx);
 	max_xfer_len = inquiry_xfer_len(iscsi, iscsi_url->lun, block_length);
 	buf = calloc(1, max_xfer_len);
-	for (end = offset + length; offset < end; offset += max_xfer_len) {
+	end = offset + length;
+	if (sparse) {
+		long long blocks = length - length % block_length;
+
+		md5_sparse(iscsi, iscsi_url->lun, buf, offset, blocks,
+			   max_xfer_len, block_length, &ctx);
+		offset += blocks;
+	}
+	for (; offset < end; offset += max_xfer_len) {
 		long long _len = MIN(end - offset, max_xfer_len);
 		pread16(iscsi, iscsi_url->lun, buf, offset / block_length, _len, block_length);
 		libiscsi_md5_process_bytes(buf, _len, &ctx);
@@ -0,0 +1,754 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Replay the commands of a file written by iscsi_set_command_record()
+ * against a LUN and compare the latencies with the recorded ones.
+ *
+ * Every command is sent with the CDB it was recorded with, at the same
+ * offset from the start as it was originally submitted unless asked to
+ * go as fast as the queue depth allows. Commands that may change the
+ * medium are skipped unless --writes is given, in which case they send
+ * zeroes.
+ */
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <poll.h>
+#include <getopt.h>
+#include <time.h>
+#include <signal.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+#ifndef HAVE_CLOCK_GETTIME
+#include <sys/time.h>
+#endif
+
+/* how late a command may be issued before it counts as behind schedule */
+#define LATE_US 1000
+
+const char *initiator = "iqn.2010-11.libiscsi:iscsi-replay";
+int finished = 0;
+
+enum replay_class {
+	CLASS_READ = 0,
+	CLASS_WRITE,
+	CLASS_OTHER,
+	CLASS_MAX
+};
+
+static const char *class_name[CLASS_MAX] = { "read", "write", "other" };
+
+struct replay_cmd {
+	struct iscsi_command_record r;
+	uint32_t seq;		/* position in the file */
+	int done;
+	uint32_t status;
+	uint32_t latency;	/* replayed, in microseconds */
+	uint64_t issue_us;
+	struct replay *replay;
+};
+
+struct replay {
+	struct iscsi_context *iscsi;
+	int lun;
+	int queue_depth;
+	int fast;
+	double speed;
+	int writes;
+
+	struct replay_cmd *cmds;
+	uint32_t count;
+	uint32_t next;
+	int in_flight;
+
+	struct scsi_iovec sink_iov;
+	unsigned char *zeroes;
+
+	uint64_t first_us;
+	uint64_t last_us;
+	uint32_t skipped;
+	uint32_t late;
+	uint64_t max_lag;
+	uint32_t changed;
+	int err_cnt;
+};
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-replay [-?] [-?|--help] [--usage] [-i|--initiator-name=iqn-name] [-q|--queue-depth=N] [-f|--fast] [-s|--speed=factor] [-w|--writes] [-d|--dump] <record-file> [<iscsi-url>]\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: iscsi-replay [OPTION...] <record-file> [<iscsi-url>]\n");
+	fprintf(stderr, "  -i, --initiator-name=iqn-name     Initiatorname to use\n");
+	fprintf(stderr, "  -q, --queue-depth=N               Commands in flight at most (32)\n");
+	fprintf(stderr, "  -f, --fast                        Do not wait for the recorded submit times\n");
+	fprintf(stderr, "  -s, --speed=factor                Run the recorded timing this many times faster\n");
+	fprintf(stderr, "  -w, --writes                      Also replay commands that modify the LUN\n");
+	fprintf(stderr, "  -d, --dump                        Print the records instead\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        Show this help message\n");
+	fprintf(stderr, "      --usage                       Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Record files are written by iscsi_set_command_record() or by setting\n");
+	fprintf(stderr, "LIBISCSI_RECORD=<file> for an application. Without a URL only the\n");
+	fprintf(stderr, "recorded latencies are reported.\n");
+	fprintf(stderr, "iSCSI URL format : %s\n", ISCSI_URL_SYNTAX);
+}
+
+uint64_t get_clock_us(void) {
+	int res;
+	uint64_t us;
+
+#ifdef HAVE_CLOCK_GETTIME
+	struct timespec ts;
+	res = clock_gettime (CLOCK_MONOTONIC, &ts);
+	us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	res = gettimeofday(&tv, NULL);
+	us = tv.tv_sec * 1000000ULL + tv.tv_usec;
+#endif
+	if (res == -1) {
+		fprintf(stderr,"could not get requested clock\n");
+		exit(10);
+	}
+	return us;
+}
+
+void sig_handler(int signum)
+{
+	finished++;
+}
+
+static enum replay_class record_class(const struct iscsi_command_record *r)
+{
+	switch (r->xfer_dir) {
+	case SCSI_XFER_READ:
+		return CLASS_READ;
+	case SCSI_XFER_WRITE:
+		return CLASS_WRITE;
+	}
+	return CLASS_OTHER;
+}
+
+/*
+ * Commands that only read from the LUN. Everything with data-in is taken
+ * to be one, and those without data from a short list.
+ */
+static int record_is_safe(const struct iscsi_command_record *r)
+{
+	if (r->xfer_dir == SCSI_XFER_READ) {
+		return 1;
+	}
+	if (r->xfer_dir != SCSI_XFER_NONE) {
+		return 0;
+	}
+	switch (r->opcode) {
+	case SCSI_OPCODE_TESTUNITREADY:
+	case SCSI_OPCODE_SYNCHRONIZECACHE10:
+	case SCSI_OPCODE_SYNCHRONIZECACHE16:
+	case SCSI_OPCODE_PREFETCH10:
+	case SCSI_OPCODE_PREFETCH16:
+	case SCSI_OPCODE_VERIFY10:
+	case SCSI_OPCODE_VERIFY12:
+	case SCSI_OPCODE_VERIFY16:
+		return 1;
+	}
+	return 0;
+}
+
+static const char *status_name(uint32_t status)
+{
+	switch (status) {
+	case SCSI_STATUS_GOOD: return "GOOD";
+	case SCSI_STATUS_CHECK_CONDITION: return "CHECK_CONDITION";
+	case SCSI_STATUS_CONDITION_MET: return "CONDITION_MET";
+	case SCSI_STATUS_BUSY: return "BUSY";
+	case SCSI_STATUS_RESERVATION_CONFLICT: return "RESERVATION_CONFLICT";
+	case SCSI_STATUS_TASK_SET_FULL: return "TASK_SET_FULL";
+	case SCSI_STATUS_ACA_ACTIVE: return "ACA_ACTIVE";
+	case SCSI_STATUS_TASK_ABORTED: return "TASK_ABORTED";
+	case SCSI_STATUS_REDIRECT: return "REDIRECT";
+	case SCSI_STATUS_CANCELLED: return "CANCELLED";
+	case SCSI_STATUS_ERROR: return "ERROR";
+	case SCSI_STATUS_TIMEOUT: return "TIMEOUT";
+	}
+	return "UNKNOWN";
+}
+
+static int cmp_cmd(const void *a, const void *b)
+{
+	const struct replay_cmd *ca = a, *cb = b;
+
+	if (ca->r.submit != cb->r.submit) {
+		return ca->r.submit < cb->r.submit ? -1 : 1;
+	}
+	return ca->seq < cb->seq ? -1 : ca->seq > cb->seq;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t ua = *(const uint32_t *)a, ub = *(const uint32_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Read the whole file, sorted by submit time rather than in the order the
+ * commands completed.
+ */
+static int load_records(const char *path, struct iscsi_record_file_header *fh,
+			struct replay_cmd **cmds, uint32_t *count)
+{
+	FILE *fp;
+	unsigned char *buf;
+	struct replay_cmd *c = NULL;
+	uint32_t n = 0, alloc = 0;
+
+	fp = fopen(path, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	if (fread(fh, sizeof(*fh), 1, fp) != 1 ||
+	    memcmp(fh->magic, ISCSI_RECORD_MAGIC, sizeof(fh->magic))) {
+		fprintf(stderr, "%s is not a command record file\n", path);
+		fclose(fp);
+		return -1;
+	}
+	if (fh->version != ISCSI_RECORD_VERSION ||
+	    fh->record_size < sizeof(struct iscsi_command_record)) {
+		fprintf(stderr, "%s: unsupported version %u, record size %u\n",
+			path, fh->version, fh->record_size);
+		fclose(fp);
+		return -1;
+	}
+	fh->target_name[sizeof(fh->target_name) - 1] = '\0';
+	fh->target_address[sizeof(fh->target_address) - 1] = '\0';
+
+	buf = malloc(fh->record_size);
+	if (buf == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		fclose(fp);
+		return -1;
+	}
+	while (fread(buf, fh->record_size, 1, fp) == 1) {
+		if (n == alloc) {
+			struct replay_cmd *tmp;
+
+			alloc = alloc ? alloc * 2 : 4096;
+			tmp = realloc(c, alloc * sizeof(*c));
+			if (tmp == NULL) {
+				fprintf(stderr, "Out of Memory\n");
+				free(c);
+				free(buf);
+				fclose(fp);
+				return -1;
+			}
+			c = tmp;
+		}
+		memset(&c[n], 0, sizeof(c[n]));
+		memcpy(&c[n].r, buf, sizeof(c[n].r));
+		c[n].seq = n;
+		n++;
+	}
+	free(buf);
+	fclose(fp);
+
+	if (n) {
+		qsort(c, n, sizeof(*c), cmp_cmd);
+	}
+	*cmds = c;
+	*count = n;
+	return 0;
+}
+
+static void dump_records(struct replay_cmd *cmds, uint32_t count)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		struct iscsi_command_record *r = &cmds[i].r;
+
+		printf("%12.6f lun %u %-24s lba %" PRIu64 " blocks %u len %u %u us %s",
+		       r->submit / 1000000.0, r->lun, scsi_opcode_str(r->opcode),
+		       r->lba, r->blocks, r->xferlen, r->latency,
+		       status_name(r->status));
+		if (r->status == SCSI_STATUS_CHECK_CONDITION) {
+			printf(" %s(0x%02x) %s(0x%04x)",
+			       scsi_sense_key_str(r->sense_key), r->sense_key,
+			       scsi_sense_ascq_str(r->ascq), r->ascq);
+		}
+		printf("\n");
+	}
+}
+
+static void report_line(const char *name, const char *what, uint32_t n,
+			uint64_t bytes, uint64_t span, uint32_t *lat)
+{
+	uint64_t sum = 0;
+	uint32_t i;
+
+	if (n == 0) {
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		sum += lat[i];
+	}
+	qsort(lat, n, sizeof(*lat), cmp_u32);
+	if (span == 0) {
+		span = 1;
+	}
+	printf("%-6s %-9s %9u %10.1f %9.1f %9" PRIu64 " %9u %9u %9u %9u\n",
+	       name, what, n, n * 1000000.0 / span,
+	       bytes * 1000000.0 / span / (1024 * 1024), sum / n,
+	       lat[(n - 1) * 50 / 100], lat[(n - 1) * 90 / 100],
+	       lat[(n - 1) * 99 / 100], lat[n - 1]);
+}
+
+/*
+ * One pair of lines per class, for the commands that were replayed, or
+ * all of them when nothing was.
+ */
+static void report(struct replay *rp, int replayed)
+{
+	uint32_t *rec_lat, *rep_lat;
+	uint64_t rec_first = UINT64_MAX, rec_last = 0;
+	int c;
+
+	rec_lat = malloc((rp->count + 1) * sizeof(*rec_lat));
+	rep_lat = malloc((rp->count + 1) * sizeof(*rep_lat));
+	if (rec_lat == NULL || rep_lat == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		exit(10);
+	}
+
+	for (c = 0; c < (int)rp->count; c++) {
+		struct replay_cmd *cmd = &rp->cmds[c];
+
+		if (replayed && !cmd->done) {
+			continue;
+		}
+		if (cmd->r.submit < rec_first) {
+			rec_first = cmd->r.submit;
+		}
+		if (cmd->r.submit + cmd->r.latency > rec_last) {
+			rec_last = cmd->r.submit + cmd->r.latency;
+		}
+	}
+
+	printf("%-6s %-9s %9s %10s %9s %9s %9s %9s %9s %9s\n",
+	       "", "", "commands", "iops", "MB/s", "avg us", "p50 us",
+	       "p90 us", "p99 us", "max us");
+	for (c = 0; c < CLASS_MAX; c++) {
+		uint64_t rec_bytes = 0, rep_bytes = 0;
+		uint32_t n = 0, i;
+
+		for (i = 0; i < rp->count; i++) {
+			struct replay_cmd *cmd = &rp->cmds[i];
+
+			if ((int)record_class(&cmd->r) != c ||
+			    (replayed && !cmd->done)) {
+				continue;
+			}
+			rec_lat[n] = cmd->r.latency;
+			rep_lat[n] = cmd->latency;
+			rec_bytes += cmd->r.xferlen;
+			if (cmd->status == SCSI_STATUS_GOOD) {
+				rep_bytes += cmd->r.xferlen;
+			}
+			n++;
+		}
+		report_line(class_name[c], "recorded", n, rec_bytes,
+			    rec_last > rec_first ? rec_last - rec_first : 0,
+			    rec_lat);
+		if (replayed) {
+			report_line("", "replayed", n, rep_bytes,
+				    rp->last_us - rp->first_us, rep_lat);
+		}
+	}
+
+	free(rec_lat);
+	free(rep_lat);
+}
+
+static void replay_cb(struct iscsi_context *iscsi, int status,
+		      void *command_data, void *private_data)
+{
+	struct replay_cmd *cmd = private_data;
+	struct replay *rp = cmd->replay;
+	struct scsi_task *task = command_data;
+	uint64_t now = get_clock_us();
+
+	cmd->done = 1;
+	cmd->status = status;
+	cmd->latency = now - cmd->issue_us;
+	rp->last_us = now;
+	rp->in_flight--;
+
+	if (status == SCSI_STATUS_CANCELLED || status == SCSI_STATUS_ERROR ||
+	    status == SCSI_STATUS_TIMEOUT) {
+		fprintf(stderr, "%s failed with %s\n",
+			scsi_opcode_str(cmd->r.opcode), iscsi_get_error(iscsi));
+		rp->err_cnt++;
+	} else if (status != (int)cmd->r.status) {
+		rp->changed++;
+	}
+	scsi_free_scsi_task(task);
+}
+
+static int issue(struct replay *rp, struct replay_cmd *cmd)
+{
+	struct scsi_task *task;
+	struct iscsi_data data, *d = NULL;
+
+	task = scsi_create_task(cmd->r.cdb_size, cmd->r.cdb, cmd->r.xfer_dir,
+				cmd->r.xferlen);
+	if (task == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		return -1;
+	}
+	if (cmd->r.xfer_dir == SCSI_XFER_READ) {
+		scsi_task_set_iov_in(task, &rp->sink_iov, 1);
+	} else if (cmd->r.xfer_dir == SCSI_XFER_WRITE) {
+		data.size = cmd->r.xferlen;
+		data.data = rp->zeroes;
+		d = &data;
+	}
+
+	cmd->replay = rp;
+	cmd->issue_us = get_clock_us();
+	if (iscsi_scsi_command_async(rp->iscsi, rp->lun, task, replay_cb,
+				     d, cmd) != 0) {
+		fprintf(stderr, "Failed to send %s: %s\n",
+			scsi_opcode_str(cmd->r.opcode),
+			iscsi_get_error(rp->iscsi));
+		scsi_free_scsi_task(task);
+		return -1;
+	}
+	rp->in_flight++;
+	return 0;
+}
+
+/*
+ * Issue everything that is due and the queue has room for. Returns how
+ * many milliseconds until the next command is due, or -1 if that is not
+ * what is being waited for.
+ */
+static int fill_queue(struct replay *rp, uint64_t base)
+{
+	while (rp->next < rp->count && rp->in_flight < rp->queue_depth) {
+		struct replay_cmd *cmd = &rp->cmds[rp->next];
+		uint64_t now = get_clock_us();
+
+		if (!rp->writes && !record_is_safe(&cmd->r)) {
+			rp->skipped++;
+			rp->next++;
+			continue;
+		}
+		if (!rp->fast) {
+			uint64_t due = rp->first_us +
+				(uint64_t)((cmd->r.submit - base) / rp->speed);
+
+			/* rounded down, so the last millisecond is polled
+			 * for rather than overslept */
+			if (now < due) {
+				return (int)((due - now) / 1000);
+			}
+			if (now - due > LATE_US) {
+				rp->late++;
+			}
+			if (now - due > rp->max_lag) {
+				rp->max_lag = now - due;
+			}
+		}
+		if (issue(rp, cmd) != 0) {
+			rp->err_cnt++;
+			return -1;
+		}
+		rp->next++;
+	}
+	return -1;
+}
+
+static int prepare_buffers(struct replay *rp)
+{
+	uint32_t max_in = 0, max_out = 0, i;
+
+	for (i = 0; i < rp->count; i++) {
+		struct iscsi_command_record *r = &rp->cmds[i].r;
+
+		if (r->xfer_dir == SCSI_XFER_READ && r->xferlen > max_in) {
+			max_in = r->xferlen;
+		}
+		if (r->xfer_dir == SCSI_XFER_WRITE && r->xferlen > max_out) {
+			max_out = r->xferlen;
+		}
+	}
+	rp->sink_iov.iov_len = max_in;
+	rp->sink_iov.iov_base = malloc(max_in + 1);
+	rp->zeroes = calloc(1, max_out + 1);
+	if (rp->sink_iov.iov_base == NULL || rp->zeroes == NULL) {
+		fprintf(stderr, "Out of Memory\n");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = NULL;
+	char *url = NULL;
+	struct iscsi_url *iscsi_url;
+	struct iscsi_record_file_header fh;
+	struct replay rp;
+	struct pollfd pfd[1];
+	struct sigaction sa;
+	int show_help = 0, show_usage = 0, dump = 0;
+	int c;
+	uint32_t i, luns = 0;
+	uint64_t base;
+	time_t start;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"initiator-name", required_argument,    NULL,        'i'},
+		{"queue-depth",    required_argument,    NULL,        'q'},
+		{"fast",           no_argument,          NULL,        'f'},
+		{"speed",          required_argument,    NULL,        's'},
+		{"writes",         no_argument,          NULL,        'w'},
+		{"dump",           no_argument,          NULL,        'd'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	memset(&rp, 0, sizeof(rp));
+	rp.queue_depth = 32;
+	rp.speed = 1.0;
+
+	while ((c = getopt_long(argc, argv, "h?ui:q:fs:wd", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'i':
+			initiator = optarg;
+			break;
+		case 'q':
+			rp.queue_depth = strtol(optarg, NULL, 0);
+			break;
+		case 'f':
+			rp.fast = 1;
+			break;
+		case 's':
+			rp.speed = strtod(optarg, NULL);
+			break;
+		case 'w':
+			rp.writes = 1;
+			break;
+		case 'd':
+			dump = 1;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (optind >= argc || argc - optind > 2 ||
+	    rp.queue_depth < 1 || rp.speed <= 0) {
+		print_usage();
+		exit(10);
+	}
+	path = argv[optind];
+	if (argc - optind == 2) {
+		url = argv[optind + 1];
+	}
+
+	if (load_records(path, &fh, &rp.cmds, &rp.count) != 0) {
+		exit(10);
+	}
+
+	if (dump) {
+		dump_records(rp.cmds, rp.count);
+		free(rp.cmds);
+		exit(0);
+	}
+
+	start = fh.start_realtime / 1000000;
+	printf("%u commands recorded on %s at %s, %s", rp.count,
+	       fh.target_name[0] ? fh.target_name : "unknown target",
+	       fh.target_address[0] ? fh.target_address : "unknown address",
+	       ctime(&start));
+	for (i = 0; i < rp.count; i++) {
+		if (rp.cmds[i].r.lun != rp.cmds[0].r.lun) {
+			luns = 1;
+			break;
+		}
+	}
+	if (rp.count == 0) {
+		free(rp.cmds);
+		exit(0);
+	}
+
+	if (url == NULL) {
+		printf("\n");
+		report(&rp, 0);
+		free(rp.cmds);
+		exit(0);
+	}
+
+	rp.iscsi = iscsi_create_context(initiator);
+	if (rp.iscsi == NULL) {
+		fprintf(stderr, "Failed to create context\n");
+		exit(10);
+	}
+
+	iscsi_url = iscsi_parse_full_url(rp.iscsi, url);
+	if (iscsi_url == NULL) {
+		fprintf(stderr, "Failed to parse URL: %s\n",
+			iscsi_get_error(rp.iscsi));
+		exit(10);
+	}
+
+	iscsi_set_session_type(rp.iscsi, ISCSI_SESSION_NORMAL);
+	iscsi_set_header_digest(rp.iscsi, ISCSI_HEADER_DIGEST_NONE_CRC32C);
+
+	if (iscsi_full_connect_sync(rp.iscsi, iscsi_url->portal, iscsi_url->lun) != 0) {
+		fprintf(stderr, "Login Failed. %s\n", iscsi_get_error(rp.iscsi));
+		iscsi_destroy_url(iscsi_url);
+		iscsi_destroy_context(rp.iscsi);
+		exit(10);
+	}
+	rp.lun = iscsi_url->lun;
+	iscsi_destroy_url(iscsi_url);
+
+	if (prepare_buffers(&rp) != 0) {
+		exit(10);
+	}
+
+	printf("replaying to %s with up to %d commands in flight, ",
+	       url, rp.queue_depth);
+	if (rp.fast) {
+		printf("as fast as possible\n");
+	} else {
+		printf("at %g times the recorded speed\n", rp.speed);
+	}
+	if (luns) {
+		printf("commands from several LUNs all go to LUN %d\n", rp.lun);
+	}
+	if (!rp.writes) {
+		printf("skipping commands that modify the LUN, use --writes to replay them\n");
+	}
+
+	sa.sa_handler = &sig_handler;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	base = rp.cmds[0].r.submit;
+	rp.first_us = rp.last_us = get_clock_us();
+
+	while (!rp.err_cnt && finished < 2) {
+		int timeout = -1;
+
+		if (!finished) {
+			timeout = fill_queue(&rp, base);
+		}
+		if (rp.in_flight == 0 &&
+		    (finished || rp.next >= rp.count || rp.err_cnt)) {
+			break;
+		}
+		/* wake up once in a while even when only waiting for
+		 * completions so that a signal is noticed */
+		if (timeout < 0 || timeout > 1000) {
+			timeout = 1000;
+		}
+
+		pfd[0].fd = iscsi_get_fd(rp.iscsi);
+		pfd[0].events = iscsi_which_events(rp.iscsi);
+		if (poll(&pfd[0], 1, timeout) < 0) {
+			continue;
+		}
+		if (iscsi_service(rp.iscsi, pfd[0].revents) < 0) {
+			fprintf(stderr, "iscsi_service failed with : %s\n",
+				iscsi_get_error(rp.iscsi));
+			rp.err_cnt++;
+			break;
+		}
+	}
+
+	printf("\n");
+	report(&rp, 1);
+	printf("\n");
+	for (i = 0, c = 0; i < rp.count; i++) {
+		c += rp.cmds[i].done;
+	}
+	printf("%d commands replayed in %.3f s, %u skipped", c,
+	       (rp.last_us - rp.first_us) / 1000000.0, rp.skipped);
+	if (rp.next < rp.count) {
+		printf(", %u not reached", rp.count - rp.next);
+	}
+	printf("\n");
+	if (rp.changed) {
+		printf("%u commands completed with a different status than recorded\n",
+		       rp.changed);
+	}
+	if (!rp.fast) {
+		printf("%u commands issued more than %d us late, at most %" PRIu64 " us\n",
+		       rp.late, LATE_US, rp.max_lag);
+	}
+
+	if (!rp.err_cnt && finished < 2) {
+		iscsi_logout_sync(rp.iscsi);
+	} else {
+		printf("ABORTED!\n");
+	}
+	iscsi_destroy_context(rp.iscsi);
+
+	free(rp.sink_iov.iov_base);
+	free(rp.zeroes);
+	free(rp.cmds);
+
+	return rp.err_cnt ? 1 : 0;
+}
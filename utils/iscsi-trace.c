@@ -0,0 +1,392 @@
+/*
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 2 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, see <http://www.gnu.org/licenses/>.
+*/
+/*
+ * Decode the PDU trace files written by iscsi_pdu_trace_save(), either as
+ * one line of text per PDU or as a pcapng capture that Wireshark can
+ * dissect as iSCSI over TCP.
+ *
+ * The capture is made up: every PDU becomes one TCP segment between the
+ * initiator at 10.0.0.1 and the target portal the trace was taken on,
+ * with consecutive sequence numbers in each direction. Only the basic
+ * header segment is traced, so any data segment is filled with zeroes
+ * and digests are left out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include "iscsi.h"
+#include "scsi-lowlevel.h"
+
+/* segments with more data than this are cut short in the capture */
+#define SNAPLEN_DATA	(256 * 1024)
+
+void print_usage(void)
+{
+	fprintf(stderr, "Usage: iscsi-trace [-?] [-?|--help] [--usage] [-a|--absolute] [-p|--pcapng=file] <trace-file>\n");
+}
+
+void print_help(void)
+{
+	fprintf(stderr, "Usage: iscsi-trace [OPTION...] <trace-file>\n");
+	fprintf(stderr, "  -a, --absolute                    Print wall clock times\n");
+	fprintf(stderr, "  -p, --pcapng=file                 Write a pcapng capture to file instead\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Help options:\n");
+	fprintf(stderr, "  -?, --help                        Show this help message\n");
+	fprintf(stderr, "      --usage                       Display brief usage message\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Trace files are written by iscsi_pdu_trace_save().\n");
+}
+
+static const char *opcode_name(uint8_t opcode)
+{
+	switch (opcode) {
+	case 0x00: return "NOP-Out";
+	case 0x01: return "SCSI-Command";
+	case 0x02: return "Task-Mgmt";
+	case 0x03: return "Login";
+	case 0x04: return "Text";
+	case 0x05: return "Data-Out";
+	case 0x06: return "Logout";
+	case 0x10: return "SNACK";
+	case 0x20: return "NOP-In";
+	case 0x21: return "SCSI-Response";
+	case 0x22: return "Task-Mgmt-Response";
+	case 0x23: return "Login-Response";
+	case 0x24: return "Text-Response";
+	case 0x25: return "Data-In";
+	case 0x26: return "Logout-Response";
+	case 0x31: return "R2T";
+	case 0x32: return "Async";
+	case 0x3f: return "Reject";
+	}
+	return "Unknown";
+}
+
+static void print_record(const struct iscsi_trace_record *r,
+			 uint64_t base, int64_t offset, int absolute)
+{
+	if (absolute) {
+		uint64_t us = r->timestamp + offset;
+		time_t t = us / 1000000;
+		struct tm *tm = localtime(&t);
+		char buf[32];
+
+		strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", tm);
+		printf("%s.%06d", buf, (int)(us % 1000000));
+	} else {
+		printf("%12.6f", (double)(r->timestamp - base) / 1000000);
+	}
+
+	printf(" %s %-18s itt 0x%08x %s %-10u len %-7u",
+	       r->direction == ISCSI_TRACE_TX ? "->" : "<-",
+	       opcode_name(r->opcode), r->itt,
+	       r->direction == ISCSI_TRACE_TX ? "cmdsn " : "statsn",
+	       r->sn, r->data_length);
+
+	switch (r->opcode) {
+	case 0x01:
+		printf(" lun %" PRIu64 " cdb 0x%02x", (r->lun >> 48) & 0x3fff,
+		       r->bhs[32]);
+		break;
+	case 0x21:
+		printf(" status 0x%02x", r->bhs[3]);
+		break;
+	case 0x25:
+	case 0x05:
+	case 0x31:
+		printf(" offset %u", scsi_get_uint32(&r->bhs[40]));
+		break;
+	case 0x22:
+	case 0x23:
+	case 0x26:
+		printf(" response 0x%02x%02x", r->bhs[2], r->bhs[3]);
+		break;
+	}
+	if (r->latency) {
+		printf(" latency %uus", r->latency);
+	}
+	printf("\n");
+}
+
+/*
+ * pcapng
+ */
+struct pcap_conn {
+	uint8_t addr[2][4];	/* initiator, target */
+	uint16_t port[2];
+	uint32_t seq[2];
+};
+
+static int write_block(FILE *fp, uint32_t type, const void *body,
+		       uint32_t len)
+{
+	static const uint8_t zeroes[4];
+	uint32_t total = 12 + ((len + 3) & ~3);
+
+	if (fwrite(&type, 4, 1, fp) != 1 ||
+	    fwrite(&total, 4, 1, fp) != 1 ||
+	    (len && fwrite(body, len, 1, fp) != 1) ||
+	    ((len & 3) && fwrite(zeroes, 4 - (len & 3), 1, fp) != 1) ||
+	    fwrite(&total, 4, 1, fp) != 1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int write_pcapng_header(FILE *fp)
+{
+	uint8_t shb[16], idb[8];
+	uint32_t magic = 0x1a2b3c4d;
+	uint16_t u16;
+	uint32_t u32;
+	int64_t section_length = -1;
+
+	memcpy(&shb[0], &magic, 4);
+	u16 = 1;
+	memcpy(&shb[4], &u16, 2);
+	u16 = 0;
+	memcpy(&shb[6], &u16, 2);
+	memcpy(&shb[8], &section_length, 8);
+	if (write_block(fp, 0x0a0d0d0a, shb, sizeof(shb)) != 0) {
+		return -1;
+	}
+
+	u16 = 101;		/* LINKTYPE_RAW, IPv4 packets */
+	memcpy(&idb[0], &u16, 2);
+	u16 = 0;
+	memcpy(&idb[2], &u16, 2);
+	u32 = 0;		/* no snaplen */
+	memcpy(&idb[4], &u32, 4);
+	return write_block(fp, 0x00000001, idb, sizeof(idb));
+}
+
+static uint16_t ip_checksum(const uint8_t *p, int len)
+{
+	uint32_t sum = 0;
+	int i;
+
+	for (i = 0; i < len; i += 2) {
+		sum += p[i] << 8 | p[i + 1];
+	}
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+	return ~sum;
+}
+
+static int write_pcapng_record(FILE *fp, struct pcap_conn *conn,
+			       const struct iscsi_trace_record *r,
+			       int64_t offset)
+{
+	static uint8_t epb[20 + 40 + 48 + SNAPLEN_DATA];
+	uint8_t *ip = &epb[20], *tcp = &epb[40], *bhs = &epb[60];
+	uint32_t data = (r->data_length + 3) & ~3;
+	uint32_t caplen, origlen, u32;
+	uint64_t us = r->timestamp + offset;
+	int from = r->direction == ISCSI_TRACE_TX ? 0 : 1;
+	int to = !from;
+
+	origlen = 40 + 48 + data;
+	if (data > SNAPLEN_DATA) {
+		data = SNAPLEN_DATA;
+	}
+	caplen = 40 + 48 + data;
+
+	/* enhanced packet block: interface, timestamp, lengths */
+	memset(epb, 0, 20);
+	u32 = us >> 32;
+	memcpy(&epb[4], &u32, 4);
+	u32 = us & 0xffffffff;
+	memcpy(&epb[8], &u32, 4);
+	memcpy(&epb[12], &caplen, 4);
+	memcpy(&epb[16], &origlen, 4);
+
+	memset(ip, 0, 40);
+	ip[0] = 0x45;
+	scsi_set_uint16(&ip[2], origlen > 0xffff ? 0xffff : origlen);
+	ip[8] = 64;
+	ip[9] = 6;		/* TCP */
+	memcpy(&ip[12], conn->addr[from], 4);
+	memcpy(&ip[16], conn->addr[to], 4);
+	scsi_set_uint16(&ip[10], ip_checksum(ip, 20));
+
+	scsi_set_uint16(&tcp[0], conn->port[from]);
+	scsi_set_uint16(&tcp[2], conn->port[to]);
+	scsi_set_uint32(&tcp[4], conn->seq[from]);
+	scsi_set_uint32(&tcp[8], conn->seq[to]);
+	tcp[12] = 5 << 4;
+	tcp[13] = 0x18;		/* PSH, ACK */
+	scsi_set_uint16(&tcp[14], 0xffff);
+	conn->seq[from] += 48 + ((r->data_length + 3) & ~3);
+
+	memcpy(bhs, r->bhs, 48);
+	memset(bhs + 48, 0, data);
+
+	return write_block(fp, 0x00000006, epb, 20 + caplen);
+}
+
+static void parse_target_address(struct pcap_conn *conn, const char *addr)
+{
+	unsigned int a, b, c, d, port = 3260;
+
+	conn->addr[0][0] = 10; conn->addr[0][1] = 0;
+	conn->addr[0][2] = 0;  conn->addr[0][3] = 1;
+	conn->addr[1][0] = 10; conn->addr[1][1] = 0;
+	conn->addr[1][2] = 0;  conn->addr[1][3] = 2;
+	conn->port[0] = 49152;
+	conn->port[1] = 3260;
+	conn->seq[0] = 1;
+	conn->seq[1] = 1;
+
+	if (sscanf(addr, "%u.%u.%u.%u:%u", &a, &b, &c, &d, &port) >= 4 &&
+	    a < 256 && b < 256 && c < 256 && d < 256 && port < 65536) {
+		conn->addr[1][0] = a;
+		conn->addr[1][1] = b;
+		conn->addr[1][2] = c;
+		conn->addr[1][3] = d;
+		conn->port[1] = port;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct iscsi_trace_file_header fh;
+	struct iscsi_trace_record r;
+	struct pcap_conn conn;
+	const char *pcapng = NULL;
+	FILE *fp, *out = NULL;
+	int show_help = 0, show_usage = 0, absolute = 0;
+	uint64_t i, base = 0;
+	int c;
+
+	static struct option long_options[] = {
+		{"help",           no_argument,          NULL,        'h'},
+		{"usage",          no_argument,          NULL,        'u'},
+		{"absolute",       no_argument,          NULL,        'a'},
+		{"pcapng",         required_argument,    NULL,        'p'},
+		{0, 0, 0, 0}
+	};
+	int option_index;
+
+	while ((c = getopt_long(argc, argv, "h?uap:", long_options,
+			&option_index)) != -1) {
+		switch (c) {
+		case 'h':
+		case '?':
+			show_help = 1;
+			break;
+		case 'u':
+			show_usage = 1;
+			break;
+		case 'a':
+			absolute = 1;
+			break;
+		case 'p':
+			pcapng = optarg;
+			break;
+		default:
+			fprintf(stderr, "Unrecognized option '%c'\n\n", c);
+			print_help();
+			exit(0);
+		}
+	}
+
+	if (show_help != 0) {
+		print_help();
+		exit(0);
+	}
+
+	if (show_usage != 0) {
+		print_usage();
+		exit(0);
+	}
+
+	if (argv[optind] == NULL) {
+		fprintf(stderr, "You must specify the trace file\n");
+		print_usage();
+		exit(10);
+	}
+
+	fp = fopen(argv[optind], "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "Failed to open %s\n", argv[optind]);
+		exit(10);
+	}
+	if (fread(&fh, sizeof(fh), 1, fp) != 1 ||
+	    memcmp(fh.magic, ISCSI_TRACE_MAGIC, sizeof(fh.magic)) ||
+	    fh.version != ISCSI_TRACE_VERSION ||
+	    fh.record_size != sizeof(struct iscsi_trace_record)) {
+		fprintf(stderr, "%s is not a libiscsi trace file\n",
+			argv[optind]);
+		fclose(fp);
+		exit(10);
+	}
+	fh.target_address[sizeof(fh.target_address) - 1] = 0;
+
+	if (pcapng != NULL) {
+		out = fopen(pcapng, "wb");
+		if (out == NULL) {
+			fprintf(stderr, "Failed to create %s\n", pcapng);
+			fclose(fp);
+			exit(10);
+		}
+		parse_target_address(&conn, fh.target_address);
+		if (write_pcapng_header(out) != 0) {
+			fprintf(stderr, "Failed to write %s\n", pcapng);
+			goto failed;
+		}
+	} else {
+		printf("# %" PRIu64 " PDUs to %s\n", fh.count,
+		       fh.target_address[0] ? fh.target_address : "unknown");
+	}
+
+	for (i = 0; i < fh.count; i++) {
+		if (fread(&r, sizeof(r), 1, fp) != 1) {
+			fprintf(stderr, "%s is truncated after %" PRIu64
+				" records\n", argv[optind], i);
+			goto failed;
+		}
+		if (i == 0) {
+			base = r.timestamp;
+		}
+		if (out == NULL) {
+			print_record(&r, base, fh.realtime_offset, absolute);
+		} else if (write_pcapng_record(out, &conn, &r,
+					       fh.realtime_offset) != 0) {
+			fprintf(stderr, "Failed to write %s\n", pcapng);
+			goto failed;
+		}
+	}
+
+	fclose(fp);
+	if (out != NULL && fclose(out) != 0) {
+		fprintf(stderr, "Failed to write %s\n", pcapng);
+		exit(10);
+	}
+	return 0;
+
+ failed:
+	fclose(fp);
+	if (out != NULL) {
+		fclose(out);
+	}
+	exit(10);
+}